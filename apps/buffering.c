@@ -27,6 +27,7 @@
 #include "panic.h"
 #include "debug.h"
 #include "file.h"
+#include "pathfuncs.h"
 #include "appevents.h"
 #include "metadata.h"
 #include "bmp.h"
@@ -70,6 +71,15 @@
 /* amount of data to read in one read() call */
 #define BUFFERING_DEFAULT_FILECHUNK      (1024*32)
 
+#if defined(APPLICATION) && !defined(WIN32)
+/* Audio files are memory-mapped and read in place rather than copied into
+   the buffer; the OS page cache does the buffering */
+#define BUFFERING_MMAP
+/* Limit on the number of files mapped at once - further tracks use the
+   buffer until earlier ones are closed */
+#define BUF_MAX_MAPPED_HANDLES 8
+#endif
+
 enum handle_flags
 {
     H_CANWRAP   = 0x1,   /* Handle data may wrap in buffer */
@@ -94,9 +104,18 @@ struct memory_handle {
     off_t   start;          /* Offset at which we started reading the file */
     off_t   pos;            /* Read position in file */
     off_t volatile end;     /* Offset at which we stopped reading the file */
+#ifdef BUFFERING_MMAP
+    const char *map;        /* Mapped file data (NULL if in the buffer) */
+#endif
     char    path[];         /* Path if data originated in a file */
 };
 
+#ifdef BUFFERING_MMAP
+#define HANDLE_MAPPED(h)    ((h)->map != NULL)
+#else
+#define HANDLE_MAPPED(h)    false
+#endif
+
 /* Minimum allowed handle movement */
 #define MIN_MOVE_DELTA      sizeof(struct memory_handle)
 
@@ -114,11 +133,31 @@ static size_t buffer_len;
 /* Configuration */
 static size_t conf_watermark = 0; /* Level to trigger filebuf fill */
 static size_t high_watermark = 0; /* High watermark for rebuffer */
+static size_t watermark_rate = 0; /* Consumption rate for an adaptive
+                                     watermark in bytes/s (0 = fixed) */
+static int watermark_margin = 0;  /* Extra seconds of adaptive watermark */
+
+/* Measured storage behaviour, per volume, used to size the adaptive
+   watermark. Read times are summed in whole ticks; over many reads that
+   averages out to the true time even if a single read takes less. */
+static struct storage_stats
+{
+    unsigned long read_rate;  /* Averaged read throughput in bytes/s */
+    long wake_time;           /* Averaged first read latency after the
+                                 storage went idle, in ticks */
+    unsigned long acc_bytes;  /* Bytes read in the current fill */
+    long acc_ticks;           /* Ticks spent reading in the current fill */
+} storage_stats[NUM_VOLUMES];
+
+static bool storage_idle = true;  /* Nothing read since storage_sleep() */
 
 static struct lld_head handle_list; /* buffer-order handle list */
 static struct lld_head mru_cache;   /* MRU-ordered list of handles */
 static int num_handles;             /* number of handles in the lists */
 static int base_handle_id;
+#ifdef BUFFERING_MMAP
+static int num_mapped;              /* number of mapped handles */
+#endif
 
 /* Main lock for adding / removing handles */
 static struct mutex llist_mutex SHAREDBSS_ATTR;
@@ -360,7 +399,8 @@ add_handle(unsigned int flags, size_t data_size, const char *path,
         struct memory_handle *last = HLIST_LAST;
         ridx = ringbuf_offset(first);
         widx = last->data;
-        cur_total = last->filesize - last->start;
+        if (!HANDLE_MAPPED(last))
+            cur_total = last->filesize - last->start;
     }
 
     if (cur_total > 0) {
@@ -414,6 +454,9 @@ add_handle(unsigned int flags, size_t data_size, const char *path,
     h->flags    = flags;
     h->pinned   = 0; /* Can be moved */
     h->signaled = 0; /* Data can be waited for */
+#ifdef BUFFERING_MMAP
+    h->map      = NULL;
+#endif
 
     /* Save the provided path */
     if (path)
@@ -619,6 +662,69 @@ static int update_data_counters(struct data_counters *dc)
     return num;
 }
 
+static void update_watermark(void);
+
+/* Storage volume that a handle's file lives on */
+static int handle_volume(const struct memory_handle *h)
+{
+#ifdef HAVE_MULTIVOLUME
+    int volume = path_strip_volume(h->path, NULL, false);
+    if (CHECK_VOL(volume))
+        return volume;
+#endif
+    (void)h;
+    return 0;
+}
+
+/* Account for one read() of 'ticks' duration into a handle */
+static void storage_stats_add(const struct memory_handle *h, ssize_t rc,
+                              long ticks, bool waking)
+{
+    struct storage_stats *st = &storage_stats[handle_volume(h)];
+
+    storage_idle = false;
+
+    if (rc <= 0)
+        return;
+
+    if (waking) {
+        /* Wake-up dominates this one; keep it out of the throughput */
+        st->wake_time = st->wake_time < 0 ?
+            ticks : (3*st->wake_time + ticks) / 4;
+        logf("storage wake: %ld ticks", ticks);
+        return;
+    }
+
+    st->acc_bytes += rc;
+    st->acc_ticks += ticks;
+}
+
+/* Fold the throughput measured over a fill into the averages and adjust
+   the adaptive watermark to it */
+static void storage_stats_fill_done(void)
+{
+    for (int i = 0; i < NUM_VOLUMES; i++) {
+        struct storage_stats *st = &storage_stats[i];
+
+        /* Too few samples to say anything */
+        if (st->acc_ticks < HZ/10 && st->acc_bytes < 1024*1024)
+            continue;
+
+        unsigned long rate = (uint64_t)st->acc_bytes * HZ /
+                             MAX(st->acc_ticks, 1);
+
+        st->read_rate = st->read_rate == 0 ?
+            rate : (3*st->read_rate + rate) / 4;
+        st->acc_bytes = 0;
+        st->acc_ticks = 0;
+
+        logf("storage read rate: %lu B/s", st->read_rate);
+    }
+
+    storage_idle = true;
+    update_watermark();
+}
+
 /* Q_BUFFER_HANDLE event and buffer data for the given handle.
    Return whether or not the buffering should continue explicitly.  */
 static bool buffer_handle(int handle_id, size_t to_buffer)
@@ -689,7 +795,10 @@ static bool buffer_handle(int handle_id, size_t to_buffer)
             return false; /* no space for read */
 
         /* rc is the actual amount read */
+        bool waking = storage_idle && !storage_disk_is_active();
+        long read_tick = current_tick;
         ssize_t rc = read(h->fd, ringbuf_ptr(widx), copy_n);
+        storage_stats_add(h, rc, current_tick - read_tick, waking);
 
         if (rc <= 0) {
             /* Some kind of filesystem error, maybe recoverable if not codec */
@@ -740,6 +849,12 @@ static bool close_handle(int handle_id)
     /* If the handle is not found, it is closed */
     if (h) {
         close_fd(&h->fd);
+#ifdef BUFFERING_MMAP
+        if (HANDLE_MAPPED(h)) {
+            os_file_unmap((void *)h->map, h->filesize);
+            num_mapped--;
+        }
+#endif
         unlink_handle(h);
     }
 
@@ -754,6 +869,11 @@ static struct memory_handle * shrink_handle(struct memory_handle *h)
     if (!h)
         return NULL;
 
+    if (HANDLE_MAPPED(h)) {
+        /* no data in the buffer to free */
+        return h;
+    }
+
     if (h->type == TYPE_PACKET_AUDIO) {
         /* only move the handle struct */
         /* data is pinned by default - if we start moving packet audio,
@@ -835,6 +955,7 @@ static bool fill_buffer(void)
     } else {
         /* only spin the disk down if the filling wasn't interrupted by an
            event arriving in the queue. */
+        storage_stats_fill_done();
         storage_sleep();
         return false;
     }
@@ -880,6 +1001,61 @@ static int load_image(int fd, const char *path,
 #endif /* HAVE_ALBUMART */
 
 
+#ifdef BUFFERING_MMAP
+/* Open an audio handle whose data is the mapped file rather than a copy in
+   the buffer. Only the handle struct takes buffer space and the whole file
+   is available at once. Returns < 0 if the file wasn't mapped. */
+static int bufopen_mapped(const char *file, int fd, off_t offset,
+                          enum data_type type)
+{
+    if (num_mapped >= BUF_MAX_MAPPED_HANDLES)
+        return ERR_BUFFER_FULL;
+
+    off_t size = filesize(fd);
+    const char *map = os_file_map(fd, size);
+    if (!map)
+        return ERR_FILE_ERROR;
+
+    if (offset > size)
+        offset = 0;
+
+    mutex_lock(&llist_mutex);
+
+    size_t data;
+    struct memory_handle *h = add_handle(H_ALLOCALL, 0, file, &data);
+    if (!h) {
+        mutex_unlock(&llist_mutex);
+        os_file_unmap((void *)map, size);
+        return ERR_BUFFER_FULL;
+    }
+
+    int handle_id = h->id;
+
+    h->type     = type;
+    h->fd       = -1;
+    h->map      = map;
+    h->data     = data;
+    h->ridx     = data;
+    h->widx     = data;
+    h->filesize = size;
+    h->start    = 0;
+    h->pos      = offset;
+    h->end      = size;
+
+    link_handle(h);
+    num_mapped++;
+
+    mutex_unlock(&llist_mutex);
+
+    logf("bufopen: mapped hdl %d", handle_id);
+
+    /* There is nothing left to buffer */
+    send_event(BUFFER_EVENT_FINISHED, &handle_id);
+    return handle_id;
+}
+#endif /* BUFFERING_MMAP */
+
+
 /*
 MAIN BUFFERING API CALLS
 ========================
@@ -958,6 +1134,17 @@ int bufopen(const char *file, off_t offset, enum data_type type,
     if (fd < 0)
         return ERR_FILE_ERROR;
 
+#ifdef BUFFERING_MMAP
+    if (type == TYPE_PACKET_AUDIO || type == TYPE_ATOMIC_AUDIO) {
+        handle_id = bufopen_mapped(file, fd, offset, type);
+        if (handle_id >= 0) {
+            close(fd);
+            return handle_id;
+        }
+        /* Couldn't map it; buffer it normally */
+    }
+#endif
+
     size_t size = 0;
 #ifdef HAVE_ALBUMART
     if (type == TYPE_BITMAP) {
@@ -1248,7 +1435,8 @@ static int seek_handle(struct memory_handle *h, off_t newpos)
                     (intptr_t)&(struct buf_message_data){ h->id, newpos });
     }
     else {
-        h->ridx = ringbuf_add(h->data, newpos - h->start);
+        if (!HANDLE_MAPPED(h))
+            h->ridx = ringbuf_add(h->data, newpos - h->start);
         h->pos  = newpos;
         return 0;
     }
@@ -1329,7 +1517,7 @@ static struct memory_handle *prep_bufdata(int handle_id, size_t *size,
     if (realsize <= 0 || realsize > filerem)
         realsize = filerem; /* clip to eof */
 
-    if (guardbuf_limit && realsize > GUARD_BUFSIZE) {
+    if (guardbuf_limit && realsize > GUARD_BUFSIZE && !HANDLE_MAPPED(h)) {
         logf("data request > guardbuf");
         /* If more than the size of the guardbuf is requested and this is a
          * bufgetdata, limit to guard_bufsize over the end of the buffer */
@@ -1396,6 +1584,13 @@ ssize_t bufread(int handle_id, size_t size, void *dest)
     if (!h)
         return ERR_HANDLE_NOT_FOUND;
 
+#ifdef BUFFERING_MMAP
+    if (HANDLE_MAPPED(h)) {
+        memcpy(dest, h->map + h->pos, size);
+        return size;
+    }
+#endif
+
     if (h->ridx + size > buffer_len) {
         /* the data wraps around the end of the buffer */
         size_t read = buffer_len - h->ridx;
@@ -1424,6 +1619,15 @@ ssize_t bufgetdata(int handle_id, size_t size, void **data)
     if (!h)
         return ERR_HANDLE_NOT_FOUND;
 
+#ifdef BUFFERING_MMAP
+    if (HANDLE_MAPPED(h)) {
+        /* Straight from the mapping; no guard buffer copy needed */
+        if (data)
+            *data = (void *)(h->map + h->pos);
+        return size;
+    }
+#endif
+
     if (h->ridx + size > buffer_len) {
         /* the data wraps around the end of the buffer :
            use the guard buffer to provide the requested amount of data. */
@@ -1546,9 +1750,62 @@ size_t buf_used(void)
 
 void buf_set_watermark(size_t bytes)
 {
+    watermark_rate = 0;
     conf_watermark = bytes;
 }
 
+/* Size the watermark so that the data left when it triggers lasts through
+   waking the storage and reading the first chunk back, plus 'margin'
+   seconds */
+static void update_watermark(void)
+{
+    size_t rate = watermark_rate;
+
+    if (rate == 0)
+        return;
+
+    struct storage_stats *st = &storage_stats[0];
+
+    mutex_lock(&llist_mutex);
+    if (HLIST_LAST)
+        st = &storage_stats[handle_volume(HLIST_LAST)];
+    mutex_unlock(&llist_mutex);
+
+    long wake = st->wake_time;
+
+    if (wake < 0) {
+        /* Not measured yet - use what the driver claims */
+#ifdef HAVE_DISK_STORAGE
+        wake = storage_spinup_time() ?: 5*HZ;
+#else
+        wake = 0;
+#endif
+    }
+
+    /* Wake-up times vary, so allow twice the average plus a second */
+    long ticks = 2*wake + (watermark_margin + 1)*HZ;
+
+    if (st->read_rate > 0)
+        ticks += BUFFERING_DEFAULT_FILECHUNK * HZ / st->read_rate;
+
+    size_t bytes = (uint64_t)rate * ticks / HZ;
+
+    /* Zero disables the notification */
+    conf_watermark = MAX(bytes, 1);
+
+    logf("adaptive watermark: %lu (%ld ticks)", (unsigned long)bytes, ticks);
+}
+
+/* Let the watermark follow the measured storage behaviour for data being
+   consumed at 'rate' bytes/s */
+void buf_set_watermark_rate(size_t rate, int margin)
+{
+    watermark_rate = rate;
+    watermark_margin = margin;
+    conf_watermark = 1; /* For no rate; zero disables the notification */
+    update_watermark();
+}
+
 size_t buf_get_watermark(void)
 {
     return BUF_WATERMARK;
@@ -1664,6 +1921,9 @@ void INIT_ATTR buffering_init(void)
 {
     mutex_init(&llist_mutex);
 
+    for (int i = 0; i < NUM_VOLUMES; i++)
+        storage_stats[i].wake_time = -1;
+
     /* Thread should absolutely not respond to USB because if it waits first,
        then it cannot properly service the handles and leaks will happen -
        this is a worker thread and shouldn't need to care about any system
@@ -1716,6 +1976,9 @@ bool buffering_reset(char *buf, size_t buflen)
 
     num_handles = 0;
     base_handle_id = -1;
+#ifdef BUFFERING_MMAP
+    num_mapped = 0;
+#endif
 
     /* Set the high watermark as 75% full...or 25% empty :)
        This is the greatest fullness that will trigger low-buffer events
@@ -1725,6 +1988,11 @@ bool buffering_reset(char *buf, size_t buflen)
        staying constantly active in buffering is pointless */
     high_watermark = 3*buflen / 4;
 
+    for (int i = 0; i < NUM_VOLUMES; i++) {
+        storage_stats[i].acc_bytes = 0;
+        storage_stats[i].acc_ticks = 0;
+    }
+
     thread_thaw(buffering_thread_id);
 
     return true;
@@ -1738,4 +2006,15 @@ void buffering_get_debugdata(struct buffering_debug *dbgdata)
     dbgdata->buffered_data = dc.buffered;
     dbgdata->useful_data = dc.useful;
     dbgdata->watermark = BUF_WATERMARK;
+
+    struct storage_stats *st = &storage_stats[0];
+
+    mutex_lock(&llist_mutex);
+    if (HLIST_FIRST)
+        st = &storage_stats[handle_volume(HLIST_FIRST)];
+    mutex_unlock(&llist_mutex);
+
+    dbgdata->read_rate = st->read_rate;
+    dbgdata->wake_time = st->wake_time;
+    dbgdata->data_rate = watermark_rate;
 }
@@ -111,6 +111,7 @@ size_t buf_used(void);
 /* Settings */
 void buf_set_base_handle(int handle_id);
 void buf_set_watermark(size_t bytes);
+void buf_set_watermark_rate(size_t rate, int margin);
 size_t buf_get_watermark(void);
 
 /* Debugging */
@@ -120,6 +121,9 @@ struct buffering_debug {
     size_t data_rem;
     size_t useful_data;
     size_t watermark;
+    unsigned long read_rate; /* Measured storage throughput, bytes/s */
+    long wake_time;          /* Measured storage wake-up time, ticks */
+    size_t data_rate;        /* Consumption rate for the watermark, bytes/s */
 };
 void buffering_get_debugdata(struct buffering_debug *dbgdata);
 
@@ -86,6 +86,7 @@
 #include "pcmbuf.h"
 #include "buffering.h"
 #include "playback.h"
+#include "dsp_core.h"
 #if defined(HAVE_SPDIF_OUT) || defined(HAVE_SPDIF_IN)
 #include "spdif.h"
 #endif
@@ -493,6 +494,12 @@ static bool dbg_buffering_thread(void)
                              pcmbuf_used_descs(), pcmbufdescs);
             screens[i].putsf(0, line++, "watermark: %6d",
                              (int)(d.watermark));
+            screens[i].putsf(0, line++, "rate: %ldKB/s io:%ldKB/s",
+                             (long)(d.data_rate / 1024),
+                             (long)(d.read_rate / 1024));
+            if (d.wake_time >= 0)
+                screens[i].putsf(0, line++, "wake: %ldms",
+                                 d.wake_time * 1000 / HZ);
 
             screens[i].update();
         }
@@ -1855,6 +1862,68 @@ static bool dbg_disk_info(void)
 }
 #endif /* PLATFORM_NATIVE */
 
+static int dsp_stats_callback(int btn, struct gui_synclist *lists)
+{
+    (void)lists;
+    struct dsp_config *dsp = dsp_get_config(CODEC_IDX_AUDIO);
+    struct dsp_proc_stats stats[DSP_PROC_STATS_MAX];
+
+    if (btn == ACTION_STD_CONTEXT)
+    {
+        dsp_configure(dsp, DSP_CLEAR_PROC_STATS, 0);
+        btn = ACTION_NONE;
+    }
+
+    int count = dsp_configure(dsp, DSP_GET_PROC_STATS, (intptr_t)stats);
+
+    simplelist_set_line_count(0);
+
+    if (count == 0)
+        simplelist_addline("Not available");
+#ifndef USEC_TIMER
+    else
+        simplelist_addline("Tick resolution, run for a while");
+#endif
+
+    for (int i = 0; i < count; i++)
+    {
+        /* Cost per 1000 samples is comparable between stages and
+           independent of how long the counters have been running */
+        unsigned long us_per_k = stats[i].samples ?
+            stats[i].time_us * 1000 / stats[i].samples : 0;
+
+        simplelist_addline("%s%s", stats[i].name,
+                           stats[i].active ? "" : " (inactive)");
+        simplelist_addline("  %lu us/1000 smp, %lu ms",
+                           us_per_k, (unsigned long)(stats[i].time_us / 1000));
+        simplelist_addline("  %lu calls, %lu smp",
+                           (unsigned long)stats[i].calls,
+                           (unsigned long)stats[i].samples);
+    }
+
+    if (btn == ACTION_NONE)
+        btn = ACTION_REDRAW;
+
+    return btn;
+}
+
+static bool dbg_dsp_stats(void)
+{
+    struct dsp_config *dsp = dsp_get_config(CODEC_IDX_AUDIO);
+    struct simplelist_info info;
+    simplelist_info_init(&info, "DSP stats [CONTEXT to reset]", 1, NULL);
+    info.action_callback = dsp_stats_callback;
+    info.timeout = HZ;
+    info.scroll_all = true;
+
+    /* Only count while this screen is shown */
+    dsp_configure(dsp, DSP_CLEAR_PROC_STATS, 0);
+    dsp_configure(dsp, DSP_ENABLE_PROC_STATS, true);
+    bool ret = simplelist_show_list(&info);
+    dsp_configure(dsp, DSP_ENABLE_PROC_STATS, false);
+    return ret;
+}
+
 #ifdef HAVE_DIRCACHE
 static int dircache_callback(int btn, struct gui_synclist *lists)
 {
@@ -2823,6 +2892,7 @@ static const struct {
         { "View database info", dbg_tagcache_info },
 #endif
         { "View buffering thread", dbg_buffering_thread },
+        { "View DSP stats", dbg_dsp_stats },
 #ifdef PM_DEBUG
         { "pm histogram", peak_meter_histogram},
 #endif /* PM_DEBUG */
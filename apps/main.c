@@ -278,18 +278,16 @@ static int INIT_ATTR init_dircache(bool preinit)
 
     int result = -1;
 
-#ifdef HAVE_EEPROM_SETTINGS
-    if (firmware_settings.initialized &&
-        firmware_settings.disk_clean &&
-        preinit)
+    if (preinit)
     {
+        /* the snapshot gets checked against the storage in the background */
         result = dircache_load();
+    #ifdef HAVE_EEPROM_SETTINGS
         if (result < 0)
             firmware_settings.disk_clean = false;
+    #endif
     }
     else
-#endif /* HAVE_EEPROM_SETTINGS */
-    if (!preinit)
     {
         result = dircache_enable();
         if (result != 0)
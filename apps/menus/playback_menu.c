@@ -103,10 +103,12 @@ MENUITEM_SETTING(crossfade_fade_out_duration,
     &global_settings.crossfade_fade_out_duration, setcrossfadeonexit_callback);
 MENUITEM_SETTING(crossfade_fade_out_mixmode,
     &global_settings.crossfade_fade_out_mixmode,NULL);
+MENUITEM_SETTING(crossfade_fade_curve,
+    &global_settings.crossfade_fade_curve,NULL);
 MAKE_MENU(crossfade_settings_menu,ID2P(LANG_CROSSFADE),0, Icon_NOICON,
           &crossfade, &crossfade_fade_in_delay, &crossfade_fade_in_duration,
           &crossfade_fade_out_delay, &crossfade_fade_out_duration,
-          &crossfade_fade_out_mixmode);
+          &crossfade_fade_out_mixmode, &crossfade_fade_curve);
 #endif
 
 /* replay gain submenu */
@@ -179,6 +179,8 @@ static int timestretch_callback(int action,
 
     MENUITEM_SETTING(dithering_enabled,
                      &global_settings.dithering_enabled, lowlatency_callback);
+    MENUITEM_SETTING(resample_quality,
+                     &global_settings.resample_quality, lowlatency_callback);
     MENUITEM_SETTING(afr_enabled,
                      &global_settings.afr_enabled, lowlatency_callback);
     MENUITEM_SETTING(pbe,
@@ -264,6 +266,7 @@ MAKE_MENU(sound_settings, ID2P(LANG_SOUND_SETTINGS), NULL, Icon_Audio,
           ,&power_mode
 #endif
           ,&crossfeed_menu, &equalizer_menu, &dithering_enabled
+          ,&resample_quality
           ,&surround_menu, &pbe_menu, &afr_enabled
 #ifdef HAVE_PITCHCONTROL
           ,&timestretch_enabled
@@ -233,52 +233,6 @@ bool show_search_progress(bool init, int display_count, int current, int total)
     return true;
 }
 
-/* Performance optimized version of the read_line() (see below) function. */
-int fast_readline(int fd, char *buf, int buf_size, void *parameters,
-                  int (*callback)(int n, char *buf, void *parameters))
-{
-    char *p, *next;
-    int rc, pos = 0;
-    int count = 0;
-
-    while ( 1 )
-    {
-        next = NULL;
-
-        rc = read(fd, &buf[pos], buf_size - pos - 1);
-        if (rc >= 0)
-            buf[pos+rc] = '\0';
-
-        if ( (p = strchr(buf, '\n')) != NULL)
-        {
-            *p = '\0';
-            next = ++p;
-        }
-
-        if ( (p = strchr(buf, '\r')) != NULL)
-        {
-            *p = '\0';
-            if (!next)
-                next = ++p;
-        }
-
-        rc = callback(count, buf, parameters);
-        if (rc < 0)
-            return rc;
-
-        count++;
-        if (next)
-        {
-            pos = buf_size - ((intptr_t)next - (intptr_t)buf) - 1;
-            memmove(buf, next, pos);
-        }
-        else
-            break ;
-    }
-
-    return 0;
-}
-
 /* parse a line from a configuration file. the line format is:
 
    name: value
@@ -417,6 +371,11 @@ static bool clean_shutdown(enum shutdown_type sd_type,
             audio_close_recording();
 #endif
 
+#ifdef HAVE_DIRCACHE
+            /* snapshot the cache for a quick start; flushing empties it */
+            if (global_settings.dircache)
+                dircache_save();
+#endif
             system_flush();
 #ifdef HAVE_EEPROM_SETTINGS
             if (firmware_settings.initialized)
@@ -1188,6 +1147,52 @@ int format_sound_value(char *buf, size_t size, int snd, int val)
 
 #endif /* !defined(__PCTOOL__) */
 
+/* Performance optimized version of the read_line() (see below) function. */
+int fast_readline(int fd, char *buf, int buf_size, void *parameters,
+                  int (*callback)(int n, char *buf, void *parameters))
+{
+    char *p, *next;
+    int rc, pos = 0;
+    int count = 0;
+
+    while ( 1 )
+    {
+        next = NULL;
+
+        rc = read(fd, &buf[pos], buf_size - pos - 1);
+        if (rc >= 0)
+            buf[pos+rc] = '\0';
+
+        if ( (p = strchr(buf, '\n')) != NULL)
+        {
+            *p = '\0';
+            next = ++p;
+        }
+
+        if ( (p = strchr(buf, '\r')) != NULL)
+        {
+            *p = '\0';
+            if (!next)
+                next = ++p;
+        }
+
+        rc = callback(count, buf, parameters);
+        if (rc < 0)
+            return rc;
+
+        count++;
+        if (next)
+        {
+            pos = buf_size - ((intptr_t)next - (intptr_t)buf) - 1;
+            memmove(buf, next, pos);
+        }
+        else
+            break ;
+    }
+
+    return 0;
+}
+
 /* Read (up to) a line of text from fd into buffer and return number of bytes
  * read (which may be larger than the number of bytes stored in buffer). If
  * an error occurs, -1 is returned (and buffer contains whatever could be
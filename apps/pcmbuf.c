@@ -23,11 +23,13 @@
 #include "config.h"
 #include "system.h"
 #include "debug.h"
+#include "panic.h"
 #include <kernel.h>
 #include "pcm.h"
 #include "pcm_mixer.h"
 #include "pcmbuf.h"
 #include "dsp-util.h"
+#include "fixedpoint.h"
 #include "playback.h"
 #include "codec_thread.h"
 
@@ -157,15 +159,11 @@ static size_t crossfade_bufidx;
 
 struct mixfader
 {
-    int32_t factor; /* Current volume factor to use */
-    int32_t endfac; /* Saturating end factor */
-    int32_t nsamp2; /* Twice the number of samples */
-    int32_t dfact2; /* Twice the range of factors */
-    int32_t ferr;   /* Current error accumulator */
-    int32_t dfquo;  /* Quotient of fade range / sample range */
-    int32_t dfrem;  /* Remainder of fade range / sample range */
-    int32_t dfinc;  /* Base increment (-1 or +1) */
-    bool    alloc;  /* Allocate blocks if needed else abort at EOB */
+    uint32_t pos;     /* Frames faded so far */
+    uint32_t len;     /* Frames in the whole fade */
+    uint8_t  curve;   /* Gain curve (enum crossfade_curve) */
+    bool     fade_in; /* Gain rises (else falls) */
+    bool     alloc;   /* Allocate blocks if needed else abort at EOB */
 } crossfade_infader;
 
 /* Defines for operations on position info when mixing/fading -
@@ -180,11 +178,22 @@ enum
 #define MIXFADE_UNITY_BITS  16
 #define MIXFADE_UNITY       (1 << MIXFADE_UNITY_BITS)
 
+/* The curve is evaluated at block boundaries and the gain ramped linearly
+   in between, so that the per-frame work is a multiply and an add */
+#define MIXFADE_BLOCK_FRAMES 64
+/* Fractional bits of the ramp accumulator below those of the factor */
+#define MIXFADE_RAMP_BITS   8
+/* Range of the logarithmic curve; it drops to silence from there */
+#define MIXFADE_LOG_RANGE_DB 48
+
 static void crossfade_cancel(void);
 static void crossfade_start(void);
 static void write_to_crossfade(size_t size, unsigned long elapsed,
                                off_t offset);
 static void pcmbuf_finish_crossfade_enable(void);
+#ifdef DEBUG
+static void mixfade_curve_check(void);
+#endif
 #else
 #define crossfade_cancel() do {} while(0)
 #endif /* HAVE_CROSSFADE */
@@ -204,6 +213,45 @@ extern void audio_pcmbuf_sync_position(void);
 
 /**************************************/
 
+/** Chunk ring handoff
+ *
+ * The committed chunks form a single-producer/single-consumer ring: only the
+ * codec side advances chunk_widx and only the PCM callback advances
+ * chunk_ridx. The paths that rewind or reset chunk_widx (snipping, stopping)
+ * hold the PCM lock or have the channel stopped.
+ *
+ * Each side publishes its own index with a release store once it is done
+ * with the chunk data, and reads the other side's index with an acquire load
+ * before touching the data behind it. Reading its own index needs neither.
+ * On hosted targets the callback runs in another thread and possibly on
+ * another core; on native targets it interrupts the codec thread on the
+ * same core, so keeping the compiler from moving accesses is enough.
+ */
+#if (CONFIG_PLATFORM & PLATFORM_HOSTED) && defined(__ATOMIC_ACQUIRE)
+static FORCE_INLINE size_t chunk_idx_acquire(const size_t *idxp)
+{
+    return __atomic_load_n(idxp, __ATOMIC_ACQUIRE);
+}
+
+static FORCE_INLINE void chunk_idx_release(size_t *idxp, size_t idx)
+{
+    __atomic_store_n(idxp, idx, __ATOMIC_RELEASE);
+}
+#else /* native */
+static FORCE_INLINE size_t chunk_idx_acquire(const size_t *idxp)
+{
+    size_t idx = *(const volatile size_t *)idxp;
+    asm volatile ("" : : : "memory");
+    return idx;
+}
+
+static FORCE_INLINE void chunk_idx_release(size_t *idxp, size_t idx)
+{
+    asm volatile ("" : : : "memory");
+    *(volatile size_t *)idxp = idx;
+}
+#endif /* CONFIG_PLATFORM */
+
 /* start PCM if callback says it's alright */
 static void start_audio_playback(void)
 {
@@ -215,7 +263,7 @@ static void start_audio_playback(void)
    a full chunk even if only partially filled) */
 static size_t pcmbuf_unplayed_bytes(void)
 {
-    size_t ridx = chunk_ridx;
+    size_t ridx = chunk_idx_acquire(&chunk_ridx);
     size_t widx = chunk_widx;
 
     if (ridx > widx)
@@ -283,7 +331,7 @@ static bool index_committed(size_t index)
     if (index == INVALID_BUF_INDEX)
         return false;
 
-    size_t ridx = chunk_ridx;
+    size_t ridx = chunk_idx_acquire(&chunk_ridx);
     size_t widx = chunk_widx;
 
     if (widx < ridx)
@@ -309,7 +357,7 @@ void snip_buffer_tail(size_t index, int offset)
     if (!index_committed(index) && index != chunk_widx)
         return;
 
-    chunk_widx = index;
+    chunk_idx_release(&chunk_widx, index);
     pcmbuf_bytes_waiting = 0;
     index_chunkdesc(index)->pos_key = 0;
 
@@ -348,8 +396,10 @@ static void commit_chunks(size_t threshold)
         desc->size = (uint16_t)size;
 
         /* Advance the current write chunk and make it available to the
-           PCM callback */
-        chunk_widx = index = index_next(index);
+           PCM callback; the release orders the data and descriptor stores
+           before it */
+        index = index_next(index);
+        chunk_idx_release(&chunk_widx, index);
         desc = index_chunkdesc(index);
 
         /* Reset it before using it */
@@ -508,7 +558,8 @@ void * pcmbuf_request_buffer(int *count)
 #ifdef HAVE_CROSSFADE
     if (crossfade_status != CROSSFADE_INACTIVE)
     {
-        crossfade_bufidx = index_chunk_offs(chunk_ridx, -1);
+        crossfade_bufidx =
+            index_chunk_offs(chunk_idx_acquire(&chunk_ridx), -1);
         buf = index_buffer(crossfade_bufidx); /* always CROSSFADE_BUFSIZE */
     }
     else
@@ -569,7 +620,8 @@ static unsigned int get_next_required_pcmbuf_chunks(void)
 static void init_buffer_state(void)
 {
     /* Reset counters */
-    chunk_ridx = chunk_widx = 0;
+    chunk_idx_release(&chunk_ridx, 0);
+    chunk_idx_release(&chunk_widx, 0);
     pcmbuf_bytes_waiting = 0;
 
     /* Reset first descriptor */
@@ -607,6 +659,9 @@ size_t pcmbuf_init(void *bufend)
     bufstart = pcmbuf_buffer;
 
 #ifdef HAVE_CROSSFADE
+#ifdef DEBUG
+    mixfade_curve_check();
+#endif
     pcmbuf_finish_crossfade_enable();
 #else 
     pcmbuf_watermark = PCMBUF_WATERMARK;
@@ -627,7 +682,8 @@ size_t pcmbuf_init(void *bufend)
 static void pcmbuf_monitor_track_change_ex(size_t index)
 {
     /* Call with PCM lockout */
-    if (chunk_ridx != chunk_widx && index != INVALID_BUF_INDEX)
+    if (chunk_idx_acquire(&chunk_ridx) != chunk_widx &&
+        index != INVALID_BUF_INDEX)
     {
         /* If monitoring, set flag for one previous to specified chunk */
         index = index_chunk_offs(index, -1);
@@ -656,7 +712,7 @@ static void pcmbuf_cancel_track_change(bool position)
     if (!position)
         return;
 
-    size_t index = chunk_ridx;
+    size_t index = chunk_idx_acquire(&chunk_ridx);
 
     while (1)
     {
@@ -807,11 +863,12 @@ static void pcmbuf_pcm_callback(const void **start, size_t *size)
         }
 
         /* Free it for reuse */
-        chunk_ridx = index = index_next(index);
+        index = index_next(index);
+        chunk_idx_release(&chunk_ridx, index);
     }
 
     /*- Process the new one -*/
-    if (index != chunk_widx && !fade_out_complete)
+    if (index != chunk_idx_acquire(&chunk_widx) && !fade_out_complete)
     {
         current_desc = desc = index_chunkdesc(index);
 
@@ -833,7 +890,7 @@ void pcmbuf_play_start(void)
     logf("pcmbuf_play_start");
 
     if (mixer_channel_status(PCM_MIXER_CHAN_PLAYBACK) == CHANNEL_STOPPED &&
-        chunk_widx != chunk_ridx)
+        chunk_widx != chunk_idx_acquire(&chunk_ridx))
     {
         current_desc = NULL;
         mixer_channel_play_data(PCM_MIXER_CHAN_PLAYBACK, pcmbuf_pcm_callback,
@@ -878,56 +935,190 @@ void pcmbuf_pause(bool pause)
 
 #ifdef HAVE_CROSSFADE
 
-/* Initialize a fader */
-static void mixfader_init(struct mixfader *faderp, int32_t start_factor,
-                          int32_t end_factor, size_t size, bool alloc)
-{
-    /* Linear fade */
-    faderp->endfac = end_factor;
-    faderp->nsamp2 = size / PCMBUF_SAMPLE_SIZE * 2;
-    faderp->alloc  = alloc;
+/* Both tracks are mixed here as 16-bit samples that the DSP has already
+ * dithered, not on the DSP's 32-bit output. By the time the incoming track
+ * is decoded, the outgoing one only exists in the PCM buffer, so mixing
+ * ahead of the dither would need it kept at full width or run through the
+ * DSP a second time. The fade and the mix each round once, which adds at
+ * most one LSB of error on top of the dither. */
 
-    if (faderp->nsamp2 == 0)
+/* Gain for having 'x' (0 to MIXFADE_UNITY) of the way to full level */
+static int32_t mixfade_curve(unsigned int curve, uint32_t x)
+{
+    switch (curve)
+    {
+    case CROSSFADE_CURVE_EQUAL_POWER:
     {
-        /* No data; set up as if fader finished the fade */
-        faderp->factor = end_factor;
+        /* sin(x*pi/2) - powers of the two tracks add up to unity. Round
+           without adding to s, which is just below 2^31 near the top. */
+        int32_t s = fp_sincos((unsigned long)x << 14, NULL);
+        return (s >> 15) + ((s >> 14) & 1);
+    }
+    case CROSSFADE_CURVE_LOG:
+        /* Linear in decibels */
+        if (x == 0)
+            return 0;
+        return fp_factor(((long)x - MIXFADE_UNITY) * MIXFADE_LOG_RANGE_DB,
+                         MIXFADE_UNITY_BITS);
+    default:
+        return x;
+    }
+}
+
+#ifdef DEBUG
+/* Every curve has to start at silence, end at exactly unity and never fall */
+static void mixfade_curve_check(void)
+{
+    static bool checked = false;
+
+    if (checked)
         return;
+
+    checked = true;
+
+    for (unsigned int curve = CROSSFADE_CURVE_LINEAR;
+         curve <= CROSSFADE_CURVE_LOG; curve++)
+    {
+        int32_t prev = mixfade_curve(curve, 0);
+
+        if (prev != 0)
+            panicf("Fade curve %u starts at %ld", curve, (long)prev);
+
+        for (uint32_t x = 1; x <= MIXFADE_UNITY; x++)
+        {
+            int32_t gain = mixfade_curve(curve, x);
+
+            if (gain < prev)
+                panicf("Fade curve %u falls at %lu", curve, (unsigned long)x);
+
+            prev = gain;
+        }
+
+        if (prev != MIXFADE_UNITY)
+            panicf("Fade curve %u ends at %ld", curve, (long)prev);
     }
+}
+#endif /* DEBUG */
 
-    int32_t dfact2 = 2*abs(end_factor - start_factor);
-    faderp->factor = start_factor;
-    faderp->ferr   = dfact2 / 2;
-    faderp->dfquo  = dfact2 / faderp->nsamp2;
-    faderp->dfrem  = dfact2 - faderp->dfquo*faderp->nsamp2;
-    faderp->dfinc  = end_factor < start_factor ? -1 : +1;
-    faderp->dfquo *= faderp->dfinc;
+/* Initialize a fader */
+static void mixfader_init(struct mixfader *faderp, bool fade_in,
+                          size_t size, bool alloc)
+{
+    faderp->pos     = 0;
+    faderp->len     = size / PCMBUF_SAMPLE_SIZE;
+    faderp->curve   = global_settings.crossfade_fade_curve;
+    faderp->fade_in = fade_in;
+    faderp->alloc   = alloc;
 }
 
 /* Query if the fader has finished its envelope */
 static inline bool mixfader_finished(const struct mixfader *faderp)
 {
-    return faderp->factor == faderp->endfac;
+    return faderp->pos >= faderp->len;
 }
 
-/* Step fader by one sample */
-static inline void mixfader_step(struct mixfader *faderp)
+/* Volume factor at a frame position of the fade */
+static int32_t mixfader_factor(const struct mixfader *faderp, uint32_t pos)
 {
-    if (mixfader_finished(faderp))
-        return;
+    if (pos >= faderp->len)
+        return faderp->fade_in ? MIXFADE_UNITY : 0;
+
+    uint32_t x = (uint64_t)pos * MIXFADE_UNITY / faderp->len;
+
+    return mixfade_curve(faderp->curve,
+                         faderp->fade_in ? x : MIXFADE_UNITY - x);
+}
+
+/* Get the ramp for up to 'frames' frames from the current position: the
+   factor (with MIXFADE_RAMP_BITS more fraction bits) and its per-frame
+   increment. Returns the number of frames the ramp is good for. */
+static unsigned int mixfader_ramp(struct mixfader *faderp, unsigned int frames,
+                                  int32_t *facp, int32_t *incp)
+{
+    uint32_t pos = faderp->pos;
+
+    if (pos >= faderp->len)
+    {
+        *facp = mixfader_factor(faderp, pos) << MIXFADE_RAMP_BITS;
+        *incp = 0;
+        return frames;
+    }
+
+    uint32_t blk = pos - pos % MIXFADE_BLOCK_FRAMES;
+    uint32_t blkend = MIN(blk + MIXFADE_BLOCK_FRAMES, faderp->len);
+    int32_t fac0 = mixfader_factor(faderp, blk) << MIXFADE_RAMP_BITS;
+    int32_t fac1 = mixfader_factor(faderp, blkend) << MIXFADE_RAMP_BITS;
+    int32_t inc = (fac1 - fac0) / (int32_t)(blkend - blk);
+
+    *facp = fac0 + inc * (int32_t)(pos - blk);
+    *incp = inc;
 
-    faderp->factor += faderp->dfquo;
-    faderp->ferr += faderp->dfrem;
+    frames = MIN(frames, blkend - pos);
+    faderp->pos = pos + frames;
+    return frames;
+}
+
+static FORCE_INLINE int32_t mixfade_sample(int32_t fac, int32_t s)
+{
+    return ((fac >> MIXFADE_RAMP_BITS) * s + MIXFADE_UNITY/2)
+                >> MIXFADE_UNITY_BITS;
+}
+
+/* Fade 'frames' frames of the input into the output */
+static void mixfade_copy(struct mixfader *faderp, int16_t *out,
+                         const int16_t *in, unsigned int frames)
+{
+    while (frames)
+    {
+        int32_t fac, inc;
+        unsigned int n = mixfader_ramp(faderp, frames, &fac, &inc);
+        frames -= n;
+
+        for (; n != 0; n--, fac += inc)
+        {
+            *out++ = mixfade_sample(fac, *in++);
+            *out++ = mixfade_sample(fac, *in++);
+        }
+    }
+}
 
-    if (faderp->ferr >= faderp->nsamp2)
+/* Fade 'frames' frames of the input and add them to the output */
+static void mixfade_mix(struct mixfader *faderp, int16_t *out,
+                        const int16_t *in, unsigned int frames)
+{
+    while (frames)
     {
-        faderp->factor += faderp->dfinc;
-        faderp->ferr -= faderp->nsamp2;
+        int32_t fac, inc;
+        unsigned int n = mixfader_ramp(faderp, frames, &fac, &inc);
+        frames -= n;
+
+        for (; n != 0; n--, fac += inc)
+        {
+            int32_t left  = out[0] + mixfade_sample(fac, *in++);
+            int32_t right = out[1] + mixfade_sample(fac, *in++);
+            *out++ = clip_sample_16(left);
+            *out++ = clip_sample_16(right);
+        }
     }
 }
 
-static FORCE_INLINE int32_t mixfade_sample(const struct mixfader *faderp, int32_t s)
+/* Fade 'frames' frames of the output in place */
+static void mixfade_inplace(struct mixfader *faderp, int16_t *out,
+                            unsigned int frames)
 {
-    return (faderp->factor * s + MIXFADE_UNITY/2) >> MIXFADE_UNITY_BITS;
+    while (frames)
+    {
+        int32_t fac, inc;
+        unsigned int n = mixfader_ramp(faderp, frames, &fac, &inc);
+        frames -= n;
+
+        for (; n != 0; n--, fac += inc)
+        {
+            out[0] = mixfade_sample(fac, out[0]);
+            out[1] = mixfade_sample(fac, out[1]);
+            out += 2;
+        }
+    }
 }
 
 /* Cancel crossfade operation */
@@ -967,7 +1158,7 @@ static size_t crossfade_find_index(size_t index, size_t size)
 static size_t crossfade_find_buftail(bool auto_skip, size_t buffer_rem,
                                      size_t buffer_need, size_t *buffer_rem_outp)
 {
-    size_t index = chunk_ridx;
+    size_t index = chunk_idx_acquire(&chunk_ridx);
 
     if (buffer_rem > buffer_need)
     {
@@ -1042,45 +1233,29 @@ static void crossfade_mix_fade(struct mixfader *faderp, size_t size,
 
         size -= amount;
 
+        unsigned int frames = amount / PCMBUF_SAMPLE_SIZE;
+
         if (alloced)
         {
             /* Fade the input buffer into the new destination chunk */
-            for (size_t s = amount; s != 0; s -= PCMBUF_SAMPLE_SIZE)
-            {
-                *outbuf++ = mixfade_sample(faderp, *inbuf++);
-                *outbuf++ = mixfade_sample(faderp, *inbuf++);
-                mixfader_step(faderp);
-            }
-
+            mixfade_copy(faderp, outbuf, inbuf, frames);
             commit_write_buffer(amount);
         }
         else if (inbuf)
         {
             /* Fade the input buffer and mix into the destination chunk */
-            for (size_t s = amount; s != 0; s -= PCMBUF_SAMPLE_SIZE)
-            {
-                int32_t left  = outbuf[0];
-                int32_t right = outbuf[1];
-                left  += mixfade_sample(faderp, *inbuf++);
-                right += mixfade_sample(faderp, *inbuf++);
-                *outbuf++ = clip_sample_16(left);
-                *outbuf++ = clip_sample_16(right);
-                mixfader_step(faderp);
-            }
+            mixfade_mix(faderp, outbuf, inbuf, frames);
         }
         else
         {
             /* Fade the chunk in place */
-            for (size_t s = amount; s != 0; s -= PCMBUF_SAMPLE_SIZE)
-            {
-                int32_t left  = outbuf[0];
-                int32_t right = outbuf[1];
-                *outbuf++ = mixfade_sample(faderp, left);
-                *outbuf++ = mixfade_sample(faderp, right);
-                mixfader_step(faderp);
-            }
+            mixfade_inplace(faderp, outbuf, frames);
         }
 
+        outbuf = SKIPBYTES(outbuf, amount);
+        if (inbuf)
+            inbuf = SKIPBYTES(inbuf, amount);
+
         if (outbuf < chunkend)
         {
             index += amount;
@@ -1194,7 +1369,7 @@ static void crossfade_start(void)
         /* Fade out the specified amount of the already processed audio */
         struct mixfader outfader;
 
-        mixfader_init(&outfader, MIXFADE_UNITY, 0, fade_out_rem, false);
+        mixfader_init(&outfader, false, fade_out_rem, false);
         crossfade_mix_fade(&outfader, fade_out_rem, NULL, &index, 0,
                            MIXFADE_KEEP_POS);
 
@@ -1206,7 +1381,7 @@ static void crossfade_start(void)
     }
 
     /* Initialize fade-in counters */
-    mixfader_init(&crossfade_infader, 0, MIXFADE_UNITY, fade_in_duration, true);
+    mixfader_init(&crossfade_infader, true, fade_in_duration, true);
 
     /* Find the right chunk and sample to start fading in - redo from read
        chunk in case original position were/was overrun in callback - the
@@ -78,6 +78,10 @@
  * for their correct seek target, 32k seems a good size */
 #define AUDIO_REBUFFER_GUESS_SIZE    (1024*32)
 
+/* Number of upcoming playlist entries whose metadata is read in one burst
+ * once the buffering thread has nothing left to do */
+#define AUDIO_PREFETCH_TRACKS        4
+
 /* Define LOGF_ENABLE to enable logf output in this file */
 #if 0
 #define LOGF_ENABLE
@@ -139,6 +143,7 @@ static struct audio_scratch_memory
 {
     struct mp3entry codec_id3; /* (A,C) */
     struct mp3entry unbuffered_id3;
+    struct mp3entry prefetch_id3[AUDIO_PREFETCH_TRACKS]; /* (A) */
     struct cuesheet *curr_cue; /* Will follow this structure */
 } * audio_scratch_memory = NULL;
 
@@ -792,6 +797,80 @@ static void track_list_clear(unsigned int action)
 }
 
 
+/** --- Metadata prefetch --- **/
+
+/* Forget all prefetched metadata */
+static void audio_prefetch_clear(void)
+{
+    for (int i = 0; i < AUDIO_PREFETCH_TRACKS; i++)
+        audio_scratch_memory->prefetch_id3[i].path[0] = '\0';
+}
+
+/* Find the prefetched metadata for a file */
+static struct mp3entry * audio_prefetch_find(const char *path)
+{
+    for (int i = 0; i < AUDIO_PREFETCH_TRACKS; i++)
+    {
+        struct mp3entry *id3 = &audio_scratch_memory->prefetch_id3[i];
+
+        if (id3->path[0] != '\0' && !strcmp(id3->path, path))
+            return id3;
+    }
+
+    return NULL;
+}
+
+/* Read the metadata of the playlist entries from peek offset 'offset' on,
+   unless the first of them is already there. Called once all handles have
+   been buffered, so that it doesn't hold up the loading of a track. */
+static void audio_prefetch_fill(int offset)
+{
+    static char path_buf[MAX_PATH + 1]; /* (A) */
+    const char *path = playlist_peek(offset, path_buf, sizeof (path_buf));
+
+    if (!path || audio_prefetch_find(path))
+        return;
+
+    audio_prefetch_clear();
+
+    logf("%s:%d tracks from %d", __func__, AUDIO_PREFETCH_TRACKS, offset);
+
+    for (int i = 0; i < AUDIO_PREFETCH_TRACKS; i++)
+    {
+        struct mp3entry *entry = &audio_scratch_memory->prefetch_id3[i];
+
+        if (i > 0)
+        {
+            path = playlist_peek(offset + i, path_buf, sizeof (path_buf));
+            if (!path)
+                break;
+        }
+
+        /* Broken entries are dealt with when the loader gets there */
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            continue;
+
+        if (!get_metadata(entry, fd, path))
+            entry->path[0] = '\0';
+
+        close(fd);
+    }
+}
+
+/* Hand over prefetched metadata to a buffer handle. The data is there
+   already, so the handle is finished as soon as it exists. */
+static int audio_prefetch_bufalloc(struct mp3entry *id3)
+{
+    int hid = bufalloc(id3, sizeof (struct mp3entry), TYPE_ID3);
+
+    if (hid >= 0)
+        id3->path[0] = '\0'; /* Consumed */
+
+    return hid;
+}
+
+
 /** --- Audio buffer -- **/
 
 /* What size is needed for the scratch buffer? */
@@ -813,6 +892,7 @@ static void scratch_mem_init(void *mem)
     id3_write_locked(UNBUFFERED_ID3, NULL);
     id3_write(CODEC_ID3, NULL);
     ci.id3 = id3_get(CODEC_ID3);
+    audio_prefetch_clear();
     audio_scratch_memory->curr_cue = NULL;
 
     if (global_settings.cuesheet)
@@ -1052,14 +1132,13 @@ static void audio_reset_buffer(void)
         panicf("%s(): OOM!\n", __func__);
 }
 
-/* Set the buffer margin to begin rebuffering when 'seconds' from empty */
+/* Set the buffer margin to begin rebuffering when 'seconds' from empty; the
+   buffering code adds the time it measures the storage needs to wake up */
 static void audio_update_filebuf_watermark(int seconds)
 {
     size_t bytes = 0;
 
 #ifdef HAVE_DISK_STORAGE
-    int spinup = storage_spinup_time();
-
     if (seconds == 0)
     {
         /* By current setting */
@@ -1079,15 +1158,10 @@ static void audio_update_filebuf_watermark(int seconds)
         }
     }
 
-    if (spinup)
-        seconds += (spinup / HZ) + 1;
-    else
-        seconds += 5;
-
     seconds += buffer_margin;
 #else
     /* flash storage */
-    seconds = 1;
+    seconds = 0;
 #endif
 
     /* Watermark is a function of the bitrate of the last track in the buffer */
@@ -1101,7 +1175,10 @@ static void audio_update_filebuf_watermark(int seconds)
     {
         if (!rbcodec_format_is_atomic(id3->codectype))
         {
-            bytes = id3->bitrate * (1000/8) * seconds;
+            buf_set_watermark_rate(id3->bitrate * (1000/8), seconds);
+            logf("fwmark: %lu B/s + %ds", id3->bitrate * (1000/8UL),
+                 seconds);
+            return;
         }
         else
         {
@@ -2011,9 +2088,19 @@ static int audio_load_track(void)
         return LOAD_TRACK_ERR_NO_MORE;
     }
 
-    /* Successfully opened the file - get track metadata */
-    if (filling == STATE_FULL ||
-        (info.id3_hid = bufopen(path, 0, TYPE_ID3, NULL)) < 0)
+    /* Successfully opened the file - get track metadata, preferably from
+       the prefetched entries so that storage isn't woken for each track */
+    struct mp3entry *prefetch_id3 = audio_prefetch_find(path);
+
+    if (filling != STATE_FULL)
+    {
+        if (prefetch_id3)
+            info.id3_hid = audio_prefetch_bufalloc(prefetch_id3);
+        else
+            info.id3_hid = bufopen(path, 0, TYPE_ID3, NULL);
+    }
+
+    if (filling == STATE_FULL || info.id3_hid < 0)
     {
         /* Buffer or track list is full */
         struct mp3entry *ub_id3;
@@ -2023,7 +2110,11 @@ static int audio_load_track(void)
         /* Load the metadata for the first unbuffered track */
         ub_id3 = id3_get(UNBUFFERED_ID3);
 
-        if (fd >= 0)
+        if (prefetch_id3)
+        {
+            id3_write_locked(UNBUFFERED_ID3, prefetch_id3);
+        }
+        else if (fd >= 0)
         {
             id3_mutex_lock();
             get_metadata(ub_id3, fd, path);
@@ -2052,6 +2143,14 @@ static int audio_load_track(void)
 
         /* Successful load initiation */
         track_list.in_progress_hid = info.self_hid;
+
+        if (prefetch_id3)
+        {
+            /* No buffering thread notification will come for this one */
+            LOGFQUEUE("audio > audio Q_AUDIO_FINISH_LOAD_TRACK: %d",
+                      info.id3_hid);
+            audio_queue_post(Q_AUDIO_FINISH_LOAD_TRACK, info.id3_hid);
+        }
     }
     if (fd >= 0)
         close(fd);
@@ -2457,19 +2556,25 @@ static void audio_on_finish_load_track(int id3_hid)
 static void audio_on_handle_finished(int hid)
 {
     /* Right now, only audio handles should end up calling this */
+    struct track_info info;
+
+    /* Really we don't know which order the handles will actually complete
+       to zero bytes remaining since another thread is doing it - be sure
+       it's the right one */
+    if (!track_list_last(0, &info) || info.audio_hid != hid)
+        return;
+
     if (filling == STATE_END_OF_PLAYLIST)
     {
-        struct track_info info;
-
-        /* Really we don't know which order the handles will actually complete
-           to zero bytes remaining since another thread is doing it - be sure
-           it's the right one */
-        if (track_list_last(0, &info) && info.audio_hid == hid)
-        {
-            /* This was the last track in the playlist and we now have all the
-               data we need */
-            filling_is_finished();
-        }
+        /* This was the last track in the playlist and we now have all the
+           data we need */
+        filling_is_finished();
+    }
+    else
+    {
+        /* Everything loaded so far is buffered and storage is still awake;
+           read ahead the metadata of the tracks that come next */
+        audio_prefetch_fill(playlist_peek_offset + 1);
     }
 }
 
@@ -2980,6 +3085,7 @@ static void audio_stop_playback(void)
     play_status = PLAY_STOPPED;
 
     wipe_track_metadata(true);
+    audio_prefetch_clear();
 #ifdef HAVE_ALBUMART
     clear_last_folder_album_art();
 #endif
@@ -842,6 +842,11 @@ static const struct plugin_api rockbox_api = {
        the API gets incompatible */
 
     talk_fullpath,
+#ifdef HAVE_TAGCACHE
+    tagcache_search_add_clause,
+    tagcache_import_changelog,
+    tagcache_create_changelog,
+#endif
 };
 
 static int plugin_buffer_handle;
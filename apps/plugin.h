@@ -163,7 +163,7 @@ int plugin_open(const char *plugin, const char *parameter);
  * when this happens please take the opportunity to sort in
  * any new functions "waiting" at the end of the list.
  */
-#define PLUGIN_API_VERSION 271
+#define PLUGIN_API_VERSION 278
 
 /* 239 Marks the removal of ARCHOS HWCODEC and CHARCELL */
 
@@ -979,6 +979,12 @@ struct plugin_api {
        the API gets incompatible */
 
     int (*talk_fullpath)(const char* path, bool enqueue);
+#ifdef HAVE_TAGCACHE
+    bool (*tagcache_search_add_clause)(struct tagcache_search *tcs,
+                                       struct tagcache_search_clause *clause);
+    bool (*tagcache_import_changelog)(void);
+    bool (*tagcache_create_changelog)(struct tagcache_search *tcs);
+#endif
 };
 
 /* plugin header */
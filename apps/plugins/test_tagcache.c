@@ -0,0 +1,417 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * Copyright (C) 2026 by the Rockbox developers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+/* Times the database queries on the database the player has built, in
+ * the simulator or on the target. It runs the same searches and tagnavi
+ * menu paths as the benchmark of the database tool (tools/database, -b),
+ * plus tagcache_fill_tags() on targets with the RAM cache and dircache.
+ * Commit and update run on the tagcache thread here and are timed by the
+ * tool instead.
+ *
+ * Every phase writes one line of key=value pairs to test_tagcache.txt.
+ * Quick phases are repeated for at least half a second to get past the
+ * tick resolution; ms is the time of one run. */
+
+#include "plugin.h"
+
+#define LOG_FILE        HOME_DIR "/test_tagcache.txt"
+#define CHANGELOG_FILE  ROCKBOX_DIR "/database_changelog.txt"
+#define MIN_TICKS       (HZ/2)
+#define MAX_KEYS        32  /* Keys followed on each level of a view */
+#define PATH_KEYS       8   /* Keys followed on each level of a menu path */
+#define LEVELS          4
+#define FILL_FILES      256 /* Files looked up by the fill_tags phase */
+#define UNIQBUF_SIZE    (64*1024) /* Same as tagtree */
+
+/* A path through the database menus of tagnavi.config, see the database
+ * tool benchmark. */
+struct menu_path {
+    const char *name;
+    int levels;
+    int tag[LEVELS];
+    int clause_count;
+    struct tagcache_search_clause clause[2];
+    int format[6];
+};
+
+#define NUMERIC_CLAUSE(t, c, n) \
+    { .tag = t, .type = c, .numeric = true, .numeric_data = n, \
+      .source = source_constant, .str = "" }
+
+static struct menu_path paths[] = {
+    { "tagnavi_artist", 3,
+      { tag_virt_canonicalartist, tag_album, tag_title }, 0, { },
+      { tag_discnumber, tag_tracknumber, tag_title, tag_virt_length_min,
+        tag_virt_length_sec, -1 } },
+    { "tagnavi_genre", 4,
+      { tag_genre, tag_virt_canonicalartist, tag_album, tag_title }, 0, { },
+      { tag_discnumber, tag_tracknumber, tag_title, tag_virt_length_min,
+        tag_virt_length_sec, -1 } },
+    { "tagnavi_year", 4,
+      { tag_year, tag_virt_canonicalartist, tag_album, tag_title }, 1,
+      { NUMERIC_CLAUSE(tag_year, clause_gt, 0) },
+      { tag_discnumber, tag_tracknumber, tag_title, tag_virt_length_min,
+        tag_virt_length_sec, -1 } },
+    { "tagnavi_most_played", 1, { tag_title }, 1,
+      { NUMERIC_CLAUSE(tag_playcount, clause_gt, 0) },
+      { tag_playcount, tag_virt_autoscore, tag_title,
+        tag_virt_canonicalartist, -1 } },
+    { "tagnavi_favourite_artists", 3,
+      { tag_virt_canonicalartist, tag_album, tag_title }, 2,
+      { NUMERIC_CLAUSE(tag_playcount, clause_gt, 3),
+        NUMERIC_CLAUSE(tag_virt_autoscore, clause_gt, 85) },
+      { tag_tracknumber, tag_title, tag_virt_autoscore, -1 } },
+};
+
+static uint32_t *uniqbuf;
+static char *names;         /* FILL_FILES paths of MAX_PATH bytes */
+static int name_count;
+#if defined(HAVE_TC_RAMCACHE) && defined(HAVE_DIRCACHE)
+static struct mp3entry id3;
+#endif
+
+static int log_fd;
+static int line;
+static int max_line;
+
+static void log_text(const char *text)
+{
+    rb->lcd_puts(0, line, text);
+    rb->lcd_update();
+    if (++line >= max_line)
+        line = 0;
+    rb->fdprintf(log_fd, "%s\n", text);
+}
+
+/* Run a phase once, or over and over for at least MIN_TICKS. */
+static void run(const char *name, long (*phase)(void *), void *arg,
+                bool repeat)
+{
+    char text[128];
+    long start = *rb->current_tick, ticks;
+    long results;
+    int runs = 0;
+
+    do
+    {
+        results = phase(arg);
+        runs++;
+        ticks = *rb->current_tick - start;
+    }
+    while (repeat && ticks < MIN_TICKS);
+
+    rb->snprintf(text, sizeof(text),
+                 "phase=%s tracks=%d ms=%ld results=%ld runs=%d ram_bytes=%d",
+                 name, rb->tagcache_get_stat()->total_entries,
+                 ticks * 1000 / (HZ * runs), results, runs,
+                 rb->tagcache_get_stat()->ramcache_used);
+    log_text(text);
+}
+
+/* Count the results of a search, keeping the seeks of the first ones. */
+static long search(int tag, int filter_tag, int filter_seek,
+                   struct tagcache_search_clause *clause,
+                   int32_t *seeks, int *seek_count)
+{
+    struct tagcache_search tcs;
+    char buf[TAGCACHE_BUFSZ];
+    long count = 0;
+
+    if (seek_count)
+        *seek_count = 0;
+
+    if (!rb->tagcache_search(&tcs, tag))
+        return -1;
+
+    rb->tagcache_search_set_uniqbuf(&tcs, uniqbuf, UNIQBUF_SIZE);
+    if (filter_tag >= 0)
+        rb->tagcache_search_add_filter(&tcs, filter_tag, filter_seek);
+    if (clause)
+        rb->tagcache_search_add_clause(&tcs, clause);
+
+    while (rb->tagcache_get_next(&tcs, buf, sizeof(buf)))
+    {
+        if (seek_count && *seek_count < MAX_KEYS)
+            seeks[(*seek_count)++] = tcs.result_seek;
+        count++;
+    }
+
+    rb->tagcache_search_finish(&tcs);
+
+    return count;
+}
+
+static long list_titles(void *arg)
+{
+    (void)arg;
+    return search(tag_title, -1, 0, NULL, NULL, NULL);
+}
+
+/* A two level view: list the keys, then the items under each key. */
+static long view(void *arg)
+{
+    const int *tags = arg;
+    int32_t seeks[MAX_KEYS];
+    int count, i;
+    long results;
+
+    results = search(tags[0], -1, 0, NULL, seeks, &count);
+    for (i = 0; i < count; i++)
+        results += search(tags[1], tags[0], seeks[i], NULL, NULL, NULL);
+
+    return results;
+}
+
+static long clause_search(void *arg)
+{
+    return search(tag_title, -1, 0, arg, NULL, NULL);
+}
+
+/* Format an entry of the last level the way tagtree does. */
+static void format_entry(struct tagcache_search *tcs, const int *format)
+{
+    char buf[TAGCACHE_BUFSZ], str[MAX_PATH];
+    size_t pos = 0;
+
+    for (; *format >= 0 && pos < sizeof(buf); format++)
+    {
+        if (TAGCACHE_IS_NUMERIC(*format))
+        {
+            pos += rb->snprintf(&buf[pos], sizeof(buf) - pos, "%ld ",
+                                rb->tagcache_get_numeric(tcs, *format));
+        }
+        else if (*format == tcs->type)
+        {
+            pos += rb->snprintf(&buf[pos], sizeof(buf) - pos, "%s ",
+                                tcs->result);
+        }
+        else if (rb->tagcache_retrieve(tcs, tcs->idx_id, *format,
+                                       str, sizeof(str)))
+        {
+            pos += rb->snprintf(&buf[pos], sizeof(buf) - pos, "%s ", str);
+        }
+    }
+}
+
+static long walk_path(struct menu_path *path, int level, int32_t *filter)
+{
+    struct tagcache_search tcs;
+    char buf[TAGCACHE_BUFSZ];
+    int32_t seeks[PATH_KEYS];
+    bool last = level == path->levels - 1;
+    int seek_count = 0, i;
+    long count = 0;
+
+    if (!rb->tagcache_search(&tcs, path->tag[level]))
+        return 0;
+
+    rb->tagcache_search_set_uniqbuf(&tcs, uniqbuf, UNIQBUF_SIZE);
+    for (i = 0; i < level; i++)
+        rb->tagcache_search_add_filter(&tcs, path->tag[i], filter[i]);
+    for (i = 0; i < path->clause_count; i++)
+        rb->tagcache_search_add_clause(&tcs, &path->clause[i]);
+
+    while (rb->tagcache_get_next(&tcs, buf, sizeof(buf)))
+    {
+        if (last)
+            format_entry(&tcs, path->format);
+        else if (seek_count < PATH_KEYS)
+            seeks[seek_count++] = tcs.result_seek;
+        count++;
+    }
+
+    rb->tagcache_search_finish(&tcs);
+
+    for (i = 0; i < seek_count; i++)
+    {
+        filter[level] = seeks[i];
+        count += walk_path(path, level + 1, filter);
+    }
+
+    return count;
+}
+
+static long menu_path(void *arg)
+{
+    int32_t filter[LEVELS];
+
+    return walk_path(arg, 0, filter);
+}
+
+#if defined(HAVE_TC_RAMCACHE) && defined(HAVE_DIRCACHE)
+static long fill_tags(void *arg)
+{
+    long found = 0;
+    int i;
+
+    (void)arg;
+    for (i = 0; i < name_count; i++)
+    {
+        if (rb->tagcache_fill_tags(&id3, &names[i * MAX_PATH]))
+            found++;
+    }
+
+    return found;
+}
+#endif
+
+/* Keep the names of the first files for fill_tags, and write a play
+ * history for every fourth file to the changelog like the database tool
+ * benchmark does. Returns the number of history entries. */
+static long scan_files(void)
+{
+    struct tagcache_search tcs;
+    char buf[TAGCACHE_BUFSZ];
+    long count = 0;
+    int fd, n = 0;
+
+    fd = rb->open(CHANGELOG_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return -1;
+
+    if (!rb->tagcache_search(&tcs, tag_filename))
+    {
+        rb->close(fd);
+        return -1;
+    }
+
+    while (rb->tagcache_get_next(&tcs, buf, sizeof(buf)))
+    {
+        long playtime = rb->tagcache_get_numeric(&tcs, tag_length);
+        int playcount = count % 6 + 1;
+
+        if (name_count < FILL_FILES)
+            rb->strlcpy(&names[name_count++ * MAX_PATH], buf, MAX_PATH);
+
+        if (n++ % 4 != 0)
+            continue;
+
+        playtime *= playcount;
+        if (count % 2)
+            playtime /= 2;
+
+        rb->fdprintf(fd, "filename=\"%s\" playcount=\"%d\" playtime=\"%ld\" "
+                     "lastplayed=\"%ld\" rating=\"%ld\"\n", buf, playcount,
+                     playtime, count + 1, count % 11);
+        count++;
+    }
+
+    rb->tagcache_search_finish(&tcs);
+    rb->close(fd);
+
+    return count;
+}
+
+static long import_changelog(void *arg)
+{
+    long entries = *(long *)arg;
+
+    return entries >= 0 && rb->tagcache_import_changelog() ? entries : -1;
+}
+
+static long export_changelog(void *arg)
+{
+    struct tagcache_search tcs;
+    long entries = *(long *)arg;
+
+    return rb->tagcache_create_changelog(&tcs) ? entries : -1;
+}
+
+enum plugin_status plugin_start(const void* parameter)
+{
+    static const int artist_album[] = { tag_artist, tag_album };
+    static const int album_title[] = { tag_album, tag_title };
+    static const int genre_artist[] = { tag_genre, tag_artist };
+    static char genres[] = "Rock|Jazz|Blues";
+    static char digit[] = "7";
+    static struct tagcache_search_clause clauses[] = {
+        NUMERIC_CLAUSE(tag_year, clause_gteq, 2000),
+        { .tag = tag_genre, .type = clause_oneof, .source = source_constant,
+          .str = genres },
+        { .tag = tag_title, .type = clause_contains,
+          .source = source_constant, .str = digit },
+    };
+    size_t size;
+    long entries;
+    unsigned int i;
+    int h;
+
+    (void)parameter;
+
+    if (!rb->tagcache_get_stat()->ready)
+    {
+        rb->splash(HZ*2, "Database not ready");
+        return PLUGIN_OK;
+    }
+
+    uniqbuf = rb->plugin_get_buffer(&size);
+    if (size < UNIQBUF_SIZE + FILL_FILES * MAX_PATH)
+    {
+        rb->splash(HZ*2, "Out of memory");
+        return PLUGIN_ERROR;
+    }
+    names = (char *)uniqbuf + UNIQBUF_SIZE;
+
+    log_fd = rb->open(LOG_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (log_fd < 0)
+        return PLUGIN_ERROR;
+
+    rb->lcd_getstringsize("A", NULL, &h);
+    max_line = LCD_HEIGHT / h;
+    rb->lcd_clear_display();
+
+#ifdef HAVE_ADJUSTABLE_CPU_FREQ
+    rb->cpu_boost(true);
+#endif
+
+    run("list_titles", list_titles, NULL, true);
+    run("view_artist_album", view, (void *)artist_album, true);
+    run("view_album_title", view, (void *)album_title, true);
+    run("view_genre_artist", view, (void *)genre_artist, true);
+    run("clause_year", clause_search, &clauses[0], true);
+    run("clause_genre_oneof", clause_search, &clauses[1], true);
+    run("clause_title_contains", clause_search, &clauses[2], true);
+
+    entries = scan_files();
+    run("changelog_import", import_changelog, &entries, false);
+    run("changelog_export", export_changelog, &entries, false);
+
+    for (i = 0; i < ARRAYLEN(paths); i++)
+        run(paths[i].name, menu_path, &paths[i], true);
+
+#if defined(HAVE_TC_RAMCACHE) && defined(HAVE_DIRCACHE)
+    if (rb->tagcache_is_in_ram())
+        run("fill_tags", fill_tags, NULL, true);
+    else
+        log_text("fill_tags: database not in RAM");
+#endif
+
+#ifdef HAVE_ADJUSTABLE_CPU_FREQ
+    rb->cpu_boost(false);
+#endif
+
+    log_text("DONE");
+    rb->close(log_fd);
+    rb->button_clear_queue();
+    rb->button_get(true);
+
+    return PLUGIN_OK;
+}
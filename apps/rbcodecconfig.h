@@ -73,6 +73,18 @@ static inline void dsp_process_end(struct dsp_loop_context *ctx)
 #define DSP_PROCESS_END() \
     dsp_process_end(&__ctx)
 
+/* Time source for the per-stage DSP statistics (DSP_GET_PROC_STATS) */
+#ifdef USEC_TIMER
+#define DSP_PROFILE_TIME()  ((uint32_t)USEC_TIMER)
+#define DSP_PROFILE_TIME_HZ 1000000
+#else
+/* A stage call is much shorter than a tick, so each one mostly reads 0 and
+   sometimes 1. The chance of a tick landing inside a call grows with its
+   length, though, so the totals still converge on the real cost. */
+#define DSP_PROFILE_TIME()  ((uint32_t)current_tick)
+#define DSP_PROFILE_TIME_HZ HZ
+#endif
+
 #endif
 
 #define DSP_OUT_MIN_HZ      PLAY_SAMPR_HW_MIN
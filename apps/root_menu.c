@@ -219,15 +219,16 @@ static int browser(void* param)
 
                     /* Display building progress */
                     static long talked_tick = 0;
+                    int commit_step = tagcache_get_commit_step();
                     if(global_settings.talk_menu &&
                        (talked_tick == 0
                         || TIME_AFTER(current_tick, talked_tick+7*HZ)))
                     {
                         talked_tick = current_tick;
-                        if (stat->commit_step > 0)
+                        if (commit_step > 0)
                         {
                             talk_id(LANG_TAGCACHE_INIT, false);
-                            talk_number(stat->commit_step, true);
+                            talk_number(commit_step, true);
                             talk_id(VOICE_OF, true);
                             talk_number(tagcache_get_max_commit_step(), true);
                         } else if(stat->processed_entries)
@@ -236,22 +237,22 @@ static int browser(void* param)
                             talk_id(LANG_BUILDING_DATABASE, true);
                         }
                     }
-                    if (stat->commit_step > 0)
+                    if (commit_step > 0)
                     {
                         if (lang_is_rtl())
                         {
-                            splash_progress(stat->commit_step,
+                            splash_progress(commit_step,
                                             tagcache_get_max_commit_step(),
-                                            "[%d/%d] %s", stat->commit_step,
+                                            "[%d/%d] %s", commit_step,
                                             tagcache_get_max_commit_step(),
                                             str(LANG_TAGCACHE_INIT));
                         }
                         else
                         {
-                            splash_progress(stat->commit_step,
+                            splash_progress(commit_step,
                                             tagcache_get_max_commit_step(),
                                             "%s [%d/%d]", str(LANG_TAGCACHE_INIT),
-                                            stat->commit_step,
+                                            commit_step,
                                             tagcache_get_max_commit_step());
                         }
                     }
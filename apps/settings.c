@@ -1031,6 +1031,7 @@ void settings_apply(bool read_disk)
     }
 
     dsp_dither_enable(global_settings.dithering_enabled);
+    dsp_set_resample_quality(global_settings.resample_quality);
     dsp_surround_set_balance(global_settings.surround_balance);
     dsp_surround_set_cutoff(global_settings.surround_fx1, global_settings.surround_fx2);
     dsp_surround_mix(global_settings.surround_mix);
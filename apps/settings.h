@@ -64,6 +64,13 @@ enum {
     BOOKMARK_ONE_PER_TRACK = 3,
 };
 
+/* Crossfade gain curve */
+enum crossfade_curve {
+    CROSSFADE_CURVE_LINEAR = 0,
+    CROSSFADE_CURVE_EQUAL_POWER,
+    CROSSFADE_CURVE_LOG,
+};
+
 enum
 {
     TRIG_MODE_OFF = 0,
@@ -911,6 +918,12 @@ struct user_settings
 #if defined(HAVE_EROS_QN_CODEC)
     int stereosw_mode; /* indicates normal, reverse, always 0, always 1 operation */
 #endif
+
+    int resample_quality; /* see enum resample_quality */
+#ifdef HAVE_CROSSFADE
+    int crossfade_fade_curve; /* Fade curve (0=linear,1=equal power,
+                                             2=logarithmic) */
+#endif
 };
 
 /** global variables **/
@@ -1686,6 +1686,12 @@ const struct settings_list settings[] = {
                    LANG_CROSSFADE_FADE_OUT_MODE, 0,
                    "crossfade fade out mode", "crossfade,mix", NULL, 2,
                    ID2P(LANG_CROSSFADE), ID2P(LANG_MIX)),
+    CHOICE_SETTING(F_SOUNDSETTING, crossfade_fade_curve,
+                   LANG_CROSSFADE_FADE_CURVE, 0,
+                   "crossfade fade curve", "linear,equal power,logarithmic",
+                   NULL, 3, ID2P(LANG_CROSSFADE_CURVE_LINEAR),
+                   ID2P(LANG_CROSSFADE_CURVE_EQUAL_POWER),
+                   ID2P(LANG_CROSSFADE_CURVE_LOG)),
 #endif
 
     /* crossfeed */
@@ -1738,6 +1744,10 @@ const struct settings_list settings[] = {
     /* dithering */
     OFFON_SETTING(F_SOUNDSETTING, dithering_enabled, LANG_DITHERING, false,
                   "dithering enabled", dsp_dither_enable),
+    /* resampler */
+    CHOICE_SETTING(F_SOUNDSETTING, resample_quality, LANG_RESAMPLER, 0,
+                   "resampler", "normal,high", dsp_set_resample_quality, 2,
+                   ID2P(LANG_NORMAL), ID2P(LANG_RESAMPLER_HIGH)),
     /* surround */
      TABLE_SETTING(F_TIME_SETTING | F_SOUNDSETTING, surround_enabled,
                   LANG_SURROUND, 0, "surround enabled", off,
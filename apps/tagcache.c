@@ -116,7 +116,7 @@
 #define TAGCACHE_MAGIC  0x54434810
 
 /* Dump store/restore header version 'TCSxx'. */
-#define TAGCACHE_STATEFILE_MAGIC 0x54435301
+#define TAGCACHE_STATEFILE_MAGIC 0x54435302
 
 /* How much to allocate extra space for ramcache. */
 #define TAGCACHE_RESERVE 32768
@@ -127,6 +127,9 @@
  */
 #define TAGFILE_ENTRY_CHUNK_LENGTH   8
 
+/* Progress steps reported within each commit step. */
+#define TAGCACHE_COMMIT_SUBSTEPS   10
+
 /* Used to guess the necessary buffer size at commit. */
 #define TAGFILE_ENTRY_AVG_LENGTH   16
 
@@ -148,6 +151,19 @@
 /* The main database string data. */
 #define TAGCACHE_FILE_INDEX      "database_%d.tcd"
 
+/* Inverted index (tag seek -> master index entries) of a filter tag. */
+#define TAGCACHE_FILE_INVERTED   "database_inv_%d.tcd"
+
+/* Hash table of the filename tags, for looking up files by path. */
+#define TAGCACHE_FILE_HASH       "database_hash.tcd"
+
+/* Directory state of the last scan (temporary one while scanning). */
+#define TAGCACHE_FILE_DIRS       "database_dirs.tcd"
+#define TAGCACHE_FILE_DIRS_TEMP  "database_dirs.tmp"
+
+/* Sorted runs of the external sort at commit. */
+#define TAGCACHE_FILE_SORT       "database_sort%d.tmp"
+
 /* ASCII dumpfile of the DB contents. */
 #define TAGCACHE_FILE_CHANGELOG  "database_changelog.txt"
 
@@ -206,6 +222,12 @@ static int tempbuf_handle;
     (1LU << tag_albumartist) | (1LU << tag_grouping) | \
     (1LU << tag_virt_canonicalartist))
 
+/* Tags that get an inverted index at commit, so that filtered searches only
+   have to visit the matching entries. */
+#define TAGCACHE_INVERTED_TAGS ((1LU << tag_artist) | (1LU << tag_album) | \
+    (1LU << tag_genre) | (1LU << tag_composer) | (1LU << tag_albumartist))
+#define TAGCACHE_IS_INVERTED(tag) (BIT_N(tag) & TAGCACHE_INVERTED_TAGS)
+
 /* String presentation of the tags defined in tagcache.h. Must be in correct order! */
 static const char * const tags_str[] = { "artist", "album", "genre", "title",
     "filename", "composer", "comment", "albumartist", "grouping", "year",
@@ -300,6 +322,46 @@ struct master_header {
 
 static struct master_header current_tcmh;
 
+/**
+ * Inverted index file layout:
+ *
+ *   struct inverted_header
+ *   struct inverted_key[tch.entry_count]   sorted by tag seek
+ *   int32_t idx_id[tch.datasize / 4]       master index entries, ascending
+ *                                          within each key
+ *
+ * The file is only valid for the commit it was built on; deleted entries
+ * may still be listed and have to be checked in the master index.
+ */
+struct inverted_header {
+    struct tagcache_header tch;
+    int32_t commitid;    /* Commit the index was built on (-1 = incomplete) */
+};
+
+/**
+ * The filename hash is an open addressing table of the filename tags,
+ * with linear probing:
+ *     struct hash_header   entry_count = number of slots (power of two)
+ *     struct hash_slot     [entry_count]
+ */
+struct hash_header {
+    struct tagcache_header tch;
+    int32_t commitid;    /* Commit the table was built on (-1 = incomplete) */
+};
+
+struct hash_slot {
+    int32_t crc;         /* crc32 of the path */
+    int32_t seek;        /* Tag file location, 0 = free slot */
+};
+
+#define HASH_READ_SLOTS 8
+
+struct inverted_key {
+    int32_t seek;        /* Tag seek in the tag file */
+    int32_t offset;      /* First entry in the idx_id list */
+    int32_t count;       /* Number of entries */
+};
+
 #ifdef HAVE_TC_RAMCACHE
 
 #define TC_ALIGN_PTR(p, type, gap_out_p) \
@@ -320,9 +382,19 @@ static struct master_header current_tcmh;
 struct ramcache_header {
     char *tags[TAG_COUNT];       /* Tag file content (dcfrefs if tag_filename) */
     int entry_count[TAG_COUNT];  /* Number of entries in the indices. */
+    int index_count;             /* Number of entries in the master index */
+    bool columnar;               /* Master index is stored field by field */
     struct index_entry indices[0]; /* Master index file content */
 };
 
+/* Big databases keep the master index in RAM as one array per field (each
+   tag_seek[] and the flags) instead of an array of index entries. A search
+   then only pulls the fields it tests through the data cache, instead of
+   whole entries. Use tcrc_seek() and tcrc_flag() to access the fields. */
+#define TAGCACHE_RAM_COLUMNS_MIN 2048
+#define TCRC_FIELD_FLAG TAG_COUNT
+#define TCRC_FIELDS     (TAG_COUNT + 1)
+
 #ifdef HAVE_EEPROM_SETTINGS
 struct statefile_header {
     int32_t magic;                /* Statefile version number */
@@ -349,6 +421,45 @@ static inline void tcrc_buffer_unlock(void)
     core_unpin(tcramcache.handle);
 }
 
+static inline int32_t *tcrc_field(int idx_id, int field)
+{
+    int32_t *base = (int32_t *)tcramcache.hdr->indices;
+
+    if (tcramcache.hdr->columnar)
+        return &base[field * tcramcache.hdr->index_count + idx_id];
+
+    return &base[idx_id * TCRC_FIELDS + field];
+}
+
+#define tcrc_seek(idx_id, tag) (*tcrc_field((idx_id), (tag)))
+#define tcrc_flag(idx_id)      (*tcrc_field((idx_id), TCRC_FIELD_FLAG))
+
+/* Copy an entry of the RAM master index. */
+static void tcrc_get_index(int idx_id, struct index_entry *idx)
+{
+    if (!tcramcache.hdr->columnar)
+    {
+        *idx = tcramcache.hdr->indices[idx_id];
+        return;
+    }
+
+    for (int tag = 0; tag < TAG_COUNT; tag++)
+        idx->tag_seek[tag] = tcrc_seek(idx_id, tag);
+
+    idx->flag = tcrc_flag(idx_id);
+}
+
+/* Copy the flag and the given tag fields of an entry of the columnar RAM
+   master index, leaving the rest of idx as it is. */
+static inline void tcrc_gather_index(int idx_id, struct index_entry *idx,
+                                     const uint8_t *tags, int count)
+{
+    for (int i = 0; i < count; i++)
+        idx->tag_seek[tags[i]] = tcrc_seek(idx_id, tags[i]);
+
+    idx->flag = tcrc_flag(idx_id);
+}
+
 #else /* ndef HAVE_TC_RAMCACHE */
 
 #define IF_TCRCDC(...)
@@ -384,6 +495,8 @@ static struct tempbuf_searchidx **lookup;
 
 /* Used when building the temporary file. */
 static int cachefd = -1, filenametag_fd;
+static int filenamehash_fd = -1;
+static long filenamehash_slots;
 static int total_entry_count = 0;
 static int data_size = 0;
 static int processed_dir_count;
@@ -393,6 +506,7 @@ static volatile int write_lock;
 static volatile int read_lock;
 
 static bool delete_entry(long idx_id);
+static void dirscan_file_failed(const char *path);
 
 static inline void str_setlen(char *buf, size_t len)
 {
@@ -444,11 +558,21 @@ static void swap_master_header(struct master_header *buf)
         buf->dirty = swap32(buf->dirty);
     }
 }
+
+static void swap_int32s(int32_t *buf, size_t count)
+{
+    if (tc_stat.econ)
+    {
+        for (; count > 0; count--, buf++)
+            *buf = swap32(*buf);
+    }
+}
 #else
 static void swap_tagfile_entry(struct tagfile_entry *buf) { (void)buf; }
 static void swap_index_entry(struct index_entry *buf) { (void)buf; }
 static void swap_tagcache_header(struct tagcache_header *buf) { (void)buf; }
 static void swap_master_header(struct master_header *buf) { (void)buf; }
+static void swap_int32s(int32_t *buf, size_t count) { (void)buf; (void)count; }
 #endif
 
 static ssize_t read_tagfile_entry(int fd, struct tagfile_entry *buf)
@@ -504,10 +628,39 @@ static ssize_t read_index_entries(int fd, struct index_entry *buf, size_t count)
     return ret;
 }
 
+/**
+ * Read-ahead cache of the master index for searches that don't use the
+ * ramcache. It holds one sector aligned block of the file and is shared by
+ * all searches. Every write to the master index goes through
+ * write_index_entries() which invalidates it.
+ */
+#define MASTER_CACHE_SIZE   8192
+#define MASTER_CACHE_ALIGN  512
+
+static struct master_cache
+{
+    off_t start;          /* File offset of data[0] */
+    ssize_t len;          /* Valid bytes in data (0 = empty) */
+    unsigned int gen;     /* Changes on every invalidation */
+    bool busy;            /* A fill is in progress */
+    int32_t data[MASTER_CACHE_SIZE / sizeof(int32_t)];
+} master_cache;
+
+static void master_cache_invalidate(void)
+{
+    master_cache.len = 0;
+    master_cache.gen++;
+}
+
 static ssize_t write_index_entries(int fd, struct index_entry *buf, size_t count)
 {
+    ssize_t ret;
+
+    /* Before and after: a fill running concurrently must not keep what it
+       read while the write was in progress. */
+    master_cache_invalidate();
 #ifdef TAGCACHE_SUPPORT_FOREIGN_ENDIAN
-    ssize_t ret = 0;
+    ret = 0;
     for (; count > 0; count--)
     {
         struct index_entry e = *buf++;
@@ -515,14 +668,18 @@ static ssize_t write_index_entries(int fd, struct index_entry *buf, size_t count
 
         ssize_t rc = write(fd, &e, sizeof(e));
         if (rc < 0)
-            return rc;
+        {
+            ret = rc;
+            break;
+        }
         ret += rc;
     }
-
-    return ret;
 #else
-    return write(fd, buf, sizeof(*buf) * count);
+    ret = write(fd, buf, sizeof(*buf) * count);
 #endif
+    master_cache_invalidate();
+
+    return ret;
 }
 
 static ssize_t read_tagcache_header(int fd, struct tagcache_header *buf)
@@ -557,6 +714,16 @@ static ssize_t write_master_header(int fd, struct master_header *buf)
     return write(fd, &e, sizeof(e));
 }
 
+/* The inverted index and filename hash consist only of int32_t fields. */
+static ssize_t write_int32s(int fd, int32_t *buf, size_t count)
+{
+    swap_int32s(buf, count);
+    ssize_t ret = write(fd, buf, sizeof(*buf) * count);
+    swap_int32s(buf, count);
+
+    return ret;
+}
+
 /*
  * open_db_fd and remove_db_file are noinline to minimize stack usage
  */
@@ -669,7 +836,12 @@ static void remove_files(void)
     tc_stat.ready = false;
     tc_stat.ramcache = false;
     tc_stat.econ = false;
+    master_cache_invalidate();
     remove_db_file(TAGCACHE_FILE_MASTER);
+    remove_db_file(TAGCACHE_FILE_HASH);
+#if !defined(PLUGIN)
+    remove_db_file(TAGCACHE_FILE_DIRS);
+#endif /*!defined(PLUGIN)*/
     for (i = 0; i < TAG_COUNT; i++)
     {
         if (TAGCACHE_IS_NUMERIC(i))
@@ -678,6 +850,13 @@ static void remove_files(void)
         snprintf(buf, bufsz, "%s/" TAGCACHE_FILE_INDEX,
                  tc_stat.db_path, i);
         remove(buf);
+
+        if (TAGCACHE_IS_INVERTED(i))
+        {
+            snprintf(buf, bufsz, "%s/" TAGCACHE_FILE_INVERTED,
+                     tc_stat.db_path, i);
+            remove(buf);
+        }
     }
 }
 
@@ -791,6 +970,102 @@ static void free_tempbuf(void)
     tempbuf_size = 0;
 }
 
+static ssize_t read_int32s(int fd, int32_t *buf, size_t count)
+{
+    ssize_t ret = read(fd, buf, sizeof(*buf) * count);
+    if (ret > 0)
+        swap_int32s(buf, ret / sizeof(*buf));
+
+    return ret;
+}
+
+/* Open the filename hash if it was built for the current DB. */
+static int open_hash_fd(long *slots)
+{
+    struct hash_header hdr;
+    int fd = open_db_fd(TAGCACHE_FILE_HASH, O_RDONLY);
+
+    if (fd < 0)
+        return fd;
+
+    if (read_int32s(fd, (int32_t *)&hdr, sizeof(hdr) / sizeof(int32_t)) !=
+        sizeof(hdr) || hdr.tch.magic != TAGCACHE_MAGIC ||
+        hdr.commitid != current_tcmh.commitid || hdr.tch.entry_count <= 0)
+    {
+        logf("filename hash is stale");
+        close(fd);
+        return -2;
+    }
+
+    *slots = hdr.tch.entry_count;
+    return fd;
+}
+
+/**
+ * Look up a file in the filename hash, checking the candidates against
+ * the filename tag file.
+ * Return values:
+ *    >= 0   idx_id of the file
+ *    == -1  not in the database
+ *    == -2  the hash is unusable, scan the tag file instead
+ */
+static long find_entry_hash(int fd, long slot_count, int tagfd,
+                            const char *filename, char *buf, long bufsz)
+{
+    struct hash_slot slots[HASH_READ_SLOTS];
+    long length = strlen(filename) + 1;
+    uint32_t crc = crc_32(filename, length - 1, 0xffffffff);
+    long mask = slot_count - 1;
+    long pos = crc & mask;
+    long probes, n;
+    int i;
+
+    if (length > bufsz)
+        return -2;
+
+    for (probes = 0; probes < slot_count; probes += n)
+    {
+        n = MIN(HASH_READ_SLOTS, slot_count - pos);
+
+        lseek(fd, sizeof(struct hash_header) + pos * sizeof(struct hash_slot),
+              SEEK_SET);
+        if (read_int32s(fd, (int32_t *)slots, n * 2) !=
+            (ssize_t)(n * sizeof(struct hash_slot)))
+        {
+            logf("filename hash: read error");
+            return -2;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            struct tagfile_entry tfe;
+
+            if (slots[i].seek == 0)
+                return -1;
+
+            if ((uint32_t)slots[i].crc != crc)
+                continue;
+
+            lseek(tagfd, slots[i].seek, SEEK_SET);
+            if (read_tagfile_entry(tagfd, &tfe) != sizeof(struct tagfile_entry))
+                return -2;
+
+            if (tfe.tag_length != length)
+                continue;
+
+            if (read(tagfd, buf, length) != length)
+                return -2;
+
+            if (!strncmp(filename, buf, length))
+                return tfe.idx_id;
+        }
+
+        pos = (pos + n) & mask;
+    }
+
+    return -1;
+}
+
 #if defined(HAVE_TC_RAMCACHE) && defined(HAVE_DIRCACHE)
 /* find the ramcache entry corresponding to the file indicated by
  * filename and dc (it's corresponding dircache id). */
@@ -819,7 +1094,7 @@ static long find_entry_ram(const char *filename)
         {
             do_timed_yield();
 
-            if (!(tcramcache.hdr->indices[i].flag & FLAG_DIRCACHE))
+            if (!(tcrc_flag(i) & FLAG_DIRCACHE))
                 continue;
 
             int cmp = dircache_fileref_cmp(&tcrc_dcfrefs[i], &dcfref);
@@ -856,9 +1131,10 @@ static long find_entry_disk(const char *filename_raw, bool localfd)
     char buf[TAGCACHE_BUFSZ];
     const long bufsz = sizeof(buf);
 
-    int fd;
+    int fd, hashfd;
     int pos = -1;
     long idx = -1;
+    long slots;
 
     bool found = false;
 
@@ -881,6 +1157,28 @@ static long find_entry_disk(const char *filename_raw, bool localfd)
             return -1;
     }
 
+    /* The hash stays open along with filenametag_fd during builds. */
+    hashfd = filenamehash_fd;
+    slots = filenamehash_slots;
+    if (fd != filenametag_fd)
+        hashfd = open_hash_fd(&slots);
+
+    idx = hashfd >= 0 ?
+          find_entry_hash(hashfd, slots, fd, filename, buf, bufsz) : -2;
+
+    if (hashfd >= 0 && hashfd != filenamehash_fd)
+        close(hashfd);
+
+    if (idx != -2)
+    {
+        if (fd != filenametag_fd || localfd)
+            close(fd);
+
+        return idx >= 0 ? idx : -4;
+    }
+
+    idx = -1;
+
     check_again:
 
     if (last_pos > 0) /* pos gets cached to prevent reading from beginning */
@@ -989,6 +1287,53 @@ bool tagcache_find_index(struct tagcache_search *tcs, const char *filename)
     return true;
 }
 
+/* Read a master index entry through the read-ahead cache. */
+static bool read_master_entry(int masterfd, int idxid, struct index_entry *idx)
+{
+    off_t pos = sizeof(struct master_header)
+                + (off_t)idxid * sizeof(struct index_entry);
+    off_t rel = pos - master_cache.start;
+
+    if (rel < 0 || rel + (off_t)sizeof(*idx) > master_cache.len)
+    {
+        if (master_cache.busy)
+            goto direct_read; /* Another thread is filling it */
+
+        unsigned int gen = master_cache.gen;
+        off_t start = pos & ~(off_t)(MASTER_CACHE_ALIGN - 1);
+
+        master_cache.busy = true;
+        master_cache.len = 0;
+
+        ssize_t len = -1;
+        if (lseek(masterfd, start, SEEK_SET) == start)
+            len = read(masterfd, master_cache.data, MASTER_CACHE_SIZE);
+
+        master_cache.busy = false;
+
+        if (len < 0)
+            return false;
+
+        if (gen != master_cache.gen)
+            goto direct_read; /* Written while we were reading */
+
+        master_cache.start = start;
+        master_cache.len = len;
+
+        rel = pos - start;
+        if (rel + (off_t)sizeof(*idx) > len)
+            return false; /* End of file */
+    }
+
+    memcpy(idx, (char *)master_cache.data + rel, sizeof(*idx));
+    swap_index_entry(idx);
+    return true;
+
+direct_read:
+    lseek(masterfd, pos, SEEK_SET);
+    return read_index_entries(masterfd, idx, 1) == sizeof(struct index_entry);
+}
+
 static bool get_index(int masterfd, int idxid,
                       struct index_entry *idx, bool use_ram)
 {
@@ -1003,10 +1348,10 @@ static bool get_index(int masterfd, int idxid,
 #ifdef HAVE_TC_RAMCACHE
     if (tc_stat.ramcache && use_ram)
     {
-        if (tcramcache.hdr->indices[idxid].flag & FLAG_DELETED)
+        if (tcrc_flag(idxid) & FLAG_DELETED)
             return false;
 
-        *idx = tcramcache.hdr->indices[idxid];
+        tcrc_get_index(idxid, idx);
         return true;
     }
 #endif /* HAVE_TC_RAMCACHE */
@@ -1021,9 +1366,7 @@ static bool get_index(int masterfd, int idxid,
             return false;
     }
 
-    lseek(masterfd, idxid * sizeof(struct index_entry)
-          + sizeof(struct master_header), SEEK_SET);
-    if (read_index_entries(masterfd, idx, 1) != sizeof(struct index_entry))
+    if (!read_master_entry(masterfd, idxid, idx))
     {
         logf("read error #3");
         if (localfd)
@@ -1043,8 +1386,6 @@ static bool get_index(int masterfd, int idxid,
     (void)use_ram;
 }
 
-#ifndef __PCTOOL__
-
 static bool write_index(int masterfd, int idxid, struct index_entry *idx)
 {
     /* We need to exclude all memory only flags & tags when writing to disk. */
@@ -1060,19 +1401,19 @@ static bool write_index(int masterfd, int idxid, struct index_entry *idx)
      */
     if (tc_stat.ramcache)
     {
-        struct index_entry *idx_ram = &tcramcache.hdr->indices[idxid];
+        int32_t *flag_ram = &tcrc_flag(idxid);
 
         for (int tag = 0; tag < TAG_COUNT; tag++)
         {
             if (TAGCACHE_IS_NUMERIC(tag))
             {
-                idx_ram->tag_seek[tag] = idx->tag_seek[tag];
+                tcrc_seek(idxid, tag) = idx->tag_seek[tag];
             }
         }
 
         /* Don't touch the dircache flag or attributes. */
-        idx_ram->flag = (idx->flag & 0x0000ffff)
-            | (idx_ram->flag & (0xffff0000 | FLAG_DIRCACHE));
+        *flag_ram = (idx->flag & 0x0000ffff)
+            | (*flag_ram & (0xffff0000 | FLAG_DIRCACHE));
     }
 #endif /* HAVE_TC_RAMCACHE */
 
@@ -1088,8 +1429,6 @@ static bool write_index(int masterfd, int idxid, struct index_entry *idx)
     return true;
 }
 
-#endif /* !__PCTOOL__ */
-
 static bool open_files(struct tagcache_search *tcs, int tag)
 {
     if (tcs->idxfd[tag] < 0)
@@ -1314,6 +1653,37 @@ static long check_virtual_tags(int tag, int idx_id,
     return data;
 }
 
+#ifdef HAVE_TC_RAMCACHE
+/* Bit mask of the master index fields that check_virtual_tags() reads for
+   a tag; keep the two in sync. */
+static uint32_t virtual_tag_fields(int tag)
+{
+    switch (tag)
+    {
+        case tag_virt_length_sec:
+        case tag_virt_length_min:
+            return 1u << tag_length;
+
+        case tag_virt_playtime_sec:
+        case tag_virt_playtime_min:
+            return 1u << tag_playtime;
+
+        case tag_virt_autoscore:
+            return (1u << tag_length) | (1u << tag_playtime) |
+                   (1u << tag_playcount);
+
+        case tag_virt_entryage:
+            return 1u << tag_commitid;
+
+        case tag_virt_basename:
+            return 1u << tag_filename;
+
+        default:
+            return tag < TAG_COUNT ? 1u << tag : 0;
+    }
+}
+#endif /* HAVE_TC_RAMCACHE */
+
 long tagcache_get_numeric(const struct tagcache_search *tcs, int tag)
 {
     struct index_entry idx;
@@ -1445,1123 +1815,2360 @@ static bool check_against_clause(long numeric, const char *str,
     return false;
 }
 
-static bool check_clauses(struct tagcache_search *tcs,
-                          struct index_entry *idx,
-                          struct tagcache_search_clause **clauses, int count)
+/* Evaluation rank of the tag a clause reads: fields of the index entry
+   first, then the computed virtual tags, then tag strings and finally the
+   filename which may need a path lookup. */
+static int clause_fetch_rank(int tag)
 {
-    int i;
+    if (TAGCACHE_IS_NUMERIC(tag))
+        return tag < TAG_COUNT ? 0 : 1;
 
-    /* Go through all conditional clauses. */
-    for (i = 0; i < count; i++)
-    {
-        int seek;
-        char buf[256];
-        const int bufsz = sizeof(buf);
-        char *str = buf;
-        struct tagcache_search_clause *clause = clauses[i];
+    if (tag == tag_filename || tag == tag_virt_basename)
+        return 3;
 
-        logf_clauses("%s clause %d %s %s [%ld] %s",
-            "Checking",  i, tag_type_str[clause->type],
-            tags_str[clause->tag],  clause->numeric_data,
-            (clause->numeric || clause->str == NULL) ? "[NUMERIC?]" : clause->str);
+    return 2;
+}
 
-        if (clause->type == clause_logical_or)
-        {
-            logf_clauses("Bailing");
-            break; /* all conditions before logical-or satisfied --
-                      stop processing clauses */
-        }
-        seek = check_virtual_tags(clause->tag, tcs->idx_id, idx);
+static bool clause_op_before(const struct tagcache_clause_op *op1,
+                             const struct tagcache_clause_op *op2)
+{
+    int rank1 = clause_fetch_rank(op1->tag);
+    int rank2 = clause_fetch_rank(op2->tag);
 
-#ifdef HAVE_TC_RAMCACHE
-        if (tcs->ramsearch)
-        {
-            struct tagfile_entry *tfe;
+    if (rank1 != rank2)
+        return rank1 < rank2;
 
-            if (!TAGCACHE_IS_NUMERIC(clause->tag))
-            {
-                if (clause->tag == tag_filename
-                    || clause->tag == tag_virt_basename)
-                {
-                    retrieve(tcs, IF_DIRCACHE(tcs->idx_id,) idx, clause->tag,
-                             buf, bufsz);
-                }
-                else
-                {
-                    tfe = (struct tagfile_entry *)
-                                        &tcramcache.hdr->tags[clause->tag][seek];
-                    /* str points to movable data, but no locking required here,
-                     * as no yield() is following */
-                    str = tfe->tag_data;
-                }
-            }
-        }
-        else
-#endif /* HAVE_TC_RAMCACHE */
-        {
-            struct tagfile_entry tfe;
+    /* Keep clauses on the same string together so it is read only once. */
+    if (op1->tag != op2->tag)
+        return op1->tag < op2->tag;
 
-            if (!TAGCACHE_IS_NUMERIC(clause->tag))
-            {
-                int tag = clause->tag;
-                if (tag == tag_virt_basename)
-                    tag = tag_filename;
+    return op1->cost < op2->cost;
+}
 
-                int fd = tcs->idxfd[tag];
-                lseek(fd, seek, SEEK_SET);
+/* Split the string operand of a clause into its '|' separated items the same
+   way str_oneof() walks the list. Returns false if there is no room. */
+static bool compile_clause_items(struct tagcache_clause_plan *plan,
+                                 struct tagcache_clause_op *op,
+                                 const char *str, bool split)
+{
+    const char *list = str;
+    const char *sep;
+    int l;
 
-                switch (read_tagfile_entry_and_tag(fd, &tfe, str, bufsz))
-                {
-                    case e_SUCCESS_LEN_ZERO: /* Check if entry has been deleted. */
-                        return false;
-                    case e_SUCCESS:
-                        if (clause->tag == tag_virt_basename)
-                        {
-                            char *basename = strrchr(str, '/');
-                            if (basename)
-                                str = basename + 1;
-                        }
-                        break;
-                    case e_ENTRY_SIZEMISMATCH:
-                        logf("read error #15");
-                        return false;
-                    case e_TAG_TOOLONG:
-                        logf("too long tag #6");
-                        return false;
-                    case e_TAG_SIZEMISMATCH:
-                        logf("read error #16");
-                        return false;
-                    default:
-                        logf("unknown_error");
-                        break;;
-                }
-            }
-        }
+    op->item = plan->item_count;
+    op->item_count = 0;
 
-        if (!check_against_clause(seek, str, clause))
+    do
+    {
+        if (plan->item_count >= TAGCACHE_MAX_CLAUSE_ITEMS)
         {
-            /* Clause failed -- try finding a logical-or clause */
-            while (++i < count)
-            {
-                if (clauses[i]->type == clause_logical_or)
-                    break;
-            }
-
-            if (i < count)        /* Found logical-or? */
-                continue;         /* Check clauses after logical-or */
-
+            op->item_count = 0;
             return false;
         }
 
-        logf_clauses("%s clause %d %s %s [%ld] %s",
-            "Found",  i, tag_type_str[clause->type],
-            tags_str[clause->tag],  clause->numeric_data,
-            (clause->numeric || clause->str == NULL) ? "[NUMERIC?]" : clause->str);
-    }
+        sep = split ? strchr(list, '|') : NULL;
+        l = sep ? (intptr_t)sep - (intptr_t)list : (int)strlen(list);
+        plan->item[plan->item_count].offset = list - str;
+        plan->item[plan->item_count].len = l;
+        plan->item_count++;
+        op->item_count++;
+        list += sep ? l + 1 : l;
+    } while (*list);
 
     return true;
 }
 
-bool tagcache_check_clauses(struct tagcache_search *tcs,
-                            struct tagcache_search_clause **clause, int count)
-{
-    struct index_entry idx;
-
-    if (count == 0)
-        return true;
-
-    if (!get_index(tcs->masterfd, tcs->idx_id, &idx, true))
-        return false;
-
-    return check_clauses(tcs, &idx, clause, count);
-}
-
-static bool add_uniqbuf(struct tagcache_search *tcs, uint32_t id)
+/* Add clause number index of a clause list to the evaluation plan of a
+   search. The clause is placed inside its OR group by rank; the group order
+   doesn't change the result. */
+static bool compile_clause(struct tagcache_clause_plan *plan,
+                           struct tagcache_search_clause *clause, int index)
 {
+    struct tagcache_clause_op op;
     int i;
 
-    /* If uniq buffer is not defined we must return true for search to work. */
-    if (tcs->unique_list == NULL || (!TAGCACHE_IS_UNIQUE(tcs->type)
-                                     && !TAGCACHE_IS_NUMERIC(tcs->type)))
+    if (clause->type == clause_logical_or)
     {
+        if (plan->op_count == plan->group_start)
+            plan->empty_group = true;
+
+        plan->group_start = plan->op_count;
         return true;
     }
 
-    for (i = 0; i < tcs->unique_list_count; i++)
+    if (plan->op_count >= TAGCACHE_MAX_CLAUSES)
+        return false;
+
+    op.clause = index;
+    op.tag = clause->tag == tag_virt_basename ? tag_filename : clause->tag;
+    op.cost = 0;
+    op.item = 0;
+    op.item_count = 0;
+
+    if (!clause->numeric && clause->str != NULL)
     {
-        /* Return false if entry is found. */
-        if (tcs->unique_list[i] == id)
+        switch (clause->type)
         {
-            //logf("%d Exists @ %d", id, i);
-            return false;
+            case clause_is:
+            case clause_is_not:
+                compile_clause_items(plan, &op, clause->str, false);
+                break;
+            case clause_begins_with:
+            case clause_not_begins_with:
+            case clause_ends_with:
+            case clause_not_ends_with:
+                op.cost = 1;
+                compile_clause_items(plan, &op, clause->str, false);
+                break;
+            case clause_oneof:
+                op.cost = 1;
+                compile_clause_items(plan, &op, clause->str, true);
+                break;
+            case clause_begins_oneof:
+            case clause_ends_oneof:
+                op.cost = 2;
+                compile_clause_items(plan, &op, clause->str, true);
+                break;
+            case clause_contains:
+            case clause_not_contains:
+                op.cost = 3;
+                break;
+            default:
+                op.cost = 1;
+                break;
         }
     }
 
-    if (tcs->unique_list_count < tcs->unique_list_capacity)
+    /* Insertion sort into the current group */
+    for (i = plan->op_count; i > plan->group_start; i--)
     {
-        tcs->unique_list[i] = id;
-        tcs->unique_list_count++;
+        if (!clause_op_before(&op, &plan->op[i - 1]))
+            break;
+        plan->op[i] = plan->op[i - 1];
     }
+    plan->op[i] = op;
+    plan->op_count++;
+
+    for (i = plan->group_start; i < plan->op_count; i++)
+        plan->op[i].group_end = plan->op_count;
 
     return true;
 }
 
-static bool build_lookup_list(struct tagcache_search *tcs)
+/* Strings read for the clauses of the current entry */
+#define CLAUSE_STR_CACHE 4
+#define CLAUSE_STR_BUFSZ 256
+struct clause_str_cache {
+    int count;
+    int used;
+    struct {
+        int tag;
+        int len;
+        const char *str;
+    } entry[CLAUSE_STR_CACHE];
+    char buf[2*CLAUSE_STR_BUFSZ];
+};
+
+/* Read the string of a tag for the clauses, reusing an earlier read for the
+   same entry. Returns NULL if the entry can't be matched. */
+static const char *clause_fetch_str(struct tagcache_search *tcs,
+                                    struct index_entry *idx, int tag,
+                                    struct clause_str_cache *cache, int *len)
 {
-    struct index_entry entry;
-    int i, j;
+    char *buf;
+    const char *str;
+    int i, bufsz;
 
-    tcs->seek_list_count = 0;
+    for (i = 0; i < cache->count; i++)
+    {
+        if (cache->entry[i].tag == tag)
+        {
+            *len = cache->entry[i].len;
+            return cache->entry[i].str;
+        }
+    }
+
+    /* Start over when full, only the string of the current clause is in use */
+    if (cache->count >= CLAUSE_STR_CACHE
+        || (int)sizeof(cache->buf) - cache->used < CLAUSE_STR_BUFSZ)
+    {
+        cache->count = 0;
+        cache->used = 0;
+    }
+
+    buf = &cache->buf[cache->used];
+    bufsz = CLAUSE_STR_BUFSZ;
+    str = buf;
 
 #ifdef HAVE_TC_RAMCACHE
     if (tcs->ramsearch)
     {
-        tcrc_buffer_lock(); /* lock because below makes a pointer to movable data */
-
-        for (i = tcs->seek_pos; i < current_tcmh.tch.entry_count; i++)
+        if (tag == tag_filename)
         {
-            struct tagcache_seeklist_entry *seeklist;
-            /* idx points to movable data, don't yield or reload */
-            struct index_entry *idx = &tcramcache.hdr->indices[i];
-            if (tcs->seek_list_count == SEEK_LIST_SIZE)
-                break ;
-
-            /* Skip deleted files. */
-            if (idx->flag & FLAG_DELETED)
-                continue;
-
-            /* Go through all filters.. */
-            for (j = 0; j < tcs->filter_count; j++)
-            {
-                if (idx->tag_seek[tcs->filter_tag[j]] != tcs->filter_seek[j])
-                {
-                    break ;
-                }
-            }
+            if (!retrieve(tcs, IF_DIRCACHE(tcs->idx_id,) idx, tag, buf, bufsz))
+                return NULL;
+        }
+        else
+        {
+            struct tagfile_entry *tfe = (struct tagfile_entry *)
+                &tcramcache.hdr->tags[tag][idx->tag_seek[tag]];
+            /* str points to movable data, but no locking required here,
+             * as no yield() is following */
+            str = tfe->tag_data;
+        }
+    }
+    else
+#endif /* HAVE_TC_RAMCACHE */
+    {
+        struct tagfile_entry tfe;
 
-            if (j < tcs->filter_count)
-                continue ;
+        if (!open_files(tcs, tag))
+            return NULL;
 
-            /* Check for conditions. */
-            if (!check_clauses(tcs, idx, tcs->clause, tcs->clause_count))
-                continue;
-            /* Add to the seek list if not already in uniq buffer (doesn't yield)*/
-            if (!add_uniqbuf(tcs, idx->tag_seek[tcs->type]))
-                continue;
+        lseek(tcs->idxfd[tag], idx->tag_seek[tag], SEEK_SET);
 
-            /* Lets add it. */
-            seeklist = &tcs->seeklist[tcs->seek_list_count];
-            seeklist->seek = idx->tag_seek[tcs->type];
-            seeklist->flag = idx->flag;
-            seeklist->idx_id = i;
-            tcs->seek_list_count++;
+        switch (read_tagfile_entry_and_tag(tcs->idxfd[tag], &tfe, buf, bufsz))
+        {
+            case e_SUCCESS_LEN_ZERO: /* Check if entry has been deleted. */
+                return NULL;
+            case e_SUCCESS:
+                break;
+            case e_ENTRY_SIZEMISMATCH:
+                logf("read error #15");
+                return NULL;
+            case e_TAG_TOOLONG:
+                logf("too long tag #6");
+                return NULL;
+            case e_TAG_SIZEMISMATCH:
+                logf("read error #16");
+                return NULL;
+            default:
+                logf("unknown_error");
+                break;
         }
+    }
 
-        tcrc_buffer_unlock();
+    *len = strlen(str);
+    if (str == buf)
+        cache->used += *len + 1;
 
-        tcs->seek_pos = i;
+    cache->entry[cache->count].tag = tag;
+    cache->entry[cache->count].len = *len;
+    cache->entry[cache->count].str = str;
+    cache->count++;
 
-        return tcs->seek_list_count > 0;
-    }
-#endif /* HAVE_TC_RAMCACHE */
+    return str;
+}
 
-    if (tcs->masterfd < 0)
-    {
-        struct master_header tcmh;
-        tcs->masterfd = open_master_fd(&tcmh, false);
+/* Match a string against the pre-split operand of a clause. */
+static bool check_clause_items(const struct tagcache_clause_plan *plan,
+                               const struct tagcache_clause_op *op,
+                               struct tagcache_search_clause *clause,
+                               const char *str, int len)
+{
+    const struct tagcache_clause_item *item = &plan->item[op->item];
+    const struct tagcache_clause_item *end = item + op->item_count;
+    const char *operand = clause->str;
+    bool found;
+
+    switch (clause->type)
+    {
+        case clause_is:
+            return len == item->len && !strcasecmp(str, operand);
+        case clause_is_not:
+            return len != item->len || strcasecmp(str, operand);
+        case clause_begins_with:
+            return item->len <= len && !strncasecmp(str, operand, item->len);
+        case clause_not_begins_with:
+            return item->len > len || strncasecmp(str, operand, item->len);
+        case clause_ends_with:
+            return item->len <= len
+                   && !strcasecmp(&str[len - item->len], operand);
+        case clause_not_ends_with:
+            return item->len > len
+                   || strcasecmp(&str[len - item->len], operand);
+        case clause_oneof:
+            for (; item < end; item++)
+            {
+                if (item->len == len
+                    && !strncasecmp(str, &operand[item->offset], len))
+                    return true;
+            }
+            return false;
+        case clause_begins_oneof:
+        case clause_ends_oneof:
+            for (; item < end; item++)
+            {
+                if (item->len > len)
+                    continue;
+
+                found = !strncasecmp(clause->type == clause_begins_oneof ?
+                                     str : &str[len - item->len],
+                                     &operand[item->offset], item->len);
+                if (found)
+                    return true;
+            }
+            return false;
+        default:
+            return check_against_clause(0, str, clause);
     }
+}
 
-    lseek(tcs->masterfd, tcs->seek_pos * sizeof(struct index_entry) +
-            sizeof(struct master_header), SEEK_SET);
+static bool check_clauses(struct tagcache_search *tcs,
+                          struct index_entry *idx,
+                          const struct tagcache_clause_plan *plan,
+                          struct tagcache_search_clause **clauses)
+{
+    struct clause_str_cache cache;
+    int i = 0;
 
-    while (read_index_entries(tcs->masterfd, &entry, 1) == sizeof(struct index_entry))
-    {
-        struct tagcache_seeklist_entry *seeklist;
+    /* An empty OR group is always satisfied */
+    if (plan->empty_group || plan->group_start == plan->op_count)
+        return true;
 
-        if (tcs->seek_list_count == SEEK_LIST_SIZE)
-            break ;
+    cache.count = 0;
+    cache.used = 0;
 
-        i = tcs->seek_pos;
-        tcs->seek_pos++;
+    while (i < plan->op_count)
+    {
+        const struct tagcache_clause_op *op = &plan->op[i];
+        struct tagcache_search_clause *clause = clauses[op->clause];
+        bool match;
 
-        /* Check if entry has been deleted. */
-        if (entry.flag & FLAG_DELETED)
-            continue;
+        logf_clauses("%s clause %d %s %s [%ld] %s",
+            "Checking",  i, tag_type_str[clause->type],
+            tags_str[clause->tag],  clause->numeric_data,
+            (clause->numeric || clause->str == NULL) ? "[NUMERIC?]" : clause->str);
 
-        /* Go through all filters.. */
-        for (j = 0; j < tcs->filter_count; j++)
+        if (TAGCACHE_IS_NUMERIC(clause->tag))
         {
-            if (entry.tag_seek[tcs->filter_tag[j]] != tcs->filter_seek[j])
-                break ;
+            match = check_against_clause(
+                check_virtual_tags(clause->tag, tcs->idx_id, idx), "", clause);
         }
+        else
+        {
+            int len;
+            const char *str = clause_fetch_str(tcs, idx, op->tag, &cache, &len);
+
+            if (str == NULL)
+                return false;
 
-        if (j < tcs->filter_count)
-            continue ;
+            if (clause->tag == tag_virt_basename)
+            {
+                const char *basename = strrchr(str, '/');
+                if (basename)
+                {
+                    len -= basename + 1 - str;
+                    str = basename + 1;
+                }
+            }
 
-        /* Check for conditions. */
-        if (!check_clauses(tcs, &entry, tcs->clause, tcs->clause_count))
-            continue;
+            if (clause->numeric)
+                match = check_against_clause(
+                    check_virtual_tags(clause->tag, tcs->idx_id, idx), str, clause);
+            else if (op->item_count > 0)
+                match = check_clause_items(plan, op, clause, str, len);
+            else
+                match = check_against_clause(0, str, clause);
+        }
 
-        /* Add to the seek list if not already in uniq buffer. */
-        if (!add_uniqbuf(tcs, entry.tag_seek[tcs->type]))
+        if (!match)
+        {
+            /* Clause failed -- try the next OR group */
+            i = op->group_end;
+            if (i >= plan->op_count)
+                return false;
             continue;
+        }
 
-        /* Lets add it. */
-        seeklist = &tcs->seeklist[tcs->seek_list_count];
-        seeklist->seek = entry.tag_seek[tcs->type];
-        seeklist->flag = entry.flag;
-        seeklist->idx_id = i;
-        tcs->seek_list_count++;
+        logf_clauses("%s clause %d %s %s [%ld] %s",
+            "Found",  i, tag_type_str[clause->type],
+            tags_str[clause->tag],  clause->numeric_data,
+            (clause->numeric || clause->str == NULL) ? "[NUMERIC?]" : clause->str);
 
-        yield();
+        /* All clauses of the group matched */
+        if (++i == op->group_end)
+            return true;
     }
 
-    return tcs->seek_list_count > 0;
+    return true;
 }
 
-
-bool tagcache_search(struct tagcache_search *tcs, int tag)
+bool tagcache_check_clauses(struct tagcache_search *tcs,
+                            struct tagcache_search_clause **clause, int count)
 {
-    /* NOTE: call tagcache_search_finish(&tcs) when finished or BAD things may happen (TM) */
-    struct tagcache_header tag_hdr;
-    struct master_header   master_hdr;
+    struct tagcache_clause_plan plan;
+    struct index_entry idx;
     int i;
 
-    while (read_lock)
-        sleep(1);
+    if (count == 0)
+        return true;
 
-    memset(tcs, 0, sizeof(struct tagcache_search));
-    if (tc_stat.commit_step > 0 || !tc_stat.ready)
+    memset(&plan, 0, sizeof(plan));
+    for (i = 0; i < count; i++)
+    {
+        if (!compile_clause(&plan, clause[i], i))
+            return false;
+    }
+
+    if (!get_index(tcs->masterfd, tcs->idx_id, &idx, true))
         return false;
 
-    tcs->position = sizeof(struct tagcache_header);
-    tcs->type = tag;
-    tcs->seek_pos = 0;
-    tcs->list_position = 0;
-    tcs->seek_list_count = 0;
-    tcs->filter_count = 0;
-    tcs->masterfd = -1;
+    return check_clauses(tcs, &idx, &plan, clause);
+}
 
-    for (i = 0; i < TAG_COUNT; i++)
-        tcs->idxfd[i] = -1;
+static bool add_uniqbuf(struct tagcache_search *tcs, uint32_t id)
+{
+    int i;
 
-#ifndef HAVE_TC_RAMCACHE
-    tcs->ramsearch = false;
-#else
-    tcs->ramsearch = tc_stat.ramcache;
-    if (tcs->ramsearch)
+    /* If uniq buffer is not defined we must return true for search to work. */
+    if (tcs->unique_list == NULL || (!TAGCACHE_IS_UNIQUE(tcs->type)
+                                     && !TAGCACHE_IS_NUMERIC(tcs->type)))
     {
-        tcs->entry_count = tcramcache.hdr->entry_count[tcs->type];
+        return true;
     }
-    else
-#endif
-    {
-        /* Always open as R/W so we can pass tcs to functions that modify data also
-         * without failing. */
-        tcs->masterfd = open_master_fd(&master_hdr, true);
-        if (tcs->masterfd < 0)
-            return false;
-
-        if (!TAGCACHE_IS_NUMERIC(tcs->type))
-        {
-            tcs->idxfd[tcs->type] = open_tag_fd(&tag_hdr, tcs->type, false);
-            if (tcs->idxfd[tcs->type] < 0)
-                return false;
 
-            tcs->entry_count = tag_hdr.entry_count;
-        }
-        else
+    for (i = 0; i < tcs->unique_list_count; i++)
+    {
+        /* Return false if entry is found. */
+        if (tcs->unique_list[i] == id)
         {
-            tcs->entry_count = master_hdr.tch.entry_count;
+            //logf("%d Exists @ %d", id, i);
+            return false;
         }
     }
 
-    tcs->valid = true;
-    tcs->initialized = true;
-    write_lock++;
+    if (tcs->unique_list_count < tcs->unique_list_capacity)
+    {
+        tcs->unique_list[i] = id;
+        tcs->unique_list_count++;
+    }
 
     return true;
 }
 
-void tagcache_search_set_uniqbuf(struct tagcache_search *tcs,
-                                 void *buffer, long length)
+/* Add an entry to the seek list if it passes the filters and clauses.
+ * Doesn't yield, so idx may point to movable data. */
+static bool add_lookup_entry(struct tagcache_search *tcs,
+                             struct index_entry *idx, int idx_id)
 {
-    tcs->unique_list = (uint32_t *)buffer;
-    tcs->unique_list_capacity = length / sizeof(*tcs->unique_list);
-    tcs->unique_list_count = 0;
-    memset(tcs->unique_list, 0, tcs->unique_list_capacity);
-}
+    struct tagcache_seeklist_entry *seeklist;
+    int i;
 
-bool tagcache_search_add_filter(struct tagcache_search *tcs,
-                                int tag, int seek)
-{
-    if (tcs->filter_count == TAGCACHE_MAX_FILTERS)
+    /* Skip deleted files. */
+    if (idx->flag & FLAG_DELETED)
         return false;
 
-    if (TAGCACHE_IS_NUMERIC_OR_NONUNIQUE(tag))
+    /* Go through all filters.. */
+    for (i = 0; i < tcs->filter_count; i++)
+    {
+        if (idx->tag_seek[tcs->filter_tag[i]] != tcs->filter_seek[i])
+            return false;
+    }
+
+    /* Check for conditions. */
+    if (!check_clauses(tcs, idx, &tcs->plan, tcs->clause))
         return false;
 
-    tcs->filter_tag[tcs->filter_count] = tag;
-    tcs->filter_seek[tcs->filter_count] = seek;
-    tcs->filter_count++;
+    /* Add to the seek list if not already in uniq buffer. */
+    if (!add_uniqbuf(tcs, idx->tag_seek[tcs->type]))
+        return false;
+
+    /* Lets add it. */
+    seeklist = &tcs->seeklist[tcs->seek_list_count];
+    seeklist->seek = idx->tag_seek[tcs->type];
+    seeklist->flag = idx->flag;
+    seeklist->idx_id = idx_id;
+    tcs->seek_list_count++;
 
     return true;
 }
 
-bool tagcache_search_add_clause(struct tagcache_search *tcs,
-                                struct tagcache_search_clause *clause)
+#ifdef HAVE_TC_RAMCACHE
+/* Quick reject of an entry in the columnar RAM index, using only the fields
+   the search tests directly. Whatever passes is checked in full by
+   add_lookup_entry(). */
+static bool check_columns(struct tagcache_search *tcs, int idx_id)
 {
+    const struct tagcache_clause_plan *plan = &tcs->plan;
     int i;
-    int clause_count = tcs->clause_count;
 
-    if (clause_count >= TAGCACHE_MAX_CLAUSES)
-    {
-        logf("Too many clauses");
+    if (tcrc_flag(idx_id) & FLAG_DELETED)
         return false;
+
+    for (i = 0; i < tcs->filter_count; i++)
+    {
+        if (tcrc_seek(idx_id, tcs->filter_tag[i]) != tcs->filter_seek[i])
+            return false;
     }
 
-    if (clause->type != clause_logical_or)
+    /* Without OR groups all clauses must match. Plain numeric clauses are
+       ordered first. Updates still in the command queue are only seen by
+       tc_find_tag(), so leave those to the full check. */
+    if (plan->group_start > 0 || plan->empty_group || !COMMAND_QUEUE_IS_EMPTY)
+        return true;
+
+    for (i = 0; i < plan->op_count; i++)
     {
-        /* BUGFIX OR'd clauses seem to be mishandled once made into a filter */
-        if (clause_count <= 1 || tcs->clause[clause_count - 1]->type != clause_logical_or)
-        {
-            /* Check if there is already a similar filter in present (filters are
-             * much faster than clauses).
-             */
-            for (i = 0; i < tcs->filter_count; i++)
-            {
-                if (tcs->filter_tag[i] == clause->tag)
-                {
-                    return true;
-                }
-            }
-        }
+        const struct tagcache_search_clause *clause =
+            tcs->clause[plan->op[i].clause];
 
-        if (!TAGCACHE_IS_NUMERIC(clause->tag) && tcs->idxfd[clause->tag] < 0)
-        {
-            char fname[MAX_PATH];
-            tcs->idxfd[clause->tag] = open_pathfmt(fname, sizeof(fname), O_RDONLY,
-                                                   "%s/" TAGCACHE_FILE_INDEX,
-                                                   tc_stat.db_path, clause->tag);
-        }
-    }
+        if (!TAGCACHE_IS_NUMERIC(clause->tag) || clause->tag >= TAG_COUNT)
+            break;
 
-    tcs->clause[tcs->clause_count] = clause;
-    tcs->clause_count++;
+        if (!check_against_clause(tcrc_seek(idx_id, clause->tag), "", clause))
+            return false;
+    }
 
     return true;
 }
 
-static bool get_next(struct tagcache_search *tcs, bool is_numeric, char *buf, long bufsz)
+/* List the tags whose fields add_lookup_entry() reads for this search, so
+   that only those are gathered from the columns. Returns the count. */
+static int lookup_fields(const struct tagcache_search *tcs, uint8_t *tags)
 {
-    struct tagfile_entry entry;
-#if defined(HAVE_TC_RAMCACHE) && defined(HAVE_DIRCACHE)
-    long flag = 0;
-#endif
+    const struct tagcache_clause_plan *plan = &tcs->plan;
+    uint32_t fields = virtual_tag_fields(tcs->type);
+    int i, count = 0;
 
-    if (tcs->idxfd[tcs->type] < 0 && !is_numeric
-#ifdef HAVE_TC_RAMCACHE
-        && !tcs->ramsearch
-#endif
-        )
-        return false;
+    for (i = 0; i < tcs->filter_count; i++)
+        fields |= virtual_tag_fields(tcs->filter_tag[i]);
 
-    /* Relative fetch. */
-    if (tcs->filter_count > 0 || tcs->clause_count > 0 || is_numeric
-#if defined(HAVE_TC_RAMCACHE) && defined(HAVE_DIRCACHE)
-        /* We need to retrieve flag status for dircache. */
-        || (tcs->ramsearch && tcs->type == tag_filename)
-#endif
-        )
+    for (i = 0; i < plan->op_count; i++)
     {
-        struct tagcache_seeklist_entry *seeklist;
+        fields |= virtual_tag_fields(tcs->clause[plan->op[i].clause]->tag) |
+                  virtual_tag_fields(plan->op[i].tag);
+    }
 
-        /* Check for end of list. */
-        if (tcs->list_position == tcs->seek_list_count)
-        {
-            tcs->list_position = 0;
+    for (i = 0; i < TAG_COUNT; i++)
+    {
+        if (fields & (1u << i))
+            tags[count++] = i;
+    }
 
-            /* Try to fetch more. */
-            if (!build_lookup_list(tcs))
-            {
-                tcs->valid = false;
-                return false;
-            }
-        }
+    return count;
+}
+#endif /* HAVE_TC_RAMCACHE */
 
-        seeklist = &tcs->seeklist[tcs->list_position];
-#if defined(HAVE_TC_RAMCACHE) && defined(HAVE_DIRCACHE)
-        flag = seeklist->flag;
-#endif
-        tcs->position = seeklist->seek;
-        tcs->idx_id = seeklist->idx_id;
-        tcs->list_position++;
+/* Open the inverted index of a tag if it was built for the current DB. */
+static int open_inverted_fd(int tag, struct inverted_header *hdr)
+{
+    int fd;
+    char fname[MAX_PATH];
+
+    if (!TAGCACHE_IS_INVERTED(tag))
+        return -1;
+
+    fd = open_pathfmt(fname, sizeof(fname), O_RDONLY,
+                      "%s/" TAGCACHE_FILE_INVERTED, tc_stat.db_path, tag);
+    if (fd < 0)
+        return fd;
+
+    if (read_int32s(fd, (int32_t *)hdr, sizeof(*hdr) / sizeof(int32_t)) !=
+        sizeof(*hdr) || hdr->tch.magic != TAGCACHE_MAGIC ||
+        hdr->commitid != current_tcmh.commitid)
+    {
+        logf("inverted index %d is stale", tag);
+        close(fd);
+        return -2;
     }
-    else
+
+    return fd;
+}
+
+/**
+ * Binary search the key table of an inverted index.
+ * Return values:
+ *     > 0   found
+ *    == 0   no entries with this seek
+ *     < 0   read error
+ */
+static int find_inverted_key(int fd, const struct inverted_header *hdr,
+                             int32_t seek, struct inverted_key *key)
+{
+    int lo = 0, hi = hdr->tch.entry_count;
+
+    while (lo < hi)
     {
-        if (tcs->entry_count == 0)
+        int mid = (lo + hi) / 2;
+
+        lseek(fd, sizeof(struct inverted_header) +
+              mid * sizeof(struct inverted_key), SEEK_SET);
+        if (read_int32s(fd, (int32_t *)key, sizeof(*key) / sizeof(int32_t)) !=
+            sizeof(*key))
         {
-            tcs->valid = false;
-            return false;
+            logf("inverted key read error");
+            return -1;
         }
 
-        tcs->entry_count--;
+        if (key->seek == seek)
+            return 1;
+
+        if (key->seek < seek)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
 
-    tcs->result_seek = tcs->position;
+    return 0;
+}
 
-    if (is_numeric)
+/* Pick the shortest entry list among the filters that have an inverted
+ * index. Only entries on that list need to be checked. */
+static void select_inverted_index(struct tagcache_search *tcs)
+{
+    int i;
+
+    tcs->inverted_checked = true;
+
+    for (i = 0; i < tcs->filter_count; i++)
     {
-        snprintf(buf, bufsz, "%ld", tcs->position);
-        tcs->result = buf;
-        tcs->result_len = strlen(buf) + 1;
-        return true;
+        struct inverted_header hdr;
+        struct inverted_key key;
+        int fd = open_inverted_fd(tcs->filter_tag[i], &hdr);
+
+        if (fd < 0)
+            continue;
+
+        int rc = find_inverted_key(fd, &hdr, tcs->filter_seek[i], &key);
+        if (rc == 0)
+        {
+            key.offset = 0;
+            key.count = 0;
+        }
+
+        if (rc < 0 ||
+            (tcs->inverted_fd >= 0 && key.count >= tcs->inverted_count))
+        {
+            close(fd);
+            continue;
+        }
+
+        if (tcs->inverted_fd >= 0)
+            close(tcs->inverted_fd);
+
+        tcs->inverted_fd = fd;
+        tcs->inverted_pos = sizeof(struct inverted_header)
+            + hdr.tch.entry_count * sizeof(struct inverted_key)
+            + key.offset * sizeof(int32_t);
+        tcs->inverted_count = key.count;
     }
 
-    /* Direct fetch. */
+    logf("inverted index: %d entries", tcs->inverted_fd >= 0 ?
+         tcs->inverted_count : -1);
+}
+
+static bool build_lookup_list(struct tagcache_search *tcs)
+{
+    struct index_entry entry;
+    int i;
+
+    tcs->seek_list_count = 0;
+    tcs->seek_list_start = tcs->seek_pos;
+    tcs->unique_list_start = tcs->unique_list_count;
+
 #ifdef HAVE_TC_RAMCACHE
     if (tcs->ramsearch)
     {
-#ifdef HAVE_DIRCACHE
-        if (tcs->type == tag_filename && (flag & FLAG_DIRCACHE))
+        uint8_t fields[TAG_COUNT];
+        int field_count = 0;
+
+        if (tcramcache.hdr->columnar)
         {
-            ssize_t len = dircache_get_fileref_path(&tcrc_dcfrefs[tcs->idx_id],
-                                                    buf, bufsz);
-            if (len >= 0)
-            {
-                tcs->result_len = len + 1;
-                tcs->result     = buf;
-                tcs->ramresult  = false;
-                return true;
-            }
-            /* else do it the hard way */
+            field_count = lookup_fields(tcs, fields);
+            memset(&entry, 0, sizeof(entry));
         }
-#endif /* HAVE_DIRCACHE */
 
-        if (tcs->type != tag_filename)
+        tcrc_buffer_lock(); /* lock because below makes a pointer to movable data */
+
+        for (i = tcs->seek_pos; i < current_tcmh.tch.entry_count; i++)
         {
-            struct tagfile_entry *ep;
+            if (tcs->seek_list_count == SEEK_LIST_SIZE)
+                break ;
 
-            ep = (struct tagfile_entry *)&tcramcache.hdr->tags[tcs->type][tcs->position];
-            /* don't return ep->tag_data directly as it may move */
-            tcs->result_len = strlcpy(buf, ep->tag_data, bufsz) + 1;
-            tcs->result = buf;
-            tcs->idx_id = ep->idx_id;
-            tcs->ramresult = false; /* was true before we copied to buf too */
+            /* idx points to movable data, don't yield or reload */
+            if (!tcramcache.hdr->columnar)
+                add_lookup_entry(tcs, &tcramcache.hdr->indices[i], i);
+            else if (check_columns(tcs, i))
+            {
+                tcrc_gather_index(i, &entry, fields, field_count);
+                add_lookup_entry(tcs, &entry, i);
+            }
+        }
 
-            /* Increase position for the next run. This may get overwritten. */
-            tcs->position += sizeof(struct tagfile_entry) + ep->tag_length;
+        tcrc_buffer_unlock();
 
-            return true;
-        }
+        tcs->seek_pos = i;
+
+        return tcs->seek_list_count > 0;
     }
 #endif /* HAVE_TC_RAMCACHE */
 
-    if (!open_files(tcs, tcs->type))
+    if (tcs->masterfd < 0)
     {
-        tcs->valid = false;
-        return false;
+        struct master_header tcmh;
+        tcs->masterfd = open_master_fd(&tcmh, false);
     }
 
-    /* Seek stream to the correct position and continue to direct fetch. */
-    lseek(tcs->idxfd[tcs->type], tcs->position, SEEK_SET);
+    if (!tcs->inverted_checked)
+        select_inverted_index(tcs);
 
-    switch (read_tagfile_entry_and_tag(tcs->idxfd[tcs->type], &entry, buf, bufsz))
+    if (tcs->inverted_fd >= 0)
     {
-        case e_SUCCESS_LEN_ZERO:
-        case e_SUCCESS:
-             break;
-        case e_ENTRY_SIZEMISMATCH:
-            logf("read error #5");
-            tcs->valid = false;
-            return false;
-        case e_TAG_TOOLONG:
-            tcs->valid = false;
-            logf("too long tag #2");
-            logf("P:%lX/%lX", tcs->position, entry.tag_length);
-            return false;
-        case e_TAG_SIZEMISMATCH:
-            tcs->valid = false;
-            logf("read error #4");
-            return false;
+        /* Only visit the entries listed for the filter; seek_pos is the
+         * position in that list. */
+        int32_t idbuf[SEEK_LIST_SIZE];
+
+        while (tcs->seek_list_count < SEEK_LIST_SIZE &&
+               tcs->seek_pos < tcs->inverted_count)
+        {
+            int count = MIN(tcs->inverted_count - tcs->seek_pos,
+                            SEEK_LIST_SIZE);
+
+            lseek(tcs->inverted_fd, tcs->inverted_pos +
+                  tcs->seek_pos * sizeof(int32_t), SEEK_SET);
+            if (read_int32s(tcs->inverted_fd, idbuf, count) !=
+                (ssize_t)sizeof(int32_t) * count)
+            {
+                logf("inverted list read error");
+                if (tcs->seek_pos > 0)
+                {
+                    tcs->seek_pos = tcs->inverted_count;
+                    break;
+                }
+
+                /* Nothing returned yet, do a full scan instead. */
+                close(tcs->inverted_fd);
+                tcs->inverted_fd = -1;
+                break;
+            }
+
+            for (i = 0; i < count; i++)
+            {
+                if (tcs->seek_list_count == SEEK_LIST_SIZE)
+                    break ;
+
+                tcs->seek_pos++;
+
+                if (!read_master_entry(tcs->masterfd, idbuf[i], &entry))
+                {
+                    logf("read error #17");
+                    tcs->seek_pos = tcs->inverted_count;
+                    break;
+                }
+
+                add_lookup_entry(tcs, &entry, idbuf[i]);
+
+                yield();
+            }
+        }
+
+        if (tcs->inverted_fd >= 0)
+            return tcs->seek_list_count > 0;
     }
 
-    /**
-     Update the position for the next read (this may be overridden
-     if filters or clauses are being used).
-     */
-    tcs->position += sizeof(struct tagfile_entry) + entry.tag_length;
-    str_setlen(buf, entry.tag_length);
+    while (tcs->seek_list_count < SEEK_LIST_SIZE &&
+           read_master_entry(tcs->masterfd, tcs->seek_pos, &entry))
+    {
+        i = tcs->seek_pos;
+        tcs->seek_pos++;
 
-    tcs->result = buf;
-    tcs->result_len = entry.tag_length + 1;
-    tcs->idx_id = entry.idx_id;
-    tcs->ramresult = false;
+        if (!add_lookup_entry(tcs, &entry, i))
+            continue;
+
+        yield();
+    }
+
+    return tcs->seek_list_count > 0;
+}
+
+
+bool tagcache_search(struct tagcache_search *tcs, int tag)
+{
+    /* NOTE: call tagcache_search_finish(&tcs) when finished or BAD things may happen (TM) */
+    struct tagcache_header tag_hdr;
+    struct master_header   master_hdr;
+    int i;
+
+    while (read_lock)
+        sleep(1);
+
+    memset(tcs, 0, sizeof(struct tagcache_search));
+    if (tc_stat.commit_step > 0 || !tc_stat.ready)
+        return false;
+
+    tcs->position = sizeof(struct tagcache_header);
+    tcs->type = tag;
+    tcs->seek_pos = 0;
+    tcs->list_position = 0;
+    tcs->seek_list_count = 0;
+    tcs->filter_count = 0;
+    tcs->masterfd = -1;
+    tcs->inverted_fd = -1;
+
+    for (i = 0; i < TAG_COUNT; i++)
+        tcs->idxfd[i] = -1;
+
+#ifndef HAVE_TC_RAMCACHE
+    tcs->ramsearch = false;
+#else
+    tcs->ramsearch = tc_stat.ramcache;
+    if (tcs->ramsearch)
+    {
+        tcs->entry_count = tcramcache.hdr->entry_count[tcs->type];
+    }
+    else
+#endif
+    {
+        /* Always open as R/W so we can pass tcs to functions that modify data also
+         * without failing. */
+        tcs->masterfd = open_master_fd(&master_hdr, true);
+        if (tcs->masterfd < 0)
+            return false;
+
+        if (!TAGCACHE_IS_NUMERIC(tcs->type))
+        {
+            tcs->idxfd[tcs->type] = open_tag_fd(&tag_hdr, tcs->type, false);
+            if (tcs->idxfd[tcs->type] < 0)
+                return false;
+
+            tcs->entry_count = tag_hdr.entry_count;
+        }
+        else
+        {
+            tcs->entry_count = master_hdr.tch.entry_count;
+        }
+    }
+
+    tcs->valid = true;
+    tcs->initialized = true;
+    write_lock++;
+
+    return true;
+}
+
+void tagcache_search_set_uniqbuf(struct tagcache_search *tcs,
+                                 void *buffer, long length)
+{
+    tcs->unique_list = (uint32_t *)buffer;
+    tcs->unique_list_capacity = length / sizeof(*tcs->unique_list);
+    tcs->unique_list_count = 0;
+}
+
+bool tagcache_search_add_filter(struct tagcache_search *tcs,
+                                int tag, int seek)
+{
+    if (tcs->filter_count == TAGCACHE_MAX_FILTERS)
+        return false;
+
+    if (TAGCACHE_IS_NUMERIC_OR_NONUNIQUE(tag))
+        return false;
+
+    tcs->filter_tag[tcs->filter_count] = tag;
+    tcs->filter_seek[tcs->filter_count] = seek;
+    tcs->filter_count++;
+
+    return true;
+}
+
+bool tagcache_search_add_clause(struct tagcache_search *tcs,
+                                struct tagcache_search_clause *clause)
+{
+    int i;
+    int clause_count = tcs->clause_count;
+
+    if (clause_count >= TAGCACHE_MAX_CLAUSES)
+    {
+        logf("Too many clauses");
+        return false;
+    }
+
+    if (clause->type != clause_logical_or)
+    {
+        /* BUGFIX OR'd clauses seem to be mishandled once made into a filter */
+        if (clause_count <= 1 || tcs->clause[clause_count - 1]->type != clause_logical_or)
+        {
+            /* Check if there is already a similar filter in present (filters are
+             * much faster than clauses).
+             */
+            for (i = 0; i < tcs->filter_count; i++)
+            {
+                if (tcs->filter_tag[i] == clause->tag)
+                {
+                    return true;
+                }
+            }
+        }
+
+        if (!TAGCACHE_IS_NUMERIC(clause->tag))
+        {
+            /* basename clauses read the filename */
+            open_files(tcs, clause->tag == tag_virt_basename ?
+                            tag_filename : clause->tag);
+        }
+    }
+
+    if (!compile_clause(&tcs->plan, clause, tcs->clause_count))
+        return false;
+
+    tcs->clause[tcs->clause_count] = clause;
+    tcs->clause_count++;
+
+    return true;
+}
+
+static bool get_next(struct tagcache_search *tcs, bool is_numeric, char *buf, long bufsz)
+{
+    struct tagfile_entry entry;
+#if defined(HAVE_TC_RAMCACHE) && defined(HAVE_DIRCACHE)
+    long flag = 0;
+#endif
+
+    if (tcs->idxfd[tcs->type] < 0 && !is_numeric
+#ifdef HAVE_TC_RAMCACHE
+        && !tcs->ramsearch
+#endif
+        )
+        return false;
+
+    /* Relative fetch. */
+    if (tcs->filter_count > 0 || tcs->clause_count > 0 || is_numeric
+#if defined(HAVE_TC_RAMCACHE) && defined(HAVE_DIRCACHE)
+        /* We need to retrieve flag status for dircache. */
+        || (tcs->ramsearch && tcs->type == tag_filename)
+#endif
+        )
+    {
+        struct tagcache_seeklist_entry *seeklist;
+
+        /* Check for end of list. */
+        if (tcs->list_position == tcs->seek_list_count)
+        {
+            tcs->list_position = 0;
+
+            /* Try to fetch more. */
+            if (!build_lookup_list(tcs))
+            {
+                tcs->valid = false;
+                return false;
+            }
+        }
+
+        seeklist = &tcs->seeklist[tcs->list_position];
+#if defined(HAVE_TC_RAMCACHE) && defined(HAVE_DIRCACHE)
+        flag = seeklist->flag;
+#endif
+        tcs->position = seeklist->seek;
+        tcs->idx_id = seeklist->idx_id;
+        tcs->list_position++;
+    }
+    else
+    {
+        if (tcs->entry_count == 0)
+        {
+            tcs->valid = false;
+            return false;
+        }
+
+        tcs->entry_count--;
+    }
+
+    tcs->result_seek = tcs->position;
+
+    if (is_numeric)
+    {
+        snprintf(buf, bufsz, "%ld", tcs->position);
+        tcs->result = buf;
+        tcs->result_len = strlen(buf) + 1;
+        return true;
+    }
+
+    /* Direct fetch. */
+#ifdef HAVE_TC_RAMCACHE
+    if (tcs->ramsearch)
+    {
+#ifdef HAVE_DIRCACHE
+        if (tcs->type == tag_filename && (flag & FLAG_DIRCACHE))
+        {
+            ssize_t len = dircache_get_fileref_path(&tcrc_dcfrefs[tcs->idx_id],
+                                                    buf, bufsz);
+            if (len >= 0)
+            {
+                tcs->result_len = len + 1;
+                tcs->result     = buf;
+                tcs->ramresult  = false;
+                return true;
+            }
+            /* else do it the hard way */
+        }
+#endif /* HAVE_DIRCACHE */
+
+        if (tcs->type != tag_filename)
+        {
+            struct tagfile_entry *ep;
+
+            ep = (struct tagfile_entry *)&tcramcache.hdr->tags[tcs->type][tcs->position];
+            /* don't return ep->tag_data directly as it may move */
+            tcs->result_len = strlcpy(buf, ep->tag_data, bufsz) + 1;
+            tcs->result = buf;
+            tcs->idx_id = ep->idx_id;
+            tcs->ramresult = false; /* was true before we copied to buf too */
+
+            /* Increase position for the next run. This may get overwritten. */
+            tcs->position += sizeof(struct tagfile_entry) + ep->tag_length;
+
+            return true;
+        }
+    }
+#endif /* HAVE_TC_RAMCACHE */
+
+    if (!open_files(tcs, tcs->type))
+    {
+        tcs->valid = false;
+        return false;
+    }
+
+    /* Seek stream to the correct position and continue to direct fetch. */
+    lseek(tcs->idxfd[tcs->type], tcs->position, SEEK_SET);
+
+    switch (read_tagfile_entry_and_tag(tcs->idxfd[tcs->type], &entry, buf, bufsz))
+    {
+        case e_SUCCESS_LEN_ZERO:
+        case e_SUCCESS:
+             break;
+        case e_ENTRY_SIZEMISMATCH:
+            logf("read error #5");
+            tcs->valid = false;
+            return false;
+        case e_TAG_TOOLONG:
+            tcs->valid = false;
+            logf("too long tag #2");
+            logf("P:%lX/%lX", tcs->position, entry.tag_length);
+            return false;
+        case e_TAG_SIZEMISMATCH:
+            tcs->valid = false;
+            logf("read error #4");
+            return false;
+    }
+
+    /**
+     Update the position for the next read (this may be overridden
+     if filters or clauses are being used).
+     */
+    tcs->position += sizeof(struct tagfile_entry) + entry.tag_length;
+    str_setlen(buf, entry.tag_length);
+
+    tcs->result = buf;
+    tcs->result_len = entry.tag_length + 1;
+    tcs->idx_id = entry.idx_id;
+    tcs->ramresult = false;
+
+    return true;
+}
+
+bool tagcache_get_next(struct tagcache_search *tcs, char *buf, long size)
+{
+    if (tcs->valid && tagcache_is_usable())
+    {
+        bool is_numeric = TAGCACHE_IS_NUMERIC(tcs->type);
+        while (get_next(tcs, is_numeric, buf, size))
+        {
+            if (tcs->result_len > 1)
+                return true;
+        }
+    }
+#ifdef LOGF_ENABLE
+    if (tcs->unique_list_count > 0)
+        logf(" uniqbuf: %d used / %d avail", tcs->unique_list_count, tcs->unique_list_capacity);
+#endif
+
+    return false;
+}
+
+bool tagcache_retrieve(struct tagcache_search *tcs, int idxid,
+                       int tag, char *buf, long size)
+{
+    struct index_entry idx;
+
+    *buf = '\0';
+    if (!get_index(tcs->masterfd, idxid, &idx, true))
+        return false;
+
+    return retrieve(tcs, IF_DIRCACHE(idxid,) &idx, tag, buf, size);
+}
+
+/* Remember where a search is in its results. Running the same search again
+ * (same tag, filters, clauses and uniqbuf, the uniqbuf left as this search
+ * left it) and resuming it from the checkpoint returns the results that
+ * followed, without fetching the ones before. */
+void tagcache_search_checkpoint(const struct tagcache_search *tcs,
+                                struct tagcache_checkpoint *cp)
+{
+    cp->position = tcs->position;
+    cp->seek_pos = tcs->seek_pos;
+    cp->seek_list_start = tcs->seek_list_start;
+    cp->seek_list_count = tcs->seek_list_count;
+    cp->list_position = tcs->list_position;
+    cp->entry_count = tcs->entry_count;
+    cp->unique_list_count = tcs->unique_list_count;
+    cp->unique_list_start = tcs->unique_list_start;
+    cp->commitid = current_tcmh.commitid;
+    cp->ramsearch = tcs->ramsearch;
+}
+
+/* Resume a search that hasn't returned any results yet. Returns false if
+ * the database has changed since the checkpoint was taken or if the results
+ * can't be read again, leaving the search at its start. */
+bool tagcache_search_resume(struct tagcache_search *tcs,
+                            const struct tagcache_checkpoint *cp)
+{
+    struct tagcache_checkpoint start;
+
+    if (!tcs->valid || cp->commitid != current_tcmh.commitid ||
+        cp->ramsearch != tcs->ramsearch)
+    {
+        return false;
+    }
+
+    tagcache_search_checkpoint(tcs, &start);
+
+    tcs->position = cp->position;
+    tcs->entry_count = cp->entry_count;
+    tcs->list_position = 0;
+    tcs->seek_list_count = 0;
+
+    if (cp->list_position == cp->seek_list_count)
+    {
+        /* Between two seek lists, the next one is built as usual */
+        tcs->seek_pos = cp->seek_pos;
+        tcs->unique_list_count = cp->unique_list_count;
+        return true;
+    }
+
+    /* Build the seek list again and continue inside it. Its entries were
+     * added to the uniqbuf the first time, so have them added again. */
+    tcs->seek_pos = cp->seek_list_start;
+    tcs->unique_list_count = cp->unique_list_start;
+
+    if (!build_lookup_list(tcs) || tcs->seek_list_count != cp->seek_list_count)
+    {
+        logf("resume failed");
+        tcs->position = start.position;
+        tcs->seek_pos = start.seek_pos;
+        tcs->seek_list_start = start.seek_list_start;
+        tcs->seek_list_count = start.seek_list_count;
+        tcs->list_position = start.list_position;
+        tcs->entry_count = start.entry_count;
+        tcs->unique_list_count = start.unique_list_count;
+        tcs->unique_list_start = start.unique_list_start;
+        return false;
+    }
+
+    tcs->list_position = cp->list_position;
+
+    return true;
+}
+
+void tagcache_search_finish(struct tagcache_search *tcs)
+{
+    int i;
+
+    if (!tcs->initialized)
+        return;
+
+    if (tcs->masterfd >= 0)
+    {
+        close(tcs->masterfd);
+        tcs->masterfd = -1;
+    }
+
+    for (i = 0; i < TAG_COUNT; i++)
+    {
+        if (tcs->idxfd[i] >= 0)
+        {
+            close(tcs->idxfd[i]);
+            tcs->idxfd[i] = -1;
+        }
+    }
+
+    if (tcs->inverted_fd >= 0)
+    {
+        close(tcs->inverted_fd);
+        tcs->inverted_fd = -1;
+    }
+
+    tcs->ramsearch = false;
+    tcs->valid = false;
+    tcs->initialized = 0;
+    if (write_lock > 0)
+        write_lock--;
+}
+
+#if defined(HAVE_TC_RAMCACHE) && defined(HAVE_DIRCACHE)
+static struct tagfile_entry *get_tag(const struct index_entry *entry, int tag)
+{
+    return (struct tagfile_entry *)&tcramcache.hdr->tags[tag][entry->tag_seek[tag]];
+}
+
+static long get_tag_numeric(const struct index_entry *entry, int tag, int idx_id)
+{
+    return check_virtual_tags(tag, idx_id, entry);
+}
+
+static char* get_tag_string(const struct index_entry *entry, int tag)
+{
+    char* s = get_tag(entry, tag)->tag_data;
+    return strcmp(s, UNTAGGED) ? s : NULL;
+}
+
+bool tagcache_fill_tags(struct mp3entry *id3, const char *filename)
+{
+    struct index_entry idx;
+    struct index_entry *entry = &idx;
+    int idx_id;
+
+    if (!tc_stat.ready || !tc_stat.ramcache)
+        return false;
+
+    /* Find the corresponding entry in tagcache. */
+
+    if (filename != NULL)
+        memset(id3, 0, sizeof(struct mp3entry));
+    else /* Note: caller clears id3 prior to call */
+        filename = id3->path;
+
+    idx_id = find_entry_ram(filename);
+    if (idx_id < 0)
+        return false;
+
+    tcrc_get_index(idx_id, entry);
+
+    char* buf = id3->id3v2buf;
+    ssize_t remaining = sizeof(id3->id3v2buf);
+
+    /* this macro sets id3 strings by copying to the id3v2buf */
+#define SET(x, y) do                                                           \
+    {                                                                          \
+        if (remaining > 0)                                                     \
+        {                                                                      \
+            x          = NULL; /* initialize with null if tag doesn't exist */ \
+            char* src = get_tag_string(entry, y);                              \
+            if (src)                                                           \
+            {                                                                  \
+                x = buf;                                                       \
+                size_t len = strlcpy(buf, src, remaining) +1;                  \
+                buf += len; remaining -= len;                                  \
+            }                                                                  \
+        }                                                                      \
+    } while(0)
+
+
+    SET(id3->title,         tag_title);
+    SET(id3->artist,        tag_artist);
+    SET(id3->album,         tag_album);
+    SET(id3->genre_string,  tag_genre);
+    SET(id3->composer,      tag_composer);
+    SET(id3->comment,       tag_comment);
+    SET(id3->albumartist,   tag_albumartist);
+    SET(id3->grouping,      tag_grouping);
+
+    id3->length     = get_tag_numeric(entry, tag_length, idx_id);
+    id3->playcount  = get_tag_numeric(entry, tag_playcount, idx_id);
+    id3->rating     = get_tag_numeric(entry, tag_rating, idx_id);
+    id3->lastplayed = get_tag_numeric(entry, tag_lastplayed, idx_id);
+    id3->score      = get_tag_numeric(entry, tag_virt_autoscore, idx_id) / 10;
+    id3->year       = get_tag_numeric(entry, tag_year, idx_id);
+
+    id3->discnum = get_tag_numeric(entry, tag_discnumber, idx_id);
+    id3->tracknum = get_tag_numeric(entry, tag_tracknumber, idx_id);
+    id3->bitrate = get_tag_numeric(entry, tag_bitrate, idx_id);
+    if (id3->bitrate == 0)
+        id3->bitrate = 1;
+
+    if (global_settings.autoresume_enable)
+    {
+        id3->elapsed = get_tag_numeric(entry, tag_lastelapsed, idx_id);
+        logf("tagcache_fill_tags: Set elapsed for %s to %lX\n",
+             id3->title, id3->elapsed);
+
+        id3->offset = get_tag_numeric(entry, tag_lastoffset, idx_id);
+        logf("tagcache_fill_tags: Set offset for %s to %lX\n",
+             id3->title, id3->offset);
+    }
+
+    return true;
+}
+#endif /* defined(HAVE_TC_RAMCACHE) && defined(HAVE_DIRCACHE) */
+
+static inline void write_item(const char *item)
+{
+    int len = strlen(item) + 1;
+
+    data_size += len;
+    write(cachefd, item, len);
+}
+
+static int check_if_empty(char **tag)
+{
+    int length;
+
+    if (*tag == NULL || **tag == '\0')
+    {
+        *tag = UNTAGGED;
+        return sizeof(UNTAGGED); /* Tag length */
+    }
+
+    length = strlen(*tag);
+    if (length > TAG_MAXLEN)
+    {
+        logf("over length tag: %s", *tag);
+        length = TAG_MAXLEN;
+        str_setlen((*tag), length);
+    }
+
+    return length + 1;
+}
+
+/**
+ * Check if a file found by the scan needs to be added to the database. An
+ * entry of the file made before it was last modified is deleted, so that
+ * the file gets added again.
+ */
+static bool NO_INLINE check_new_file(char *path, unsigned long mtime)
+{
+    int idx_id = -1;
+
+#ifdef SIMULATOR
+    /* Crude logging for the sim - to aid in debugging */
+    int logfd = open(ROCKBOX_DIR "/database.log",
+                     O_WRONLY | O_APPEND | O_CREAT, 0666);
+    if (logfd >= 0)
+    {
+        write(logfd, path, strlen(path));
+        write(logfd, "\n", 1);
+        close(logfd);
+    }
+#endif /* SIMULATOR */
+
+    if (cachefd < 0)
+        return false;
+
+    /* Check for overlength file path. */
+    if (strlen(path) > TAG_MAXLEN)
+    {
+        /* Path can't be shortened. */
+        logf("Too long path: %s", path);
+        return false;
+    }
+
+    /* Check if the file is supported. */
+    if (probe_file_format(path) == AFMT_UNKNOWN)
+        return false;
+
+    /* Check if the file is already cached. */
+#if defined(HAVE_TC_RAMCACHE) && defined(HAVE_DIRCACHE)
+    idx_id = find_entry_ram(path);
+#endif
+
+    /* Be sure the entry doesn't exist. */
+    if (filenametag_fd >= 0 && idx_id < 0)
+        idx_id = find_entry_disk(path, false);
+
+    /* Check if file has been modified. */
+    if (idx_id >= 0)
+    {
+        struct index_entry idx;
+
+        /* TODO: Mark that the index exists (for fast reverse scan) */
+        //found_idx[idx_id/8] |= idx_id%8;
+
+        if (!get_index(-1, idx_id, &idx, true))
+        {
+            logf("failed to retrieve index entry");
+            dirscan_file_failed(path);
+            return false;
+        }
+
+        if ((unsigned long)idx.tag_seek[tag_mtime] == mtime)
+        {
+            /* No changes to file. */
+            return false;
+        }
+
+        /* Metadata might have been changed. Delete the entry. */
+        logf("Re-adding: %s", path);
+        if (!delete_entry(idx_id))
+        {
+            logf("delete_entry failed: %d", idx_id);
+            dirscan_file_failed(path);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* GCC 3.4.6 for Coldfire can choose to inline this function. Not a good
+ * idea, as it uses lots of stack and is called from a recursive function
+ * (check_dir). The file must have passed check_new_file().
+ */
+static void NO_INLINE add_tagcache(char *path, unsigned long mtime,
+                                   struct mp3entry *parsed)
+{
+    #define ADD_TAG(entry, tag, data) \
+        /* Adding tag */                              \
+        entry.tag_length[tag] = check_if_empty(data); \
+        entry.tag_offset[tag] = offset;               \
+        offset += entry.tag_length[tag]
+
+    struct mp3entry id3buf;
+    struct mp3entry *id3 = parsed ? parsed : &id3buf;
+    struct temp_file_entry entry;
+    bool ret;
+    char tracknumfix[3];
+    int offset = 0;
+    bool has_artist;
+    bool has_grouping;
+
+    if (cachefd < 0)
+        return ;
+
+    /*memset(&id3, 0, sizeof(struct mp3entry)); -- get_metadata does this for us */
+    memset(&entry, 0, sizeof(struct temp_file_entry));
+    memset(&tracknumfix, 0, sizeof(tracknumfix));
+    /* The database tool may have parsed the file already. */
+    ret = parsed != NULL
+          || get_metadata_ex(id3, -1, path, METADATA_EXCLUDE_ID3_PATH);
+
+    if (!ret)
+    {
+        logf("get_metadata fail: %s", path);
+        dirscan_file_failed(path);
+        return ;
+    }
+
+    logf("-> %s", path);
+
+    if (id3->tracknum <= 0)              /* Track number missing? */
+    {
+        id3->tracknum = -1;
+    }
+
+    /* Numeric tags */
+    entry.tag_offset[tag_year] = id3->year;
+    entry.tag_offset[tag_discnumber] = id3->discnum;
+    entry.tag_offset[tag_tracknumber] = id3->tracknum;
+    entry.tag_offset[tag_length] = id3->length;
+    entry.tag_offset[tag_bitrate] = id3->bitrate;
+    entry.tag_offset[tag_mtime] = mtime;
+
+    /* String tags. */
+    has_artist = id3->artist != NULL
+        && strlen(id3->artist) > 0;
+    has_grouping = id3->grouping != NULL
+        && strlen(id3->grouping) > 0;
+
+    ADD_TAG(entry, tag_filename, &path);
+    ADD_TAG(entry, tag_title, &id3->title);
+    ADD_TAG(entry, tag_artist, &id3->artist);
+    ADD_TAG(entry, tag_album, &id3->album);
+    ADD_TAG(entry, tag_genre, &id3->genre_string);
+    ADD_TAG(entry, tag_composer, &id3->composer);
+    ADD_TAG(entry, tag_comment, &id3->comment);
+    ADD_TAG(entry, tag_albumartist, &id3->albumartist);
+    if (has_artist)
+    {
+        ADD_TAG(entry, tag_virt_canonicalartist, &id3->artist);
+    }
+    else
+    {
+        ADD_TAG(entry, tag_virt_canonicalartist, &id3->albumartist);
+    }
+    if (has_grouping)
+    {
+        ADD_TAG(entry, tag_grouping, &id3->grouping);
+    }
+    else
+    {
+        ADD_TAG(entry, tag_grouping, &id3->title);
+    }
+    entry.data_length = offset;
+
+    /* Write the header */
+    write(cachefd, &entry, sizeof(struct temp_file_entry));
+
+    /* And tags also... Correct order is critical */
+    write_item(path);
+    write_item(id3->title);
+    write_item(id3->artist);
+    write_item(id3->album);
+    write_item(id3->genre_string);
+    write_item(id3->composer);
+    write_item(id3->comment);
+    write_item(id3->albumartist);
+    if (has_artist)
+    {
+        write_item(id3->artist);
+    }
+    else
+    {
+        write_item(id3->albumartist);
+    }
+    if (has_grouping)
+    {
+        write_item(id3->grouping);
+    }
+    else
+    {
+        write_item(id3->title);
+    }
+
+    total_entry_count++;
+
+    #undef ADD_TAG
+}
+
+#ifdef __PCTOOL__
+static const struct tagcache_scan_hooks *scan_hooks = NULL;
+
+void tagcache_set_scan_hooks(const struct tagcache_scan_hooks *hooks)
+{
+    scan_hooks = hooks;
+}
+
+void tagcache_add_file(char *path, unsigned long mtime, struct mp3entry *id3)
+{
+    add_tagcache(path, mtime, id3);
+}
+#endif /* __PCTOOL__ */
+#endif /*!defined(PLUGIN)*/
+
+
+static bool tempbuf_insert(char *str, int id, int idx_id, bool unique)
+{
+    struct tempbuf_searchidx *index = (struct tempbuf_searchidx *)tempbuf;
+    int len = strlen(str)+1;
+    int i;
+    unsigned *crcbuf = (unsigned *)&tempbuf[tempbuf_size-4];
+    unsigned crc32 = 0xffffffff;
+    char chr_lower;
+    for (i = 0; str[i] != '\0' && i < len -1; i++)
+    {
+        chr_lower = tolower(str[i]);
+        crc32 = crc_32(&chr_lower, 1, crc32);
+    }
+
+    if (unique)
+    {
+        /* Check if the crc does not exist -> entry does not exist for sure. */
+        for (i = 0; i < tempbufidx; i++)
+        {
+            if (crcbuf[-i] != crc32)
+                continue;
+
+            if (!strcasecmp(str, index[i].str))
+            {
+                if (id < 0 || id >= lookup_buffer_depth)
+                {
+                    logf("lookup buf overf.: %d", id);
+                    return false;
+                }
+
+                lookup[id] = &index[i];
+                return true;
+            }
+        }
+    }
+
+    /* Insert to CRC buffer. */
+    crcbuf[-tempbufidx] = crc32;
+    tempbuf_left -= 4;
+
+    /* Insert it to the buffer. */
+    tempbuf_left -= len;
+    if (tempbuf_left - 4 < 0 || tempbufidx >= commit_entry_count)
+    {
+        logf("temp buf error rem: %ld idx: %d / %d",
+             tempbuf_left, tempbufidx, commit_entry_count-1);
+        return false;
+    }
+    if (id >= lookup_buffer_depth)
+    {
+        logf("lookup buf overf. #2: %d", id);
+        return false;
+    }
+
+    if (id >= 0)
+    {
+        lookup[id] = &index[tempbufidx];
+        index[tempbufidx].idlist.id = id;
+    }
+    else
+        index[tempbufidx].idlist.id = -1;
+
+    index[tempbufidx].idlist.next = NULL;
+    index[tempbufidx].idx_id = idx_id;
+    index[tempbufidx].seek = -1;
+    index[tempbufidx].str = &tempbuf[tempbuf_pos];
+    memcpy(index[tempbufidx].str, str, len);
+    tempbuf_pos += len;
+    tempbufidx++;
 
     return true;
 }
 
-bool tagcache_get_next(struct tagcache_search *tcs, char *buf, long size)
+/* Sort order of the tag files: UNTAGGED first, then case insensitive. */
+static int compare_tags(const char *str1, const char *str2)
 {
-    if (tcs->valid && tagcache_is_usable())
+    if (strcmp(str1, UNTAGGED) == 0)
     {
-        bool is_numeric = TAGCACHE_IS_NUMERIC(tcs->type);
-        while (get_next(tcs, is_numeric, buf, size))
-        {
-            if (tcs->result_len > 1)
-                return true;
-        }
+        if (strcmp(str2, UNTAGGED) == 0)
+            return 0;
+        return -1;
     }
-#ifdef LOGF_ENABLE
-    if (tcs->unique_list_count > 0)
-        logf(" uniqbuf: %d used / %d avail", tcs->unique_list_count, tcs->unique_list_capacity);
-#endif
+    else if (strcmp(str2, UNTAGGED) == 0)
+        return 1;
 
-    return false;
+    return strncasecmp(str1, str2, TAG_MAXLEN);
 }
 
-bool tagcache_retrieve(struct tagcache_search *tcs, int idxid,
-                       int tag, char *buf, long size)
+static int compare(const void *p1, const void *p2)
 {
-    struct index_entry idx;
+    do_timed_yield();
 
-    *buf = '\0';
-    if (!get_index(tcs->masterfd, idxid, &idx, true))
-        return false;
+    struct tempbuf_searchidx *e1 = (struct tempbuf_searchidx *)p1;
+    struct tempbuf_searchidx *e2 = (struct tempbuf_searchidx *)p2;
 
-    return retrieve(tcs, IF_DIRCACHE(idxid,) &idx, tag, buf, size);
+    return compare_tags(e1->str, e2->str);
 }
 
-void tagcache_search_finish(struct tagcache_search *tcs)
+/**
+ * Write a tag with its entry header, padded to TAGFILE_ENTRY_CHUNK_LENGTH.
+ * Returns the number of bytes written or < 0 on error.
+ */
+static long write_tag_entry(int fd, const char *str, long idx_id)
 {
-    int i;
+    struct tagfile_entry fe;
+    int length = strlen(str) + 1;
 
-    if (!tcs->initialized)
-        return;
+    fe.tag_length = length;
+    fe.idx_id = idx_id;
 
-    if (tcs->masterfd >= 0)
+    /* Check the chunk alignment. */
+    if ((fe.tag_length + sizeof(struct tagfile_entry))
+        % TAGFILE_ENTRY_CHUNK_LENGTH)
     {
-        close(tcs->masterfd);
-        tcs->masterfd = -1;
+        fe.tag_length += TAGFILE_ENTRY_CHUNK_LENGTH -
+            ((fe.tag_length + sizeof(struct tagfile_entry))
+             % TAGFILE_ENTRY_CHUNK_LENGTH);
     }
 
-    for (i = 0; i < TAG_COUNT; i++)
+    if (write_tagfile_entry(fd, &fe) != sizeof(struct tagfile_entry))
     {
-        if (tcs->idxfd[i] >= 0)
-        {
-            close(tcs->idxfd[i]);
-            tcs->idxfd[i] = -1;
-        }
+        logf("write_tag_entry: write error #1");
+        return -1;
     }
 
-    tcs->ramsearch = false;
-    tcs->valid = false;
-    tcs->initialized = 0;
-    if (write_lock > 0)
-        write_lock--;
-}
+    if (write(fd, str, length) != length)
+    {
+        logf("write_tag_entry: write error #2");
+        return -2;
+    }
 
-#if defined(HAVE_TC_RAMCACHE) && defined(HAVE_DIRCACHE)
-static struct tagfile_entry *get_tag(const struct index_entry *entry, int tag)
-{
-    return (struct tagfile_entry *)&tcramcache.hdr->tags[tag][entry->tag_seek[tag]];
-}
+    /* Write some padding. */
+    if (fe.tag_length - length > 0)
+        write(fd, "XXXXXXXX", fe.tag_length - length);
 
-static long get_tag_numeric(const struct index_entry *entry, int tag, int idx_id)
-{
-    return check_virtual_tags(tag, idx_id, entry);
+    return sizeof(struct tagfile_entry) + fe.tag_length;
 }
 
-static char* get_tag_string(const struct index_entry *entry, int tag)
+static int tempbuf_sort(int fd)
 {
-    char* s = get_tag(entry, tag)->tag_data;
-    return strcmp(s, UNTAGGED) ? s : NULL;
-}
+    struct tempbuf_searchidx *index = (struct tempbuf_searchidx *)tempbuf;
+    int i;
 
-bool tagcache_fill_tags(struct mp3entry *id3, const char *filename)
-{
-    struct index_entry *entry;
-    int idx_id;
+    /* Generate reverse lookup entries. */
+    for (i = 0; i < lookup_buffer_depth; i++)
+    {
+        struct tempbuf_id_list *idlist;
 
-    if (!tc_stat.ready || !tc_stat.ramcache)
-        return false;
+        if (!lookup[i])
+            continue;
 
-    /* Find the corresponding entry in tagcache. */
+        if (lookup[i]->idlist.id == i)
+            continue;
 
-    if (filename != NULL)
-        memset(id3, 0, sizeof(struct mp3entry));
-    else /* Note: caller clears id3 prior to call */
-        filename = id3->path;
+        idlist = &lookup[i]->idlist;
+        while (idlist->next != NULL)
+            idlist = idlist->next;
 
-    idx_id = find_entry_ram(filename);
-    if (idx_id < 0)
-        return false;
+        ALIGN_BUFFER(tempbuf_pos, tempbuf_left, alignof(struct tempbuf_id_list));
+        tempbuf_left -= sizeof(struct tempbuf_id_list);
+        if (tempbuf_left < 0)
+            return -1;
 
-    entry = &tcramcache.hdr->indices[idx_id];
-   
-    char* buf = id3->id3v2buf;
-    ssize_t remaining = sizeof(id3->id3v2buf);
+        idlist->next = (struct tempbuf_id_list *)&tempbuf[tempbuf_pos];
+        tempbuf_pos += sizeof(struct tempbuf_id_list);
 
-    /* this macro sets id3 strings by copying to the id3v2buf */
-#define SET(x, y) do                                                           \
-    {                                                                          \
-        if (remaining > 0)                                                     \
-        {                                                                      \
-            x          = NULL; /* initialize with null if tag doesn't exist */ \
-            char* src = get_tag_string(entry, y);                              \
-            if (src)                                                           \
-            {                                                                  \
-                x = buf;                                                       \
-                size_t len = strlcpy(buf, src, remaining) +1;                  \
-                buf += len; remaining -= len;                                  \
-            }                                                                  \
-        }                                                                      \
-    } while(0)
+        idlist = idlist->next;
+        idlist->id = i;
+        idlist->next = NULL;
 
+        do_timed_yield();
+    }
 
-    SET(id3->title,         tag_title);
-    SET(id3->artist,        tag_artist);
-    SET(id3->album,         tag_album);
-    SET(id3->genre_string,  tag_genre);
-    SET(id3->composer,      tag_composer);
-    SET(id3->comment,       tag_comment);
-    SET(id3->albumartist,   tag_albumartist);
-    SET(id3->grouping,      tag_grouping);
+    qsort(index, tempbufidx, sizeof(struct tempbuf_searchidx), compare);
+    memset(lookup, 0, lookup_buffer_depth * sizeof(struct tempbuf_searchidx **));
 
-    id3->length     = get_tag_numeric(entry, tag_length, idx_id);
-    id3->playcount  = get_tag_numeric(entry, tag_playcount, idx_id);
-    id3->rating     = get_tag_numeric(entry, tag_rating, idx_id);
-    id3->lastplayed = get_tag_numeric(entry, tag_lastplayed, idx_id);
-    id3->score      = get_tag_numeric(entry, tag_virt_autoscore, idx_id) / 10;
-    id3->year       = get_tag_numeric(entry, tag_year, idx_id);
+    for (i = 0; i < tempbufidx; i++)
+    {
+        struct tempbuf_id_list *idlist = &index[i].idlist;
 
-    id3->discnum = get_tag_numeric(entry, tag_discnumber, idx_id);
-    id3->tracknum = get_tag_numeric(entry, tag_tracknumber, idx_id);
-    id3->bitrate = get_tag_numeric(entry, tag_bitrate, idx_id);
-    if (id3->bitrate == 0)
-        id3->bitrate = 1;
+        /* Fix the lookup list. */
+        while (idlist != NULL)
+        {
+            if (idlist->id >= 0)
+                lookup[idlist->id] = &index[i];
+            idlist = idlist->next;
+        }
 
-    if (global_settings.autoresume_enable)
-    {
-        id3->elapsed = get_tag_numeric(entry, tag_lastelapsed, idx_id);
-        logf("tagcache_fill_tags: Set elapsed for %s to %lX\n",
-             id3->title, id3->elapsed);
+        index[i].seek = lseek(fd, 0, SEEK_CUR);
 
-        id3->offset = get_tag_numeric(entry, tag_lastoffset, idx_id);
-        logf("tagcache_fill_tags: Set offset for %s to %lX\n",
-             id3->title, id3->offset);
+        long rc = write_tag_entry(fd, index[i].str, index[i].idx_id);
+        if (rc < 0)
+            return rc;
     }
 
-    return true;
+    return i;
 }
-#endif /* defined(HAVE_TC_RAMCACHE) && defined(HAVE_DIRCACHE) */
 
-static inline void write_item(const char *item)
+inline static struct tempbuf_searchidx* tempbuf_locate(int id)
 {
-    int len = strlen(item) + 1;
+    if (id < 0 || id >= lookup_buffer_depth)
+        return NULL;
 
-    data_size += len;
-    write(cachefd, item, len);
+    return lookup[id];
 }
 
-static int check_if_empty(char **tag)
-{
-    int length;
 
-    if (*tag == NULL || **tag == '\0')
-    {
-        *tag = UNTAGGED;
-        return sizeof(UNTAGGED); /* Tag length */
-    }
+inline static int tempbuf_find_location(int id)
+{
+    struct tempbuf_searchidx *entry;
 
-    length = strlen(*tag);
-    if (length > TAG_MAXLEN)
-    {
-        logf("over length tag: %s", *tag);
-        length = TAG_MAXLEN;
-        str_setlen((*tag), length);
-    }
+    entry = tempbuf_locate(id);
+    if (entry == NULL)
+        return -1;
 
-    return length + 1;
+    return entry->seek;
 }
 
-/* GCC 3.4.6 for Coldfire can choose to inline this function. Not a good
- * idea, as it uses lots of stack and is called from a recursive function
- * (check_dir).
+/**
+ * External merge sort of a sorted tag, used at commit when its tags don't
+ * fit in tempbuf. Tags are collected in runs that are sorted in memory and
+ * spilled to a temporary file, then the runs are merged into the tag file.
+ *
+ * Instead of the lookup buffer, the new location of each tag is kept in
+ * flat maps at the start of tempbuf:
+ *     newmap[i]    for the tag of entry i in the temporary file
+ *     oldmap[k]    for the k:th tag of the old tag file, whose old
+ *                  location/ENTRY_CHUNK_SIZE oldseek[k] is found with a
+ *                  binary search
+ *
+ * +--------+---------+--------+-----+------------------------------+
+ * | newmap | oldseek | oldmap | out | records ->     <- record ptrs |
+ * +--------+---------+--------+-----+------------------------------+
  */
-static void NO_INLINE add_tagcache(char *path, unsigned long mtime)
-{
-    #define ADD_TAG(entry, tag, data) \
-        /* Adding tag */                              \
-        entry.tag_length[tag] = check_if_empty(data); \
-        entry.tag_offset[tag] = offset;               \
-        offset += entry.tag_length[tag]
-
-    struct mp3entry id3;
-    struct temp_file_entry entry;
-    bool ret;
-    int idx_id = -1;
-    char tracknumfix[3];
-    int offset = 0;
-    int path_length = strlen(path);
-    bool has_artist;
-    bool has_grouping;
-
-#ifdef SIMULATOR
-    /* Crude logging for the sim - to aid in debugging */
-    int logfd = open(ROCKBOX_DIR "/database.log",
-                     O_WRONLY | O_APPEND | O_CREAT, 0666);
-    if (logfd >= 0)
-    {
-        write(logfd, path, strlen(path));
-        write(logfd, "\n", 1);
-        close(logfd);
-    }
-#endif /* SIMULATOR */
+struct extsort_record {
+    int32_t id;         /* >= 0: new entry, < 0: -1 - index in oldmap */
+    int32_t idx_id;
+    int32_t length;     /* String length including the terminator */
+    char str[];
+};
 
-    if (cachefd < 0)
-        return ;
+#define EXTSORT_RECORD_SIZE(len) \
+    ALIGN_UP(sizeof(struct extsort_record) + (len), 4)
+#define EXTSORT_MAX_RUNS   64
+#define EXTSORT_BUF_MIN    2048
+
+static struct {
+    bool active;
+    int fd[2];          /* Run files, merge passes go back and forth */
+    int cur;            /* File holding the current runs */
+    int run_count;
+    off_t run_end[EXTSORT_MAX_RUNS]; /* Runs are consecutive in the file */
+    int32_t *newmap;
+    int32_t *oldseek;
+    int32_t *oldmap;
+    long new_count;
+    long old_count;
+    long old_added;
+    long total;         /* Records added */
+    char *mem;          /* Work memory for runs and merge buffers */
+    long mem_size;
+    long used;          /* Bytes of records in the current run */
+    long rec_count;     /* Records in the current run */
+} extsort;
+
+struct extsort_out {
+    int fd;
+    char *buf;
+    long size;
+    long fill;
+};
 
-    /* Check for overlength file path. */
-    if (path_length > TAG_MAXLEN)
-    {
-        /* Path can't be shortened. */
-        logf("Too long path: %s", path);
-        return ;
-    }
+struct extsort_reader {
+    off_t pos;          /* Part of the run not read yet */
+    off_t end;
+    char *buf;
+    long size;
+    long off;
+    long fill;
+    struct extsort_record *rec; /* Current record, NULL at end of run */
+};
 
-    /* Check if the file is supported. */
-    if (probe_file_format(path) == AFMT_UNKNOWN)
-        return ;
+static inline void set_commit_substep(int first, int last,
+                                      long done, long total)
+{
+    if (total > 0)
+        tc_stat.commit_substep = first + (last - first) * done / total;
+}
 
-    /* Check if the file is already cached. */
-#if defined(HAVE_TC_RAMCACHE) && defined(HAVE_DIRCACHE)
-    idx_id = find_entry_ram(path);
-#endif
+static int open_sort_fd(int n)
+{
+    return open_pathfmt(build_idx_buf, build_idx_bufsz,
+                        O_RDWR | O_CREAT | O_TRUNC,
+                        "%s/" TAGCACHE_FILE_SORT, tc_stat.db_path, n);
+}
 
-    /* Be sure the entry doesn't exist. */
-    if (filenametag_fd >= 0 && idx_id < 0)
-        idx_id = find_entry_disk(path, false);
+static void extsort_close(void)
+{
+    int i;
 
-    /* Check if file has been modified. */
-    if (idx_id >= 0)
+    if (!extsort.active)
+        return;
+
+    for (i = 0; i < 2; i++)
     {
-        struct index_entry idx;
+        if (extsort.fd[i] < 0)
+            continue;
 
-        /* TODO: Mark that the index exists (for fast reverse scan) */
-        //found_idx[idx_id/8] |= idx_id%8;
+        close(extsort.fd[i]);
+        extsort.fd[i] = -1;
+        snprintf(build_idx_buf, build_idx_bufsz, "%s/" TAGCACHE_FILE_SORT,
+                 tc_stat.db_path, i);
+        remove(build_idx_buf);
+    }
 
-        if (!get_index(-1, idx_id, &idx, true))
-        {
-            logf("failed to retrieve index entry");
-            return ;
-        }
+    extsort.active = false;
+}
 
-        if ((unsigned long)idx.tag_seek[tag_mtime] == mtime)
-        {
-            /* No changes to file. */
-            return ;
-        }
+/**
+ * Lay out tempbuf for sorting new_count new and old_count old tags. The
+ * seek maps stay in memory and take (new_count + 2 * old_count) * 4 bytes,
+ * and the runs need some room after them.
+ * Return values:
+ *     > 0   success
+ *    == 0   the sort files can't be created
+ *     < 0   tempbuf is too small for this many entries
+ */
+static int extsort_init(long new_count, long old_count)
+{
+    long i;
+    long maps = (new_count + 2 * old_count) * sizeof(int32_t);
 
-        /* Metadata might have been changed. Delete the entry. */
-        logf("Re-adding: %s", path);
-        if (!delete_entry(idx_id))
+    extsort.fd[0] = extsort.fd[1] = -1;
+    if ((long)tempbuf_size - maps < 3 * EXTSORT_BUF_MIN)
+    {
+        logf("extsort: %ld bytes needed", maps + 3 * EXTSORT_BUF_MIN);
+        return -1;
+    }
+
+    extsort.newmap = (int32_t *)tempbuf;
+    extsort.oldseek = extsort.newmap + new_count;
+    extsort.oldmap = extsort.oldseek + old_count;
+    extsort.mem = (char *)(extsort.oldmap + old_count);
+    extsort.mem_size = ALIGN_DOWN((long)tempbuf_size - maps,
+                                  sizeof(struct extsort_record *));
+    for (i = 0; i < new_count; i++)
+        extsort.newmap[i] = -1;
+
+    extsort.new_count = new_count;
+    extsort.old_count = old_count;
+    extsort.old_added = 0;
+    extsort.total = 0;
+    extsort.used = 0;
+    extsort.rec_count = 0;
+    extsort.run_count = 0;
+    extsort.cur = 0;
+    extsort.active = true;
+
+    for (i = 0; i < 2; i++)
+    {
+        extsort.fd[i] = open_sort_fd(i);
+        if (extsort.fd[i] < 0)
         {
-            logf("delete_entry failed: %d", idx_id);
-            return ;
+            logf(TAGCACHE_FILE_SORT " open fail", (int)i);
+            extsort_close();
+            return 0;
         }
     }
 
-    /*memset(&id3, 0, sizeof(struct mp3entry)); -- get_metadata does this for us */
-    memset(&entry, 0, sizeof(struct temp_file_entry));
-    memset(&tracknumfix, 0, sizeof(tracknumfix));
-    ret = get_metadata_ex(&id3, -1, path, METADATA_EXCLUDE_ID3_PATH);
+    logf("extsort: %ld bytes for runs", extsort.mem_size);
+    return 1;
+}
 
-    if (!ret)
+static bool extsort_out_flush(struct extsort_out *out)
+{
+    if (out->fill > 0 && write(out->fd, out->buf, out->fill) != out->fill)
     {
-        logf("get_metadata fail: %s", path);
-        return ;
+        logf("extsort: write error");
+        return false;
     }
 
-    logf("-> %s", path);
-
-    if (id3.tracknum <= 0)              /* Track number missing? */
-    {
-        id3.tracknum = -1;
-    }
+    out->fill = 0;
+    return true;
+}
 
-    /* Numeric tags */
-    entry.tag_offset[tag_year] = id3.year;
-    entry.tag_offset[tag_discnumber] = id3.discnum;
-    entry.tag_offset[tag_tracknumber] = id3.tracknum;
-    entry.tag_offset[tag_length] = id3.length;
-    entry.tag_offset[tag_bitrate] = id3.bitrate;
-    entry.tag_offset[tag_mtime] = mtime;
+static bool extsort_out_put(struct extsort_out *out,
+                            const struct extsort_record *rec)
+{
+    long size = EXTSORT_RECORD_SIZE(rec->length);
 
-    /* String tags. */
-    has_artist = id3.artist != NULL
-        && strlen(id3.artist) > 0;
-    has_grouping = id3.grouping != NULL
-        && strlen(id3.grouping) > 0;
+    if (out->fill + size > out->size && !extsort_out_flush(out))
+        return false;
 
-    ADD_TAG(entry, tag_filename, &path);
-    ADD_TAG(entry, tag_title, &id3.title);
-    ADD_TAG(entry, tag_artist, &id3.artist);
-    ADD_TAG(entry, tag_album, &id3.album);
-    ADD_TAG(entry, tag_genre, &id3.genre_string);
-    ADD_TAG(entry, tag_composer, &id3.composer);
-    ADD_TAG(entry, tag_comment, &id3.comment);
-    ADD_TAG(entry, tag_albumartist, &id3.albumartist);
-    if (has_artist)
-    {
-        ADD_TAG(entry, tag_virt_canonicalartist, &id3.artist);
-    }
-    else
-    {
-        ADD_TAG(entry, tag_virt_canonicalartist, &id3.albumartist);
-    }
-    if (has_grouping)
-    {
-        ADD_TAG(entry, tag_grouping, &id3.grouping);
-    }
-    else
-    {
-        ADD_TAG(entry, tag_grouping, &id3.title);
-    }
-    entry.data_length = offset;
+    if (size > out->size)
+        return write(out->fd, rec, size) == size;
 
-    /* Write the header */
-    write(cachefd, &entry, sizeof(struct temp_file_entry));
+    memcpy(&out->buf[out->fill], rec, size);
+    out->fill += size;
+    return true;
+}
 
-    /* And tags also... Correct order is critical */
-    write_item(path);
-    write_item(id3.title);
-    write_item(id3.artist);
-    write_item(id3.album);
-    write_item(id3.genre_string);
-    write_item(id3.composer);
-    write_item(id3.comment);
-    write_item(id3.albumartist);
-    if (has_artist)
-    {
-        write_item(id3.artist);
-    }
-    else
-    {
-        write_item(id3.albumartist);
-    }
-    if (has_grouping)
-    {
-        write_item(id3.grouping);
-    }
-    else
-    {
-        write_item(id3.title);
-    }
+static int compare_extsort(const void *p1, const void *p2)
+{
+    const struct extsort_record *e1 = *(const struct extsort_record **)p1;
+    const struct extsort_record *e2 = *(const struct extsort_record **)p2;
+    int ret = compare_tags(e1->str, e2->str);
 
-    total_entry_count++;
+    /* Keep the order of equal tags so the first one added wins. */
+    if (ret == 0)
+        ret = e1 < e2 ? -1 : 1;
 
-    #undef ADD_TAG
+    return ret;
 }
-#endif /*!defined(PLUGIN)*/
 
+/* Run r is stored from the end of the previous run up to run_end[r]. */
+static inline off_t extsort_run_start(int r)
+{
+    return r > 0 ? extsort.run_end[r - 1] : 0;
+}
 
-static bool tempbuf_insert(char *str, int id, int idx_id, bool unique)
+/**
+ * Return values:
+ *     > 0   the next record is in r->rec
+ *    == 0   end of run
+ *     < 0   read error
+ */
+static int extsort_reader_next(int fd, struct extsort_reader *r)
 {
-    struct tempbuf_searchidx *index = (struct tempbuf_searchidx *)tempbuf;
-    int len = strlen(str)+1;
-    int i;
-    unsigned *crcbuf = (unsigned *)&tempbuf[tempbuf_size-4];
-    unsigned crc32 = 0xffffffff;
-    char chr_lower;
-    for (i = 0; str[i] != '\0' && i < len -1; i++)
-    {
-        chr_lower = tolower(str[i]);
-        crc32 = crc_32(&chr_lower, 1, crc32);
-    }
+    long need = sizeof(struct extsort_record);
+    int pass;
 
-    if (unique)
+    if (r->rec != NULL)
+        r->off += EXTSORT_RECORD_SIZE(r->rec->length);
+    r->rec = NULL;
+
+    for (pass = 0; pass < 2; pass++)
     {
-        /* Check if the crc does not exist -> entry does not exist for sure. */
-        for (i = 0; i < tempbufidx; i++)
+        if (r->fill - r->off < need)
         {
-            if (crcbuf[-i] != crc32)
-                continue;
+            long len;
 
-            if (!strcasecmp(str, index[i].str))
+            memmove(r->buf, &r->buf[r->off], r->fill - r->off);
+            r->fill -= r->off;
+            r->off = 0;
+
+            len = MIN(r->size - r->fill, r->end - r->pos);
+            if (len > 0)
             {
-                if (id < 0 || id >= lookup_buffer_depth)
+                lseek(fd, r->pos, SEEK_SET);
+                if (read(fd, &r->buf[r->fill], len) != len)
                 {
-                    logf("lookup buf overf.: %d", id);
-                    return false;
+                    logf("extsort: read error");
+                    return -1;
                 }
+                r->pos += len;
+                r->fill += len;
+            }
 
-                lookup[id] = &index[i];
-                return true;
+            if (r->fill == 0 && pass == 0)
+                return 0;
+
+            if (r->fill < need)
+            {
+                logf("extsort: truncated run");
+                return -2;
+            }
+        }
+
+        if (pass == 0)
+        {
+            struct extsort_record *rec = (struct extsort_record *)
+                                         &r->buf[r->off];
+            need = EXTSORT_RECORD_SIZE(rec->length);
+            if (rec->length <= 0 || need > r->size)
+            {
+                logf("extsort: corrupt run");
+                return -3;
             }
         }
     }
 
-    /* Insert to CRC buffer. */
-    crcbuf[-tempbufidx] = crc32;
-    tempbuf_left -= 4;
+    r->rec = (struct extsort_record *)&r->buf[r->off];
+    return 1;
+}
 
-    /* Insert it to the buffer. */
-    tempbuf_left -= len;
-    if (tempbuf_left - 4 < 0 || tempbufidx >= commit_entry_count)
+static inline bool extsort_heap_less(const struct extsort_reader *readers,
+                                     int a, int b)
+{
+    int ret = compare_tags(readers[a].rec->str, readers[b].rec->str);
+    return ret < 0 || (ret == 0 && a < b);
+}
+
+static void extsort_heap_down(const struct extsort_reader *readers,
+                              int *heap, int count, int i)
+{
+    while (true)
     {
-        logf("temp buf error rem: %ld idx: %d / %d",
-             tempbuf_left, tempbufidx, commit_entry_count-1);
-        return false;
+        int child = 2 * i + 1;
+        int tmp;
+
+        if (child >= count)
+            break;
+
+        if (child + 1 < count
+            && extsort_heap_less(readers, heap[child + 1], heap[child]))
+            child++;
+
+        if (!extsort_heap_less(readers, heap[child], heap[i]))
+            break;
+
+        tmp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = tmp;
+        i = child;
     }
-    if (id >= lookup_buffer_depth)
+}
+
+/**
+ * Merge runs first..last-1 of the current run file, passing the records
+ * in order to emit(). mem is divided between the runs.
+ */
+static bool extsort_merge(int first, int last, char *mem, long mem_size,
+                          bool (*emit)(const struct extsort_record *, void *),
+                          void *data)
+{
+    struct extsort_reader readers[EXTSORT_MAX_RUNS];
+    int heap[EXTSORT_MAX_RUNS];
+    int count = last - first;
+    int fd = extsort.fd[extsort.cur];
+    long size = ALIGN_DOWN(mem_size / count, 4);
+    int i, n = 0;
+
+    for (i = 0; i < count; i++)
     {
-        logf("lookup buf overf. #2: %d", id);
-        return false;
+        struct extsort_reader *r = &readers[i];
+        int ret;
+
+        r->pos = extsort_run_start(first + i);
+        r->end = extsort.run_end[first + i];
+        r->buf = &mem[i * size];
+        r->size = size;
+        r->off = r->fill = 0;
+        r->rec = NULL;
+
+        ret = extsort_reader_next(fd, r);
+        if (ret < 0)
+            return false;
+        if (ret > 0)
+            heap[n++] = i;
     }
 
-    if (id >= 0)
+    for (i = n / 2 - 1; i >= 0; i--)
+        extsort_heap_down(readers, heap, n, i);
+
+    while (n > 0)
     {
-        lookup[id] = &index[tempbufidx];
-        index[tempbufidx].idlist.id = id;
-    }
-    else
-        index[tempbufidx].idlist.id = -1;
+        struct extsort_reader *r = &readers[heap[0]];
+        int ret;
 
-    index[tempbufidx].idlist.next = NULL;
-    index[tempbufidx].idx_id = idx_id;
-    index[tempbufidx].seek = -1;
-    index[tempbufidx].str = &tempbuf[tempbuf_pos];
-    memcpy(index[tempbufidx].str, str, len);
-    tempbuf_pos += len;
-    tempbufidx++;
+        if (!emit(r->rec, data))
+            return false;
+
+        ret = extsort_reader_next(fd, r);
+        if (ret < 0)
+            return false;
+        if (ret == 0)
+            heap[0] = heap[--n];
+
+        extsort_heap_down(readers, heap, n, 0);
+        do_timed_yield();
+    }
 
     return true;
 }
 
-static int compare(const void *p1, const void *p2)
+static bool extsort_emit_run(const struct extsort_record *rec, void *data)
 {
-    do_timed_yield();
+    return extsort_out_put((struct extsort_out *)data, rec);
+}
 
-    struct tempbuf_searchidx *e1 = (struct tempbuf_searchidx *)p1;
-    struct tempbuf_searchidx *e2 = (struct tempbuf_searchidx *)p2;
+/* Number of runs the work memory can merge at once. */
+static inline int extsort_fanin(void)
+{
+    return MIN(EXTSORT_MAX_RUNS, extsort.mem_size / EXTSORT_BUF_MIN - 1);
+}
+
+/* Merge groups of runs into the other run file to reduce the run count. */
+static bool extsort_merge_pass(void)
+{
+    off_t run_end[EXTSORT_MAX_RUNS];
+    struct extsort_out out;
+    int fanin = extsort_fanin();
+    int first, count = 0;
+    long size;
+
+    out.fd = extsort.fd[!extsort.cur];
+    lseek(out.fd, 0, SEEK_SET);
+    ftruncate(out.fd, 0);
 
-    if (strcmp(e1->str, UNTAGGED) == 0)
+    for (first = 0; first < extsort.run_count; first += fanin)
     {
-        if (strcmp(e2->str, UNTAGGED) == 0)
-            return 0;
-        return -1;
+        int last = MIN(first + fanin, extsort.run_count);
+
+        /* One buffer for output, the rest for the runs. */
+        size = ALIGN_DOWN(extsort.mem_size / (last - first + 1), 4);
+        out.buf = extsort.mem;
+        out.size = size;
+        out.fill = 0;
+
+        if (!extsort_merge(first, last, &extsort.mem[size],
+                           extsort.mem_size - size, extsort_emit_run, &out)
+            || !extsort_out_flush(&out))
+            return false;
+
+        run_end[count++] = lseek(out.fd, 0, SEEK_CUR);
     }
-    else if (strcmp(e2->str, UNTAGGED) == 0)
-        return 1;
 
-    return strncasecmp(e1->str, e2->str, TAG_MAXLEN);
+    logf("extsort: %d runs merged to %d", extsort.run_count, count);
+    memcpy(extsort.run_end, run_end, count * sizeof(off_t));
+    extsort.run_count = count;
+    extsort.cur = !extsort.cur;
+    return true;
 }
 
-static int tempbuf_sort(int fd)
+/* Sort the records in memory and spill them as a new run. */
+static bool extsort_flush_run(void)
 {
-    struct tempbuf_searchidx *index = (struct tempbuf_searchidx *)tempbuf;
-    struct tagfile_entry fe;
-    int i;
-    int length;
+    struct extsort_record **ptrs = (struct extsort_record **)
+        &extsort.mem[extsort.mem_size] - extsort.rec_count;
+    struct extsort_out out;
+    int fd = extsort.fd[extsort.cur];
+    long i;
 
-    /* Generate reverse lookup entries. */
-    for (i = 0; i < lookup_buffer_depth; i++)
+    if (extsort.rec_count == 0)
+        return true;
+
+    if (extsort.run_count >= EXTSORT_MAX_RUNS)
     {
-        struct tempbuf_id_list *idlist;
+        logf("extsort: too many runs");
+        return false;
+    }
 
-        if (!lookup[i])
-            continue;
+    qsort(ptrs, extsort.rec_count, sizeof(*ptrs), compare_extsort);
 
-        if (lookup[i]->idlist.id == i)
-            continue;
+    out.fd = fd;
+    out.buf = extsort.mem;
+    out.size = EXTSORT_BUF_MIN;
+    out.fill = 0;
 
-        idlist = &lookup[i]->idlist;
-        while (idlist->next != NULL)
-            idlist = idlist->next;
+    lseek(fd, 0, SEEK_END);
+    for (i = 0; i < extsort.rec_count; i++)
+    {
+        if (!extsort_out_put(&out, ptrs[i]))
+            return false;
+    }
+
+    if (!extsort_out_flush(&out))
+        return false;
+
+    extsort.run_end[extsort.run_count++] = lseek(fd, 0, SEEK_CUR);
+    extsort.used = 0;
+    extsort.rec_count = 0;
+
+    /* Merge early so the next runs still fit in the run table. */
+    if (extsort.run_count == EXTSORT_MAX_RUNS)
+        return extsort_merge_pass();
+
+    return true;
+}
+
+/**
+ * Add a tag to be sorted. id is the entry in the temporary file for new
+ * tags and the location in the old tag file (oldseek) for old ones.
+ */
+static bool extsort_add(const char *str, int32_t id, int32_t idx_id, bool old)
+{
+    struct extsort_record *rec;
+    struct extsort_record **ptrs;
+    long len = strlen(str) + 1;
+    long size = EXTSORT_RECORD_SIZE(len);
+
+    if (old)
+    {
+        if (extsort.old_added >= extsort.old_count)
+        {
+            logf("extsort: too many old tags");
+            return false;
+        }
+
+        extsort.oldseek[extsort.old_added] = id / TAGFILE_ENTRY_CHUNK_LENGTH;
+        extsort.oldmap[extsort.old_added] = -1;
+        id = -1 - extsort.old_added++;
+    }
+    else if (id >= extsort.new_count)
+    {
+        logf("extsort: bad id %ld", (long)id);
+        return false;
+    }
+
+    /* Records are stored after the output buffer. */
+    if (EXTSORT_BUF_MIN + extsort.used + size
+        + (extsort.rec_count + 1) * (long)sizeof(*ptrs) > extsort.mem_size)
+    {
+        if (!extsort_flush_run())
+            return false;
+    }
 
-        ALIGN_BUFFER(tempbuf_pos, tempbuf_left, alignof(struct tempbuf_id_list));
-        tempbuf_left -= sizeof(struct tempbuf_id_list);
-        if (tempbuf_left < 0)
-            return -1;
+    rec = (struct extsort_record *)
+          &extsort.mem[EXTSORT_BUF_MIN + extsort.used];
+    rec->id = id;
+    rec->idx_id = idx_id;
+    rec->length = len;
+    memcpy(rec->str, str, len);
 
-        idlist->next = (struct tempbuf_id_list *)&tempbuf[tempbuf_pos];
-        tempbuf_pos += sizeof(struct tempbuf_id_list);
+    ptrs = (struct extsort_record **)&extsort.mem[extsort.mem_size];
+    ptrs[-(++extsort.rec_count)] = rec;
+    extsort.used += size;
+    extsort.total++;
 
-        idlist = idlist->next;
-        idlist->id = i;
-        idlist->next = NULL;
+    return true;
+}
 
-        do_timed_yield();
-    }
+struct extsort_tagfile {
+    int fd;
+    bool unique;
+    long pos;           /* End of the tag file */
+    long seek;          /* Location of the last tag written */
+    long written;
+    long merged;
+};
 
-    qsort(index, tempbufidx, sizeof(struct tempbuf_searchidx), compare);
-    memset(lookup, 0, lookup_buffer_depth * sizeof(struct tempbuf_searchidx **));
+static bool extsort_emit_tag(const struct extsort_record *rec, void *data)
+{
+    struct extsort_tagfile *tf = (struct extsort_tagfile *)data;
 
-    for (i = 0; i < tempbufidx; i++)
+    /* Merged in order, so duplicates of a unique tag are adjacent. */
+    if (!tf->unique || tf->written == 0 || strcasecmp(rec->str, build_idx_buf))
     {
-        struct tempbuf_id_list *idlist = &index[i].idlist;
+        long ret = write_tag_entry(tf->fd, rec->str, rec->idx_id);
+        if (ret < 0)
+            return false;
 
-        /* Fix the lookup list. */
-        while (idlist != NULL)
-        {
-            if (idlist->id >= 0)
-                lookup[idlist->id] = &index[i];
-            idlist = idlist->next;
-        }
+        tf->seek = tf->pos;
+        tf->pos += ret;
+        tf->written++;
+        if (tf->unique)
+            strlcpy(build_idx_buf, rec->str, build_idx_bufsz);
+    }
 
-        index[i].seek = lseek(fd, 0, SEEK_CUR);
-        length = strlen(index[i].str) + 1;
-        fe.tag_length = length;
-        fe.idx_id = index[i].idx_id;
+    if (rec->id >= 0)
+        extsort.newmap[rec->id] = tf->seek;
+    else
+        extsort.oldmap[-1 - rec->id] = tf->seek;
 
-        /* Check the chunk alignment. */
-        if ((fe.tag_length + sizeof(struct tagfile_entry))
-            % TAGFILE_ENTRY_CHUNK_LENGTH)
-        {
-            fe.tag_length += TAGFILE_ENTRY_CHUNK_LENGTH -
-                ((fe.tag_length + sizeof(struct tagfile_entry))
-                 % TAGFILE_ENTRY_CHUNK_LENGTH);
-        }
+    set_commit_substep(5, 9, ++tf->merged, extsort.total);
+    return true;
+}
 
-        if (write_tagfile_entry(fd, &fe) != sizeof(struct tagfile_entry))
-        {
-            logf("tempbuf_sort: write error #1");
-            return -1;
-        }
+/**
+ * Merge all tags into the tag file at the current position of fd.
+ * Returns the number of tags written or < 0 on error.
+ */
+static long extsort_finish(int fd, bool unique)
+{
+    struct extsort_tagfile tf;
 
-        if (write(fd, index[i].str, length) != length)
-        {
-            logf("tempbuf_sort: write error #2");
-            return -2;
-        }
+    if (!extsort_flush_run())
+        return -1;
 
-        /* Write some padding. */
-        if (fe.tag_length - length > 0)
-            write(fd, "XXXXXXXX", fe.tag_length - length);
+    while (extsort.run_count > extsort_fanin())
+    {
+        if (!extsort_merge_pass())
+            return -1;
     }
 
-    return i;
+    tf.fd = fd;
+    tf.unique = unique;
+    tf.pos = lseek(fd, 0, SEEK_CUR);
+    tf.seek = -1;
+    tf.written = 0;
+    tf.merged = 0;
+
+    if (extsort.run_count > 0
+        && !extsort_merge(0, extsort.run_count, extsort.mem, extsort.mem_size,
+                          extsort_emit_tag, &tf))
+        return -2;
+
+    tempbufidx = tf.written;
+    return tf.written;
 }
 
-inline static struct tempbuf_searchidx* tempbuf_locate(int id)
+static int extsort_find_location(int id)
 {
-    if (id < 0 || id >= lookup_buffer_depth)
-        return NULL;
+    long loc, lo = 0, hi = extsort.old_added;
 
-    return lookup[id];
-}
+    if (id < commit_entry_count)
+    {
+        if (id < 0 || id >= extsort.new_count)
+            return -1;
+        return extsort.newmap[id];
+    }
 
+    loc = id - commit_entry_count;
+    while (lo < hi)
+    {
+        long mid = (lo + hi) / 2;
 
-inline static int tempbuf_find_location(int id)
-{
-    struct tempbuf_searchidx *entry;
+        if (extsort.oldseek[mid] < loc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
 
-    entry = tempbuf_locate(id);
-    if (entry == NULL)
+    if (lo >= extsort.old_added || extsort.oldseek[lo] != loc)
         return -1;
 
-    return entry->seek;
+    return extsort.oldmap[lo];
+}
+
+static int find_location(int id)
+{
+    if (extsort.active)
+        return extsort_find_location(id);
+
+    return tempbuf_find_location(id);
 }
 
 static bool build_numeric_indices(struct tagcache_header *h, int tmpfd)
@@ -2803,9 +4410,12 @@ static bool build_numeric_indices(struct tagcache_header *h, int tmpfd)
  * Return values:
  *     > 0   success
  *    == 0   temporary failure
+ *    -3     out of tempbuf while sorting in memory
+ *    -4     tempbuf can't even hold the maps for sorting on disk
  *     < 0   fatal error
  */
-static int build_index(int index_type, struct tagcache_header *h, int tmpfd)
+static int build_index_pass(int index_type, struct tagcache_header *h,
+                            int tmpfd, bool external)
 {
     int i;
     struct tagcache_header tch;
@@ -2814,10 +4424,15 @@ static int build_index(int index_type, struct tagcache_header *h, int tmpfd)
     int idxbuf_pos;
     int fd = -1, masterfd;
     bool error = false;
+    bool nomem = false;
+    bool unchanged = false;
+    long old_tags = 0;
+    long dead_tags = 0;
     int init;
     int masterfd_pos;
 
     logf("Building index: %d", index_type);
+    tc_stat.commit_substep = 0;
 
     /* Check the number of entries we need to allocate ram for. */
     commit_entry_count = h->entry_count + 1;
@@ -2877,19 +4492,36 @@ static int build_index(int index_type, struct tagcache_header *h, int tmpfd)
      *     new_seek = tempbuf_find_location(old_seek, ...);
      * and for new tags:
      *     new_seek = tempbuf_find_location(idx);
+     *
+     * If that is not going to fit, the tags are sorted on disk instead
+     * (see extsort_add) and only the locations are kept in memory.
      */
-    lookup = (struct tempbuf_searchidx **)&tempbuf[tempbuf_pos];
     tempbuf_pos += lookup_buffer_depth * sizeof(void **);
-    memset(lookup, 0, lookup_buffer_depth * sizeof(void **));
 
     /* And calculate the remaining data space used mainly for storing
      * tag data (strings). */
-    tempbuf_left = tempbuf_size - tempbuf_pos - 8;
-    if (tempbuf_left - TAGFILE_ENTRY_AVG_LENGTH * commit_entry_count < 0)
+    tempbuf_left = (long)tempbuf_size - tempbuf_pos - 8;
+    if (!TAGCACHE_IS_SORTED(index_type))
+        external = false; /* Nothing to hold in memory. */
+    else if (tempbuf_left - TAGFILE_ENTRY_AVG_LENGTH * commit_entry_count < 0)
+        external = true;
+
+    if (external)
     {
-        logf("Buffer way too small!");
-        close(fd);
-        return 0;
+        logf("Sorting on disk: %d", index_type);
+        int ret = extsort_init(h->entry_count, fd >= 0 ? tch.entry_count : 0);
+        if (ret <= 0)
+        {
+            logf("Buffer way too small!");
+            close(fd);
+            return ret < 0 ? -4 : 0;
+        }
+    }
+    else if (TAGCACHE_IS_SORTED(index_type))
+    {
+        lookup = (struct tempbuf_searchidx **)
+                 &tempbuf[tempbuf_pos - lookup_buffer_depth * sizeof(void **)];
+        memset(lookup, 0, lookup_buffer_depth * sizeof(void **));
     }
 
     if (fd >= 0)
@@ -2910,6 +4542,7 @@ static int build_index(int index_type, struct tagcache_header *h, int tmpfd)
                 switch (read_tagfile_entry_and_tag(fd, &entry, build_idx_buf, build_idx_bufsz))
                 {
                     case e_SUCCESS_LEN_ZERO: /* Skip deleted entries. */
+                        dead_tags++;
                         continue;
                     case e_SUCCESS:
                          break;
@@ -2927,18 +4560,42 @@ static int build_index(int index_type, struct tagcache_header *h, int tmpfd)
                         return -2;
                 }
 
+                /**
+                 * delete_entry() blanks the tags nobody uses anymore. No
+                 * live entry points at them, so leave them out.
+                 */
+                if (build_idx_buf[0] == '\0')
+                {
+                    dead_tags++;
+                    continue;
+                }
+
                 /**
                  * Save the tag and tag id in the memory buffer. Tag id
                  * is saved so we can later reindex the master lookup
                  * table when the index gets resorted.
                  */
-                ret = tempbuf_insert(build_idx_buf, loc/TAGFILE_ENTRY_CHUNK_LENGTH
-                                     + commit_entry_count, entry.idx_id,
-                                     TAGCACHE_IS_UNIQUE(index_type));
+                if (external)
+                    ret = extsort_add(build_idx_buf, loc, entry.idx_id, true);
+                else
+                {
+                    ret = tempbuf_insert(build_idx_buf,
+                                         loc/TAGFILE_ENTRY_CHUNK_LENGTH
+                                         + commit_entry_count, entry.idx_id,
+                                         TAGCACHE_IS_UNIQUE(index_type));
+
+                    /* Keep the location in case the file stays as is. */
+                    if (ret && tempbufidx > old_tags)
+                    {
+                        struct tempbuf_searchidx *index =
+                            (struct tempbuf_searchidx *)tempbuf;
+                        index[old_tags++].seek = loc;
+                    }
+                }
                 if (!ret)
                 {
                     close(fd);
-                    return -3;
+                    return external ? -2 : -3;
                 }
                 do_timed_yield();
             }
@@ -3081,25 +4738,49 @@ static int build_index(int index_type, struct tagcache_header *h, int tmpfd)
             if (user_check_tag(index_type, build_idx_buf))
 #endif /*defined(PLUGIN)*/
             {
-                if (TAGCACHE_IS_UNIQUE(index_type))
-                    error = !tempbuf_insert(build_idx_buf, i, -1, true);
+                long idx_id = TAGCACHE_IS_UNIQUE(index_type) ?
+                              -1 : tcmh.tch.entry_count + i;
+
+                if (external)
+                    error = !extsort_add(build_idx_buf, i, idx_id, false);
                 else
-                    error = !tempbuf_insert(build_idx_buf, i,
-                                            tcmh.tch.entry_count + i, false);
+                    error = !tempbuf_insert(build_idx_buf, i, idx_id,
+                                            TAGCACHE_IS_UNIQUE(index_type));
 
                 if (error)
                 {
                     logf("insert error");
+                    nomem = !external;
                     goto error_exit;
                 }
             }
             /* Skip to next. */
             lseek(tmpfd, entry.data_length - entry.tag_offset[index_type] -
                     entry.tag_length[index_type], SEEK_CUR);
+            set_commit_substep(0, 4, i + 1, h->entry_count);
             do_timed_yield();
         }
         logf("done");
 
+        /**
+         * If all the new tags of a unique index were there already, the
+         * tag file and the locations in the master file stay valid, so
+         * leave them untouched and only add the new entries. Don't do
+         * that while the file holds blanked tags of deleted entries
+         * though, or they would never be compacted away.
+         */
+        unchanged = !external && TAGCACHE_IS_UNIQUE(index_type) &&
+                    old_tags > 0 && dead_tags == 0 &&
+                    tempbufidx == old_tags;
+        if (unchanged)
+        {
+            logf("no new tags");
+            tempbufidx = tch.entry_count;
+        }
+    }
+
+    if (TAGCACHE_IS_SORTED(index_type) && !unchanged)
+    {
         /* Sort the buffer data and write it to the index file. */
         lseek(fd, sizeof(struct tagcache_header), SEEK_SET);
         /**
@@ -3109,10 +4790,17 @@ static int build_index(int index_type, struct tagcache_header *h, int tmpfd)
          */
         ftruncate(fd, lseek(fd, 0, SEEK_CUR));
 
-        i = tempbuf_sort(fd);
+        if (external)
+            i = extsort_finish(fd, TAGCACHE_IS_UNIQUE(index_type));
+        else
+            i = tempbuf_sort(fd);
         if (i < 0)
+        {
+            error = true;
             goto error_exit;
+        }
         logf("sorted %d tags", i);
+        tc_stat.commit_substep = 5;
 
         /**
          * Now update all indexes in the master lookup file.
@@ -3144,7 +4832,7 @@ static int build_index(int index_type, struct tagcache_header *h, int tmpfd)
                     continue;
                 }
 
-                idxbuf[j].tag_seek[index_type] = tempbuf_find_location(
+                idxbuf[j].tag_seek[index_type] = find_location(
                     idxbuf[j].tag_seek[index_type]/TAGFILE_ENTRY_CHUNK_LENGTH
                     + commit_entry_count);
 
@@ -3167,6 +4855,7 @@ static int build_index(int index_type, struct tagcache_header *h, int tmpfd)
                 error = true;
                 goto error_exit;
             }
+            set_commit_substep(5, 9, i + idxbuf_pos, tcmh.tch.entry_count);
         }
         logf("done");
     }
@@ -3254,7 +4943,7 @@ static int build_index(int index_type, struct tagcache_header *h, int tmpfd)
             else
             {
                 /* Locate the correct entry from the sorted array. */
-                idxbuf[j].tag_seek[index_type] = tempbuf_find_location(i + j);
+                idxbuf[j].tag_seek[index_type] = find_location(i + j);
                 if (idxbuf[j].tag_seek[index_type] < 0)
                 {
                     logf("entry not found (%d)", j);
@@ -3264,38 +4953,317 @@ static int build_index(int index_type, struct tagcache_header *h, int tmpfd)
             }
         }
 
-        /* Write index. */
-        if (write_index_entries(masterfd, idxbuf, idxbuf_pos) !=
-            (ssize_t)sizeof(struct index_entry) * idxbuf_pos)
+        /* Write index. */
+        if (write_index_entries(masterfd, idxbuf, idxbuf_pos) !=
+            (ssize_t)sizeof(struct index_entry) * idxbuf_pos)
+        {
+            logf("tagcache: write fail #4");
+            error = true;
+            break ;
+        }
+
+        do_timed_yield();
+    }
+    logf("done");
+
+    /* Finally write the header. */
+    tch.magic = TAGCACHE_MAGIC;
+    tch.entry_count = tempbufidx;
+    tch.datasize = lseek(fd, 0, SEEK_END) - sizeof(struct tagcache_header);
+    lseek(fd, 0, SEEK_SET);
+    write_tagcache_header(fd, &tch);
+
+    if (index_type != tag_filename)
+        h->datasize += tch.datasize;
+    logf("s:%d/%ld/%ld", index_type, tch.datasize, h->datasize);
+    error_exit:
+
+    close(fd);
+    close(masterfd);
+
+    if (error)
+        return nomem ? -3 : -2;
+
+    return 1;
+}
+
+static int build_index(int index_type, struct tagcache_header *h, int tmpfd)
+{
+    int ret = build_index_pass(index_type, h, tmpfd, false);
+
+    /* The estimate was off. Nothing has been sorted into the tag file
+     * yet, so start over sorting on disk. */
+    if (ret == -3)
+    {
+        extsort_close();
+        ret = build_index_pass(index_type, h, tmpfd, true);
+    }
+
+    extsort_close();
+    return ret;
+}
+
+struct inverted_pair {
+    int32_t seek;
+    int32_t idx_id;
+};
+
+static int compare_inverted(const void *p1, const void *p2)
+{
+    const struct inverted_pair *e1 = p1, *e2 = p2;
+
+    if (e1->seek != e2->seek)
+        return e1->seek < e2->seek ? -1 : 1;
+
+    return e1->idx_id - e2->idx_id;
+}
+
+static bool build_inverted_index(int tag, const struct master_header *tcmh,
+                                 int masterfd)
+{
+    struct inverted_pair *pairs = (struct inverted_pair *)tempbuf;
+    struct index_entry idxbuf[IDX_BUF_DEPTH];
+    struct inverted_header hdr;
+    int32_t outbuf[IDX_BUF_DEPTH * 3];
+    int count = 0, keys = 0, outpos;
+    int i, j, fd;
+
+    /* Collect (seek, idx_id) of every live entry. */
+    lseek(masterfd, sizeof(struct master_header), SEEK_SET);
+    for (i = 0; i < tcmh->tch.entry_count && !USR_CANCEL; i += j)
+    {
+        int n = MIN(tcmh->tch.entry_count - i, IDX_BUF_DEPTH);
+
+        if (read_index_entries(masterfd, idxbuf, n) !=
+            (ssize_t)sizeof(struct index_entry) * n)
+        {
+            logf("inverted: read fail");
+            return false;
+        }
+
+        for (j = 0; j < n; j++)
+        {
+            if (idxbuf[j].flag & FLAG_DELETED)
+                continue;
+
+            pairs[count].seek = idxbuf[j].tag_seek[tag];
+            pairs[count].idx_id = i + j;
+            count++;
+        }
+
+        do_timed_yield();
+    }
+
+    if (USR_CANCEL)
+        return false;
+
+    qsort(pairs, count, sizeof(*pairs), compare_inverted);
+
+    for (i = 0; i < count; i++)
+    {
+        if (i == 0 || pairs[i].seek != pairs[i-1].seek)
+            keys++;
+    }
+
+    fd = open_pathfmt(build_idx_buf, build_idx_bufsz,
+                      O_WRONLY | O_CREAT | O_TRUNC,
+                      "%s/" TAGCACHE_FILE_INVERTED, tc_stat.db_path, tag);
+    if (fd < 0)
+    {
+        logf(TAGCACHE_FILE_INVERTED " open fail", tag);
+        return false;
+    }
+
+    /* Mark incomplete until everything has been written. */
+    hdr.tch.magic = TAGCACHE_MAGIC;
+    hdr.tch.entry_count = keys;
+    hdr.tch.datasize = count * sizeof(int32_t);
+    hdr.commitid = -1;
+    if (write_int32s(fd, (int32_t *)&hdr, sizeof(hdr) / sizeof(int32_t)) !=
+        sizeof(hdr))
+        goto write_error;
+
+    /* Key table */
+    outpos = 0;
+    for (i = 0; i < count; i = j)
+    {
+        for (j = i + 1; j < count && pairs[j].seek == pairs[i].seek; j++);
+
+        outbuf[outpos++] = pairs[i].seek;
+        outbuf[outpos++] = i;
+        outbuf[outpos++] = j - i;
+
+        if (outpos == (int)ARRAYLEN(outbuf) || j == count)
+        {
+            if (write_int32s(fd, outbuf, outpos) !=
+                (ssize_t)sizeof(int32_t) * outpos)
+                goto write_error;
+            outpos = 0;
+        }
+    }
+
+    /* Entry lists; pairs are sorted by idx_id within each key. */
+    for (i = 0; i < count; i += outpos)
+    {
+        outpos = MIN(count - i, (int)ARRAYLEN(outbuf));
+
+        for (j = 0; j < outpos; j++)
+            outbuf[j] = pairs[i + j].idx_id;
+
+        if (write_int32s(fd, outbuf, outpos) !=
+            (ssize_t)sizeof(int32_t) * outpos)
+            goto write_error;
+
+        do_timed_yield();
+    }
+
+    hdr.commitid = tcmh->commitid;
+    lseek(fd, 0, SEEK_SET);
+    if (write_int32s(fd, (int32_t *)&hdr, sizeof(hdr) / sizeof(int32_t)) !=
+        sizeof(hdr))
+        goto write_error;
+
+    close(fd);
+    logf("inverted index %d: %d keys, %d entries", tag, keys, count);
+    return true;
+
+write_error:
+    logf("inverted: write fail");
+    close(fd);
+    return false;
+}
+
+/* Build the filename hash table from the tag file of the new commit. If
+ * it can't be built, lookups by filename fall back to a linear scan. */
+static void build_filename_hash(const struct master_header *tcmh)
+{
+    struct hash_slot *slots = (struct hash_slot *)tempbuf;
+    struct tagcache_header tch;
+    struct hash_header hdr;
+    long slot_count = 64;
+    long i;
+    int fd, tagfd;
+
+    remove_db_file(TAGCACHE_FILE_HASH);
+
+    tagfd = open_tag_fd(&tch, tag_filename, false);
+    if (tagfd < 0)
+        return;
+
+    /* Keep the table at most half full. */
+    while (slot_count < 2 * tch.entry_count)
+        slot_count *= 2;
+
+    if (slot_count * sizeof(struct hash_slot) > tempbuf_size)
+    {
+        logf("no room for filename hash");
+        close(tagfd);
+        return;
+    }
+
+    memset(slots, 0, slot_count * sizeof(struct hash_slot));
+    for (i = 0; i < tch.entry_count && !USR_CANCEL; i++)
+    {
+        struct tagfile_entry tfe;
+        long seek = lseek(tagfd, 0, SEEK_CUR);
+        uint32_t crc;
+        long pos;
+
+        switch (read_tagfile_entry_and_tag(tagfd, &tfe, build_idx_buf,
+                                           build_idx_bufsz))
+        {
+            case e_SUCCESS:
+                break;
+            case e_SUCCESS_LEN_ZERO:
+                continue;
+            default:
+                logf("filename hash: read fail");
+                close(tagfd);
+                return;
+        }
+
+        /* Skip deleted entries. */
+        if (build_idx_buf[0] == '\0')
+            continue;
+
+        crc = crc_32(build_idx_buf, strlen(build_idx_buf), 0xffffffff);
+        for (pos = crc & (slot_count - 1); slots[pos].seek != 0;
+             pos = (pos + 1) & (slot_count - 1));
+
+        slots[pos].crc = crc;
+        slots[pos].seek = seek;
+        do_timed_yield();
+    }
+    close(tagfd);
+
+    if (USR_CANCEL)
+        return;
+
+    fd = open_db_fd(TAGCACHE_FILE_HASH, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd < 0)
+        return;
+
+    /* Mark incomplete until everything has been written. */
+    hdr.tch.magic = TAGCACHE_MAGIC;
+    hdr.tch.entry_count = slot_count;
+    hdr.tch.datasize = slot_count * sizeof(struct hash_slot);
+    hdr.commitid = -1;
+    if (write_int32s(fd, (int32_t *)&hdr, sizeof(hdr) / sizeof(int32_t)) !=
+        sizeof(hdr) ||
+        write_int32s(fd, (int32_t *)slots, slot_count * 2) !=
+        (ssize_t)(slot_count * sizeof(struct hash_slot)))
+        goto write_error;
+
+    hdr.commitid = tcmh->commitid;
+    lseek(fd, 0, SEEK_SET);
+    if (write_int32s(fd, (int32_t *)&hdr, sizeof(hdr) / sizeof(int32_t)) !=
+        sizeof(hdr))
+        goto write_error;
+
+    close(fd);
+    logf("filename hash: %ld slots", slot_count);
+    return;
+
+write_error:
+    logf("filename hash: write fail");
+    close(fd);
+    remove_db_file(TAGCACHE_FILE_HASH);
+}
+
+/* Build the inverted indices once the master index is final. Failure is
+ * not fatal; searches then scan the whole master index. */
+static void build_inverted_indices(const struct master_header *tcmh)
+{
+    int masterfd;
+    int tag;
+
+    for (tag = 0; tag < TAG_COUNT; tag++)
+    {
+        if (TAGCACHE_IS_INVERTED(tag))
         {
-            logf("tagcache: write fail #4");
-            error = true;
-            break ;
+            snprintf(build_idx_buf, build_idx_bufsz, "%s/" TAGCACHE_FILE_INVERTED,
+                     tc_stat.db_path, tag);
+            remove(build_idx_buf);
         }
+    }
 
-        do_timed_yield();
+    if (tcmh->tch.entry_count * sizeof(struct inverted_pair) > tempbuf_size)
+    {
+        logf("no room for inverted indices");
+        return;
     }
-    logf("done");
 
-    /* Finally write the header. */
-    tch.magic = TAGCACHE_MAGIC;
-    tch.entry_count = tempbufidx;
-    tch.datasize = lseek(fd, 0, SEEK_END) - sizeof(struct tagcache_header);
-    lseek(fd, 0, SEEK_SET);
-    write_tagcache_header(fd, &tch);
+    masterfd = open_db_fd(TAGCACHE_FILE_MASTER, O_RDONLY);
+    if (masterfd < 0)
+        return;
 
-    if (index_type != tag_filename)
-        h->datasize += tch.datasize;
-    logf("s:%d/%ld/%ld", index_type, tch.datasize, h->datasize);
-    error_exit:
+    for (tag = 0; tag < TAG_COUNT && !USR_CANCEL; tag++)
+    {
+        if (TAGCACHE_IS_INVERTED(tag))
+            build_inverted_index(tag, tcmh, masterfd);
+    }
 
-    close(fd);
     close(masterfd);
-
-    if (error)
-        return -2;
-
-    return 1;
 }
 
 static bool commit(void)
@@ -3434,6 +5402,12 @@ static bool commit(void)
             logf("tagcache failed init");
             if (ret == 0)
                 tc_stat.commit_delayed = true;
+            else if (ret == -4)
+            {
+                /* Retrying with the same buffer can't work, and the
+                   leftover file would keep on triggering it */
+                remove_db_file(TAGCACHE_FILE_TEMP);
+            }
 
             tc_stat.commit_step = 0;
             goto commit_error;
@@ -3472,6 +5446,9 @@ static bool commit(void)
         write_master_header(masterfd, &tcmh);
         close(masterfd);
 
+        build_inverted_indices(&tcmh);
+        build_filename_hash(&tcmh);
+
         logf("tagcache committed");
         tagcache_commit_finalize();
 
@@ -3717,8 +5694,6 @@ static bool write_tag(int fd, const char *tagstr, const char *datastr)
     return true;
 }
 
-#ifndef __PCTOOL__
-
 static bool read_tag(char *dest, long size,
                      const char *src, const char *tagstr)
 {
@@ -3864,10 +5839,57 @@ static int parse_changelog_line(int line_n, char *buf, void *parameters)
     return write_index(masterfd, idx_id, &idx) ? 0 : -5;
 }
 
+/* Move an inverted index or the filename hash that was built for commit
+ * 'old_id' over to the current one. */
+static void restamp_commit_file(int fd, int32_t old_id)
+{
+    struct inverted_header hdr; /* Same layout as struct hash_header */
+
+    if (fd < 0)
+        return;
+
+    if (read_int32s(fd, (int32_t *)&hdr, sizeof(hdr) / sizeof(int32_t)) ==
+        sizeof(hdr) && hdr.tch.magic == TAGCACHE_MAGIC &&
+        hdr.commitid == old_id)
+    {
+        hdr.commitid = current_tcmh.commitid;
+        lseek(fd, 0, SEEK_SET);
+        write_int32s(fd, (int32_t *)&hdr, sizeof(hdr) / sizeof(int32_t));
+    }
+
+    close(fd);
+}
+
+/* The import may raise the commit id, but it only changes numeric tags,
+ * which neither the inverted indices nor the filename hash cover. Keep the
+ * ones that were current in use instead of leaving them stale until the
+ * next commit. */
+static void restamp_commit_files(int32_t old_id)
+{
+    char fname[MAX_PATH];
+    int tag;
+
+    if (old_id == current_tcmh.commitid)
+        return;
+
+    for (tag = 0; tag < TAG_COUNT; tag++)
+    {
+        if (!TAGCACHE_IS_INVERTED(tag))
+            continue;
+
+        restamp_commit_file(open_pathfmt(fname, sizeof(fname), O_RDWR,
+                                         "%s/" TAGCACHE_FILE_INVERTED,
+                                         tc_stat.db_path, tag), old_id);
+    }
+
+    restamp_commit_file(open_db_fd(TAGCACHE_FILE_HASH, O_RDWR), old_id);
+}
+
 bool tagcache_import_changelog(void)
 {
     struct master_header myhdr;
     struct tagcache_header tch;
+    int32_t old_commitid = current_tcmh.commitid;
     int clfd;
     long masterfd;
     char buf[2048];
@@ -3908,6 +5930,8 @@ bool tagcache_import_changelog(void)
         filenametag_fd = -1;
     }
 
+    restamp_commit_files(old_commitid);
+
     write_lock--;
 
     update_master_header();
@@ -3915,8 +5939,6 @@ bool tagcache_import_changelog(void)
     return true;
 }
 
-#endif /* !__PCTOOL__ */
-
 bool tagcache_create_changelog(struct tagcache_search *tcs)
 {
     struct master_header myhdr;
@@ -3961,7 +5983,8 @@ bool tagcache_create_changelog(struct tagcache_search *tcs)
 
     for (i = 0; i < myhdr.tch.entry_count; i++)
     {
-        if (read_index_entries(tcs->masterfd, &idx, 1) != sizeof(struct index_entry))
+        /* tagcache_retrieve() below moves the file position */
+        if (!read_master_entry(tcs->masterfd, i, &idx))
         {
             logf("read error #9");
             tagcache_search_finish(tcs);
@@ -4017,7 +6040,7 @@ static bool delete_entry(long idx_id)
 #ifdef HAVE_TC_RAMCACHE
     /* At first mark the entry removed from ram cache. */
     if (tc_stat.ramcache)
-        tcramcache.hdr->indices[idx_id].flag |= FLAG_DELETED;
+        tcrc_flag(idx_id) |= FLAG_DELETED;
 #endif
 
     if ( (masterfd = open_master_fd(&myhdr, true) ) < 0)
@@ -4056,7 +6079,10 @@ static bool delete_entry(long idx_id)
 #ifdef HAVE_TC_RAMCACHE
         /* Use RAM DB if available for greater speed */
         if (tc_stat.ramcache)
-            idxp = &tcramcache.hdr->indices[i];
+        {
+            tcrc_get_index(i, &idx);
+            idxp = &idx;
+        }
         else
 #endif
         {
@@ -4099,7 +6125,7 @@ static bool delete_entry(long idx_id)
         if (tc_stat.ramcache && tag != tag_filename)
         {
             struct tagfile_entry *tfe;
-            int32_t *seek = &tcramcache.hdr->indices[idx_id].tag_seek[tag];
+            int32_t *seek = &tcrc_seek(idx_id, tag);
 
             /* crc_32 is assumed not to yield (why would it...?) */
             tfe = (struct tagfile_entry *)&tcramcache.hdr->tags[tag][*seek];
@@ -4425,8 +6451,15 @@ static bool load_tagcache(void)
     current_tcmh = tcmh;
 
     /* Load the master index table. */
+    tcramcache.hdr->index_count = tcmh.tch.entry_count;
+    tcramcache.hdr->columnar = tcmh.tch.entry_count >= TAGCACHE_RAM_COLUMNS_MIN;
+    logf("master index layout: %s",
+         tcramcache.hdr->columnar ? "columns" : "entries");
+
     for (int i = 0; i < tcmh.tch.entry_count; i++)
     {
+        struct index_entry idx;
+
         bytesleft -= sizeof(struct index_entry);
         if (bytesleft < 0)
         {
@@ -4434,12 +6467,18 @@ static bool load_tagcache(void)
             goto failure;
         }
 
-        int rc = read_index_entries(fd, &tcramcache.hdr->indices[i], 1);
+        int rc = read_index_entries(fd, &idx, 1);
         if (rc != sizeof (struct index_entry))
         {
             logf("read error #10");
             goto failure;
         }
+
+        for (int field = 0; field < TCRC_FIELDS; field++)
+        {
+            *tcrc_field(i, field) = field == TCRC_FIELD_FLAG ?
+                idx.flag : idx.tag_seek[field];
+        }
     }
 
     close(fd);
@@ -4503,7 +6542,6 @@ static bool load_tagcache(void)
             }
 
             int idx_id = fe->idx_id; /* dircache reference clobbers *fe */
-            struct index_entry *idx = &tcramcache.hdr->indices[idx_id];
 
             if (idx_id != -1 || tag == tag_filename) /* filename NOT optional */
             {
@@ -4513,11 +6551,11 @@ static bool load_tagcache(void)
                     goto failure;
                 }
 
-                if (idx->tag_seek[tag] != pos)
+                if (tcrc_seek(idx_id, tag) != pos)
                 {
                     logf("corrupt data structures!:");
                     logf("  tag_seek[%d]=%ld:pos=%ld", tag,
-                         idx->tag_seek[tag], pos);
+                         (long)tcrc_seek(idx_id, tag), pos);
                     goto failure;
                 }
             }
@@ -4528,7 +6566,7 @@ static bool load_tagcache(void)
             if (tag == tag_filename)
             {
             #ifdef HAVE_DIRCACHE
-                if (idx->flag & FLAG_DIRCACHE)
+                if (tcrc_flag(idx_id) & FLAG_DIRCACHE)
                 {
                     /* This flag must not be used yet. */
                     logf("internal error!");
@@ -4549,7 +6587,7 @@ static bool load_tagcache(void)
                     goto failure;
                 }
 
-                if ((idx->flag & FLAG_DELETED)
+                if ((tcrc_flag(idx_id) & FLAG_DELETED)
                     IFN_DIRCACHE( || !global_settings.tagcache_autoupdate ))
                 {
                     /* seek over tag data instead of reading */
@@ -4617,6 +6655,358 @@ failure:
 }
 #endif /* HAVE_TC_RAMCACHE */
 
+/**
+ * Directory state of the last completed scan. A directory whose mtime and
+ * listing (names, mtimes and sizes of its entries) are unchanged since
+ * then has all its files in the database already, so the scan doesn't
+ * need to look them up again and the deleted files check can skip them.
+ * Subdirectories are still visited since a change deep down a tree
+ * doesn't show up in the listing of its parents.
+ */
+struct dir_record {
+    uint32_t path_crc;  /* crc32 of the directory path */
+    uint32_t mtime;     /* mtime of the directory */
+    uint32_t sig;       /* Sum of the hashes of its entries */
+    uint16_t count;     /* Number of entries */
+    uint16_t flags;
+};
+
+/* Set on a record of the last scan if the directory is still unchanged. */
+#define DIR_RECORD_UNCHANGED 0x1
+/* Set on a record if some files of the directory failed to be added, so
+ * the next scan tries them again. */
+#define DIR_RECORD_FAILED    0x2
+
+/* Directories with failed files kept in memory until the end of a scan.
+ * If there are more, the records of the scan are dropped. */
+#define DIRSCAN_MAX_FAILED 16
+
+static struct {
+    struct dir_record *old; /* Records of the last scan, by path_crc */
+    long old_count;
+#ifndef __PCTOOL__
+    int handle;
+#endif
+    int fd;                 /* Records of this scan */
+    long new_count;
+    uint32_t failed[DIRSCAN_MAX_FAILED]; /* path_crc of dirs with failures */
+    int failed_count;
+} dirscan = { .fd = -1 };
+
+static int NO_INLINE rename_db_file(const char* oldname, const char* newname)
+{
+    char oldpath[MAX_PATH];
+    char newpath[MAX_PATH];
+
+    snprintf(oldpath, sizeof(oldpath), "%s/%s", tc_stat.db_path, oldname);
+    snprintf(newpath, sizeof(newpath), "%s/%s", tc_stat.db_path, newname);
+
+    return rename(oldpath, newpath);
+}
+
+static int compare_dir_records(const void *p1, const void *p2)
+{
+    const struct dir_record *r1 = (const struct dir_record *)p1;
+    const struct dir_record *r2 = (const struct dir_record *)p2;
+
+    if (r1->path_crc == r2->path_crc)
+        return 0;
+
+    return r1->path_crc < r2->path_crc ? -1 : 1;
+}
+
+static void dirscan_free(void)
+{
+#ifdef __PCTOOL__
+    free(dirscan.old);
+#else
+    if (dirscan.handle > 0)
+        dirscan.handle = core_free(dirscan.handle);
+#endif
+    dirscan.old = NULL;
+    dirscan.old_count = 0;
+}
+
+/* Load the records of the last scan. Without them every directory is
+ * treated as changed. */
+static void dirscan_load(void)
+{
+    struct tagcache_header hdr;
+    size_t size;
+    int fd;
+
+    dirscan_free();
+
+    fd = open_db_fd(TAGCACHE_FILE_DIRS, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    /* Records are in native byte order, others are just ignored. */
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        hdr.magic != TAGCACHE_MAGIC || hdr.entry_count <= 0 ||
+        hdr.datasize != hdr.entry_count * (long)sizeof(struct dir_record))
+    {
+        logf("dirscan: bad header");
+        close(fd);
+        return;
+    }
+
+    size = hdr.datasize;
+#ifdef __PCTOOL__
+    dirscan.old = malloc(size);
+#else
+    dirscan.handle = core_alloc_ex(size, &buflib_ops_locked);
+    if (dirscan.handle > 0)
+        dirscan.old = core_get_data(dirscan.handle);
+#endif
+    if (dirscan.old == NULL)
+    {
+        logf("dirscan: no memory for %ld dirs", (long)hdr.entry_count);
+        dirscan_free();
+        close(fd);
+        return;
+    }
+
+    if (read(fd, dirscan.old, size) != (ssize_t)size)
+    {
+        logf("dirscan: read error");
+        dirscan_free();
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    dirscan.old_count = hdr.entry_count;
+    qsort(dirscan.old, dirscan.old_count, sizeof(struct dir_record),
+          compare_dir_records);
+    logf("dirscan: %ld dirs", dirscan.old_count);
+}
+
+static struct dir_record *dirscan_find(uint32_t path_crc)
+{
+    long lo = 0, hi = dirscan.old_count;
+
+    while (lo < hi)
+    {
+        long mid = (lo + hi) / 2;
+
+        if (dirscan.old[mid].path_crc == path_crc)
+            return &dirscan.old[mid];
+
+        if (dirscan.old[mid].path_crc < path_crc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return NULL;
+}
+
+/* Start recording the directories, with use_old only if the database
+ * still holds the files of the last scan. */
+static void dirscan_begin(bool use_old)
+{
+    struct tagcache_header hdr;
+
+    if (use_old)
+        dirscan_load();
+    else
+        dirscan_free();
+
+    dirscan.new_count = 0;
+    dirscan.failed_count = 0;
+    dirscan.fd = open_db_fd(TAGCACHE_FILE_DIRS_TEMP,
+                            O_RDWR | O_CREAT | O_TRUNC);
+    if (dirscan.fd < 0)
+        return;
+
+    /* Write the header (write real values later). */
+    memset(&hdr, 0, sizeof(hdr));
+    write(dirscan.fd, &hdr, sizeof(hdr));
+}
+
+/* Flag the records of the directories that had failed files. */
+static bool dirscan_flag_failed(void)
+{
+    struct dir_record rec;
+    long i;
+    int j;
+
+    lseek(dirscan.fd, sizeof(struct tagcache_header), SEEK_SET);
+    for (i = 0; i < dirscan.new_count; i++)
+    {
+        if (read(dirscan.fd, &rec, sizeof(rec)) != sizeof(rec))
+            return false;
+
+        for (j = 0; j < dirscan.failed_count; j++)
+        {
+            if (dirscan.failed[j] == rec.path_crc)
+                break;
+        }
+
+        if (j == dirscan.failed_count)
+            continue;
+
+        rec.flags |= DIR_RECORD_FAILED;
+        lseek(dirscan.fd, -(off_t)sizeof(rec), SEEK_CUR);
+        if (write(dirscan.fd, &rec, sizeof(rec)) != sizeof(rec))
+            return false;
+    }
+
+    return true;
+}
+
+/* Keep the records of this scan for the next one if it was committed. */
+static void dirscan_end(bool committed)
+{
+    struct tagcache_header hdr;
+
+    if (dirscan.fd < 0)
+        return;
+
+    /* Too many failures to track, make the next scan a full one. */
+    if (dirscan.failed_count < 0)
+    {
+        remove_db_file(TAGCACHE_FILE_DIRS);
+        committed = false;
+    }
+    else if (committed && dirscan.failed_count > 0)
+        committed = dirscan_flag_failed();
+
+    hdr.magic = TAGCACHE_MAGIC;
+    hdr.datasize = dirscan.new_count * sizeof(struct dir_record);
+    hdr.entry_count = dirscan.new_count;
+    lseek(dirscan.fd, 0, SEEK_SET);
+    committed = committed &&
+                write(dirscan.fd, &hdr, sizeof(hdr)) == sizeof(hdr);
+    close(dirscan.fd);
+    dirscan.fd = -1;
+
+    if (!committed || rename_db_file(TAGCACHE_FILE_DIRS_TEMP,
+                                     TAGCACHE_FILE_DIRS) < 0)
+        remove_db_file(TAGCACHE_FILE_DIRS_TEMP);
+}
+
+static inline uint32_t dirscan_path_crc(const char *path, size_t len)
+{
+    return crc_32(path, len, 0xffffffff);
+}
+
+/**
+ * Check if the files of dirname have changed since the last scan and
+ * record its state for the next one.
+ */
+static bool NO_INLINE dirscan_changed(const char *dirname, time_t mtime)
+{
+    struct dir_record rec;
+    struct dir_record *old;
+    struct dirent *entry;
+    long count = 0;
+    size_t len;
+    DIR *dir;
+
+    if (dirscan.fd < 0)
+        return true;
+
+    dir = opendir(dirname);
+    if (!dir)
+        return true;
+
+    /* Same as the parent path of its files, see dirscan_file_unchanged(). */
+    len = strlen(dirname);
+    while (len > 1 && dirname[len - 1] == '/')
+        len--;
+
+    rec.path_crc = dirscan_path_crc(dirname, len);
+    rec.mtime = mtime;
+    rec.sig = 0;
+    rec.flags = 0;
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        struct dirinfo info;
+        uint32_t hash;
+
+        if (is_dotdir_name(entry->d_name))
+            continue;
+
+        info = dir_get_info(dir, entry);
+        hash = crc_32(entry->d_name, strlen(entry->d_name), 0xffffffff);
+
+        /* Subdirectories are checked on their own. */
+        if (info.attribute & ATTR_DIRECTORY)
+            hash = ~hash;
+        else
+        {
+            uint32_t stat[2] = { info.mtime, info.size };
+            hash = crc_32(stat, sizeof(stat), hash);
+        }
+
+        rec.sig += hash;
+        count++;
+    }
+    closedir(dir);
+
+    rec.count = count;
+    old = dirscan_find(rec.path_crc);
+    if (old && old->mtime == rec.mtime && old->sig == rec.sig &&
+        old->count == rec.count && count <= 0xffff &&
+        !(old->flags & DIR_RECORD_FAILED))
+    {
+        old->flags |= DIR_RECORD_UNCHANGED;
+    }
+    else
+        old = NULL;
+
+    if (write(dirscan.fd, &rec, sizeof(rec)) == sizeof(rec))
+        dirscan.new_count++;
+    else
+    {
+        close(dirscan.fd);
+        dirscan.fd = -1;
+        remove_db_file(TAGCACHE_FILE_DIRS_TEMP);
+    }
+
+    return old == NULL;
+}
+
+/* Note that path could not be added, so its directory is scanned again
+ * next time. */
+static void dirscan_file_failed(const char *path)
+{
+    const char *sep = strrchr(path, '/');
+    uint32_t path_crc;
+    int i;
+
+    if (dirscan.fd < 0 || dirscan.failed_count < 0 || sep == NULL)
+        return;
+
+    path_crc = dirscan_path_crc(path, MAX(sep - path, 1));
+    for (i = 0; i < dirscan.failed_count; i++)
+    {
+        if (dirscan.failed[i] == path_crc)
+            return;
+    }
+
+    if (dirscan.failed_count < DIRSCAN_MAX_FAILED)
+        dirscan.failed[dirscan.failed_count++] = path_crc;
+    else
+        dirscan.failed_count = -1; /* Too many, rescan everything */
+}
+
+/* Check if a file is in a directory found unchanged by the last scan. */
+static bool dirscan_file_unchanged(const char *path)
+{
+    const char *sep = strrchr(path, '/');
+    struct dir_record *rec;
+
+    if (dirscan.old == NULL || sep == NULL)
+        return false;
+
+    rec = dirscan_find(dirscan_path_crc(path, MAX(sep - path, 1)));
+    return rec && (rec->flags & DIR_RECORD_UNCHANGED);
+}
+
 static bool check_file_refs(bool auto_update)
 {
     int fd;
@@ -4675,13 +7065,21 @@ static bool check_file_refs(bool auto_update)
                 continue;
         }
 
+        /* delete_entry() blanked the name, the entry is already gone. */
+        if (buf[0] == '\0')
+            continue;
+
+        /* The files of unchanged directories are still there. */
+        if (auto_update && dirscan_file_unchanged(buf))
+            continue;
+
         int idx_id = tfe.idx_id; /* dircache reference clobbers *tfe */
 #ifdef HAVE_DIRCACHE
-        struct index_entry *idx = &tcramcache.hdr->indices[idx_id];
+        int32_t *flag = &tcrc_flag(idx_id);
         unsigned int searchflag;
         if (!auto_update)
         {
-            if(idx->flag & FLAG_DIRCACHE) /* already found */
+            if(*flag & FLAG_DIRCACHE) /* already found */
             {
                 continue;
             }
@@ -4697,7 +7095,7 @@ static bool check_file_refs(bool auto_update)
 
         if (rc_cache > 0)           /* in cache and we have fileref */
         {
-            idx->flag |= FLAG_DIRCACHE;
+            *flag |= FLAG_DIRCACHE;
         }
         else if (rc_cache == 0)     /* not in cache but okay */
         {;}
@@ -4728,7 +7126,11 @@ wend_finished:
 
 static bool check_deleted_files(void)
 {
-    return check_file_refs(true);
+    bool ret = check_file_refs(true);
+
+    /* Only valid right after the scan. */
+    dirscan_free();
+    return ret;
 }
 
 /* Note that this function must not be inlined, otherwise the whole point
@@ -4864,9 +7266,10 @@ static int free_search_roots(struct search_roots_ll * start)
 #define free_search_roots(a) do {} while(0)
 #endif
 
-static bool check_dir(const char *dirname, int add_files)
+static bool check_dir(const char *dirname, int add_files, time_t mtime)
 {
     int success = false;
+    bool scan_files;
 
     DIR *dir = opendir(dirname);
     if (!dir)
@@ -4883,6 +7286,9 @@ static bool check_dir(const char *dirname, int add_files)
     if (ignore != unignore)
         add_files = unignore;
 
+    /* Files of an unchanged directory are in the database already. */
+    scan_files = add_files && dirscan_changed(dirname, mtime);
+
     /* Recursively scan the dir. */
     while (!check_event_queue())
     {
@@ -4911,14 +7317,22 @@ static bool check_dir(const char *dirname, int add_files)
                 add_search_root(curpath);
             else
 #endif /* SIMULATOR */
-                check_dir(curpath, add_files);
+                check_dir(curpath, add_files, info.mtime);
         }
-        else if (add_files)
+        else if (scan_files)
         {
             tc_stat.curentry = curpath;
 
             /* Add a new entry to the temporary db file. */
-            add_tagcache(curpath, info.mtime);
+            if (check_new_file(curpath, info.mtime))
+            {
+#ifdef __PCTOOL__
+                if (scan_hooks)
+                    scan_hooks->queue_file(curpath, info.mtime);
+                else
+#endif
+                add_tagcache(curpath, info.mtime, NULL);
+            }
 
             /* Wait until current path for debug screen is read and unset. */
             while (tc_stat.syncscreen && tc_stat.curentry != NULL)
@@ -4981,6 +7395,9 @@ void do_tagcache_build(const char *path[])
     }
 
     filenametag_fd = open_tag_fd(&header, tag_filename, false);
+    if (filenametag_fd >= 0)
+        filenamehash_fd = open_hash_fd(&filenamehash_slots);
+    dirscan_begin(filenametag_fd >= 0);
 
     cpu_boost(true);
 
@@ -5057,8 +7474,13 @@ void do_tagcache_build(const char *path[])
     {
         logf("Search root %s", this->path);
         strmemccpy(curpath, this->path, sizeof(curpath));
-        ret = ret && check_dir(this->path, true);
+        ret = ret && check_dir(this->path, true, 0);
     }
+#ifdef __PCTOOL__
+    /* Add the files still being parsed by the database tool. */
+    if (scan_hooks)
+        scan_hooks->flush();
+#endif
     free_search_roots(&roots_ll[0]);
 
     /* Write the header. */
@@ -5075,9 +7497,16 @@ void do_tagcache_build(const char *path[])
         filenametag_fd = -1;
     }
 
+    if (filenamehash_fd >= 0)
+    {
+        close(filenamehash_fd);
+        filenamehash_fd = -1;
+    }
+
     if (!ret)
     {
         logf("Aborted.");
+        dirscan_end(false);
         cpu_boost(false);
         return ;
     }
@@ -5086,13 +7515,15 @@ void do_tagcache_build(const char *path[])
 #ifdef __PCTOOL__
     allocate_tempbuf();
 #endif
-    if (commit())
+    ret = commit();
+    if (ret)
     {
         logf("tagcache built!");
     }
 #ifdef __PCTOOL__
     free_tempbuf();
 #endif
+    dirscan_end(ret);
 
 #ifdef HAVE_TC_RAMCACHE
     if (tcramcache.hdr)
@@ -5254,7 +7685,10 @@ static void tagcache_thread(void)
                     if (global_settings.tagcache_ram == TAGCACHE_RAM_ON)
                         check_file_refs(global_settings.tagcache_autoupdate);
                     if (tc_stat.ramcache && global_settings.tagcache_autoupdate)
+                    {
                         tagcache_build();
+                        dirscan_free();
+                    }
                 }
                 else
 #endif /* HAVE_RC_RAMCACHE */
@@ -5284,6 +7718,8 @@ static void tagcache_thread(void)
                 logf("USB: TagCache");
                 usb_acknowledge(SYS_USB_CONNECTED_ACK);
                 usb_wait_for_disconnect(&tagcache_queue);
+                /* The files may have been replaced from the host. */
+                master_cache_invalidate();
                 break ;
         }
     }
@@ -5440,10 +7876,14 @@ bool tagcache_is_in_ram(void)
 #endif
 int tagcache_get_commit_step(void)
 {
-    return tc_stat.commit_step;
+    if (tc_stat.commit_step <= 0)
+        return tc_stat.commit_step;
+
+    return (tc_stat.commit_step - 1) * TAGCACHE_COMMIT_SUBSTEPS
+           + tc_stat.commit_substep + 1;
 }
 int tagcache_get_max_commit_step(void)
 {
-    return (int)(SORTED_TAGS_COUNT)+1;
+    return ((int)(SORTED_TAGS_COUNT)+1) * TAGCACHE_COMMIT_SUBSTEPS;
 }
 #endif /*!defined(PLUGIN)*/
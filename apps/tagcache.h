@@ -50,6 +50,8 @@ enum tag_type { tag_artist = 0, tag_album, tag_genre, tag_title,
 
 #define TAGCACHE_MAX_FILTERS 4
 #define TAGCACHE_MAX_CLAUSES 32
+/* Operands of the "oneof" style clauses that can be pre-split per search. */
+#define TAGCACHE_MAX_CLAUSE_ITEMS 32
 
 /* Tag to be used on untagged files. */
 #define UNTAGGED "<Untagged>"
@@ -99,6 +101,8 @@ struct tagcache_stat {
     int  queue_length;       /* Command queue length */
 
     //const char *uimessage;   /* Pending error message. Implement soon. */
+
+    int  commit_substep;     /* Progress within the commit step */
 };
 
 enum source_type {source_constant, 
@@ -118,12 +122,53 @@ struct tagcache_search_clause
     char *str;
 };
 
+/* A clause compiled for evaluation, see tagcache_search_add_clause(). */
+struct tagcache_clause_op {
+    uint8_t clause;     /* Index of the clause in the clause list */
+    uint8_t tag;        /* Tag to read (filename for basename clauses) */
+    uint8_t cost;       /* Relative cost of the comparison itself */
+    uint8_t group_end;  /* First op after the OR group of this clause */
+    uint8_t item;       /* First operand item, see below */
+    uint8_t item_count; /* Number of operand items, 0 if not pre-split */
+};
+
+/* One '|' separated part of a string clause operand. */
+struct tagcache_clause_item {
+    uint16_t offset;
+    uint16_t len;
+};
+
+/* Clauses reordered inside their OR groups so that the cheap numeric checks
+   run before any tag string has to be read. */
+struct tagcache_clause_plan {
+    struct tagcache_clause_op op[TAGCACHE_MAX_CLAUSES];
+    struct tagcache_clause_item item[TAGCACHE_MAX_CLAUSE_ITEMS];
+    uint8_t op_count;
+    uint8_t item_count;
+    uint8_t group_start; /* First op of the OR group being added to */
+    bool empty_group;    /* An empty OR group matches every entry */
+};
+
 struct tagcache_seeklist_entry {
     int32_t seek;
     int32_t flag;
     int32_t idx_id;
 };
 
+/* Position in the results of a search, see tagcache_search_checkpoint(). */
+struct tagcache_checkpoint {
+    long position;
+    int seek_pos;
+    int seek_list_start;   /* seek_pos the seek list was built from */
+    int seek_list_count;
+    int list_position;
+    int entry_count;
+    int unique_list_count;
+    int unique_list_start; /* unique_list_count before the seek list */
+    int32_t commitid;
+    bool ramsearch;
+};
+
 struct tagcache_search {
     /* For internal use only. */
     int fd, masterfd;
@@ -155,6 +200,15 @@ struct tagcache_search {
     int result_len;      /* Length of the result including \0 */
     int32_t result_seek; /* Current position in the tag data. */
     int32_t idx_id;      /* Entry number in the master index. */
+
+    /* For internal use only. */
+    int inverted_fd;       /* Inverted index used for the filters (or -1) */
+    int32_t inverted_pos;  /* File position of its entry list */
+    int inverted_count;    /* Entries in the list */
+    bool inverted_checked;
+    struct tagcache_clause_plan plan;
+    int seek_list_start;
+    int unique_list_start;
 };
 
 #ifdef __PCTOOL__
@@ -162,6 +216,18 @@ void tagcache_reverse_scan(void);
 /* call this directly instead of tagcache_build in order to not pull
  * on global_settings */
 void do_tagcache_build(const char *path[]);
+
+/* Lets the database tool parse files ahead of the scan. Every new or
+ * modified file found is passed to queue_file() instead of being added
+ * directly. The tool hands each one back with tagcache_add_file() in the
+ * order it was queued, all of them before flush() returns. id3 is the
+ * parsed metadata, or NULL to have the file parsed again. */
+struct tagcache_scan_hooks {
+    void (*queue_file)(const char *path, unsigned long mtime);
+    void (*flush)(void);
+};
+void tagcache_set_scan_hooks(const struct tagcache_scan_hooks *hooks);
+void tagcache_add_file(char *path, unsigned long mtime, struct mp3entry *id3);
 #endif
 
 const char* tagcache_tag_to_str(int tag);
@@ -177,6 +243,10 @@ bool tagcache_search_add_filter(struct tagcache_search *tcs,
 bool tagcache_search_add_clause(struct tagcache_search *tcs,
                                 struct tagcache_search_clause *clause);
 bool tagcache_get_next(struct tagcache_search *tcs, char *buf, long size);
+void tagcache_search_checkpoint(const struct tagcache_search *tcs,
+                                struct tagcache_checkpoint *cp);
+bool tagcache_search_resume(struct tagcache_search *tcs,
+                            const struct tagcache_checkpoint *cp);
 bool tagcache_retrieve(struct tagcache_search *tcs, int idxid, 
                        int tag, char *buf, long size);
 void tagcache_search_finish(struct tagcache_search *tcs);
@@ -210,6 +210,15 @@ static int rootmenu;
 static int current_offset;
 static int current_entry_count;
 
+/* Search positions every checkpoint_interval results into the current list,
+ * so that loading another part of it doesn't fetch it again from the start.
+ * The interval doubles whenever the checkpoints run out. */
+#define MAX_CHECKPOINTS 64
+#define CHECKPOINT_INTERVAL_MIN 32
+static struct tagcache_checkpoint checkpoints[MAX_CHECKPOINTS];
+static int checkpoint_count;
+static int checkpoint_interval;
+
 static struct tree_context *tc;
 
 static int max_history_level; /* depth of menu levels with applicable history */
@@ -1507,6 +1516,28 @@ static void tcs_get_basename(struct tagcache_search *tcs, bool is_basename)
     }
 }
 
+static void add_checkpoint(struct tagcache_search *tcs, int result_count)
+{
+    int i;
+
+    if (result_count % checkpoint_interval != 0 ||
+        result_count / checkpoint_interval != checkpoint_count + 1)
+        return;
+
+    if (checkpoint_count == MAX_CHECKPOINTS)
+    {
+        /* Keep every other one. This result isn't on the new interval. */
+        for (i = 0; i < MAX_CHECKPOINTS / 2; i++)
+            checkpoints[i] = checkpoints[i * 2 + 1];
+
+        checkpoint_count = MAX_CHECKPOINTS / 2;
+        checkpoint_interval *= 2;
+        return;
+    }
+
+    tagcache_search_checkpoint(tcs, &checkpoints[checkpoint_count++]);
+}
+
 static int retrieve_entries(struct tree_context *c, int offset, bool init)
 {
     logf( "%s", __func__);
@@ -1517,6 +1548,7 @@ static int retrieve_entries(struct tree_context *c, int offset, bool init)
     int i;
     int namebufused = 0;
     int total_count = 0;
+    int result_count = 0;
     int special_entry_count = 0;
     int level = c->currextra;
     int tag;
@@ -1650,8 +1682,32 @@ static int retrieve_entries(struct tree_context *c, int offset, bool init)
         total_count += 2;
     }
 
+    if (init)
+    {
+        checkpoint_count = 0;
+        checkpoint_interval = CHECKPOINT_INTERVAL_MIN;
+    }
+    else
+    {
+        /* Skip ahead to the last checkpoint before the offset */
+        i = MIN((offset - total_count) / checkpoint_interval,
+                checkpoint_count);
+        if (i > 0)
+        {
+            if (tagcache_search_resume(&tcs, &checkpoints[i - 1]))
+            {
+                result_count = i * checkpoint_interval;
+                total_count += result_count;
+            }
+            else
+                checkpoint_count = 0;
+        }
+    }
+
     while (tagcache_get_next(&tcs, tcs_buf, tcs_bufsz))
     {
+        add_checkpoint(&tcs, ++result_count);
+
         if (total_count++ < offset)
             continue;
 
@@ -1798,6 +1854,8 @@ entry_skip_formatter:
 
     while (tagcache_get_next(&tcs, tcs_buf, tcs_bufsz))
     {
+        add_checkpoint(&tcs, ++result_count);
+
         if (!show_search_progress(false, total_count, 0, 0))
             break;
         total_count++;
@@ -154,6 +154,7 @@ enum
 #define DC_MAX_NAME       (UINT8_MAX+NAMELEN_ADJ)
 #define CE_NAMESIZE(len)  ((len)+NAMELEN_ADJ)
 #define NAMESIZE_CE(size) ((size)-NAMELEN_ADJ)
+#define ENTRY_SERIAL_BITS 12
 
 /* Throw some warnings if about the limits if things may not work */
 #if MAX_COMPNAME > UINT8_MAX+5
@@ -164,6 +165,10 @@ enum
 #warning Names may not be addressable with 24 bits
 #endif
 
+#if DIRCACHE_LIMIT/16 > (1 << 19)-1
+#warning Parent indexes may not fit in 20 bits
+#endif
+
 /* data structure used by cache entries */
 struct dircache_entry
 {
@@ -172,7 +177,8 @@ struct dircache_entry
     int         down;              /* first at child level (if directory) */
     file_size_t filesize;          /* size of file in bytes (if file) */
     };
-    int         up;                /* parent index (-volume-1 if root) */
+    signed int  up           : 20; /* parent index (-volume-1 if root) */
+    uint32_t    serialnum    : ENTRY_SERIAL_BITS; /* (0 if free) */
     union {
     struct {
     uint32_t    name         : 24; /* indirect storage (.tinyname == 0) */
@@ -192,7 +198,6 @@ struct dircache_entry
 #else
     time_t      mtime;             /* file last-modified time */
 #endif
-    dc_serial_t serialnum;         /* entry serial number */
 };
 
 /* spare us some tedium */
@@ -212,9 +217,7 @@ static struct dircache
     size_t       sizeused;            /* bytes of .size bytes actually used */
     union {
     unsigned int numentries;          /* entry count (including holes) */
-#ifdef HAVE_EEPROM_SETTINGS
     size_t       sizeentries;         /* used when persisting */
-#endif
     };
     int          names;               /* index of first name in name block */
     size_t       sizenames;           /* size of all names (including holes) */
@@ -294,7 +297,6 @@ static struct dircache_runinfo
 #define DIRCACHE_STUFFED(reserve_used) \
     ((reserve_used) > 3*DIRCACHE_RESERVE / 4)
 
-#ifdef HAVE_EEPROM_SETTINGS
 /**
  * remove the snapshot file
  */
@@ -310,7 +312,6 @@ static int open_dircache_file(int oflag)
 {
     return open(DIRCACHE_FILE, oflag, 0666);
 }
-#endif /* HAVE_EEPROM_SETTINGS */
 
 #ifdef DIRCACHE_DUMPSTER
 /**
@@ -558,6 +559,17 @@ static dc_serial_t next_serialnum(void)
     return serialnum;
 }
 
+/**
+ * generate the serial number that follows the one last used by an entry; these
+ * only tell apart the successive users of the same index, so that they fit in
+ * the entry
+ */
+static dc_serial_t next_entry_serialnum(dc_serial_t serialnum)
+{
+    serialnum = (serialnum + 1) & ((1u << ENTRY_SERIAL_BITS) - 1);
+    return MAX(serialnum, 1);
+}
+
 /**
  * return the dircache volume pointer for the special index
  */
@@ -737,6 +749,20 @@ static void entry_name_copy(char *dst, const struct dircache_entry *ce)
     *dst = '\0';
 }
 
+/**
+ * is the entry a "." or ".." directory entry?
+ */
+static bool is_dotdir_entry(const struct dircache_entry *ce)
+{
+    char name[MAX_TINYNAME+1];
+
+    if (!ce->tinyname)
+        return false; /* too long */
+
+    entry_name_copy(name, ce);
+    return is_dotdir_name(name);
+}
+
 /**
  * set the namesfree hint to a new position
  */
@@ -944,20 +970,24 @@ static int entry_reassign_name(struct dircache_entry *ce,
 static int alloc_entry(struct dircache_entry **res)
 {
     struct dircache_entry *ce;
+    dc_serial_t serialnum;
     int idx = dircache.free_list;
 
     if (idx)
     {
-        /* reuse a freed entry */
+        /* reuse a freed entry; it kept its last serial number */
         ce = get_entry(idx);
         dircache.free_list = ce->next;
+        serialnum = ce->down;
     }
     else if (dircache_buf_remaining() > ENTRYSIZE)
     {
-        /* allocate a new one */
+        /* allocate a new one; start it off from the cache-wide sequence so
+           that references from before a reset don't match the new user */
         idx = ++dircache.numentries;
         dircache.size += ENTRYSIZE;
         ce = get_entry(idx);
+        serialnum = next_serialnum();
     }
     else
     {
@@ -973,7 +1003,7 @@ static int alloc_entry(struct dircache_entry **res)
     ce->down      = 0;
     ce->tinyname  = 1;
     ce->frontier  = FRONTIER_SETTLED;
-    ce->serialnum = next_serialnum();
+    ce->serialnum = next_entry_serialnum(serialnum);
 
     *res = ce;
     return idx;
@@ -997,7 +1027,8 @@ static void free_orphan_entry(struct dircache_runinfo_volume *dcrivolp,
             if (p == dcrivolp->queued0)
                 break;
 
-            if (ce->serialnum == p->info.dcfile.serialnum)
+            if (p->info.dcfile.idx == idx &&
+                p->info.dcfile.serialnum == ce->serialnum)
             {
                 binding_dissolve(prevp, p);
                 break;
@@ -1009,7 +1040,9 @@ static void free_orphan_entry(struct dircache_runinfo_volume *dcrivolp,
 
     entry_unassign_name(ce);
 
-    /* no serialnum says "it's free" (for cache-wide iterators) */
+    /* no serialnum says "it's free" (for cache-wide iterators); the next
+       user of the entry continues from the last one */
+    ce->down      = ce->serialnum;
     ce->serialnum = 0;
 
     /* add to free list */
@@ -1226,6 +1259,54 @@ static void process_events(void)
 }
 
 #if defined (DIRCACHE_NATIVE)
+/**
+ * does the cache entry still describe the directory entry just read?
+ */
+static bool entry_is_fatent(const struct dircache_entry *ce,
+                            const struct file_base_info *infop,
+                            const struct fat_direntry *fatentp)
+{
+    if (ce->direntry     != infop->fatfile.e.entry   ||
+        ce->direntries   != infop->fatfile.e.entries ||
+        ce->attr         != fatentp->attr            ||
+        ce->firstcluster != fatentp->firstcluster    ||
+        ce->wrtdate      != fatentp->wrtdate         ||
+        ce->wrttime      != fatentp->wrttime)
+        return false;
+
+    if (!(ce->attr & ATTR_DIRECTORY) && ce->filesize != fatentp->filesize)
+        return false;
+
+    size_t size = strlen(fatentp->name);
+
+    if (ce->tinyname)
+    {
+        return size <= MAX_TINYNAME &&
+               !strncmp((const char *)ce->namebuf, fatentp->name, MAX_TINYNAME);
+    }
+
+    return size == CE_NAMESIZE(ce->namelen) &&
+           !memcmp(get_name(ce->name), fatentp->name, size);
+}
+
+/**
+ * free the entry at *prevp and its children during a scan; used for entries
+ * that aren't on the storage (any more)
+ */
+static void sab_drop_entry(struct sab *sabp, int *prevp)
+{
+    struct file_base_info *infop = &sabp->info;
+    struct dircache_runinfo_volume *dcrivolp = DCRIVOL(infop);
+    int idx = *prevp;
+
+    struct dircache_entry *ce = get_entry(idx);
+    if ((ce->attr & ATTR_DIRECTORY) && ce->down)
+        free_subentries(dcrivolp, &ce->down);
+
+    remove_entry(dcrivolp, ce, prevp);
+    free_orphan_entry(dcrivolp, ce, idx);
+}
+
 /**
  * scan and build the contents of a subdirectory
  */
@@ -1276,27 +1357,42 @@ static void sab_process_sub(struct sab *sabp)
                 if (rc < 0)
                     sabp->quit = true;
                 else
+                {
+                    /* anything left was loaded but is gone now */
+                    while (*compp->prevp)
+                        sab_drop_entry(sabp, compp->prevp);
+
                     compp->prevp = downp; /* rewind list */
+                }
 
                 break;
             }
 
             struct dircache_entry *ce;
-            int prev = *compp->prevp;
+            int prev;
 
-            if (prev)
+            while ((prev = *compp->prevp))
             {
                 /* there are entries ahead of us; they will be what was just
                    read or something to be subsequently read; if it belongs
                    ahead of this one, insert a new entry before it; if it's
                    the entry just scanned, do nothing further and continue
-                   with the next */
+                   with the next; entries loaded from a snapshot that were
+                   skipped over or that don't match any more are dropped */
                 ce = get_entry(prev);
-                if (ce->direntry == infop->fatfile.e.entry)
-                {
-                    compp->prevp = &ce->next;
-                    continue; /* already there */
-                }
+                if (ce->direntry > infop->fatfile.e.entry)
+                    break;
+
+                if (entry_is_fatent(ce, infop, fatentp))
+                    break;
+
+                sab_drop_entry(sabp, compp->prevp);
+            }
+
+            if (prev && ce->direntry == infop->fatfile.e.entry)
+            {
+                compp->prevp = &ce->next;
+                continue; /* already there */
             }
 
             int idx = create_entry(fatentp->name, &ce);
@@ -1595,7 +1691,19 @@ int dircache_readdir_internal(struct filestr_base *stream,
            information; otherwise return the uncached read result while
            maintaining the last index */
         int rc = uncached_readdir_internal(stream, infop, fatent);
-        if (rc <= 0 || !ce || ce->direntry > infop->fatfile.e.entry)
+        if (rc <= 0)
+            return rc;
+
+        /* a loaded cache may hold entries that aren't on the storage any
+           more until the scan gets to them; step over those */
+        while (ce && ce->direntry < infop->fatfile.e.entry)
+        {
+            infop->dcfile.idx = idx;
+            idx = ce->next;
+            ce = get_entry(idx);
+        }
+
+        if (!ce || !entry_is_fatent(ce, infop, fatent))
             return rc;
 
         /* entry matches next one to read */
@@ -1897,7 +2005,6 @@ static int prepare_build(bool *realloced)
     /* called holding dircache lock */
     size_t size = dircache.last_size;
 
-#ifdef HAVE_EEPROM_SETTINGS
     if (realloced)
     {
         dircache_unlock();
@@ -1907,7 +2014,6 @@ static int prepare_build(bool *realloced)
         if (dircache_runinfo.suspended)
             return -1;
     }
-#endif /* HAVE_EEPROM_SETTINGS */
 
     bool stuffed = DIRCACHE_STUFFED(dircache.reserve_used);
     if (dircache_runinfo.bufsize > size && !stuffed)
@@ -2430,7 +2536,7 @@ void dircache_fileop_rename(struct file_base_info *dirinfop,
     if (entry_reassign_name(ce, basename) == 0)
     {
         /* it's not really the same one now so re-stamp it */
-        dc_serial_t serialnum = next_serialnum();
+        dc_serial_t serialnum = next_entry_serialnum(ce->serialnum);
         ce->serialnum = serialnum;
         bindp->info.dcfile.serialnum = serialnum;
     }
@@ -2953,7 +3059,7 @@ void dircache_dump(void)
                      "0x%08X,%lu,"
                      "%04d/%02d/%02d,"
                      "%02d:%02d:%02d\n",
-                     idx, ce->serialnum, data.serialhash,
+                     idx, (dc_serial_t)ce->serialnum, data.serialhash,
                      buf, ce->frontier,
                      ce->attr, (ce->attr & ATTR_DIRECTORY) ?
                                 0ul : (unsigned long)ce->filesize,
@@ -2984,23 +3090,26 @@ void dircache_dcfile_init(struct dircache_file *dcfilep)
     dcfilep->serialnum = 0;
 }
 
-#ifdef HAVE_EEPROM_SETTINGS
-
-#ifdef HAVE_HOTSWAP
-/* NOTE: This is hazardous to the filesystem of any sort of removable
-         storage unless it may be determined that the filesystem from save
-         to load is identical. If it's not possible to do so in a timely
-         manner, it's not worth persisting the cache. */
-  #warning "Don't do this; you'll find the consequences unpleasant."
-#endif
+/* NOTE: The storage may have been changed in any way between a save and the
+         next load, be it by another device or by an unclean shutdown. A
+         loaded cache is therefore never trusted as it is; every directory is
+         marked as a frontier and the build that follows compares each entry
+         with the storage, keeping the ones that still match (and with them,
+         their serial numbers) and correcting the rest. */
 
 /* dircache persistence file header magic */
-#define DIRCACHE_MAGIC  0x00d0c0a1
+#define DIRCACHE_MAGIC   0x00d0c0a1
+
+/* dircache persistence file format version; bump when struct dircache or
+   struct dircache_entry change */
+#define DIRCACHE_VERSION 4
 
 /* dircache persistence file header */
 struct dircache_maindata
 {
     uint32_t        magic;      /* DIRCACHE_MAGIC */
+    uint16_t        version;    /* DIRCACHE_VERSION */
+    uint16_t        entrysize;  /* ENTRYSIZE */
     struct dircache dircache;   /* metadata of the cache! */
     uint32_t        datacrc;    /* CRC32 of data */
     uint32_t        hdrcrc;     /* CRC32 of header through datacrc */
@@ -3047,7 +3156,9 @@ int dircache_load(void)
     }
 
     /* sanity check the header */
-    if (maindata.magic != DIRCACHE_MAGIC)
+    if (maindata.magic != DIRCACHE_MAGIC ||
+        maindata.version != DIRCACHE_VERSION ||
+        maindata.entrysize != ENTRYSIZE)
     {
         logf("dircache: invalid header magic");
         goto error_nolock;
@@ -3123,23 +3234,43 @@ int dircache_load(void)
     }
 
     /* only names will be changed in relative position so fix up those
-       references */
+       references; nothing should be open besides the dircache file itself
+       therefore no bindings need be resolved; the cache will have its own
+       entry but that should get cleaned up when removing the file */
     ssize_t offset = dircache.names - maindata.dircache.names;
-    if (offset != 0)
+    if (dircache.nextnamefree)
+        dircache.nextnamefree += offset;
+
+    FOR_EACH_CACHE_ENTRY(ce)
     {
-        /* nothing should be open besides the dircache file itself therefore
-           no bindings need be resolved; the cache will have its own entry
-           but that should get cleaned up when removing the file */
-        FOR_EACH_CACHE_ENTRY(ce)
+        if (!ce->tinyname)
+            ce->name += offset;
+
+        /* every directory needs checking against the storage */
+        if ((ce->attr & ATTR_DIRECTORY) && !is_dotdir_entry(ce))
+            ce->frontier = FRONTIER_NEW;
+    }
+
+    for (int i = 0; i < NUM_VOLUMES; i++)
+    {
+        struct dircache_volume *dcvolp = DCVOL(i);
+        if (dcvolp->status == DIRCACHE_IDLE)
+            continue;
+
+        if (!volume_ismounted(IF_MV(i)))
         {
-            if (!ce->tinyname)
-                ce->name += offset;
+            /* nothing to check it against */
+            reset_volume(IF_MV(i));
+            continue;
         }
+
+        dcvolp->status   = DIRCACHE_SCANNING;
+        dcvolp->frontier = FRONTIER_NEW;
     }
 
     dircache.reserve_used = 0;
 
-    /* enable the cache but do not try to build it */
+    /* enable the cache but do not try to build it until the file is closed */
     dircache_enable_internal(false);
 
     /* cache successfully loaded */
@@ -3160,6 +3291,15 @@ error_nolock:
         close(fd);
 
     remove_dircache_file();
+
+    if (rc == 0)
+    {
+        /* have the build check it against the storage in the background */
+        dircache_lock();
+        dircache_thread_post(NULL);
+        dircache_unlock();
+    }
+
     return rc;
 }
 
@@ -3171,6 +3311,14 @@ int dircache_save(void)
 {
     logf("Saving directory cache");
 
+    /* an incomplete cache isn't worth saving and may not even have a buffer */
+    dircache_lock();
+    bool clean = dircache_is_clean(true);
+    dircache_unlock();
+
+    if (!clean)
+        return -1;
+
     int fd = open_dircache_file(O_WRONLY|O_CREAT|O_TRUNC|O_APPEND);
     if (fd < 0)
         return -1;
@@ -3189,8 +3337,10 @@ int dircache_save(void)
     uint32_t crc;
     struct dircache_maindata maindata =
     {
-        .magic    = DIRCACHE_MAGIC,
-        .dircache = dircache,
+        .magic     = DIRCACHE_MAGIC,
+        .version   = DIRCACHE_VERSION,
+        .entrysize = ENTRYSIZE,
+        .dircache  = dircache,
     };
 
     /* store the size since it better detects an invalid header */
@@ -3255,7 +3405,6 @@ error:
     close(fd);
     return rc;
 }
-#endif /* HAVE_EEPROM_SETTINGS */
 
 /**
  * main one-time initialization function that must be called before any other
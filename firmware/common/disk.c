@@ -505,6 +505,19 @@ int disk_unmount_all(void)
     return unmounted;
 }
 
+bool disk_count_free(void)
+{
+    bool more = false;
+
+    disk_reader_lock();
+
+    for (int i = 0; i < NUM_VOLUMES && !more; i++)
+        more = fat_count_free(IF_MV(i));
+
+    disk_reader_unlock();
+    return more;
+}
+
 bool disk_present(IF_MD_NONVOID(int drive))
 {
     int rc = -1;
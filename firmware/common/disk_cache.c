@@ -19,6 +19,7 @@
  *
  ****************************************************************************/
 #include "config.h"
+#include <string.h>
 #include "debug.h"
 #include "system.h"
 #include "linked_list.h"
@@ -83,10 +84,12 @@ static inline unsigned int map_sector(sector_t sector)
 }
 
 static struct lldc_head cache_lru; /* LRU cache list (head = LRU item) */
+static unsigned int cache_lru_count; /* number of entries in the list */
 static struct disk_cache_entry cache_entry[DC_NUM_ENTRIES];
 static cache_map_entry_t cache_map_entry[NUM_VOLUMES][DC_MAP_NUM_ENTRIES];
 static cache_map_entry_t cache_vol_map[NUM_VOLUMES] IBSS_ATTR;
 static uint8_t cache_buffer[DC_NUM_ENTRIES][DC_CACHE_BUFSIZE] CACHEALIGN_ATTR;
+static uint8_t run_buffer[DC_RUN_SECTORS][SECTOR_SIZE] CACHEALIGN_ATTR;
 struct mutex disk_cache_mutex SHAREDBSS_ATTR;
 
 #define CACHE_MAP_ENTRY(volume, mapnum) \
@@ -151,6 +154,7 @@ static struct disk_cache_entry * cache_remove_lru_entry(void)
 
     /* remove it; next-LRU becomes the LRU */
     lldc_remove(&cache_lru, lru);
+    cache_lru_count--;
     return NODE_DCE(lru);
 }
 
@@ -158,6 +162,7 @@ static struct disk_cache_entry * cache_remove_lru_entry(void)
 static void cache_return_lru_entry(struct disk_cache_entry *fce)
 {
     lldc_insert_first(&cache_lru, &fce->node);
+    cache_lru_count++;
 }
 
 /* discard the entry's data and mark it unused */
@@ -169,6 +174,22 @@ static inline void cache_discard_entry(struct disk_cache_entry *dce,
     dce->flags = 0;
 }
 
+/* return the entry caching the specified sector, if any */
+static struct disk_cache_entry * cache_find_entry(IF_MV(int volume,)
+                                                  sector_t sector)
+{
+    FOR_EACH_BITARRAY_SET_BIT(&CACHE_MAP_ENTRY(volume, map_sector(sector)),
+                              index)
+    {
+        struct disk_cache_entry *dce = &cache_entry[index];
+
+        if (dce->sector == sector)
+            return dce;
+    }
+
+    return NULL;
+}
+
 /* search the cache for the specified sector, returning a buffer, either
    to the specified sector, if it exists, or a new/evicted entry that must
    be filled */
@@ -176,21 +197,17 @@ void * dc_cache_probe(IF_MV(int volume,) sector_t sector,
                       unsigned int *flagsp)
 {
     unsigned int mapnum = map_sector(sector);
+    struct disk_cache_entry *dce = cache_find_entry(IF_MV(volume,) sector);
 
-    FOR_EACH_BITARRAY_SET_BIT(&CACHE_MAP_ENTRY(volume, mapnum), index)
+    if (dce)
     {
-        struct disk_cache_entry *dce = &cache_entry[index];
-
-        if (dce->sector == sector)
-        {
-            *flagsp = DCE_INUSE;
-            touch_cache_entry(dce);
-            return cache_buffer[index];
-        }
+        *flagsp = DCE_INUSE;
+        touch_cache_entry(dce);
+        return cache_buffer[DCIDX_FROM_DCE(dce)];
     }
 
     /* sector not found so the LRU is the victim */
-    struct disk_cache_entry *dce = DCE_LRU();
+    dce = DCE_LRU();
     cache_lru.head = dce->node.next;
 
     unsigned int index = DCIDX_FROM_DCE(dce);
@@ -204,7 +221,7 @@ void * dc_cache_probe(IF_MV(int volume,) sector_t sector,
         unsigned int old_mapnum = map_sector(sector);
 
         if (old_flags & DCE_DIRTY)
-            dc_writeback_callback(IF_MV(old_volume,) sector, buf);
+            dc_writeback_callback(IF_MV(old_volume,) sector, 1, buf);
 
         if (mapnum == old_mapnum IF_MV( && volume == old_volume ))
             goto finish_setup;
@@ -257,17 +274,50 @@ void dc_commit_all(IF_MV_NONVOID(int volume))
 {
     DEBUGF("dc_commit_all()\n");
 
-    FOR_EACH_BITARRAY_SET_BIT(&CACHE_VOL_MAP(volume), index)
+    /* write in ascending order, adjacent sectors together */
+    while (1)
     {
-        struct disk_cache_entry *dce = &cache_entry[index];
-        unsigned int flags = dce->flags;
+        struct disk_cache_entry *first = NULL;
 
-        if (flags & DCE_DIRTY)
+        FOR_EACH_BITARRAY_SET_BIT(&CACHE_VOL_MAP(volume), index)
         {
-            dc_writeback_callback(IF_MV(volume,) dce->sector,
-                                  cache_buffer[index]);
-            dce->flags = flags & ~DCE_DIRTY;
+            struct disk_cache_entry *dce = &cache_entry[index];
+
+            if ((dce->flags & DCE_DIRTY) &&
+                (!first || dce->sector < first->sector))
+                first = dce;
         }
+
+        if (!first)
+            break;
+
+        sector_t sector = first->sector;
+        void *buf = cache_buffer[DCIDX_FROM_DCE(first)];
+        unsigned int count = 1;
+
+        first->flags &= ~DCE_DIRTY;
+
+        while (count < DC_RUN_SECTORS)
+        {
+            struct disk_cache_entry *dce =
+                cache_find_entry(IF_MV(volume,) sector + count);
+
+            if (!dce || !(dce->flags & DCE_DIRTY))
+                break;
+
+            if (count == 1)
+            {
+                memcpy(run_buffer[0], buf, SECTOR_SIZE);
+                buf = run_buffer;
+            }
+
+            memcpy(run_buffer[count], cache_buffer[DCIDX_FROM_DCE(dce)],
+                   SECTOR_SIZE);
+            dce->flags &= ~DCE_DIRTY;
+            count++;
+        }
+
+        dc_writeback_callback(IF_MV(volume,) sector, count, buf);
     }
 }
 
@@ -280,6 +330,29 @@ void dc_discard_all(IF_MV_NONVOID(int volume))
         cache_discard_entry(&cache_entry[index], index);
 }
 
+/* return the read-ahead buffer and the number of sectors worth reading into
+   it; keeps read-ahead from pushing out more than a quarter of the cache */
+unsigned int dc_readahead_buffer(void **bufp)
+{
+    *bufp = run_buffer;
+    return MIN(DC_RUN_SECTORS, cache_lru_count / 4);
+}
+
+/* put sectors read ahead by the client into the cache, keeping any that are
+   cached already */
+void dc_cache_fill(IF_MV(int volume,) sector_t sector, unsigned int count,
+                   const void *buf)
+{
+    for (unsigned int i = 0; i < count; i++)
+    {
+        unsigned int flags;
+        void *dst = dc_cache_probe(IF_MV(volume,) sector + i, &flags);
+
+        if (!flags)
+            memcpy(dst, (const uint8_t *)buf + i * SECTOR_SIZE, SECTOR_SIZE);
+    }
+}
+
 /* expropriate a buffer from the cache */
 void * dc_get_buffer(void)
 {
@@ -299,7 +372,7 @@ void * dc_get_buffer(void)
         {
             /* must first commit this sector if dirty */
             if (flags & DCE_DIRTY)
-                dc_writeback_callback(IF_MV(dce->volume,) dce->sector, buf);
+                dc_writeback_callback(IF_MV(dce->volume,) dce->sector, 1, buf);
 
             cache_discard_entry(dce, index);
         }
@@ -340,4 +413,5 @@ void dc_init(void)
     lldc_init(&cache_lru);
     for (unsigned int i = 0; i < DC_NUM_ENTRIES; i++)
         lldc_insert_last(&cache_lru, &cache_entry[i].node);
+    cache_lru_count = DC_NUM_ENTRIES;
 }
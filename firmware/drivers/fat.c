@@ -238,6 +238,7 @@ static struct bpb
     unsigned long fatrgnstart;
     unsigned long fatrgnend;
     struct fsinfo fsinfo;
+    sector_t readahead;       /* sector after the last one read into cache */
 #ifdef HAVE_FAT16SUPPORT
     unsigned int bpb_rootentcnt;    /* Number of dir entries in the root */
     /* internals for FAT16 support */
@@ -328,6 +329,28 @@ static void cache_discard(IF_MV_NONVOID(struct bpb *fat_bpb))
     dc_unlock_cache();
 }
 
+/* number of sectors from secnum on that may be read along with it: FAT
+   sectors up to the end of the FAT, directory sectors up to the end of their
+   cluster or of the FAT16 root directory */
+static unsigned long readahead_count(struct bpb *fat_bpb, sector_t secnum)
+{
+    sector_t end;
+
+    if (IS_FAT_SECTOR(fat_bpb, secnum))
+        end = fat_bpb->fatrgnend;
+    else if (secnum >= fat_bpb->firstdatasector)
+        end = secnum + fat_bpb->bpb_secperclus -
+              (secnum - fat_bpb->firstdatasector) % fat_bpb->bpb_secperclus;
+#ifdef HAVE_FAT16SUPPORT
+    else if (fat_bpb->is_fat16 && secnum >= fat_bpb->rootdirsector)
+        end = fat_bpb->firstdatasector;
+#endif
+    else
+        return 1;
+
+    return MIN(end, fat_bpb->totalsectors) - secnum;
+}
+
 /* caches a FAT or data area sector */
 static void * cache_sector(struct bpb *fat_bpb, sector_t secnum)
 {
@@ -336,8 +359,22 @@ static void * cache_sector(struct bpb *fat_bpb, sector_t secnum)
 
     if (!flags)
     {
+        void *runbuf = NULL;
+        unsigned long count = 1;
+
+        /* missing the sector right after the last one read means a scan;
+           read the sectors that follow along with this one */
+        if (secnum == fat_bpb->readahead)
+        {
+            count = MIN(dc_readahead_buffer(&runbuf),
+                        readahead_count(fat_bpb, secnum));
+            if (count < 2)
+                count = 1;
+        }
+
         int rc = storage_read_sectors(IF_MD(fat_bpb->drive,)
-                                      secnum + fat_bpb->startsector, 1, buf);
+                                      secnum + fat_bpb->startsector, count,
+                                      count > 1 ? runbuf : buf);
         if (UNLIKELY(rc < 0))
         {
             DEBUGF("%s() - Could not read sector %llu"
@@ -345,6 +382,15 @@ static void * cache_sector(struct bpb *fat_bpb, sector_t secnum)
             dc_discard_buf(buf);
             return NULL;
         }
+
+        if (count > 1)
+        {
+            memcpy(buf, runbuf, SECTOR_SIZE);
+            dc_cache_fill(IF_MV(fat_bpb->volume,) secnum + 1, count - 1,
+                          (uint8_t *)runbuf + SECTOR_SIZE);
+        }
+
+        fat_bpb->readahead = secnum + count;
     }
 
     return buf;
@@ -361,28 +407,48 @@ static void * cache_sector_buffer(IF_MV(struct bpb *fat_bpb,)
 }
 
 /* flush a cache buffer to storage */
-void dc_writeback_callback(IF_MV(int volume,) sector_t sector, void *buf)
+void dc_writeback_callback(IF_MV(int volume,) sector_t sector,
+                           unsigned int count, void *buf)
 {
     struct bpb * const fat_bpb = &fat_bpbs[IF_MV_VOL(volume)];
-    unsigned int copies = !IS_FAT_SECTOR(fat_bpb, sector) ?
-                                1 : fat_bpb->bpb_numfats;
-
-    sector += fat_bpb->startsector;
+    uint8_t *p = buf;
 
-    while (1)
+    while (count)
     {
-        int rc = storage_write_sectors(IF_MD(fat_bpb->drive,) sector, 1, buf);
-        if (rc < 0)
+        /* FAT sectors go to every FAT, so write them separately */
+        unsigned int n = count;
+        unsigned int copies = 1;
+
+        if (IS_FAT_SECTOR(fat_bpb, sector))
         {
-            panicf("%s() - Could not write sector %llu"
-                   " (error %d)\n", __func__, (uint64_t)sector, rc);
+            n = MIN(n, fat_bpb->fatrgnend - sector);
+            copies = fat_bpb->bpb_numfats;
         }
+        else if (sector < fat_bpb->fatrgnstart)
+            n = MIN(n, fat_bpb->fatrgnstart - sector);
 
-        if (--copies == 0)
-            break;
+        sector_t secnum = sector + fat_bpb->startsector;
+
+        while (1)
+        {
+            int rc = storage_write_sectors(IF_MD(fat_bpb->drive,) secnum, n,
+                                           p);
+            if (rc < 0)
+            {
+                panicf("%s() - Could not write sector %llu"
+                       " (error %d)\n", __func__, (uint64_t)secnum, rc);
+            }
+
+            if (--copies == 0)
+                break;
+
+            /* Update next FAT */
+            secnum += fat_bpb->fatsize;
+        }
 
-        /* Update next FAT */
-        sector += fat_bpb->fatsize;
+        sector += n;
+        count -= n;
+        p += n * SECTOR_SIZE;
     }
 }
 
@@ -813,6 +879,361 @@ static unsigned long cluster2sec(struct bpb *fat_bpb, long cluster)
             + fat_bpb->firstdatasector;
 }
 
+
+/** Cluster run cache **/
+
+#ifndef BOOTLOADER
+/* The contiguous cluster runs of the most recently used files, learned while
+   following their cluster chains, so that seeking doesn't have to follow the
+   chain through the FAT again. The runs of a file always cover it from its
+   first cluster on without gaps, so every FAT entry they were learned from is
+   one that update_fat_entry() checks. */
+#define FAT_EXTENT_FILES 4
+#define FAT_EXTENT_RUNS  16
+
+static struct fat_extent_map
+{
+#ifdef HAVE_MULTIVOLUME
+    int           volume;       /* volume of the file */
+#endif
+    long          firstcluster; /* first cluster of the file (0 = unused) */
+    unsigned long lastuse;      /* for replacing the least recently used */
+    int           count;        /* number of runs */
+    struct fat_extent
+    {
+        long clusternum;        /* cluster number of the run in the file */
+        long cluster;           /* first cluster of the run */
+        long count;             /* number of clusters in the run */
+    } run[FAT_EXTENT_RUNS];
+} extent_maps[FAT_EXTENT_FILES];
+
+static unsigned long extent_use;
+
+/* call with the cache locked */
+static struct fat_extent_map * extent_map_get(struct bpb *fat_bpb,
+                                              long firstcluster, bool create)
+{
+    struct fat_extent_map *lru = &extent_maps[0];
+
+    /* empty files and the FAT16 root directory have no chain to cache */
+    if (firstcluster <= 0)
+        return NULL;
+
+    for (unsigned int i = 0; i < FAT_EXTENT_FILES; i++)
+    {
+        struct fat_extent_map *map = &extent_maps[i];
+
+        if (map->firstcluster == firstcluster
+                IF_MV( && map->volume == fat_bpb->volume ))
+        {
+            map->lastuse = ++extent_use;
+            return map;
+        }
+
+        if (map->lastuse < lru->lastuse)
+            lru = map;
+    }
+
+    if (!create)
+        return NULL;
+
+#ifdef HAVE_MULTIVOLUME
+    lru->volume            = fat_bpb->volume;
+#endif
+    lru->firstcluster      = firstcluster;
+    lru->lastuse           = ++extent_use;
+    lru->count             = 1;
+    lru->run[0].clusternum = 0;
+    lru->run[0].cluster    = firstcluster;
+    lru->run[0].count      = 1;
+    return lru;
+}
+
+/* returns the highest cluster number of the file up to clusternum whose
+   cluster is known and stores that cluster in *clusterp, or -1 if none is */
+static long extent_find(struct bpb *fat_bpb, long firstcluster,
+                        long clusternum, long *clusterp)
+{
+    long rc = -1;
+
+    dc_lock_cache();
+
+    struct fat_extent_map *map = extent_map_get(fat_bpb, firstcluster, false);
+    if (map)
+    {
+        struct fat_extent *run = &map->run[0];
+
+        for (int i = 1; i < map->count && map->run[i].clusternum <= clusternum;
+             i++)
+        {
+            run = &map->run[i];
+        }
+
+        long n = MIN(clusternum - run->clusternum, run->count - 1);
+        *clusterp = run->cluster + n;
+        rc = run->clusternum + n;
+    }
+
+    dc_unlock_cache();
+    return rc;
+}
+
+/* notes that the cluster with the given number in the file is cluster;
+   only extends what is known from the start of the file */
+static void extent_add(struct bpb *fat_bpb, long firstcluster,
+                       long clusternum, long cluster)
+{
+    if (cluster <= 0)
+        return;
+
+    dc_lock_cache();
+
+    struct fat_extent_map *map =
+        extent_map_get(fat_bpb, firstcluster, clusternum == 1);
+    if (map)
+    {
+        struct fat_extent *run = &map->run[map->count - 1];
+
+        if (run->clusternum + run->count != clusternum)
+            ; /* not adjacent to the known part */
+        else if (run->cluster + run->count == cluster)
+            run->count++;
+        else if (map->count < FAT_EXTENT_RUNS)
+        {
+            run++;
+            run->clusternum = clusternum;
+            run->cluster    = cluster;
+            run->count      = 1;
+            map->count++;
+        }
+    }
+
+    dc_unlock_cache();
+}
+
+/* FAT entry is changing; forget whatever came after it in a cached chain
+   (call with the cache locked) */
+static void extent_invalidate(struct bpb *fat_bpb, unsigned long entry)
+{
+    for (unsigned int i = 0; i < FAT_EXTENT_FILES; i++)
+    {
+        struct fat_extent_map *map = &extent_maps[i];
+
+        if (!map->firstcluster IF_MV( || map->volume != fat_bpb->volume ))
+            continue;
+
+        for (int j = 0; j < map->count; j++)
+        {
+            struct fat_extent *run = &map->run[j];
+
+            if (entry >= (unsigned long)run->cluster &&
+                entry < (unsigned long)(run->cluster + run->count))
+            {
+                run->count = entry - run->cluster + 1;
+                map->count = j + 1;
+                break;
+            }
+        }
+    }
+}
+
+/* volume is going away */
+static void extent_discard(IF_MV_NONVOID(struct bpb *fat_bpb))
+{
+    dc_lock_cache();
+
+    for (unsigned int i = 0; i < FAT_EXTENT_FILES; i++)
+    {
+        struct fat_extent_map *map = &extent_maps[i];
+
+#ifdef HAVE_MULTIVOLUME
+        if (map->volume != fat_bpb->volume)
+            continue;
+#endif
+        map->firstcluster = 0;
+        map->lastuse      = 0;
+        map->count        = 0;
+    }
+
+    dc_unlock_cache();
+}
+#else /* BOOTLOADER */
+static inline long extent_find(struct bpb *fat_bpb, long firstcluster,
+                               long clusternum, long *clusterp)
+{
+    (void)fat_bpb; (void)firstcluster; (void)clusternum; (void)clusterp;
+    return -1;
+}
+#define extent_add(fat_bpb, firstcluster, clusternum, cluster) \
+    do {} while (0)
+#define extent_invalidate(fat_bpb, entry) \
+    do {} while (0)
+#define extent_discard(fat_bpb) \
+    do {} while (0)
+#endif /* BOOTLOADER */
+
+
+/** Free space map **/
+
+/* counts the free clusters in count FAT32 sectors from sector nr on and notes
+   the first one as the next free cluster if there's no hint yet; stops at a
+   sector that can't be read (call with the cache locked) */
+static unsigned long count_free_clusters32(struct bpb *fat_bpb,
+                                           unsigned long nr,
+                                           unsigned long count)
+{
+    unsigned long free = 0;
+
+    for (unsigned long i = nr; i < nr + count; i++)
+    {
+        uint32_t *sec = cache_sector(fat_bpb, i + fat_bpb->fatrgnstart);
+        if (!sec)
+            break;
+
+        for (unsigned long j = 0; j < CLUSTERS_PER_FAT_SECTOR; j++)
+        {
+            unsigned long c = i * CLUSTERS_PER_FAT_SECTOR + j;
+
+            if (c < 2 || c > fat_bpb->dataclusters + 1) /* nr 0 is unused */
+                continue;
+
+            if (letoh32(sec[j]) & 0x0fffffff)
+                continue;
+
+            free++;
+            if (fat_bpb->fsinfo.nextfree == 0xffffffff)
+                fat_bpb->fsinfo.nextfree = c;
+        }
+    }
+
+    return free;
+}
+
+#ifndef BOOTLOADER
+/* The number of free clusters in each group of FAT32 sectors, so allocation
+   can step over the full parts of the FAT and the free space is known without
+   reading the whole FAT at mount. The groups are counted one at a time in the
+   background after every mount, also when FSInfo has a free count, since
+   allocation needs the map; the ones not counted yet are searched as before.
+   The finished count replaces the FSInfo value, which corrects a stale one. */
+#if MEMORYSIZE < 8
+#define FAT_FREEMAP_GROUPS 256
+#else
+#define FAT_FREEMAP_GROUPS 1024
+#endif
+
+static struct fat_freemap
+{
+    unsigned int  shift;        /* log2 of the FAT sectors per group */
+    unsigned int  groups;       /* number of groups (0 = no map) */
+    unsigned int  counted;      /* number of groups counted so far */
+    unsigned long total;        /* free clusters in the counted groups */
+    uint32_t      free[FAT_FREEMAP_GROUPS]; /* free clusters of each group */
+} freemaps[NUM_VOLUMES];
+
+#define FAT_FREEMAP(bpb) \
+    (&freemaps[IF_MV_VOL((bpb)->volume)])
+
+/* starts a new count of the free clusters; returns false if the volume
+   doesn't use a map (call with the cache locked) */
+static bool freemap_init(struct bpb *fat_bpb)
+{
+    struct fat_freemap *map = FAT_FREEMAP(fat_bpb);
+
+    map->shift   = 0;
+    map->groups  = 0;
+    map->counted = 0;
+    map->total   = 0;
+
+#ifdef HAVE_FAT16SUPPORT
+    if (fat_bpb->is_fat16)
+        return false; /* the FAT is small enough to read at once */
+#endif
+
+    while ((fat_bpb->fatsize - 1) >> map->shift >= FAT_FREEMAP_GROUPS)
+        map->shift++;
+
+    map->groups = ((fat_bpb->fatsize - 1) >> map->shift) + 1;
+    return true;
+}
+
+/* counts the next group; returns true while there are more to count (call
+   with the cache locked) */
+static bool freemap_count_next(struct bpb *fat_bpb)
+{
+    struct fat_freemap *map = FAT_FREEMAP(fat_bpb);
+
+    if (map->counted >= map->groups)
+        return false;
+
+    unsigned long first = (unsigned long)map->counted << map->shift;
+    unsigned long free = count_free_clusters32(fat_bpb, first,
+                            MIN(1ul << map->shift, fat_bpb->fatsize - first));
+
+    map->free[map->counted++] = free;
+    map->total += free;
+
+    if (map->counted < map->groups)
+        return true;
+
+    /* all of it is known now, which also corrects a stale FSInfo */
+    if (fat_bpb->fsinfo.freecount != map->total)
+    {
+        fat_bpb->fsinfo.freecount = map->total;
+        update_fsinfo32(fat_bpb);
+    }
+
+    return false;
+}
+
+/* returns the number of FAT sectors from sector nr to the end of its group if
+   the group is known to be full, else 0 (call with the cache locked) */
+static unsigned long freemap_full_sectors(struct bpb *fat_bpb,
+                                          unsigned long nr)
+{
+    struct fat_freemap *map = FAT_FREEMAP(fat_bpb);
+    unsigned long group = nr >> map->shift;
+
+    if (group >= map->counted || map->free[group])
+        return 0;
+
+    return MIN((group + 1) << map->shift, fat_bpb->fatsize) - nr;
+}
+
+/* a cluster covered by FAT sector nr was allocated (-1) or freed (+1) (call
+   with the cache locked) */
+static void freemap_adjust(struct bpb *fat_bpb, unsigned long nr, int delta)
+{
+    struct fat_freemap *map = FAT_FREEMAP(fat_bpb);
+    unsigned long group = nr >> map->shift;
+
+    if (group >= map->counted || (delta < 0 && !map->free[group]))
+        return;
+
+    map->free[group] += delta;
+    map->total += delta;
+}
+#else /* BOOTLOADER */
+static inline bool freemap_init(struct bpb *fat_bpb)
+{
+    (void)fat_bpb;
+    return false;
+}
+static inline bool freemap_count_next(struct bpb *fat_bpb)
+{
+    (void)fat_bpb;
+    return false;
+}
+static inline unsigned long freemap_full_sectors(struct bpb *fat_bpb,
+                                                 unsigned long nr)
+{
+    (void)fat_bpb; (void)nr;
+    return 0;
+}
+#define freemap_adjust(fat_bpb, nr, delta) \
+    do {} while (0)
+#endif /* BOOTLOADER */
+
 #ifdef HAVE_FAT16SUPPORT
 static long get_next_cluster16(struct bpb *fat_bpb, long startcluster)
 {
@@ -911,6 +1332,8 @@ static int update_fat_entry16(struct bpb *fat_bpb, unsigned long entry,
 
     uint16_t curval = letoh16(sec[offset]);
 
+    extent_invalidate(fat_bpb, entry);
+
     if (val)
     {
         /* being allocated */
@@ -1012,6 +1435,16 @@ static long find_free_cluster32(struct bpb *fat_bpb, long startcluster)
     for (unsigned long i = 0; i < fat_bpb->fatsize; i++)
     {
         unsigned long nr = (i + sector) % fat_bpb->fatsize;
+
+        /* no need to read what's known to be full */
+        unsigned long full = freemap_full_sectors(fat_bpb, nr);
+        if (full)
+        {
+            i += full - 1;
+            offset = 0;
+            continue;
+        }
+
         uint32_t *sec = cache_sector(fat_bpb, nr + fat_bpb->fatrgnstart);
         if (!sec)
             break;
@@ -1068,17 +1501,30 @@ static int update_fat_entry32(struct bpb *fat_bpb, unsigned long entry,
 
     uint32_t curval = letoh32(sec[offset]);
 
+    extent_invalidate(fat_bpb, entry);
+
+    /* the free count stays unknown until the free space map is counted */
+    bool known = fat_bpb->fsinfo.freecount != 0xffffffff;
+
     if (val)
     {
         /* being allocated */
-        if (!(curval & 0x0fffffff) && fat_bpb->fsinfo.freecount > 0)
-            fat_bpb->fsinfo.freecount--;
+        if (!(curval & 0x0fffffff))
+        {
+            if (known && fat_bpb->fsinfo.freecount > 0)
+                fat_bpb->fsinfo.freecount--;
+            freemap_adjust(fat_bpb, sector, -1);
+        }
     }
     else
     {
         /* being freed */
         if (curval & 0x0fffffff)
-            fat_bpb->fsinfo.freecount++;
+        {
+            if (known)
+                fat_bpb->fsinfo.freecount++;
+            freemap_adjust(fat_bpb, sector, 1);
+        }
     }
 
     DEBUGF("%lu free clusters\n", (unsigned long)fat_bpb->fsinfo.freecount);
@@ -1093,31 +1539,15 @@ static int update_fat_entry32(struct bpb *fat_bpb, unsigned long entry,
 
 static void fat_recalc_free_internal32(struct bpb *fat_bpb)
 {
-    unsigned long free = 0;
-
-    for (unsigned long i = 0; i < fat_bpb->fatsize; i++)
+    if (freemap_init(fat_bpb))
     {
-        uint32_t *sec = cache_sector(fat_bpb, i + fat_bpb->fatrgnstart);
-        if (!sec)
-            break;
-
-        for (unsigned long j = 0; j < CLUSTERS_PER_FAT_SECTOR; j++)
-        {
-            unsigned long c = i * CLUSTERS_PER_FAT_SECTOR + j;
-
-            if (c < 2 || c > fat_bpb->dataclusters + 1) /* nr 0 is unused */
-                continue;
-
-            if (letoh32(sec[j]) & 0x0fffffff)
-                continue;
-
-            free++;
-            if (fat_bpb->fsinfo.nextfree == 0xffffffff)
-                fat_bpb->fsinfo.nextfree = c;
-        }
+        /* count it all now instead of in the background */
+        while (freemap_count_next(fat_bpb));
+        return;
     }
 
-    fat_bpb->fsinfo.freecount = free;
+    fat_bpb->fsinfo.freecount =
+        count_free_clusters32(fat_bpb, 0, fat_bpb->fatsize);
     update_fsinfo32(fat_bpb);
 }
 
@@ -1375,7 +1805,8 @@ static long next_write_cluster(struct bpb *fat_bpb, long oldcluster)
         else
         {
         #ifdef TEST_FAT
-            if (fat_bpb->fsinfo.freecount > 0)
+            if (fat_bpb->fsinfo.freecount > 0 &&
+                fat_bpb->fsinfo.freecount != 0xffffffff)
                 panicf("There is free space, but find_free_cluster() "
                        "didn't find it!\n");
         #endif
@@ -2396,6 +2827,24 @@ unsigned long fat_query_sectornum(const struct fat_filestr *filestr)
     return fat_bpb->bpb_secperclus*filestr->clusternum + filestr->sectornum + 1;
 }
 
+/* helper for fat_readwrite: cluster after the one with the given number */
+static long next_file_cluster(struct bpb *fat_bpb, struct fat_file *file,
+                              long clusternum, long cluster, bool write)
+{
+    long next = 0;
+
+    if (write)
+        next = next_write_cluster(fat_bpb, cluster);
+    else if (extent_find(fat_bpb, file->firstcluster, clusternum + 1,
+                         &next) == clusternum + 1)
+        return next;
+    else
+        next = get_next_cluster(fat_bpb, cluster);
+
+    extent_add(fat_bpb, file->firstcluster, clusternum + 1, next);
+    return next;
+}
+
 /* helper for fat_readwrite */
 static long transfer(struct bpb *fat_bpb, sector_t start, long count,
                      char *buf, bool write)
@@ -2541,8 +2990,8 @@ long fat_readwrite(struct fat_filestr *filestr, unsigned long sectorcount,
         if (++sectornum >= fat_bpb->bpb_secperclus)
         {
             /* out of sectors in this cluster; get the next cluster */
-            long newcluster = write ? next_write_cluster(fat_bpb, cluster) :
-                                      get_next_cluster(fat_bpb, cluster);
+            long newcluster = next_file_cluster(fat_bpb, file, clusternum,
+                                                cluster, write);
             if (newcluster)
             {
                 cluster = newcluster;
@@ -2658,16 +3107,20 @@ int fat_seek(struct fat_filestr *filestr, unsigned long seeksector)
         clusternum = seeksector / fat_bpb->bpb_secperclus;
         sectornum = seeksector % fat_bpb->bpb_secperclus;
 
-        long numclusters = clusternum;
+        /* start from the furthest cluster known without reading the FAT */
+        long known = extent_find(fat_bpb, file->firstcluster, clusternum,
+                                 &cluster);
+        if (known < 0)
+            known = 0;
 
-        if (filestr->clusternum && clusternum >= filestr->clusternum)
+        if (filestr->clusternum > known && clusternum >= filestr->clusternum)
         {
             /* seek forward from current position */
             cluster = filestr->lastcluster;
-            numclusters -= filestr->clusternum;
+            known = filestr->clusternum;
         }
 
-        for (long i = 0; i < numclusters; i++)
+        for (long i = known; i < clusternum; i++)
         {
             cluster = get_next_cluster(fat_bpb, cluster);
 
@@ -2677,6 +3130,8 @@ int fat_seek(struct fat_filestr *filestr, unsigned long seeksector)
                        "(sector %lu, cluster %ld)\n", seeksector, i);
                 FAT_ERROR(FAT_SEEK_EOF);
             }
+
+            extent_add(fat_bpb, file->firstcluster, i + 1, cluster);
         }
 
         sector = cluster2sec(fat_bpb, cluster) + sectornum;
@@ -2757,22 +3212,29 @@ int fat_readdir(struct fat_filestr *dirstr, struct fat_dirscan_info *scan,
         unsigned long sector = direntry / DIR_ENTRIES_PER_SECTOR;
         if (cachep->sector != sector)
         {
-            if (cachep->sector + 1 != sector)
-            {
-                /* Nothing cached or sector isn't contiguous */
-                int rc2 = fat_seek(dirstr, sector);
-                if (rc2 < 0)
-                    FAT_ERROR(rc2 * 10 - 2);
-            }
+            struct bpb *fat_bpb = FAT_BPB(dirstr->fatfilep->volume);
+            if (!fat_bpb)
+                FAT_ERROR(-2);
+
+            /* read through the sector cache so that scans of large
+               directories get read ahead */
+            dc_lock_cache();
+
+            union raw_dirent *ent =
+                cache_direntry(fat_bpb, dirstr,
+                               sector * DIR_ENTRIES_PER_SECTOR);
+            if (ent)
+                memcpy(cachep->buffer, ent, SECTOR_SIZE);
 
-            int rc2 = fat_readwrite(dirstr, 1, cachep->buffer, false);
-            if (rc2 <= 0)
+            dc_unlock_cache();
+
+            if (!ent)
             {
-                if (rc2 == 0)
+                if (dirstr->eof)
                     break; /* eof */
 
-                DEBUGF("%s() - Couldn't read dir (err %d)\n", __func__, rc);
-                FAT_ERROR(rc2 * 10 - 3);
+                DEBUGF("%s() - Couldn't read dir\n", __func__);
+                FAT_ERROR(-3);
             }
 
             cachep->sector = sector;
@@ -2881,6 +3343,7 @@ int fat_mount(IF_MV(int volume,) IF_MD(int drive,) unsigned long startsector)
 
     /* fill-in basic info first */
     fat_bpb->startsector = startsector;
+    fat_bpb->readahead   = 0;
 #ifdef HAVE_MULTIVOLUME
     fat_bpb->volume      = volume;
 #endif
@@ -2895,8 +3358,12 @@ int fat_mount(IF_MV(int volume,) IF_MD(int drive,) unsigned long startsector)
     /* it worked */
     fat_bpb->mounted = true;
 
-    /* calculate freecount if unset */
-    if (fat_bpb->fsinfo.freecount == 0xffffffff)
+    /* calculate freecount if unset, unless it's counted in the background */
+    dc_lock_cache();
+    bool counting = freemap_init(fat_bpb);
+    dc_unlock_cache();
+
+    if (fat_bpb->fsinfo.freecount == 0xffffffff && !counting)
         fat_recalc_free(IF_MV(fat_bpb->volume));
 
     DEBUGF("Freecount: %ld\n", (unsigned long)fat_bpb->fsinfo.freecount);
@@ -2918,6 +3385,7 @@ int fat_unmount(IF_MV_NONVOID(int volume))
 
     /* free the entries for this volume */
     cache_discard(IF_MV(fat_bpb));
+    extent_discard(IF_MV(fat_bpb));
     fat_bpb->mounted = false;
 
     return 0;
@@ -2961,6 +3429,20 @@ void fat_recalc_free(IF_MV_NONVOID(int volume))
     dc_unlock_cache();
 }
 
+bool fat_count_free(IF_MV_NONVOID(int volume))
+{
+    /* not FAT_BPB(): this is polled for every volume */
+    struct bpb * const fat_bpb = &fat_bpbs[IF_MV_VOL(volume)];
+    if (!fat_bpb->mounted)
+        return false;
+
+    dc_lock_cache();
+    bool more = freemap_count_next(fat_bpb);
+    dc_unlock_cache();
+
+    return more;
+}
+
 bool fat_size(IF_MV(int volume,) sector_t *size, sector_t *free)
 {
     struct bpb * const fat_bpb = FAT_BPB(volume);
@@ -2970,7 +3452,19 @@ bool fat_size(IF_MV(int volume,) sector_t *size, sector_t *free)
     unsigned long factor = fat_bpb->bpb_secperclus * SECTOR_SIZE / 1024;
 
     if (size) *size = fat_bpb->dataclusters * factor;
-    if (free) *free = fat_bpb->fsinfo.freecount * factor;
+    if (free)
+    {
+        /* FSInfo had no free count and the background count isn't through
+           the whole FAT yet; finish it here rather than report a part */
+        if (fat_bpb->fsinfo.freecount == 0xffffffff)
+        {
+            dc_lock_cache();
+            while (freemap_count_next(fat_bpb));
+            dc_unlock_cache();
+        }
+
+        *free = (sector_t)fat_bpb->fsinfo.freecount * factor;
+    }
 
     return true;
 }
@@ -47,6 +47,10 @@ int disk_mount(int drive);
 int disk_unmount_all(void);
 int disk_unmount(int drive);
 
+/* Counts a bit more of the free space of the mounted volumes after mounting;
+   returns true while there's more to count */
+bool disk_count_free(void);
+
 /* Used when the drive's logical sector size is smaller than the sector size used by the partition table and filesystem.  Notably needed for ipod 5.5G/6G. */
 #ifdef MAX_LOG_SECTOR_SIZE
 int disk_get_sector_multiplier(IF_MD_NONVOID(int drive));
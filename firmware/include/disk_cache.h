@@ -43,11 +43,18 @@ void dc_discard_buf(void *buf);
 void dc_commit_all(IF_MV_NONVOID(int volume));
 void dc_discard_all(IF_MV_NONVOID(int volume));
 
+/* read-ahead: returns how many sectors the client may read into the buffer
+   for putting them in the cache with dc_cache_fill() */
+unsigned int dc_readahead_buffer(void **bufp);
+void dc_cache_fill(IF_MV(int volume,) sector_t sector, unsigned int count,
+                   const void *buf);
+
 void dc_init(void) INIT_ATTR;
 
-/* in addition to filling, writeback is implemented by the client */
+/* in addition to filling, writeback is implemented by the client; runs of
+   up to DC_RUN_SECTORS adjacent dirty sectors are written with one call */
 extern void dc_writeback_callback(IF_MV(int volume, ) sector_t sector,
-                                  void *buf);
+                                  unsigned int count, void *buf);
 
 
 /** These synchronize and can be called by anyone **/
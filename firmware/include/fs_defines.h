@@ -114,4 +114,14 @@
 #define DC_CACHE_BUFSIZE    SECTOR_SIZE
 #endif
 
+/* the most sectors the cache reads ahead or writes back with one transfer;
+   they are staged in a buffer of their own */
+#ifdef BOOTLOADER
+#define DC_RUN_SECTORS      1
+#elif MEMORYSIZE < 8
+#define DC_RUN_SECTORS      (2048 / SECTOR_SIZE)
+#else
+#define DC_RUN_SECTORS      (4096 / SECTOR_SIZE)
+#endif
+
 #endif /* FS_DEFINES_H */
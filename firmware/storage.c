@@ -168,6 +168,14 @@ static void NORETURN_ATTR storage_thread(void)
         switch (ev.id)
         {
         case SYS_TIMEOUT:;
+#ifndef BOOTLOADER
+            if (!usb_mode) {
+                /* count the free space of new mounts a little at a time */
+                long end = current_tick + HZ/10;
+                while (disk_count_free() && TIME_BEFORE(current_tick, end) &&
+                       queue_empty(&storage_queue));
+            }
+#endif
             /* drivers hold their bit low when they want to
                sleep and keep it high otherwise */
             unsigned int trig = 0;
@@ -21,6 +21,8 @@
 #define RB_FILESYSTEM_OS
 #include <sys/statfs.h> /* lowest common denominator */
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include <utime.h>
@@ -169,6 +171,27 @@ bool os_file_exists(const char *ospath)
     return true;
 }
 
+/* Map a whole file read-only; returns NULL if it can't be mapped */
+void * os_file_map(int osfd, off_t size)
+{
+    if (size <= 0 || (uintmax_t)size > SIZE_MAX)
+        return NULL;
+
+    void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, osfd, 0);
+    if (addr == MAP_FAILED)
+        return NULL;
+
+    /* Let the kernel read ahead of the reader and drop what's behind it */
+    madvise(addr, size, MADV_SEQUENTIAL);
+
+    return addr;
+}
+
+void os_file_unmap(void *addr, off_t size)
+{
+    munmap(addr, size);
+}
+
 int os_opendirfd(const char *osdirname)
 {
     return os_open(osdirname, O_RDONLY | O_CLOEXEC);
@@ -55,6 +55,9 @@
 #ifndef os_write
 #define os_write        write
 #endif
+
+void * os_file_map(int osfd, off_t size);
+void os_file_unmap(void *addr, off_t size);
 #endif /* !OSFUNCTIONS_DECLARED */
 
 #endif /* _FILESYSTEM_UNIX__FILE_H_ */
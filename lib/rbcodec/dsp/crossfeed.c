@@ -28,6 +28,7 @@
 #include "dsp_proc_entry.h"
 #include "dsp_filter.h"
 #include "crossfeed.h"
+#include "dsp_simd.h"
 #include <string.h>
 
 /* Implemented here or in target assembly code */
@@ -189,34 +190,76 @@ void crossfeed_process(struct dsp_proc_entry *this, struct dsp_buffer **buf_p)
 
     int count = buf->remcount;
 
-    for (int i = 0; i < count; i++)
+#ifdef DSP_HAVE_SIMD
+    if (DSP_SIMD_ON)
+    {
+        /* Same as below with both speakers filtered side by side; the delay
+         * line already holds {left, right} pairs */
+        const v2s32 c0 = v2_dup(coefs[0]), c1 = v2_dup(coefs[1]);
+        const v2s32 c2 = v2_dup(coefs[2]), g = v2_dup(gain);
+        v2s32 h0 = v2_set(hist_l[0], hist_r[0]);
+        v2s32 h1 = v2_set(hist_l[1], hist_r[1]);
+
+        for (int i = 0; i < count; i++)
+        {
+            v2s32 in = v2_set(buf->p32[0][i], buf->p32[1][i]);
+            v2s32 dly = v2_load(di);
+
+            /* Filter delayed samples and save filter history */
+            v2s32 acc = v2_add(v2_add(v2_fracmul(dly, c0), v2_fracmul(h0, c1)),
+                               v2_fracmul(h1, c2));
+            h1 = acc;
+            h0 = dly;
+            v2_store(di, in);
+            di += 2;
+
+            /* Add the attenuated direct sound to the other speaker's output */
+            v2s32 out = v2_add(v2_fracmul(in, g), v2_swap(acc));
+            buf->p32[0][i] = v2_get_l(out);
+            buf->p32[1][i] = v2_get_r(out);
+
+            /* Wrap delay line index if bigger than delay line size */
+            if (di >= di_max)
+                di = delay;
+        }
+
+        hist_l[0] = v2_get_l(h0);
+        hist_r[0] = v2_get_r(h0);
+        hist_l[1] = v2_get_l(h1);
+        hist_r[1] = v2_get_r(h1);
+    }
+    else
+#endif /* DSP_HAVE_SIMD */
     {
-        int32_t left = buf->p32[0][i];
-        int32_t right = buf->p32[1][i];
-
-        /* Filter delayed sample from left speaker */
-        int32_t acc = FRACMUL(*di, coefs[0]);
-        acc += FRACMUL(hist_l[0], coefs[1]);
-        acc += FRACMUL(hist_l[1], coefs[2]);
-        /* Save filter history for left speaker */
-        hist_l[1] = acc;
-        hist_l[0] = *di;
-        *di++ = left;
-        /* Filter delayed sample from right speaker */
-        acc = FRACMUL(*di, coefs[0]);
-        acc += FRACMUL(hist_r[0], coefs[1]);
-        acc += FRACMUL(hist_r[1], coefs[2]);
-        /* Save filter history for right speaker */
-        hist_r[1] = acc;
-        hist_r[0] = *di;
-        *di++ = right;
-        /* Now add the attenuated direct sound and write to outputs */
-        buf->p32[0][i] = FRACMUL(left, gain) + hist_r[1];
-        buf->p32[1][i] = FRACMUL(right, gain) + hist_l[1];
-
-        /* Wrap delay line index if bigger than delay line size */
-        if (di >= di_max)
-            di = delay;
+        for (int i = 0; i < count; i++)
+        {
+            int32_t left = buf->p32[0][i];
+            int32_t right = buf->p32[1][i];
+
+            /* Filter delayed sample from left speaker */
+            int32_t acc = FRACMUL(*di, coefs[0]);
+            acc += FRACMUL(hist_l[0], coefs[1]);
+            acc += FRACMUL(hist_l[1], coefs[2]);
+            /* Save filter history for left speaker */
+            hist_l[1] = acc;
+            hist_l[0] = *di;
+            *di++ = left;
+            /* Filter delayed sample from right speaker */
+            acc = FRACMUL(*di, coefs[0]);
+            acc += FRACMUL(hist_r[0], coefs[1]);
+            acc += FRACMUL(hist_r[1], coefs[2]);
+            /* Save filter history for right speaker */
+            hist_r[1] = acc;
+            hist_r[0] = *di;
+            *di++ = right;
+            /* Now add the attenuated direct sound and write to outputs */
+            buf->p32[0][i] = FRACMUL(left, gain) + hist_r[1];
+            buf->p32[1][i] = FRACMUL(right, gain) + hist_l[1];
+
+            /* Wrap delay line index if bigger than delay line size */
+            if (di >= di_max)
+                di = delay;
+        }
     }
 
     /* Write back local copies of data we've modified */
@@ -26,6 +26,7 @@
 
 #include "tdspeed.h"
 #include "resample.h"
+#include <string.h>
 
 /* Define LOGF_ENABLE to enable logf output in this file */
 /*#define LOGF_ENABLE*/
@@ -35,6 +36,22 @@
 #define DSP_PROC_DB_CREATE
 #include "dsp_proc_entry.h"
 
+#ifdef DSP_PROFILE_TIME
+/* Stage names for DSP_GET_PROC_STATS, in database order */
+#define DSP_PROC_DB_START \
+    static const char * const dsp_proc_names[] = {
+#define DSP_PROC_DB_ITEM(name) \
+    #name,
+#define DSP_PROC_DB_STOP };
+#include "dsp_proc_database.h"
+
+#if DSP_PROFILE_TIME_HZ >= 1000000
+#define DSP_PROFILE_TO_US(t) ((t) / (DSP_PROFILE_TIME_HZ / 1000000))
+#else
+#define DSP_PROFILE_TO_US(t) ((t) * (1000000 / DSP_PROFILE_TIME_HZ))
+#endif
+#endif /* DSP_PROFILE_TIME */
+
 #ifndef DSP_PROCESS_START
 /* These do nothing if not previously defined */
 #define DSP_PROCESS_START()
@@ -73,6 +90,19 @@ dsp_proc_slot_arr[DSP_NUM_PROC_STAGES+DSP_VOICE_NUM_PROC_STAGES] IBSS_ATTR;
 /* General DSP config */
 static struct dsp_config dsp_conf[DSP_COUNT] IBSS_ATTR;
 
+#ifdef DSP_PROFILE_TIME
+/* Per-stage counters of each DSP, in database order */
+static struct dsp_proc_counters
+{
+    uint32_t calls;
+    uint64_t samples;
+    uint64_t time;     /* DSP_PROFILE_TIME() units */
+} dsp_proc_counters[DSP_COUNT][DSP_NUM_PROC_STAGES];
+
+/* Counting is switched on by DSP_ENABLE_PROC_STATS */
+static bool dsp_proc_stats_on[DSP_COUNT];
+#endif
+
 static const dsp_proc_init_fn_type dsp_init_fn[] INITDATA_ATTR = {
     &dsp_timestretch_init,
     &dsp_resample_init,
@@ -385,6 +415,21 @@ static FORCE_INLINE void dsp_proc_call(struct dsp_proc_slot *s,
         buf->proc_mask |= s->mask;
     }
 
+#ifdef DSP_PROFILE_TIME
+    if (UNLIKELY(dsp_proc_stats_on[dsp - dsp_conf]))
+    {
+        struct dsp_proc_counters *c =
+            &dsp_proc_counters[dsp - dsp_conf][s->db_index];
+        c->calls++;
+        c->samples += buf->remcount;
+
+        uint32_t start = DSP_PROFILE_TIME();
+        s->proc_entry.process(&s->proc_entry, buf_p);
+        c->time += (uint32_t)(DSP_PROFILE_TIME() - start);
+        return;
+    }
+#endif
+
     s->proc_entry.process(&s->proc_entry, buf_p);
 }
 
@@ -485,9 +530,60 @@ void dsp_process(struct dsp_config *dsp, struct dsp_buffer *src,
     DSP_PROCESS_END();
 }
 
+/* Fill in the statistics of each enabled or previously used stage */
+static int dsp_get_proc_stats(struct dsp_config *dsp,
+                              struct dsp_proc_stats *stats)
+{
+    int count = 0;
+
+#ifdef DSP_PROFILE_TIME
+    for (unsigned int i = 0;
+         i < DSP_NUM_PROC_STAGES && count < DSP_PROC_STATS_MAX; i++)
+    {
+        const struct dsp_proc_counters *c =
+            &dsp_proc_counters[dsp - dsp_conf][i];
+        const uint32_t mask = BIT_N(dsp_proc_database[i]->id);
+
+        if (c->calls == 0 && !(dsp->proc_mask_enabled & mask))
+            continue;
+
+        struct dsp_proc_stats *st = &stats[count++];
+        st->name = dsp_proc_names[i];
+        st->active = (dsp->proc_mask_active & mask) != 0;
+        st->calls = c->calls;
+        st->samples = c->samples;
+        st->time_us = DSP_PROFILE_TO_US(c->time);
+    }
+#else
+    (void)dsp;
+    (void)stats;
+#endif
+
+    return count;
+}
+
 intptr_t dsp_configure(struct dsp_config *dsp, unsigned int setting,
                        intptr_t value)
 {
+    switch (setting)
+    {
+    case DSP_ENABLE_PROC_STATS:
+#ifdef DSP_PROFILE_TIME
+        dsp_proc_stats_on[dsp - dsp_conf] = value != 0;
+#endif
+        return 0;
+
+    case DSP_GET_PROC_STATS:
+        return dsp_get_proc_stats(dsp, (struct dsp_proc_stats *)value);
+
+    case DSP_CLEAR_PROC_STATS:
+#ifdef DSP_PROFILE_TIME
+        memset(dsp_proc_counters[dsp - dsp_conf], 0,
+               sizeof (dsp_proc_counters[0]));
+#endif
+        return 0;
+    }
+
     return proc_broadcast(dsp, setting, value);
 }
 
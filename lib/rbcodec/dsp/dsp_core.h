@@ -44,6 +44,11 @@ enum dsp_settings
     DSP_PROC_CLOSE,
     DSP_PROC_NEW_FORMAT,
     DSP_PROC_SETTING, /* stage-specific should be this + id */
+    /* Handled by the core; past the stage-specific range since stage ids
+       are bit numbers in a 32-bit mask */
+    DSP_ENABLE_PROC_STATS = DSP_PROC_SETTING + 32,
+    DSP_GET_PROC_STATS,
+    DSP_CLEAR_PROC_STATS,
 };
 
 enum dsp_stereo_modes
@@ -126,6 +131,22 @@ static inline void dsp_advance_buffer32(struct dsp_buffer *buf,
     buf->p32[1] += by_count;
 }
 
+/* Time spent in one processing stage, filled in by DSP_GET_PROC_STATS with
+   value = struct dsp_proc_stats[DSP_PROC_STATS_MAX]. The return value is the
+   number of entries filled in, which is zero if the platform provides no
+   DSP_PROFILE_TIME() source. Counting is off until DSP_ENABLE_PROC_STATS
+   is sent with value = true. DSP_CLEAR_PROC_STATS restarts counting. */
+#define DSP_PROC_STATS_MAX 16
+
+struct dsp_proc_stats
+{
+    const char *name;  /* Stage name */
+    bool active;       /* Stage is currently processing samples */
+    uint32_t calls;    /* Number of process() calls */
+    uint64_t samples;  /* Samples passed to process() */
+    uint64_t time_us;  /* Total time spent in process() */
+};
+
 /* Get DSP pointer */
 struct dsp_config *dsp_get_config(unsigned int dsp_id);
 
@@ -23,6 +23,7 @@
 #include "fracmul.h"
 #include "dsp_filter.h"
 #include "replaygain.h"
+#include "dsp_simd.h"
 #include <string.h>
 
 enum filter_shift
@@ -278,6 +279,48 @@ void filter_flush(struct dsp_filter *f)
  * implementations.
  */
 #if (!defined(CPU_COLDFIRE) && !defined(CPU_ARM))
+#ifdef DSP_HAVE_SIMD
+/* Same as below, with both channels of a stereo buffer filtered at once */
+static void filter_process_stereo(struct dsp_filter *f, int32_t * const buf[],
+                                  int count)
+{
+    const v2s32 b0 = v2_dup(f->coefs[0]), b1 = v2_dup(f->coefs[1]);
+    const v2s32 b2 = v2_dup(f->coefs[2]), a1 = v2_dup(f->coefs[3]);
+    const v2s32 a2 = v2_dup(f->coefs[4]);
+    unsigned int shift = f->shift;
+    int32_t *l = buf[0], *r = buf[1];
+
+    v2s32 x1 = v2_set(f->history[0][0], f->history[1][0]);
+    v2s32 x2 = v2_set(f->history[0][1], f->history[1][1]);
+    v2s32 y1 = v2_set(f->history[0][2], f->history[1][2]);
+    v2s32 y2 = v2_set(f->history[0][3], f->history[1][3]);
+
+    for (int i = 0; i < count; i++) {
+        v2s32 x0 = v2_set(l[i], r[i]);
+        v2s64 acc = v2_mull(x0, b0);
+        acc = v2_mlal(acc, x1, b1);
+        acc = v2_mlal(acc, x2, b2);
+        acc = v2_mlal(acc, y1, a1);
+        acc = v2_mlal(acc, y2, a2);
+        x2 = x1;
+        x1 = x0;
+        y2 = y1;
+        y1 = v2_shl_hi32(acc, shift);
+        l[i] = v2_get_l(y1);
+        r[i] = v2_get_r(y1);
+    }
+
+    f->history[0][0] = v2_get_l(x1);
+    f->history[1][0] = v2_get_r(x1);
+    f->history[0][1] = v2_get_l(x2);
+    f->history[1][1] = v2_get_r(x2);
+    f->history[0][2] = v2_get_l(y1);
+    f->history[1][2] = v2_get_r(y1);
+    f->history[0][3] = v2_get_l(y2);
+    f->history[1][3] = v2_get_r(y2);
+}
+#endif /* DSP_HAVE_SIMD */
+
 void filter_process(struct dsp_filter *f, int32_t * const buf[], int count,
                     unsigned int channels)
 {
@@ -287,6 +330,13 @@ void filter_process(struct dsp_filter *f, int32_t * const buf[], int count,
      */
     unsigned int shift = f->shift;
 
+#ifdef DSP_HAVE_SIMD
+    if (DSP_SIMD_ON && channels == 2 && buf[0] != buf[1]) {
+        filter_process_stereo(f, buf, count);
+        return;
+    }
+#endif
+
     for (unsigned int c = 0; c < channels; c++) {
         for (int i = 0; i < count; i++) {
             long long acc = (long long) buf[c][i] * f->coefs[0];
@@ -302,6 +352,166 @@ void filter_process(struct dsp_filter *f, int32_t * const buf[], int count,
         }
     }
 }
+
+/**
+ * Run a chain of filters over the buffer in a single pass: every filter is
+ * applied to a sample before moving on to the next one. The coefficients
+ * and history of the whole chain are packed into one array for the duration
+ * of the call. The results are identical to calling filter_process() for
+ * each filter in turn.
+ */
+#define FILTER_CASCADE_MAX 16 /* Longer chains take several passes */
+
+#ifdef DSP_HAVE_SIMD
+static void filter_cascade_stereo(struct dsp_filter * const f[], int num,
+                                  int32_t * const buf[], int count)
+{
+    struct
+    {
+        v2s32 b0, b1, b2, a1, a2;
+        v2s32 x1, x2, y1, y2;
+    } s[FILTER_CASCADE_MAX];
+    unsigned int shift[FILTER_CASCADE_MAX];
+    int32_t *l = buf[0], *r = buf[1];
+
+    for (int k = 0; k < num; k++) {
+        s[k].b0 = v2_dup(f[k]->coefs[0]);
+        s[k].b1 = v2_dup(f[k]->coefs[1]);
+        s[k].b2 = v2_dup(f[k]->coefs[2]);
+        s[k].a1 = v2_dup(f[k]->coefs[3]);
+        s[k].a2 = v2_dup(f[k]->coefs[4]);
+        s[k].x1 = v2_set(f[k]->history[0][0], f[k]->history[1][0]);
+        s[k].x2 = v2_set(f[k]->history[0][1], f[k]->history[1][1]);
+        s[k].y1 = v2_set(f[k]->history[0][2], f[k]->history[1][2]);
+        s[k].y2 = v2_set(f[k]->history[0][3], f[k]->history[1][3]);
+        shift[k] = f[k]->shift;
+    }
+
+    for (int i = 0; i < count; i++) {
+        v2s32 x = v2_set(l[i], r[i]);
+
+        for (int k = 0; k < num; k++) {
+            v2s64 acc = v2_mull(x, s[k].b0);
+            acc = v2_mlal(acc, s[k].x1, s[k].b1);
+            acc = v2_mlal(acc, s[k].x2, s[k].b2);
+            acc = v2_mlal(acc, s[k].y1, s[k].a1);
+            acc = v2_mlal(acc, s[k].y2, s[k].a2);
+            s[k].x2 = s[k].x1;
+            s[k].x1 = x;
+            s[k].y2 = s[k].y1;
+            s[k].y1 = x = v2_shl_hi32(acc, shift[k]);
+        }
+
+        l[i] = v2_get_l(x);
+        r[i] = v2_get_r(x);
+    }
+
+    for (int k = 0; k < num; k++) {
+        f[k]->history[0][0] = v2_get_l(s[k].x1);
+        f[k]->history[1][0] = v2_get_r(s[k].x1);
+        f[k]->history[0][1] = v2_get_l(s[k].x2);
+        f[k]->history[1][1] = v2_get_r(s[k].x2);
+        f[k]->history[0][2] = v2_get_l(s[k].y1);
+        f[k]->history[1][2] = v2_get_r(s[k].y1);
+        f[k]->history[0][3] = v2_get_l(s[k].y2);
+        f[k]->history[1][3] = v2_get_r(s[k].y2);
+    }
+}
+#endif /* DSP_HAVE_SIMD */
+
+static void filter_cascade_channel(struct dsp_filter * const f[], int num,
+                                   int32_t *buf, int count, unsigned int c)
+{
+    struct
+    {
+        int32_t coefs[5];
+        int32_t history[4];
+        unsigned int shift;
+    } s[FILTER_CASCADE_MAX];
+
+    for (int k = 0; k < num; k++) {
+        memcpy(s[k].coefs, f[k]->coefs, sizeof (s[k].coefs));
+        memcpy(s[k].history, f[k]->history[c], sizeof (s[k].history));
+        s[k].shift = f[k]->shift;
+    }
+
+    for (int i = 0; i < count; i++) {
+        int32_t x = buf[i];
+
+        for (int k = 0; k < num; k++) {
+            long long acc = (long long) x * s[k].coefs[0];
+            acc += (long long) s[k].history[0] * s[k].coefs[1];
+            acc += (long long) s[k].history[1] * s[k].coefs[2];
+            acc += (long long) s[k].history[2] * s[k].coefs[3];
+            acc += (long long) s[k].history[3] * s[k].coefs[4];
+            s[k].history[1] = s[k].history[0];
+            s[k].history[0] = x;
+            s[k].history[3] = s[k].history[2];
+            x = (acc << s[k].shift) >> 32;
+            s[k].history[2] = x;
+        }
+
+        buf[i] = x;
+    }
+
+    for (int k = 0; k < num; k++)
+        memcpy(f[k]->history[c], s[k].history, sizeof (s[k].history));
+}
+
+void filter_cascade_process(struct dsp_filter * const f[], int num,
+                            int32_t * const buf[], int count,
+                            unsigned int channels)
+{
+    for (; num > 0; f += FILTER_CASCADE_MAX, num -= FILTER_CASCADE_MAX) {
+        int n = MIN(num, FILTER_CASCADE_MAX);
+
+#ifdef DSP_HAVE_SIMD
+        if (DSP_SIMD_ON && channels == 2 && buf[0] != buf[1]) {
+            filter_cascade_stereo(f, n, buf, count);
+            continue;
+        }
+#endif
+
+        for (unsigned int c = 0; c < channels; c++)
+            filter_cascade_channel(f, n, buf[c], count, c);
+    }
+}
+#else /* CPU */
+/**
+ * The assembly filter_process() keeps one filter in registers for a whole
+ * pass, so cascade the filters over short blocks copied to the stack instead.
+ * The source buffer is then only read and written once no matter how many
+ * filters there are. The codec thread stack is in IRAM where there is any,
+ * so the block gets that for free without reserving IRAM of its own.
+ */
+#define FILTER_BLOCK_COUNT 64
+
+void filter_cascade_process(struct dsp_filter * const f[], int num,
+                            int32_t * const buf[], int count,
+                            unsigned int channels)
+{
+    int32_t filter_block[2][FILTER_BLOCK_COUNT];
+    int32_t * const block[2] = { filter_block[0], filter_block[1] };
+
+    if (num <= 1) {
+        if (num == 1)
+            filter_process(f[0], buf, count, channels);
+        return;
+    }
+
+    for (int pos = 0; pos < count; pos += FILTER_BLOCK_COUNT) {
+        int n = MIN(count - pos, FILTER_BLOCK_COUNT);
+
+        for (unsigned int c = 0; c < channels; c++)
+            memcpy(block[c], &buf[c][pos], n * sizeof (int32_t));
+
+        for (int k = 0; k < num; k++)
+            filter_process(f[k], block, n, channels);
+
+        for (unsigned int c = 0; c < channels; c++)
+            memcpy(&buf[c][pos], block[c], n * sizeof (int32_t));
+    }
+}
 #endif /* CPU */
 
 /* ring buffer */
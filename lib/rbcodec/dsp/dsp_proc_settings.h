@@ -31,6 +31,7 @@
 #include "surround.h"
 #include "afr.h"
 #include "pbe.h"
+#include "resample.h"
 #ifdef HAVE_PITCHCONTROL
 #include "tdspeed.h"
 #endif
@@ -25,6 +25,7 @@
 #include "dsp_sample_io.h"
 #include "dsp_proc_entry.h"
 #include "dsp-util.h"
+#include "dsp_simd.h"
 #include <string.h>
 
 #if 0
@@ -55,13 +56,36 @@ void sample_output_mono(struct sample_io_data *this,
     int scale = src->format.output_scale;
     int32_t dc_bias = 1L << (scale - 1);
 
-    do
+#if defined(DSP_SIMD_SSE2)
+    const __m128i bias = _mm_set1_epi32(dc_bias);
+    const __m128i shift = _mm_cvtsi32_si128(scale);
+
+    for (; DSP_SIMD_ON && count >= 4; count -= 4, s0 += 4, d += 8)
+    {
+        __m128i m = _mm_loadu_si128((const __m128i *)s0);
+        m = _mm_sra_epi32(_mm_add_epi32(m, bias), shift);
+        m = _mm_packs_epi32(m, m);
+        _mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi16(m, m));
+    }
+#elif defined(DSP_SIMD_NEON)
+    const int32x4_t bias = vdupq_n_s32(dc_bias);
+    const int32x4_t shift = vdupq_n_s32(-scale);
+
+    for (; DSP_SIMD_ON && count >= 4; count -= 4, s0 += 4, d += 8)
+    {
+        int16x4_t m = vqmovn_s32(vshlq_s32(vaddq_s32(vld1q_s32(s0), bias),
+                                           shift));
+        int16x4x2_t lr = { { m, m } };
+        vst2_s16(d, lr);
+    }
+#endif /* DSP_SIMD_* */
+
+    for (; count > 0; count--)
     {
         int32_t lr = clip_sample_16((*s0++ + dc_bias) >> scale);
         *d++ = lr;
         *d++ = lr;
     }
-    while (--count > 0);
 }
 
 /* write stereo internal format to output format */
@@ -75,12 +99,41 @@ void sample_output_stereo(struct sample_io_data *this,
     int scale = src->format.output_scale;
     int32_t dc_bias = 1L << (scale - 1);
 
-    do
+#if defined(DSP_SIMD_SSE2)
+    const __m128i bias = _mm_set1_epi32(dc_bias);
+    const __m128i shift = _mm_cvtsi32_si128(scale);
+
+    for (; DSP_SIMD_ON && count >= 4; count -= 4, s0 += 4, s1 += 4, d += 8)
+    {
+        __m128i l = _mm_loadu_si128((const __m128i *)s0);
+        __m128i r = _mm_loadu_si128((const __m128i *)s1);
+        l = _mm_sra_epi32(_mm_add_epi32(l, bias), shift);
+        r = _mm_sra_epi32(_mm_add_epi32(r, bias), shift);
+        /* Saturating pack is the same as clip_sample_16() */
+        _mm_storeu_si128((__m128i *)d,
+                         _mm_packs_epi32(_mm_unpacklo_epi32(l, r),
+                                         _mm_unpackhi_epi32(l, r)));
+    }
+#elif defined(DSP_SIMD_NEON)
+    const int32x4_t bias = vdupq_n_s32(dc_bias);
+    const int32x4_t shift = vdupq_n_s32(-scale);
+
+    for (; DSP_SIMD_ON && count >= 4; count -= 4, s0 += 4, s1 += 4, d += 8)
+    {
+        int16x4x2_t lr;
+        lr.val[0] = vqmovn_s32(vshlq_s32(vaddq_s32(vld1q_s32(s0), bias),
+                                         shift));
+        lr.val[1] = vqmovn_s32(vshlq_s32(vaddq_s32(vld1q_s32(s1), bias),
+                                         shift));
+        vst2_s16(d, lr);
+    }
+#endif /* DSP_SIMD_* */
+
+    for (; count > 0; count--)
     {
         *d++ = clip_sample_16((*s0++ + dc_bias) >> scale);
         *d++ = clip_sample_16((*s1++ + dc_bias) >> scale);
     }
-    while (--count > 0);
 }
 #endif /* CPU */
 
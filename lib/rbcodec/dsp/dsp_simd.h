@@ -0,0 +1,236 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * Copyright (C) 2026 by the Rockbox developers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+#ifndef DSP_SIMD_H
+#define DSP_SIMD_H
+
+/* Vector helpers for the generic C DSP loops on hosted targets.
+ *
+ * ARM and ColdFire targets have hand-written assembly for the hot loops and
+ * never use these. Everything else gets SSE2 (x86-64 always has it) or NEON
+ * (AArch64) when the compiler targets it; otherwise DSP_HAVE_SIMD stays
+ * undefined and the plain C loops are used.
+ *
+ * Most stages are recursive per channel, so the "v2" type holds one sample
+ * for each of the two channels and the loops process both channels at once.
+ * All operations produce exactly the same results as the C code, including
+ * FRACMUL truncation and 32-bit wraparound. */
+
+#if !defined(CPU_COLDFIRE) && !defined(CPU_ARM)
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define DSP_SIMD_SSE2
+#define DSP_HAVE_SIMD
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DSP_SIMD_NEON
+#define DSP_HAVE_SIMD
+#endif
+#endif /* CPU */
+
+#ifdef DSP_HAVE_SIMD
+#include "gcc_extensions.h"
+#endif
+
+/* Test builds (warble) can switch the vector paths off at runtime to check
+ * them against the C code; everywhere else the choice is made at compile
+ * time and DSP_SIMD_ON folds away */
+#ifdef DSP_SIMD_TEST
+extern bool dsp_simd_off;
+#define DSP_SIMD_ON (!dsp_simd_off)
+#else
+#define DSP_SIMD_ON 1
+#endif
+
+#if defined(DSP_SIMD_SSE2)
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+
+/* Channels live in the even 32-bit lanes (0 = left, 2 = right) so that each
+ * one can be widened to 64 bits in place by the multiplies */
+typedef __m128i v2s32;
+typedef __m128i v2s64;
+
+static FORCE_INLINE v2s32 v2_set(int32_t l, int32_t r)
+{
+    return _mm_set_epi32(0, r, 0, l);
+}
+
+static FORCE_INLINE v2s32 v2_dup(int32_t x)
+{
+    return _mm_set1_epi32(x);
+}
+
+static FORCE_INLINE int32_t v2_get_l(v2s32 v)
+{
+    return _mm_cvtsi128_si32(v);
+}
+
+static FORCE_INLINE int32_t v2_get_r(v2s32 v)
+{
+    return _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+}
+
+/* Load/store an adjacent {left, right} pair */
+static FORCE_INLINE v2s32 v2_load(const int32_t *p)
+{
+    return _mm_shuffle_epi32(_mm_loadl_epi64((const __m128i *)p),
+                             _MM_SHUFFLE(1, 1, 1, 0));
+}
+
+static FORCE_INLINE void v2_store(int32_t *p, v2s32 v)
+{
+    _mm_storel_epi64((__m128i *)p,
+                     _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 2, 0)));
+}
+
+static FORCE_INLINE v2s32 v2_add(v2s32 a, v2s32 b)
+{
+    return _mm_add_epi32(a, b);
+}
+
+static FORCE_INLINE v2s32 v2_sub(v2s32 a, v2s32 b)
+{
+    return _mm_sub_epi32(a, b);
+}
+
+static FORCE_INLINE v2s32 v2_sar(v2s32 a, int n)
+{
+    return _mm_sra_epi32(a, _mm_cvtsi32_si128(n));
+}
+
+/* Exchange the left and right channels */
+static FORCE_INLINE v2s32 v2_swap(v2s32 a)
+{
+    return _mm_shuffle_epi32(a, _MM_SHUFFLE(1, 0, 3, 2));
+}
+
+/* (int64_t)a * b */
+static FORCE_INLINE v2s64 v2_mull(v2s32 a, v2s32 b)
+{
+#ifdef __SSE4_1__
+    return _mm_mul_epi32(a, b);
+#else
+    /* SSE2 only multiplies unsigned; fix up the high word for the signs */
+    v2s64 p = _mm_mul_epu32(a, b);
+    __m128i fix = _mm_add_epi32(_mm_and_si128(_mm_srai_epi32(a, 31), b),
+                                _mm_and_si128(_mm_srai_epi32(b, 31), a));
+    return _mm_sub_epi64(p, _mm_slli_epi64(fix, 32));
+#endif
+}
+
+/* acc + (int64_t)a * b */
+static FORCE_INLINE v2s64 v2_mlal(v2s64 acc, v2s32 a, v2s32 b)
+{
+    return _mm_add_epi64(acc, v2_mull(a, b));
+}
+
+/* (int32_t)((acc << shift) >> 32) */
+static FORCE_INLINE v2s32 v2_shl_hi32(v2s64 acc, int shift)
+{
+    return _mm_srli_epi64(_mm_sll_epi64(acc, _mm_cvtsi32_si128(shift)), 32);
+}
+
+/* FRACMUL(a, b) */
+static FORCE_INLINE v2s32 v2_fracmul(v2s32 a, v2s32 b)
+{
+    return _mm_srli_epi64(v2_mull(a, b), 31);
+}
+
+#elif defined(DSP_SIMD_NEON)
+
+typedef int32x2_t v2s32;
+typedef int64x2_t v2s64;
+
+static FORCE_INLINE v2s32 v2_set(int32_t l, int32_t r)
+{
+    return vset_lane_s32(r, vdup_n_s32(l), 1);
+}
+
+static FORCE_INLINE v2s32 v2_dup(int32_t x)
+{
+    return vdup_n_s32(x);
+}
+
+static FORCE_INLINE int32_t v2_get_l(v2s32 v)
+{
+    return vget_lane_s32(v, 0);
+}
+
+static FORCE_INLINE int32_t v2_get_r(v2s32 v)
+{
+    return vget_lane_s32(v, 1);
+}
+
+static FORCE_INLINE v2s32 v2_load(const int32_t *p)
+{
+    return vld1_s32(p);
+}
+
+static FORCE_INLINE void v2_store(int32_t *p, v2s32 v)
+{
+    vst1_s32(p, v);
+}
+
+static FORCE_INLINE v2s32 v2_add(v2s32 a, v2s32 b)
+{
+    return vadd_s32(a, b);
+}
+
+static FORCE_INLINE v2s32 v2_sub(v2s32 a, v2s32 b)
+{
+    return vsub_s32(a, b);
+}
+
+static FORCE_INLINE v2s32 v2_sar(v2s32 a, int n)
+{
+    return vshl_s32(a, vdup_n_s32(-n));
+}
+
+static FORCE_INLINE v2s32 v2_swap(v2s32 a)
+{
+    return vrev64_s32(a);
+}
+
+static FORCE_INLINE v2s64 v2_mull(v2s32 a, v2s32 b)
+{
+    return vmull_s32(a, b);
+}
+
+static FORCE_INLINE v2s64 v2_mlal(v2s64 acc, v2s32 a, v2s32 b)
+{
+    return vmlal_s32(acc, a, b);
+}
+
+static FORCE_INLINE v2s32 v2_shl_hi32(v2s64 acc, int shift)
+{
+    return vshrn_n_s64(vshlq_s64(acc, vdupq_n_s64(shift)), 32);
+}
+
+/* Not vqdmulh: FRACMUL truncates rather than saturates -1 * -1 */
+static FORCE_INLINE v2s32 v2_fracmul(v2s32 a, v2s32 b)
+{
+    return vmovn_s64(vshrq_n_s64(vmull_s32(a, b), 31));
+}
+
+#endif /* DSP_SIMD_* */
+
+#endif /* DSP_SIMD_H */
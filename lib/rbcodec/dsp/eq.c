@@ -161,16 +161,21 @@ void dsp_eq_enable(bool enable)
         dsp_proc_activate(dsp, DSP_PROC_EQUALIZER, true);
 }
 
-/* Apply EQ filters to those bands that have got it switched on. */
+/* Apply EQ filters to those bands that have got it switched on. All bands
+   are cascaded in one pass over the buffer. */
 static void eq_process(struct dsp_proc_entry *this,
                        struct dsp_buffer **buf_p)
 {
     struct dsp_buffer *buf = *buf_p;
     int count = buf->remcount;
     unsigned int channels = buf->format.num_channels;
+    struct dsp_filter *chain[EQ_NUM_BANDS];
+    int num = 0;
 
     FOR_EACH_ENB_BAND(b)
-        filter_process(&eq_data.filters[*b], buf->p32, count, channels);
+        chain[num++] = &eq_data.filters[*b];
+
+    filter_cascade_process(chain, num, buf->p32, count, channels);
 
     (void)this;
 }
@@ -27,11 +27,18 @@
 #include "dsp_proc_entry.h"
 #include "dsp_misc.h"
 #include "resample.h"
+#include "dsp_simd.h"
+#include "core_alloc.h"
 #include <string.h>
 
 /**
  * Linear interpolation resampling that introduces a one sample delay because
  * of our inability to look into the future at the end of a frame.
+ *
+ * Optionally, the audio DSP uses a polyphase windowed-sinc filter instead
+ * when the ratio of the rates is a small fraction (44.1 <-> 48 kHz, 2x, 4x,
+ * ...). This costs RESAMPLE_SINC_TAPS multiplies per sample and channel and
+ * delays the output by RESAMPLE_SINC_TAPS/2 samples.
  */
 
 #if 1 /* Set to '0' to enable debug messages */
@@ -41,6 +48,13 @@
 
 #define RESAMPLE_BUF_COUNT 192 /* Per channel, per DSP */
 
+#define RESAMPLE_SINC_TAPS       64  /* Filter length per phase */
+#define RESAMPLE_SINC_MAX_PHASES 160 /* 44.1 kHz -> 48 kHz */
+#define RESAMPLE_SINC_MAX_STEP   4   /* Downsample at most by 4 */
+#define RESAMPLE_SINC_CUTOFF     0x7851eb85 /* 0.94 of Nyquist, s0.31 */
+
+#define RESAMPLE_SET_QUALITY (DSP_PROC_SETTING+DSP_PROC_RESAMPLE)
+
 /* CODEC_IDX_AUDIO = left and right, CODEC_IDX_VOICE = mono */
 static int32_t resample_out_bufs[3][RESAMPLE_BUF_COUNT] IBSS_ATTR;
 
@@ -56,16 +70,53 @@ static struct resample_data
     unsigned int frequency_out;     /* Resampler output samplerate */
     struct dsp_buffer resample_buf; /* Buffer descriptor for resampled data */
     int32_t *resample_out_p[2];     /* Actual output buffer pointers */
+    int quality;                    /* Requested enum resample_quality */
+    int (*resample_fn)(struct resample_data *data, struct dsp_buffer *src,
+                       struct dsp_buffer *dst); /* Current worker */
 } resample_data[DSP_COUNT] IBSS_ATTR;
 
+/* Polyphase filter state; only used by the audio DSP */
+static struct resample_sinc
+{
+    int handle;                /* Coefficient table, phases x taps */
+    bool is_float;             /* Table and history hold floats */
+    unsigned int phases;       /* Output samples per 'step' input samples */
+    unsigned int step;         /* Input samples per 'phases' output samples */
+    unsigned int phase;        /* Current phase */
+    unsigned int need;         /* Input samples to read before next output */
+    unsigned int pos;          /* Newest sample in history */
+    union                      /* Last input samples, stored twice so the
+                                  filter always sees them contiguously */
+    {
+        int32_t i[2][2*RESAMPLE_SINC_TAPS];
+#ifdef HAVE_FPU
+        float f[2][2*RESAMPLE_SINC_TAPS];
+#endif
+    } history;
+} resample_sinc = { .handle = -1 };
+
 /* Actual worker function. Implemented here or in target assembly code. */
 int resample_hermite(struct resample_data *data, struct dsp_buffer *src,
                      struct dsp_buffer *dst);
+static int resample_sinc_process(struct resample_data *data,
+                                 struct dsp_buffer *src,
+                                 struct dsp_buffer *dst);
+
+static void resample_sinc_flush(void)
+{
+    resample_sinc.phase = 0;
+    resample_sinc.need = 1;
+    resample_sinc.pos = 0;
+    memset(&resample_sinc.history, 0, sizeof (resample_sinc.history));
+}
 
 static void resample_flush_data(struct resample_data *data)
 {
     data->phase = 0;
     memset(&data->history, 0, sizeof (data->history));
+
+    if (data->resample_fn == resample_sinc_process)
+        resample_sinc_flush();
 }
 
 static void resample_flush(struct dsp_proc_entry *this)
@@ -75,6 +126,249 @@ static void resample_flush(struct dsp_proc_entry *this)
     resample_flush_data(data);
 }
 
+/* The table is allocated at its largest size when the sinc resampler is
+ * selected, so the codec thread only ever refills it */
+static void resample_sinc_alloc(void)
+{
+    if (resample_sinc.handle >= 0)
+        return;
+
+    resample_sinc.handle = core_alloc(RESAMPLE_SINC_MAX_PHASES *
+                                      RESAMPLE_SINC_TAPS * sizeof (int32_t));
+    resample_sinc.phases = 0; /* Contents not made yet */
+}
+
+static void resample_sinc_free(void)
+{
+    if (resample_sinc.handle < 0)
+        return;
+
+    core_free(resample_sinc.handle);
+    resample_sinc.handle = -1;
+}
+
+/* Fill in the s1.30 coefficients for each of the 'phases' output positions
+ * between two input samples. Tap i of phase p weights the input sample that
+ * is i samples older than the newest one. */
+static void resample_sinc_make_table(int32_t *c, unsigned int phases,
+                                     unsigned int step)
+{
+    /* Blackman-Harris window terms, s1.30 */
+    static const int32_t wa[4] =
+        { 385204879, 524297395, 151698245, 12541305 };
+
+    /* Cut off below the lower of the two Nyquist frequencies */
+    const int64_t fc = phases < step ?
+        (int64_t)RESAMPLE_SINC_CUTOFF * phases / step : RESAMPLE_SINC_CUTOFF;
+    const int64_t pi = 1686629713; /* s2.29 */
+
+    for (unsigned int p = 0; p < phases; p++, c += RESAMPLE_SINC_TAPS)
+    {
+        int64_t sum = 0;
+
+        for (int i = 0; i < RESAMPLE_SINC_TAPS; i++)
+        {
+            /* Distance from the output position in 1/phases input samples;
+               always within +-RESAMPLE_SINC_TAPS/2 input samples */
+            int32_t d = (RESAMPLE_SINC_TAPS/2 - i) * (int32_t)phases - (int32_t)p;
+            int32_t sinc = 1 << 30;
+            long s, c1, c2, c3;
+
+            if (d != 0)
+            {
+                /* sin(pi*fc*d) / (pi*fc*d) */
+                int64_t x = fc * d / phases; /* s.31 */
+                int64_t theta = ((x >> 3) * (pi >> 1)) >> 28; /* s.28 */
+                s = fp_sincos((uint32_t)x, &c1);
+                sinc = ((int64_t)s << 27) / theta;
+            }
+
+            /* Window spans -1/2...+1/2 turn over the whole filter */
+            uint32_t wph = (int64_t)d * 0x100000000ll /
+                           (int64_t)(phases * RESAMPLE_SINC_TAPS);
+            fp_sincos(wph, &c1);
+            fp_sincos(2*wph, &c2);
+            fp_sincos(3*wph, &c3);
+
+            int32_t w = wa[0] + FRACMUL(c1, wa[1]) + FRACMUL(c2, wa[2]) +
+                        FRACMUL(c3, wa[3]);
+
+            c[i] = FRACMUL(sinc, w);
+            sum += c[i];
+        }
+
+        /* Unity gain at DC for every phase */
+        for (int i = 0; i < RESAMPLE_SINC_TAPS; i++)
+            c[i] = (int64_t)c[i] * (1 << 30) / sum;
+    }
+}
+
+/* Set up the polyphase filter for the ratio fin:fout. Returns false if the
+ * ratio needs too many phases or the table couldn't be allocated. */
+static bool resample_sinc_setup(struct resample_data *data,
+                                unsigned int fin, unsigned int fout)
+{
+    struct resample_sinc *st = &resample_sinc;
+    unsigned int a = fin, b = fout;
+    bool is_float = false;
+
+    while (b != 0)
+    {
+        unsigned int t = a % b;
+        a = b;
+        b = t;
+    }
+
+    unsigned int phases = fout / a;
+    unsigned int step = fin / a;
+
+#ifdef HAVE_FPU
+    is_float = data->quality == RESAMPLE_QUALITY_SINC_FLOAT;
+#else
+    (void)data;
+#endif
+
+    if (phases > RESAMPLE_SINC_MAX_PHASES ||
+        step > phases*RESAMPLE_SINC_MAX_STEP)
+    {
+        DEBUGF("  DSP_PROC_RESAMPLE- no sinc for %u:%u\n", step, phases);
+        return false;
+    }
+
+    if (st->handle < 0)
+        return false;
+
+    if (st->phases == phases && st->step == step && st->is_float == is_float)
+        return true; /* Table is current */
+
+    int32_t *c = core_get_data(st->handle);
+    resample_sinc_make_table(c, phases, step);
+
+#ifdef HAVE_FPU
+    if (is_float)
+    {
+        for (unsigned int i = 0; i < phases*RESAMPLE_SINC_TAPS; i++)
+        {
+            float f = c[i] * (1.0f / (1 << 30));
+            memcpy(&c[i], &f, sizeof (f));
+        }
+    }
+#endif
+
+    st->phases = phases;
+    st->step = step;
+    st->is_float = is_float;
+    return true;
+}
+
+static inline int32_t resample_sinc_dot(const int32_t *x, const int32_t *h)
+{
+    int64_t acc0 = 0, acc1 = 0;
+
+    for (int i = 0; i < RESAMPLE_SINC_TAPS; i += 2)
+    {
+        acc0 += (int64_t)x[i+0] * h[i+0];
+        acc1 += (int64_t)x[i+1] * h[i+1];
+    }
+
+    return (acc0 + acc1) >> 30;
+}
+
+#ifdef HAVE_FPU
+static inline int32_t resample_sinc_dot_float(const float *x, const float *h)
+{
+    /* Independent partial sums let the compiler vectorize without needing
+       -ffast-math */
+    float acc[4] = { 0, 0, 0, 0 };
+
+    for (int i = 0; i < RESAMPLE_SINC_TAPS; i += 4)
+    {
+        acc[0] += x[i+0] * h[i+0];
+        acc[1] += x[i+1] * h[i+1];
+        acc[2] += x[i+2] * h[i+2];
+        acc[3] += x[i+3] * h[i+3];
+    }
+
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+#endif /* HAVE_FPU */
+
+/* Polyphase worker: each output sample is one phase of the filter applied
+ * to the last RESAMPLE_SINC_TAPS input samples */
+static int resample_sinc_process(struct resample_data *data,
+                                 struct dsp_buffer *src,
+                                 struct dsp_buffer *dst)
+{
+    struct resample_sinc *st = &resample_sinc;
+    const int32_t *coefs = core_get_data(st->handle);
+    int channels = src->format.num_channels;
+    int count = src->remcount;
+    int consumed = 0, out = 0;
+    (void)data;
+
+    /* Restore state */
+    unsigned int phase = st->phase;
+    unsigned int need = st->need;
+    unsigned int pos = st->pos;
+
+    while (out < dst->bufcount)
+    {
+        /* Read input up to the next output position */
+        for (; need > 0; need--, consumed++)
+        {
+            if (consumed >= count)
+                goto done;
+
+            pos = (pos > 0 ? pos : RESAMPLE_SINC_TAPS) - 1;
+
+            for (int ch = 0; ch < channels; ch++)
+            {
+                int32_t x = src->p32[ch][consumed];
+#ifdef HAVE_FPU
+                if (st->is_float)
+                {
+                    st->history.f[ch][pos] = x;
+                    st->history.f[ch][pos + RESAMPLE_SINC_TAPS] = x;
+                    continue;
+                }
+#endif
+                st->history.i[ch][pos] = x;
+                st->history.i[ch][pos + RESAMPLE_SINC_TAPS] = x;
+            }
+        }
+
+        const int32_t *h = coefs + phase*RESAMPLE_SINC_TAPS;
+
+        for (int ch = 0; ch < channels; ch++)
+        {
+#ifdef HAVE_FPU
+            if (st->is_float)
+            {
+                dst->p32[ch][out] =
+                    resample_sinc_dot_float(&st->history.f[ch][pos],
+                                            (const float *)h);
+                continue;
+            }
+#endif
+            dst->p32[ch][out] = resample_sinc_dot(&st->history.i[ch][pos], h);
+        }
+
+        out++;
+
+        /* Step to the next output position */
+        for (phase += st->step; phase >= st->phases; phase -= st->phases)
+            need++;
+    }
+
+done:
+    st->phase = phase;
+    st->need = need;
+    st->pos = pos;
+
+    dst->remcount = out;
+    return consumed;
+}
+
 static bool resample_new_delta(struct resample_data *data,
                                struct sample_format *format,
                                unsigned int fout)
@@ -94,10 +388,122 @@ static bool resample_new_delta(struct resample_data *data,
         return false;
     }
 
+    data->resample_fn = resample_hermite;
+
+    if (data->quality != RESAMPLE_QUALITY_HERMITE &&
+        resample_sinc_setup(data, frequency, fout))
+    {
+        data->resample_fn = resample_sinc_process;
+        resample_sinc_flush();
+    }
+
     return true;
 }
 
+static void resample_set_quality(struct resample_data *data,
+                                 struct dsp_config *dsp, int quality)
+{
+    if (quality == data->quality)
+        return;
+
+    data->quality = quality;
+
+    if (quality == RESAMPLE_QUALITY_HERMITE)
+    {
+        data->resample_fn = resample_hermite;
+        resample_flush_data(data);
+        resample_sinc_free();
+    }
+    else
+    {
+        resample_sinc_alloc();
+    }
+
+    data->frequency = 0; /* Redo the setup at the next format update */
+    dsp_proc_want_format_update(dsp, DSP_PROC_RESAMPLE);
+}
+
 #if !defined(CPU_COLDFIRE) && !defined(CPU_ARM)
+#ifdef DSP_HAVE_SIMD
+/* Both channels share the phase, so interpolate them side by side. This is
+ * the same computation as resample_hermite() below. */
+static int resample_hermite_stereo(struct resample_data *data,
+                                   struct dsp_buffer *src,
+                                   struct dsp_buffer *dst)
+{
+    uint32_t count = MIN(src->remcount, 0x8000);
+    uint32_t delta = data->delta;
+    const int32_t *sl = src->p32[0], *sr = src->p32[1];
+    int32_t *dl = dst->p32[0], *dr = dst->p32[1];
+    int32_t *dmax = dl + dst->bufcount;
+    int32_t (*h)[3] = data->history;
+
+    /* Restore state */
+    uint32_t phase = data->phase;
+    uint32_t pos = MIN(phase >> 16, count);
+
+    while (pos < count && dl < dmax)
+    {
+        v2s32 x0, x1, x2, x3;
+
+        if (pos < 3)
+        {
+            x3 = v2_set(h[0][pos+0], h[1][pos+0]);
+            x2 = pos < 2 ? v2_set(h[0][pos+1], h[1][pos+1]) :
+                           v2_set(sl[pos-2], sr[pos-2]);
+            x1 = pos < 1 ? v2_set(h[0][pos+2], h[1][pos+2]) :
+                           v2_set(sl[pos-1], sr[pos-1]);
+        }
+        else
+        {
+            x3 = v2_set(sl[pos-3], sr[pos-3]);
+            x2 = v2_set(sl[pos-2], sr[pos-2]);
+            x1 = v2_set(sl[pos-1], sr[pos-1]);
+        }
+
+        x0 = v2_set(sl[pos], sr[pos]);
+
+        v2s32 frac = v2_dup((phase & 0xffff) << 15);
+
+        /* polynomial coefficients */
+        v2s32 c1 = v2_sar(v2_sub(x1, x3), 1);
+        v2s32 v = v2_sub(x1, x2);
+        v2s32 c2 = v2_sub(v2_add(x3, v2_add(v, v)),
+                          v2_sar(v2_add(x0, x2), 1));
+        v2s32 c3 = v2_sub(v2_sar(v2_sub(v2_sub(x0, x3), v), 1), v);
+
+        /* Evaluate polynomial at time 'frac'; Horner's rule. */
+        v2s32 acc;
+        acc = v2_add(v2_fracmul(c3, frac), c2);
+        acc = v2_add(v2_fracmul(acc, frac), c1);
+        acc = v2_add(v2_fracmul(acc, frac), x2);
+
+        *dl++ = v2_get_l(acc);
+        *dr++ = v2_get_r(acc);
+
+        phase += delta;
+        pos = phase >> 16;
+    }
+
+    pos = MIN(pos, count);
+
+    /* Save delay samples for next time */
+    for (int ch = 0; ch < 2; ch++)
+    {
+        const int32_t *s = src->p32[ch];
+        h[ch][0] = pos < 3 ? h[ch][pos+0] : s[pos-3];
+        h[ch][1] = pos < 2 ? h[ch][pos+1] : s[pos-2];
+        h[ch][2] = pos < 1 ? h[ch][pos+2] : s[pos-1];
+    }
+
+    /* Wrap phase accumulator back to start of next frame. */
+    data->phase = phase - (pos << 16);
+
+    dst->remcount = dl - dst->p32[0];
+    return pos;
+}
+#endif /* DSP_HAVE_SIMD */
+
 int resample_hermite(struct resample_data *data, struct dsp_buffer *src,
                      struct dsp_buffer *dst)
 {
@@ -107,6 +513,11 @@ int resample_hermite(struct resample_data *data, struct dsp_buffer *src,
     uint32_t phase, pos;
     int32_t *d;
 
+#ifdef DSP_HAVE_SIMD
+    if (DSP_SIMD_ON && ch == 1)
+        return resample_hermite_stereo(data, src, dst);
+#endif
+
     do
     {
         const int32_t *s = src->p32[ch];
@@ -212,7 +623,7 @@ static void resample_process(struct dsp_proc_entry *this,
     {
         dst->bufcount = RESAMPLE_BUF_COUNT;
 
-        int consumed = resample_hermite(data, src, dst);
+        int consumed = data->resample_fn(data, src, dst);
 
         /* Advance src by consumed amount */
         if (consumed > 0)
@@ -291,6 +702,14 @@ void dsp_resample_init(struct dsp_config *dsp, unsigned int dsp_id)
     resample_data[dsp_id].resample_out_p[1] = rbuf;
 }
 
+/* Select the resampler used by the audio DSP; see enum resample_quality.
+ * The sinc table is allocated or freed right here, not on the codec thread. */
+void dsp_set_resample_quality(int quality)
+{
+    struct dsp_config *dsp = dsp_get_config(CODEC_IDX_AUDIO);
+    dsp_configure(dsp, RESAMPLE_SET_QUALITY, quality);
+}
+
 static void resample_proc_init(struct dsp_proc_entry *this,
                                struct dsp_config *dsp)
 {
@@ -298,6 +717,7 @@ static void resample_proc_init(struct dsp_proc_entry *this,
     this->data = (intptr_t)data;
     dsp_proc_set_in_place(dsp, DSP_PROC_RESAMPLE, false);
     data->frequency_out = DSP_OUT_DEFAULT_HZ;
+    data->resample_fn = resample_hermite;
     this->process = resample_process;
 }
 
@@ -331,6 +751,10 @@ static intptr_t resample_configure(struct dsp_proc_entry *this,
     case DSP_SET_OUT_FREQUENCY:
         dsp_proc_want_format_update(dsp, DSP_PROC_RESAMPLE);
         break;
+
+    case RESAMPLE_SET_QUALITY:
+        resample_set_quality((void *)this->data, dsp, value);
+        break;
     }
 
     return retval;
@@ -21,6 +21,14 @@
 #ifndef _DSP_RESAMPLE_H
 #define _DSP_RESAMPLE_H
 
+enum resample_quality
+{
+    RESAMPLE_QUALITY_HERMITE = 0, /* 4-point Hermite spline (default) */
+    RESAMPLE_QUALITY_SINC,        /* Polyphase windowed sinc, fixed-point */
+    RESAMPLE_QUALITY_SINC_FLOAT,  /* Same with float math (HAVE_FPU only) */
+};
+
+void dsp_set_resample_quality(int quality);
 void dsp_resample_init(struct dsp_config *dsp, unsigned int dsp_id) INIT_ATTR;
 
 #endif /* _DSP_RESAMPLE_H */
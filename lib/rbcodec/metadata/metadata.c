@@ -411,7 +411,7 @@ bool get_metadata_ex(struct mp3entry* id3, int fd, const char* trackname, int fl
     bool success = true;
     const struct afmt_entry *entry;
     int logfd = 0;
-    DEBUGF("Read metadata for %s\n", trackname);
+    logf("Read metadata for %s", trackname);
     if (write_metadata_log)
     {
         logfd = open("/metadata.log", O_WRONLY | O_APPEND | O_CREAT, 0666);
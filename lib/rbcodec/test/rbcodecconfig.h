@@ -1,2 +1,9 @@
 #include "../rbcodecconfig-example.h"
 #include "system.h"
+
+#ifndef __ASSEMBLER__
+/* Time source for the per-stage DSP statistics, see warble.c */
+uint32_t dsp_profile_time(void);
+#define DSP_PROFILE_TIME()  dsp_profile_time()
+#define DSP_PROFILE_TIME_HZ 1000000000
+#endif
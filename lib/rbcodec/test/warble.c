@@ -23,23 +23,35 @@
 #include <SDL.h>
 #include <dlfcn.h>
 #include <endian.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include "buffering.h" /* TYPE_PACKET_AUDIO */
 #include "kernel.h"
 #include "core_alloc.h"
 #include "codecs.h"
 #include "dsp_core.h"
+#include "dsp_simd.h"
+#include "crossfeed.h"
+#include "eq.h"
 #include "metadata.h"
+#include "resample.h"
 #include "settings.h"
 #include "sound.h"
 #include "tdspeed.h"
+#ifdef HAVE_SW_TONE_CONTROLS
+#include "tone_controls.h"
+#endif
 #include "platform.h"
 
 /***************** EXPORTED *****************/
@@ -97,7 +109,7 @@ off_t filesize(int fd)
 
 /***************** INTERNAL *****************/
 
-static enum { MODE_PLAY, MODE_WRITE } mode;
+static enum { MODE_PLAY, MODE_WRITE, MODE_BENCH, MODE_SIMD_CHECK } mode;
 static bool use_dsp = true;
 static bool enable_loop = false;
 static const char *config = "";
@@ -379,6 +391,190 @@ static void playback_pcm(int16_t *pcm, int count)
     }
 }
 
+/***** MODE_BENCH *****/
+
+/* MODE_BENCH decodes a list of files as fast as possible and discards the
+ * output. The codecs and the DSP keep their state in globals, so every file is
+ * decoded in a forked child process; the parent only hands out files to up to
+ * bench_jobs children at a time and collects the result each one sends back
+ * through a pipe. Times are CPU time of the child, so running several jobs in
+ * parallel does not skew them as long as there are enough cores. The DSP
+ * stage times come from the DSP core itself (DSP_GET_PROC_STATS) and are
+ * wall-clock time. */
+
+struct bench_stats {
+    unsigned long files;
+    unsigned long failed;
+    uint64_t bytes;       /* input file size */
+    uint64_t samples;     /* samples output by the codec */
+    uint64_t length_ms;   /* duration of the decoded audio */
+    uint64_t decode_ns;   /* CPU time spent in the codec and the DSP */
+    uint64_t dsp_ns;      /* part of decode_ns spent in dsp_process() */
+    long peak_rss_kb;
+};
+
+struct bench_result {
+    int codectype;
+    struct bench_stats stats;
+    int num_stages;
+    struct dsp_proc_stats stages[DSP_PROC_STATS_MAX];
+};
+
+static int bench_jobs = 0;
+static bool bench_json = false;
+static struct bench_result bench;
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* DSP_PROFILE_TIME() for the per-stage statistics; see rbcodecconfig.h */
+uint32_t dsp_profile_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/***** MODE_SIMD_CHECK *****/
+
+/* Switches the vector DSP code off at runtime; see dsp_simd.h */
+bool dsp_simd_off = false;
+
+/* Not a multiple of 4 so that the vector loops leave a tail */
+#define SIMD_CHECK_FRAMES 4099
+
+/* Run the same noise through the DSP and return the number of output frames */
+static int simd_check_run(bool simd_off, int in_hz, int stereo_mode,
+                          int16_t *out, int outsize)
+{
+    static int32_t in[2][SIMD_CHECK_FRAMES];
+    struct dsp_config *dsp = dsp_get_config(CODEC_IDX_AUDIO);
+    uint32_t seed = 0x12345678;
+    int outcount = 0;
+
+    /* Full scale 28-bit noise, so the output clips now and then */
+    for (int i = 0; i < SIMD_CHECK_FRAMES; i++) {
+        for (int c = 0; c < 2; c++) {
+            seed = seed * 1664525 + 1013904223;
+            in[c][i] = (int32_t)seed >> 3;
+        }
+    }
+
+    dsp_simd_off = simd_off;
+    dsp_configure(dsp, DSP_SET_FREQUENCY, in_hz);
+    dsp_configure(dsp, DSP_SET_SAMPLE_DEPTH, 28);
+    dsp_configure(dsp, DSP_SET_STEREO_MODE, stereo_mode);
+    dsp_configure(dsp, DSP_FLUSH, 0);
+
+    /* Uneven blocks, like a codec would insert them */
+    for (int pos = 0; pos < SIMD_CHECK_FRAMES;) {
+        struct dsp_buffer src;
+        src.remcount = MIN(SIMD_CHECK_FRAMES - pos, 1001);
+        src.pin[0] = &in[0][pos];
+        src.pin[1] = &in[1][pos];
+        src.proc_mask = 0;
+        pos += src.remcount;
+
+        while (1) {
+            struct dsp_buffer dst;
+            dst.remcount = 0;
+            dst.p16out = &out[2 * outcount];
+            dst.bufcount = MIN(outsize - outcount, 512);
+
+            dsp_process(dsp, &src, &dst);
+            outcount += dst.remcount;
+
+            if (dst.remcount <= 0 && src.remcount <= 0)
+                break;
+        }
+    }
+
+    return outcount;
+}
+
+/* Compare the output of the vector DSP code with the plain C code; they
+ * must match bit for bit */
+static int simd_check(void)
+{
+    static const struct {
+        const char *name;
+        int in_hz;
+        int stereo_mode;
+    } runs[] = {
+        { "stereo",           DSP_OUT_DEFAULT_HZ, STEREO_NONINTERLEAVED },
+        { "stereo resampled", 32000,              STEREO_NONINTERLEAVED },
+        { "mono",             DSP_OUT_DEFAULT_HZ, STEREO_MONO },
+        { "mono resampled",   48000,              STEREO_MONO },
+    };
+    /* Room for upsampling by up to 2x */
+    static int16_t out[2][2 * 2 * SIMD_CHECK_FRAMES];
+    const int outsize = ARRAYLEN(out[0]) / 2;
+    int failed = 0;
+
+#ifndef DSP_HAVE_SIMD
+    printf("note: this build has no vector DSP code\n");
+#endif
+
+    dsp_init();
+    memset(&global_settings, 0, sizeof(global_settings));
+
+    struct dsp_config *dsp = dsp_get_config(CODEC_IDX_AUDIO);
+    dsp_configure(dsp, DSP_SET_OUT_FREQUENCY, DSP_OUT_DEFAULT_HZ);
+    dsp_configure(dsp, DSP_RESET, 0);
+    dsp_dither_enable(false);
+    dsp_set_resample_quality(0);
+
+    /* Switch on every stage that has a vector path */
+    static const struct eq_band_setting eq[] = {
+        { 64, 10, 60 }, { 1000, 7, -45 }, { 12000, 10, 30 },
+    };
+    dsp_eq_enable(true);
+    dsp_set_eq_precut(6);
+    for (unsigned int i = 0; i < ARRAYLEN(eq); i++)
+        dsp_set_eq_coefs(i, &eq[i]);
+
+    dsp_set_crossfeed_type(CROSSFEED_TYPE_CUSTOM);
+    dsp_set_crossfeed_direct_gain(-15);
+    dsp_set_crossfeed_cross_params(-60, -160, 700);
+
+#ifdef HAVE_SW_TONE_CONTROLS
+    tone_set_bass(60);
+    tone_set_treble(-40);
+    tone_set_prescale(60);
+#endif
+
+    for (unsigned int i = 0; i < ARRAYLEN(runs); i++) {
+        int count[2];
+
+        for (int off = 0; off < 2; off++) {
+            count[off] = simd_check_run(off, runs[i].in_hz,
+                                        runs[i].stereo_mode,
+                                        out[off], outsize);
+        }
+
+        int diff = count[0] != count[1] ? 0 : -1;
+        for (int n = 0; diff < 0 && n < 2 * count[0]; n++) {
+            if (out[0][n] != out[1][n])
+                diff = n;
+        }
+
+        if (diff < 0) {
+            printf("%-16s ok (%d frames)\n", runs[i].name, count[0]);
+        } else {
+            printf("%-16s FAILED: %d/%d frames, first difference at "
+                   "sample %d\n", runs[i].name, count[0], count[1], diff);
+            failed++;
+        }
+    }
+
+    dsp_simd_off = false;
+    return failed ? 1 : 0;
+}
+
 /***** ALL MODES *****/
 
 static void perform_config(void)
@@ -406,6 +602,8 @@ static void perform_config(void)
             ci.id3->offset = atoi(val);
         } else if (!strncmp(name, "rate=", 5)) {
             dsp_set_pitch(atof(val) * PITCH_SPEED_100);
+        } else if (!strncmp(name, "resample=", 9)) {
+            dsp_set_resample_quality(atoi(val));
         } else if (!strncmp(name, "seek=", 5)) {
             codec_action = CODEC_ACTION_SEEK_TIME;
             codec_action_param = atoi(val);
@@ -455,7 +653,13 @@ static void ci_pcmbuf_insert(const void *ch1, const void *ch2, int count)
             dst.p16out = buf;
             dst.bufcount = out_count;
 
-            dsp_process(ci.dsp, &src, &dst);
+            if (mode == MODE_BENCH) {
+                uint64_t start = bench_now_ns();
+                dsp_process(ci.dsp, &src, &dst);
+                bench.stats.dsp_ns += bench_now_ns() - start;
+            } else {
+                dsp_process(ci.dsp, &src, &dst);
+            }
 
             if (dst.remcount > 0) {
                 if (mode == MODE_WRITE)
@@ -781,7 +985,8 @@ static void decode_file(const char *input_fn)
         fprintf(stderr, "error: metadata parsing failed\n");
         exit(1);
     }
-    print_mp3entry(&id3, stderr);
+    if (mode != MODE_BENCH)
+        print_mp3entry(&id3, stderr);
     ci.filesize = filesize(input_fd);
     ci.id3 = &id3;
     if (use_dsp) {
@@ -789,13 +994,15 @@ static void decode_file(const char *input_fn)
         dsp_configure(ci.dsp, DSP_SET_OUT_FREQUENCY, DSP_OUT_DEFAULT_HZ);
         dsp_configure(ci.dsp, DSP_RESET, 0);
         dsp_dither_enable(false);
+        dsp_configure(ci.dsp, DSP_ENABLE_PROC_STATS, mode == MODE_BENCH);
     }
     perform_config();
 
     /* Load codec */
     char str[MAX_PATH];
     snprintf(str, sizeof(str), CODECDIR"/%s.codec", audio_formats[id3.codectype].codec_root_fn);
-    debugf("Loading %s\n", str);
+    if (mode != MODE_BENCH)
+        debugf("Loading %s\n", str);
     void *dlcodec = dlopen(str, RTLD_NOW);
     if (!dlcodec) {
         fprintf(stderr, "error: dlopen failed: %s\n", dlerror());
@@ -822,22 +1029,394 @@ static void decode_file(const char *input_fn)
         fprintf(stderr, "error: codec returned error from codec_main\n");
         exit(1);
     }
+    uint64_t start = bench_now_ns();
     if (c_hdr->run_proc() != CODEC_OK) {
         fprintf(stderr, "error: codec error\n");
+        bench.stats.failed = 1;
     }
+    bench.stats.decode_ns = bench_now_ns() - start;
     c_hdr->entry_point(CODEC_UNLOAD);
 
+    bench.codectype = id3.codectype;
+    bench.stats.files = 1;
+    bench.stats.bytes = ci.filesize;
+    bench.stats.samples = num_output_samples;
+    bench.stats.length_ms = id3.length;
+    bench.num_stages = dsp_configure(ci.dsp, DSP_GET_PROC_STATS,
+                                     (intptr_t)bench.stages);
+
     /* Close */
     dlclose(dlcodec);
     if (input_fd != STDIN_FILENO)
         close(input_fd);
 }
 
+/***** MODE_BENCH driver *****/
+
+static char **bench_files;
+static int bench_num_files, bench_max_files;
+
+static void bench_add_file(const char *path)
+{
+    if (bench_num_files >= bench_max_files) {
+        bench_max_files = bench_max_files ? 2 * bench_max_files : 256;
+        bench_files = realloc(bench_files,
+                              bench_max_files * sizeof(*bench_files));
+        if (!bench_files) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    bench_files[bench_num_files++] = strdup(path);
+}
+
+static void bench_add_dir(const char *path)
+{
+    DIR *dir = opendir(path);
+    if (!dir) {
+        perror(path);
+        return;
+    }
+
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+
+        char fn[MAX_PATH];
+        struct stat st;
+        snprintf(fn, sizeof(fn), "%s/%s", path, de->d_name);
+        if (stat(fn, &st))
+            continue;
+
+        if (S_ISDIR(st.st_mode))
+            bench_add_dir(fn);
+        else if (S_ISREG(st.st_mode) && probe_file_format(fn) != AFMT_UNKNOWN)
+            bench_add_file(fn);
+    }
+
+    closedir(dir);
+}
+
+/* Add a benchmark input: a file, a directory to scan recursively for audio
+ * files, or "@LIST" to read one input per line from the file LIST */
+static void bench_add_input(const char *input)
+{
+    if (input[0] == '@') {
+        FILE *f = strcmp(input + 1, "-") ? fopen(input + 1, "r") : stdin;
+        if (!f) {
+            perror(input + 1);
+            exit(1);
+        }
+
+        char line[MAX_PATH];
+        while (fgets(line, sizeof(line), f)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0])
+                bench_add_input(line);
+        }
+
+        if (f != stdin)
+            fclose(f);
+        return;
+    }
+
+    struct stat st;
+    if (stat(input, &st)) {
+        perror(input);
+        exit(1);
+    }
+
+    if (S_ISDIR(st.st_mode))
+        bench_add_dir(input);
+    else
+        bench_add_file(input);
+}
+
+static void bench_child(const char *input_fn, int fd)
+{
+    decode_file(input_fn);
+
+    /* A short write would hand the parent garbage, so fail the job */
+    if (write(fd, &bench, sizeof(bench)) != sizeof(bench)) {
+        perror("write");
+        _exit(1);
+    }
+
+    close(fd);
+    _exit(0);
+}
+
+static void bench_add_stats(struct bench_stats *dst,
+                            const struct bench_stats *src)
+{
+    dst->files += src->files;
+    dst->failed += src->failed;
+    dst->bytes += src->bytes;
+    dst->samples += src->samples;
+    dst->length_ms += src->length_ms;
+    dst->decode_ns += src->decode_ns;
+    dst->dsp_ns += src->dsp_ns;
+    dst->peak_rss_kb = MAX(dst->peak_rss_kb, src->peak_rss_kb);
+}
+
+/* Print a quoted CSV field or JSON string */
+static void bench_print_string(const char *str)
+{
+    putchar('"');
+    for (; *str; str++) {
+        if (*str == '"' || (bench_json && *str == '\\'))
+            putchar(bench_json ? '\\' : '"');
+        if (bench_json && (unsigned char)*str < 0x20)
+            printf("\\u%04x", *str);
+        else
+            putchar(*str);
+    }
+    putchar('"');
+}
+
+/* Print one result row. JSON rows are separated by the caller. */
+static void bench_print_row(const char *kind, const char *name,
+                            const char *codec, const struct bench_stats *s)
+{
+    double secs = s->decode_ns / 1e9;
+    double mb_per_s = secs > 0 ? s->bytes / 1e6 / secs : 0;
+    double samples_per_s = secs > 0 ? s->samples / secs : 0;
+    double realtime = secs > 0 ? s->length_ms / 1e3 / secs : 0;
+
+    if (bench_json) {
+        printf("    {\"%s\": ", kind);
+        bench_print_string(name);
+        printf(", \"codec\": \"%s\", \"files\": %lu, \"failed\": %lu, "
+               "\"bytes\": %llu, \"samples\": %llu, \"length_ms\": %llu, "
+               "\"decode_ms\": %.3f, \"dsp_ms\": %.3f, "
+               "\"mb_per_s\": %.3f, \"samples_per_s\": %.0f, "
+               "\"realtime\": %.2f, \"peak_rss_kb\": %ld}",
+               codec, s->files, s->failed,
+               (unsigned long long)s->bytes, (unsigned long long)s->samples,
+               (unsigned long long)s->length_ms,
+               s->decode_ns / 1e6, s->dsp_ns / 1e6,
+               mb_per_s, samples_per_s, realtime, s->peak_rss_kb);
+    } else {
+        printf("%s,", kind);
+        bench_print_string(name);
+        printf(",%s,%lu,%lu,%llu,%llu,%llu,%.3f,%.3f,%.3f,%.0f,%.2f,%ld\n",
+               codec, s->files, s->failed,
+               (unsigned long long)s->bytes, (unsigned long long)s->samples,
+               (unsigned long long)s->length_ms,
+               s->decode_ns / 1e6, s->dsp_ns / 1e6,
+               mb_per_s, samples_per_s, realtime, s->peak_rss_kb);
+    }
+}
+
+/* Sum up the DSP stage statistics of all files, by stage name. The CSV
+ * output gets a second table after a blank line. */
+static void bench_print_stages(const struct bench_result *results)
+{
+    struct dsp_proc_stats total[DSP_PROC_STATS_MAX];
+    int num = 0, i, j, k;
+
+    for (i = 0; i < bench_num_files; i++) {
+        for (j = 0; j < results[i].num_stages; j++) {
+            const struct dsp_proc_stats *st = &results[i].stages[j];
+            for (k = 0; k < num; k++) {
+                if (!strcmp(total[k].name, st->name))
+                    break;
+            }
+            if (k == num) {
+                if (num >= DSP_PROC_STATS_MAX)
+                    continue;
+                memset(&total[num++], 0, sizeof(total[0]));
+                total[k].name = st->name;
+            }
+            total[k].calls += st->calls;
+            total[k].samples += st->samples;
+            total[k].time_us += st->time_us;
+        }
+    }
+
+    if (bench_json)
+        printf("\n  ],\n  \"stages\": [\n");
+    else
+        printf("\nstage,calls,samples,time_ms,ns_per_sample\n");
+
+    for (k = 0; k < num; k++) {
+        double ns_per_sample = total[k].samples ?
+            total[k].time_us * 1e3 / total[k].samples : 0;
+
+        if (bench_json) {
+            printf("%s    {\"stage\": \"%s\", \"calls\": %lu, "
+                   "\"samples\": %llu, \"time_ms\": %.3f, "
+                   "\"ns_per_sample\": %.2f}",
+                   k > 0 ? ",\n" : "", total[k].name,
+                   (unsigned long)total[k].calls,
+                   (unsigned long long)total[k].samples,
+                   total[k].time_us / 1e3, ns_per_sample);
+        } else {
+            printf("%s,%lu,%llu,%.3f,%.2f\n", total[k].name,
+                   (unsigned long)total[k].calls,
+                   (unsigned long long)total[k].samples,
+                   total[k].time_us / 1e3, ns_per_sample);
+        }
+    }
+}
+
+static void bench_print(const struct bench_result *results)
+{
+    int i, j;
+
+    if (bench_json)
+        printf("{\n  \"files\": [\n");
+    else
+        printf("kind,name,codec,files,failed,bytes,samples,length_ms,"
+               "decode_ms,dsp_ms,mb_per_s,samples_per_s,realtime,"
+               "peak_rss_kb\n");
+
+    for (i = 0; i < bench_num_files; i++) {
+        const char *codec = audio_formats[results[i].codectype].codec_root_fn;
+        if (bench_json && i > 0)
+            printf(",\n");
+        bench_print_row("file", bench_files[i], codec ? codec : "",
+                        &results[i].stats);
+    }
+
+    if (bench_json)
+        printf("\n  ],\n  \"codecs\": [\n");
+
+    /* Several formats may share a codec, so sum up per codec file name */
+    bool first = true;
+    for (i = AFMT_UNKNOWN + 1; i < AFMT_NUM_CODECS; i++) {
+        const char *codec = audio_formats[i].codec_root_fn;
+        if (!codec)
+            continue;
+        for (j = AFMT_UNKNOWN + 1; j < i; j++) {
+            if (audio_formats[j].codec_root_fn &&
+                !strcmp(audio_formats[j].codec_root_fn, codec))
+                break;
+        }
+        if (j < i)
+            continue; /* already printed */
+
+        struct bench_stats total = {0};
+        for (j = 0; j < bench_num_files; j++) {
+            const char *fn = audio_formats[results[j].codectype].codec_root_fn;
+            if (fn && !strcmp(fn, codec))
+                bench_add_stats(&total, &results[j].stats);
+        }
+        if (!total.files)
+            continue;
+
+        if (bench_json && !first)
+            printf(",\n");
+        bench_print_row("codec", codec, codec, &total);
+        first = false;
+    }
+
+    bench_print_stages(results);
+
+    if (bench_json)
+        printf("\n  ]\n}\n");
+}
+
+static void bench_run(void)
+{
+    struct bench_job {
+        pid_t pid;
+        int fd;
+        int index;
+    } *jobs = calloc(bench_jobs, sizeof(*jobs));
+    struct bench_result *results = calloc(bench_num_files, sizeof(*results));
+    int next = 0, running = 0, i;
+
+    if (!jobs || !results) {
+        perror("calloc");
+        exit(1);
+    }
+
+    while (next < bench_num_files || running > 0) {
+        /* Start as many children as allowed */
+        for (i = 0; i < bench_jobs && next < bench_num_files; i++) {
+            if (jobs[i].pid)
+                continue;
+
+            int pfd[2];
+            if (pipe(pfd)) {
+                perror("pipe");
+                exit(1);
+            }
+
+            fflush(stdout);
+            fflush(stderr);
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("fork");
+                exit(1);
+            } else if (pid == 0) {
+                int j;
+                /* Don't hold on to the pipes of the other jobs */
+                for (j = 0; j < bench_jobs; j++) {
+                    if (jobs[j].pid)
+                        close(jobs[j].fd);
+                }
+                close(pfd[0]);
+                bench_child(bench_files[next], pfd[1]);
+            }
+
+            close(pfd[1]);
+            jobs[i].pid = pid;
+            jobs[i].fd = pfd[0];
+            jobs[i].index = next++;
+            running++;
+        }
+
+        /* Collect a finished child */
+        int status;
+        struct rusage ru;
+        pid_t pid = wait4(-1, &status, 0, &ru);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("wait4");
+            exit(1);
+        }
+
+        for (i = 0; i < bench_jobs; i++) {
+            if (jobs[i].pid == pid)
+                break;
+        }
+        if (i >= bench_jobs)
+            continue;
+
+        struct bench_result *res = &results[jobs[i].index];
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+            read(jobs[i].fd, res, sizeof(*res)) != sizeof(*res)) {
+            fprintf(stderr, "error: decoding %s failed\n",
+                    bench_files[jobs[i].index]);
+            memset(res, 0, sizeof(*res));
+            res->codectype = probe_file_format(bench_files[jobs[i].index]);
+            res->stats.files = 1;
+            res->stats.failed = 1;
+        }
+        res->stats.peak_rss_kb = ru.ru_maxrss;
+
+        close(jobs[i].fd);
+        jobs[i].pid = 0;
+        running--;
+    }
+
+    bench_print(results);
+
+    free(results);
+    free(jobs);
+}
+
 static void print_help(const char *progname)
 {
     fprintf(stderr, "Usage:\n"
                     "        Play: %s [options] INPUTFILE\n"
                     "Write to WAV: %s [options] INPUTFILE OUTPUTFILE\n"
+                    "   Benchmark: %s -b [options] INPUT...\n"
+                    "  Self-check: %s -s\n"
                     "\n"
                     "general options:\n"
                     "  -c a=1:b=2    Configuration (see below)\n"
@@ -847,12 +1426,27 @@ static void print_help(const char *progname)
                     "  -f            Write raw codec output converted to 64-bit float\n"
                     "  -r            Write raw 32-bit codec output without WAV header\n"
                     "\n"
+                    "benchmark options:\n"
+                    "  -b            Decode every INPUT and print statistics as CSV;\n"
+                    "                INPUT is a file, a directory to scan for audio\n"
+                    "                files or @LIST to read inputs from LIST (- for stdin);\n"
+                    "                the time spent in each DSP stage follows the files\n"
+                    "  -f            Benchmark the codecs only, without the DSP\n"
+                    "  -j <n>        Run <n> decoders in parallel [number of CPUs]\n"
+                    "  -J            Print statistics as JSON\n"
+                    "\n"
+                    "self-check options:\n"
+                    "  -s            Check that the vector DSP code gives exactly the\n"
+                    "                same output as the C code and exit\n"
+                    "\n"
                     "configuration:\n"
                     "  dither=<0|1>  Enable/disable dithering [0]\n"
                     "  halt=<0|1>    Stop decoding if 1 [0]\n"
                     "  loop=<0|1>    Enable/disable looping [0]\n"
                     "  offset=<n>    Start at byte offset within the file [0]\n"
                     "  rate=<n>      Multiply rate by <n> [1.0]\n"
+                    "  resample=<n>  Resampler: 0 = hermite, 1 = sinc,\n"
+                    "                2 = float sinc [0]\n"
                     "  seek=<n>      Seek <n> ms into the file\n"
                     "  tempo=<n>     Timestretch by <n> [1.0]\n"
                     "  vol=<n>       Set volume attenuation to <n> dB [-0]\n"
@@ -864,24 +1458,39 @@ static void print_help(const char *progname)
                     "  %s in.adx -c loop=1:wait=44100:halt=1\n"
                     "  # Lower pitch 1 octave and write to out.wav\n"
                     "  %s in.ogg -c rate=0.5:tempo=2 out.wav\n"
-                    , progname, progname, progname, progname);
+                    "  # Benchmark all files below music/ on 4 cores\n"
+                    "  %s -b -j 4 music/ > bench.csv\n"
+                    , progname, progname, progname, progname, progname,
+                    progname, progname);
 }
 
 int main(int argc, char **argv)
 {
     int opt;
-    while ((opt = getopt(argc, argv, "c:fhr")) != -1) {
+    while ((opt = getopt(argc, argv, "bc:fhj:Jrs")) != -1) {
         switch (opt) {
+        case 'b':
+            mode = MODE_BENCH;
+            break;
         case 'c':
             config = optarg;
             break;
         case 'f':
             use_dsp = false;
             break;
+        case 'j':
+            bench_jobs = atoi(optarg);
+            break;
+        case 'J':
+            bench_json = true;
+            break;
         case 'r':
             use_dsp = false;
             write_raw = true;
             break;
+        case 's':
+            mode = MODE_SIMD_CHECK;
+            break;
         case 'h': /* fallthrough */
         default:
             print_help(argv[0]);
@@ -889,6 +1498,25 @@ int main(int argc, char **argv)
         }
     }
 
+    core_allocator_init();
+
+    if (mode == MODE_SIMD_CHECK)
+        return simd_check();
+
+    if (mode == MODE_BENCH) {
+        if (argc == optind) {
+            fprintf(stderr, "error: no input for benchmark\n");
+            print_help(argv[0]);
+            exit(1);
+        }
+        if (bench_jobs <= 0)
+            bench_jobs = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+        for (; optind < argc; optind++)
+            bench_add_input(argv[optind]);
+        bench_run();
+        return 0;
+    }
+
     if (argc == optind + 2) {
         write_init(argv[optind + 1]);
     } else if (argc == optind + 1) {
@@ -897,7 +1525,6 @@ int main(int argc, char **argv)
             print_help(argv[0]);
             exit(1);
         }
-        core_allocator_init();
         playback_init();
     } else {
         if (argc > 1)
@@ -0,0 +1,577 @@
+/* Benchmark of the database code on a generated library.
+ *
+ * Every phase prints one line of key=value pairs to stdout so runs can be
+ * compared by scripts: the wall time, the number of results, the I/O done
+ * by the process (from /proc/self/io where available) and the peak memory
+ * use so far.
+ *
+ * Metadata is always parsed in this process. The I/O and memory of worker
+ * processes wouldn't show up in these counts.
+ *
+ * The test_tagcache plugin runs the same queries in the simulator or on a
+ * player, on the database built there. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef WIN32
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+#include "config.h"
+#include "tagcache.h"
+#include "dir.h"
+#include "file.h"
+#include "string-extra.h"
+#include "database.h"
+
+#ifndef WIN32
+
+#define BENCH_DIR       "/bench_music"
+#define BENCH_MTIME     1500000000 /* Fixed mtimes keep runs comparable */
+#define BENCH_GENRES    16
+#define BENCH_MP3FRAMES 4
+#define BENCH_MAX_KEYS  32  /* Keys followed on each level of a view */
+#define BENCH_PATH_KEYS 8   /* Keys followed on each level of a menu path */
+#define BENCH_LEVELS    4
+#define UNIQBUF_SIZE    (64*1024) /* Same as tagtree */
+
+static const char * const genres[BENCH_GENRES] = {
+    "Rock", "Pop", "Jazz", "Blues", "Classical", "Electronic", "Folk",
+    "Metal", "Punk", "Reggae", "Soul", "Country", "Hip-Hop", "Ambient",
+    "Soundtrack", "Latin"
+};
+
+/* A path through the database menus of tagnavi.config: the tag listed on
+ * each level, the clauses the menu applies on every level and the tags
+ * the format of the last level shows, ended by -1. */
+struct bench_path {
+    const char *name;
+    int levels;
+    int tag[BENCH_LEVELS];
+    int clause_count;
+    struct tagcache_search_clause clause[2];
+    int format[6];
+};
+
+#define NUMERIC_CLAUSE(t, c, n) \
+    { .tag = t, .type = c, .numeric = true, .numeric_data = n, \
+      .source = source_constant, .str = "" }
+
+static struct bench_path paths[] = {
+    /* "Artist" -> canonicalartist -> album -> title = "fmt_title" */
+    { "tagnavi_artist", 3,
+      { tag_virt_canonicalartist, tag_album, tag_title }, 0, { },
+      { tag_discnumber, tag_tracknumber, tag_title, tag_virt_length_min,
+        tag_virt_length_sec, -1 } },
+    /* "Genre" -> genre -> canonicalartist -> album -> title = "fmt_title" */
+    { "tagnavi_genre", 4,
+      { tag_genre, tag_virt_canonicalartist, tag_album, tag_title }, 0, { },
+      { tag_discnumber, tag_tracknumber, tag_title, tag_virt_length_min,
+        tag_virt_length_sec, -1 } },
+    /* "Year" -> year ? year > "0" -> canonicalartist -> album -> title */
+    { "tagnavi_year", 4,
+      { tag_year, tag_virt_canonicalartist, tag_album, tag_title }, 1,
+      { NUMERIC_CLAUSE(tag_year, clause_gt, 0) },
+      { tag_discnumber, tag_tracknumber, tag_title, tag_virt_length_min,
+        tag_virt_length_sec, -1 } },
+    /* "Most played" -> title = "fmt_mostplayed" ? playcount > "0" */
+    { "tagnavi_most_played", 1, { tag_title }, 1,
+      { NUMERIC_CLAUSE(tag_playcount, clause_gt, 0) },
+      { tag_playcount, tag_virt_autoscore, tag_title,
+        tag_virt_canonicalartist, -1 } },
+    /* "Favourite artists" -> canonicalartist ? playcount > "3" &
+       autoscore > "85" -> album -> title = "fmt_best_tracks" */
+    { "tagnavi_favourite_artists", 3,
+      { tag_virt_canonicalartist, tag_album, tag_title }, 2,
+      { NUMERIC_CLAUSE(tag_playcount, clause_gt, 3),
+        NUMERIC_CLAUSE(tag_virt_autoscore, clause_gt, 85) },
+      { tag_tracknumber, tag_title, tag_virt_autoscore, -1 } },
+};
+
+struct io_stats {
+    long long rchar, wchar, syscr, syscw;
+};
+
+static struct {
+    struct timespec start;
+    struct io_stats io;
+} phase;
+
+static int tracks_total; /* Tracks generated, including removed ones */
+static int tracks_live;
+static int artist_count;
+static unsigned long rand_state;
+
+static unsigned long bench_rand(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return (rand_state >> 16) & 0x7fff;
+}
+
+static void read_io_stats(struct io_stats *io)
+{
+    char line[64];
+    FILE *f = fopen("/proc/self/io", "r");
+
+    io->rchar = io->wchar = io->syscr = io->syscw = -1;
+    if (!f)
+        return;
+
+    while (fgets(line, sizeof(line), f))
+    {
+        sscanf(line, "rchar: %lld", &io->rchar);
+        sscanf(line, "wchar: %lld", &io->wchar);
+        sscanf(line, "syscr: %lld", &io->syscr);
+        sscanf(line, "syscw: %lld", &io->syscw);
+    }
+
+    fclose(f);
+}
+
+static void phase_start(void)
+{
+    read_io_stats(&phase.io);
+    clock_gettime(CLOCK_MONOTONIC, &phase.start);
+}
+
+static void phase_end(const char *name, long results)
+{
+    struct timespec now;
+    struct io_stats io;
+    struct rusage ru;
+    long ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    read_io_stats(&io);
+    getrusage(RUSAGE_SELF, &ru);
+
+    ms = (now.tv_sec - phase.start.tv_sec) * 1000
+         + (now.tv_nsec - phase.start.tv_nsec) / 1000000;
+
+    printf("phase=%s tracks=%d ms=%ld results=%ld", name, tracks_live,
+           ms, results);
+    if (io.rchar >= 0 && phase.io.rchar >= 0)
+    {
+        printf(" read_bytes=%lld write_bytes=%lld read_ops=%lld write_ops=%lld",
+               io.rchar - phase.io.rchar, io.wchar - phase.io.wchar,
+               io.syscr - phase.io.syscr, io.syscw - phase.io.syscw);
+    }
+    printf(" maxrss_kb=%ld\n", ru.ru_maxrss);
+    fflush(stdout);
+}
+
+static int id3_frame(unsigned char *p, const char *id, const char *text)
+{
+    int len = strlen(text) + 1;
+
+    memcpy(p, id, 4);
+    p[4] = len >> 24;
+    p[5] = len >> 16;
+    p[6] = len >> 8;
+    p[7] = len;
+    p[8] = p[9] = 0;
+    p[10] = 0; /* ISO-8859-1 */
+    memcpy(&p[11], text, len - 1);
+
+    return 10 + len;
+}
+
+/* Track n of the library, always generated with the same tags. */
+static void track_path(char *buf, size_t size, int n)
+{
+    rand_state = n * 2654435761UL;
+    int artist = bench_rand() % artist_count;
+    int album = bench_rand() % 4;
+
+    snprintf(buf, size, BENCH_DIR "/Artist %04d/Album %d/%06d.mp3",
+             artist, album, n);
+}
+
+static bool write_track(int n, const char *title_suffix)
+{
+    static unsigned char buf[2048 + BENCH_MP3FRAMES * 417];
+    char path[MAX_PATH], text[MAX_PATH];
+    int len = 10, fd, i;
+
+    rand_state = n * 2654435761UL;
+    int artist = bench_rand() % artist_count;
+    int album = bench_rand() % 4;
+    int genre = bench_rand() % BENCH_GENRES;
+    int year = 1960 + (artist * 7 + album) % 60;
+
+    snprintf(text, sizeof(text), "Artist %04d", artist);
+    len += id3_frame(&buf[len], "TPE1", text);
+    snprintf(text, sizeof(text), "Artist %04d Album %d", artist, album);
+    len += id3_frame(&buf[len], "TALB", text);
+    snprintf(text, sizeof(text), "Track %06d%s", n, title_suffix);
+    len += id3_frame(&buf[len], "TIT2", text);
+    len += id3_frame(&buf[len], "TCON", genres[genre]);
+    snprintf(text, sizeof(text), "%d", n % 12 + 1);
+    len += id3_frame(&buf[len], "TRCK", text);
+    snprintf(text, sizeof(text), "%d", year);
+    len += id3_frame(&buf[len], "TYER", text);
+    if (n % 5 == 0)
+        len += id3_frame(&buf[len], "TPE2", "Various Artists");
+
+    /* ID3v2.3 header with a synchsafe size */
+    memcpy(buf, "ID3\3\0\0", 6);
+    buf[6] = ((len - 10) >> 21) & 0x7f;
+    buf[7] = ((len - 10) >> 14) & 0x7f;
+    buf[8] = ((len - 10) >> 7) & 0x7f;
+    buf[9] = (len - 10) & 0x7f;
+
+    /* MPEG1 layer 3, 128 kbps, 44.1 kHz */
+    for (i = 0; i < BENCH_MP3FRAMES; i++)
+    {
+        memset(&buf[len], 0, 417);
+        memcpy(&buf[len], "\xff\xfb\x90\x64", 4);
+        len += 417;
+    }
+
+    track_path(path, sizeof(path), n);
+
+    /* Create the artist and album directories as needed */
+    for (char *p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/'))
+    {
+        *p = '\0';
+        if (!dir_exists(path))
+            mkdir(path);
+        *p = '/';
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return false;
+
+    i = write(fd, buf, len);
+    close(fd);
+
+    return i == len
+           && modtime(path, BENCH_MTIME + (*title_suffix ? 1000 : 0)) == 0;
+}
+
+/* Count the results of a search, keeping the seeks of the first ones. */
+static long search(int tag, int filter_tag, int filter_seek,
+                   struct tagcache_search_clause *clause,
+                   int32_t *seeks, int *seek_count)
+{
+    static uint32_t uniqbuf[UNIQBUF_SIZE / sizeof(uint32_t)];
+    struct tagcache_search tcs;
+    char buf[TAGCACHE_BUFSZ];
+    long count = 0;
+
+    if (seek_count)
+        *seek_count = 0;
+
+    if (!tagcache_search(&tcs, tag))
+        return -1;
+
+    tagcache_search_set_uniqbuf(&tcs, uniqbuf, UNIQBUF_SIZE);
+    if (filter_tag >= 0)
+        tagcache_search_add_filter(&tcs, filter_tag, filter_seek);
+    if (clause)
+        tagcache_search_add_clause(&tcs, clause);
+
+    while (tagcache_get_next(&tcs, buf, sizeof(buf)))
+    {
+        if (seek_count && *seek_count < BENCH_MAX_KEYS)
+            seeks[(*seek_count)++] = tcs.result_seek;
+        count++;
+    }
+
+    tagcache_search_finish(&tcs);
+
+    return count;
+}
+
+/* A two level view: list the keys, then the items under each key. */
+static void bench_view(const char *name, int key_tag, int item_tag)
+{
+    int32_t seeks[BENCH_MAX_KEYS];
+    int count, i;
+    long results;
+
+    phase_start();
+    results = search(key_tag, -1, 0, NULL, seeks, &count);
+    for (i = 0; i < count; i++)
+        results += search(item_tag, key_tag, seeks[i], NULL, NULL, NULL);
+    phase_end(name, results);
+}
+
+static void bench_clause(const char *name, int tag, int type, long numeric,
+                         const char *str)
+{
+    struct tagcache_search_clause clause;
+    char strbuf[64];
+
+    memset(&clause, 0, sizeof(clause));
+    clause.tag = tag;
+    clause.type = type;
+    clause.numeric = TAGCACHE_IS_NUMERIC(tag);
+    clause.numeric_data = numeric;
+    clause.source = source_constant;
+    strmemccpy(strbuf, str ? str : "", sizeof(strbuf));
+    clause.str = strbuf;
+
+    phase_start();
+    phase_end(name, search(tag_title, -1, 0, &clause, NULL, NULL));
+}
+
+/* Format an entry of the last level the way tagtree does, fetching every
+ * tag the format shows. */
+static void format_entry(struct tagcache_search *tcs, const int *format)
+{
+    char buf[TAGCACHE_BUFSZ], str[MAX_PATH];
+    size_t pos = 0;
+
+    for (; *format >= 0 && pos < sizeof(buf); format++)
+    {
+        if (TAGCACHE_IS_NUMERIC(*format))
+        {
+            pos += snprintf(&buf[pos], sizeof(buf) - pos, "%ld ",
+                            tagcache_get_numeric(tcs, *format));
+        }
+        else if (*format == tcs->type)
+            pos += snprintf(&buf[pos], sizeof(buf) - pos, "%s ", tcs->result);
+        else if (tagcache_retrieve(tcs, tcs->idx_id, *format, str, sizeof(str)))
+            pos += snprintf(&buf[pos], sizeof(buf) - pos, "%s ", str);
+    }
+}
+
+/* List one level of a menu path, then the next level under each of the
+ * first keys, filtered by the keys chosen so far like tagtree does. */
+static long walk_path(struct bench_path *path, int level, int32_t *filter)
+{
+    static uint32_t uniqbuf[UNIQBUF_SIZE / sizeof(uint32_t)];
+    struct tagcache_search tcs;
+    char buf[TAGCACHE_BUFSZ];
+    int32_t seeks[BENCH_PATH_KEYS];
+    bool last = level == path->levels - 1;
+    int seek_count = 0, i;
+    long count = 0;
+
+    if (!tagcache_search(&tcs, path->tag[level]))
+        return 0;
+
+    tagcache_search_set_uniqbuf(&tcs, uniqbuf, UNIQBUF_SIZE);
+    for (i = 0; i < level; i++)
+        tagcache_search_add_filter(&tcs, path->tag[i], filter[i]);
+    for (i = 0; i < path->clause_count; i++)
+        tagcache_search_add_clause(&tcs, &path->clause[i]);
+
+    while (tagcache_get_next(&tcs, buf, sizeof(buf)))
+    {
+        if (last)
+            format_entry(&tcs, path->format);
+        else if (seek_count < BENCH_PATH_KEYS)
+            seeks[seek_count++] = tcs.result_seek;
+        count++;
+    }
+
+    tagcache_search_finish(&tcs);
+
+    for (i = 0; i < seek_count; i++)
+    {
+        filter[level] = seeks[i];
+        count += walk_path(path, level + 1, filter);
+    }
+
+    return count;
+}
+
+static void bench_paths(void)
+{
+    int32_t filter[BENCH_LEVELS];
+    size_t i;
+
+    for (i = 0; i < sizeof(paths) / sizeof(paths[0]); i++)
+    {
+        phase_start();
+        phase_end(paths[i].name, walk_path(&paths[i], 0, filter));
+    }
+}
+
+/* Write a play history for every fourth track to the changelog, as if it
+ * was carried over from an earlier database. Every other one of them was
+ * always played to the end. Returns the number of entries. */
+static long write_play_history(void)
+{
+    struct tagcache_search tcs;
+    char buf[TAGCACHE_BUFSZ];
+    long count = 0;
+    int fd, n = 0;
+
+    fd = open(ROCKBOX_DIR "/database_changelog.txt",
+              O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return -1;
+
+    if (!tagcache_search(&tcs, tag_filename))
+    {
+        close(fd);
+        return -1;
+    }
+
+    while (tagcache_get_next(&tcs, buf, sizeof(buf)))
+    {
+        char line[TAGCACHE_BUFSZ + 128];
+        long playtime = tagcache_get_numeric(&tcs, tag_length);
+        int playcount = count % 6 + 1;
+
+        if (n++ % 4 != 0)
+            continue;
+
+        playtime *= playcount;
+        if (count % 2)
+            playtime /= 2;
+
+        snprintf(line, sizeof(line),
+                 "filename=\"%s\" playcount=\"%d\" playtime=\"%ld\" "
+                 "lastplayed=\"%ld\" rating=\"%ld\"\n", buf, playcount,
+                 playtime, count + 1, count % 11);
+        write(fd, line, strlen(line));
+        count++;
+    }
+
+    tagcache_search_finish(&tcs);
+    close(fd);
+
+    return count;
+}
+
+static void bench_changelog(void)
+{
+    struct tagcache_search tcs;
+    long entries;
+
+    entries = write_play_history();
+
+    phase_start();
+    phase_end("changelog_import",
+              entries >= 0 && tagcache_import_changelog() ? entries : -1);
+
+    /* Only the entries changed since the commit are exported */
+    phase_start();
+    phase_end("changelog_export",
+              tagcache_create_changelog(&tcs) ? entries : -1);
+}
+
+static void bench_lookup(void)
+{
+    struct tagcache_search tcs;
+    char path[MAX_PATH];
+    long found = 0;
+    int n;
+
+    phase_start();
+    for (n = 0; n < tracks_total; n += 97)
+    {
+        track_path(path, sizeof(path), n);
+        if (tagcache_find_index(&tcs, path))
+        {
+            found++;
+            tagcache_search_finish(&tcs);
+        }
+    }
+    phase_end("find_index", found);
+}
+
+int database_bench(int tracks)
+{
+    char path[MAX_PATH];
+    long changed = 0;
+    int n;
+
+    if (tracks <= 0)
+        return 1;
+
+    tracks_total = tracks;
+    tracks_live = tracks;
+    artist_count = tracks / 40 + 4;
+
+    /* Never touch the database of a real library, and don't measure
+     * against leftovers of an earlier run */
+    if (dir_exists(ROCKBOX_DIR) || dir_exists(BENCH_DIR))
+    {
+        fprintf(stderr, "Run the benchmark in an empty directory.\n");
+        return 1;
+    }
+
+    mkdir(ROCKBOX_DIR);
+    mkdir(BENCH_DIR);
+
+    phase_start();
+    for (n = 0; n < tracks; n++)
+    {
+        if (!write_track(n, ""))
+        {
+            fprintf(stderr, "Unable to write track %d\n", n);
+            return 1;
+        }
+    }
+    phase_end("generate", tracks);
+
+    tagcache_init();
+
+    phase_start();
+    database_build(1);
+    phase_end("commit", tracks);
+
+    phase_start();
+    phase_end("list_titles", search(tag_title, -1, 0, NULL, NULL, NULL));
+    bench_view("view_artist_album", tag_artist, tag_album);
+    bench_view("view_album_title", tag_album, tag_title);
+    bench_view("view_genre_artist", tag_genre, tag_artist);
+    bench_clause("clause_year", tag_year, clause_gteq, 2000, NULL);
+    bench_clause("clause_genre_oneof", tag_genre, clause_oneof, 0,
+                 "Rock|Jazz|Blues");
+    bench_clause("clause_title_contains", tag_title, clause_contains, 0, "7");
+    bench_lookup();
+    bench_changelog();
+    bench_paths();
+
+    /* Change, remove and add 1% of the library each */
+    for (n = 0; n < tracks; n += 100)
+    {
+        track_path(path, sizeof(path), n + 1);
+        if (n + 1 < tracks && remove(path) == 0)
+        {
+            tracks_live--;
+            changed++;
+        }
+        if (n + 2 < tracks && write_track(n + 2, " (remaster)"))
+            changed++;
+        tracks_total++;
+        if (write_track(tracks_total - 1, ""))
+        {
+            tracks_live++;
+            changed++;
+        }
+    }
+
+    phase_start();
+    database_build(1);
+    phase_end("update", changed);
+
+    /* Titles of removed and changed tracks stay in the tag file until
+     * the next full rebuild, so this lists more than the first one */
+    phase_start();
+    phase_end("list_titles", search(tag_title, -1, 0, NULL, NULL, NULL));
+
+    return 0;
+}
+
+#else /* WIN32 */
+
+int database_bench(int tracks)
+{
+    (void)tracks;
+    fprintf(stderr, "The benchmark isn't supported on this host.\n");
+    return 1;
+}
+
+#endif /* WIN32 */
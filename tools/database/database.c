@@ -2,25 +2,395 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
 
 #include "config.h"
 #include "tagcache.h"
 #include "dir.h"
+#include "string-extra.h"
+#include "database.h"
 
 /* This is meant to be run on the root of the dap. it'll put the db files into
  * a .rockbox subdir */
 
+#ifndef WIN32
+/* The metadata parsers keep some state in globals, so files are parsed by
+ * forked worker processes instead of threads. Each worker gets every n-th
+ * file over a pipe and answers in the same order, so the files are added to
+ * the database in scan order and the result is the same as a serial build. */
+
+/* The pipes are host descriptors, not files of the simulated filesystem */
+#undef read
+#undef write
+#undef close
+
+#define MAX_JOBS      64
+#define PARSE_DEPTH   3   /* Files queued per worker, keeps the pipes from
+                             filling up in both directions */
+#define PARSE_STRINGS 8
+#define PATH_BUFSZ    TAGCACHE_BUFSZ
+
+struct parse_result {
+    int ok;
+    int year;
+    int discnum;
+    int tracknum;
+    unsigned int bitrate;
+    unsigned long length;
+    int str_len[PARSE_STRINGS]; /* -1 for a missing tag */
+};
+
+struct parse_job {
+    char path[PATH_BUFSZ];
+    unsigned long mtime;
+};
+
+static struct {
+    pid_t pid;
+    int req_fd;
+    int res_fd;
+} workers[MAX_JOBS];
+static int worker_count = 0;
+
+static struct parse_job jobs[MAX_JOBS * PARSE_DEPTH];
+static int job_first = 0;
+static int job_count = 0;
+
+static bool read_full(int fd, void *buf, size_t size)
+{
+    char *p = buf;
+
+    while (size > 0)
+    {
+        ssize_t rc = read(fd, p, size);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return false;
+        p += rc;
+        size -= rc;
+    }
+
+    return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t size)
+{
+    const char *p = buf;
+
+    while (size > 0)
+    {
+        ssize_t rc = write(fd, p, size);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return false;
+        p += rc;
+        size -= rc;
+    }
+
+    return true;
+}
+
+/* Tags of a parsed file in the order they are sent over the pipe. */
+static char **parse_strings(struct mp3entry *id3, char **str)
+{
+    str[0] = id3->title;
+    str[1] = id3->artist;
+    str[2] = id3->album;
+    str[3] = id3->genre_string;
+    str[4] = id3->composer;
+    str[5] = id3->comment;
+    str[6] = id3->albumartist;
+    str[7] = id3->grouping;
+    return str;
+}
+
+static void worker_main(int req_fd, int res_fd)
+{
+    static struct mp3entry id3;
+    struct parse_result res;
+    char path[PATH_BUFSZ];
+    char *str[PARSE_STRINGS];
+    int i, len;
+
+    while (read_full(req_fd, &len, sizeof(len))
+           && len > 0 && len < PATH_BUFSZ
+           && read_full(req_fd, path, len))
+    {
+        path[len] = '\0';
+        memset(&res, 0, sizeof(res));
+
+        res.ok = probe_file_format(path) != AFMT_UNKNOWN
+                 && get_metadata_ex(&id3, -1, path, METADATA_EXCLUDE_ID3_PATH);
+        if (res.ok)
+        {
+            res.year = id3.year;
+            res.discnum = id3.discnum;
+            res.tracknum = id3.tracknum;
+            res.bitrate = id3.bitrate;
+            res.length = id3.length;
+            parse_strings(&id3, str);
+        }
+
+        for (i = 0; i < PARSE_STRINGS; i++)
+        {
+            /* The database cuts longer tags at TAG_MAXLEN anyway */
+            res.str_len[i] = (res.ok && str[i]) ? (int)strlen(str[i]) : -1;
+            if (res.str_len[i] > TAG_MAXLEN)
+                res.str_len[i] = TAG_MAXLEN;
+        }
+
+        if (!write_full(res_fd, &res, sizeof(res)))
+            break;
+
+        for (i = 0; i < PARSE_STRINGS; i++)
+        {
+            if (res.str_len[i] > 0 && !write_full(res_fd, str[i], res.str_len[i]))
+                _exit(1);
+        }
+    }
+
+    _exit(0);
+}
+
+/* Add the oldest queued file with the metadata parsed by its worker. */
+static void finish_job(void)
+{
+    static struct mp3entry id3;
+    static char strbuf[PARSE_STRINGS][TAG_MAXLEN+1];
+    struct parse_job *job = &jobs[job_first];
+    int worker = job_first % worker_count;
+    struct parse_result res;
+    char *str[PARSE_STRINGS];
+    bool ok;
+    int i;
+
+    ok = read_full(workers[worker].res_fd, &res, sizeof(res));
+    for (i = 0; ok && i < PARSE_STRINGS; i++)
+    {
+        str[i] = NULL;
+        if (res.str_len[i] < 0)
+            continue;
+        if (res.str_len[i] > TAG_MAXLEN
+            || !read_full(workers[worker].res_fd, strbuf[i], res.str_len[i]))
+        {
+            ok = false;
+            break;
+        }
+        strbuf[i][res.str_len[i]] = '\0';
+        str[i] = strbuf[i];
+    }
+
+    if (!ok)
+    {
+        fprintf(stderr, "Metadata worker %d failed\n", worker);
+        exit(1);
+    }
+
+    if (res.ok)
+    {
+        memset(&id3, 0, sizeof(id3));
+        id3.year = res.year;
+        id3.discnum = res.discnum;
+        id3.tracknum = res.tracknum;
+        id3.bitrate = res.bitrate;
+        id3.length = res.length;
+        id3.title = str[0];
+        id3.artist = str[1];
+        id3.album = str[2];
+        id3.genre_string = str[3];
+        id3.composer = str[4];
+        id3.comment = str[5];
+        id3.albumartist = str[6];
+        id3.grouping = str[7];
+    }
+
+    /* Failed files are handed back unparsed, as a serial build would try */
+    tagcache_add_file(job->path, job->mtime, res.ok ? &id3 : NULL);
+
+    job_first = (job_first + 1) % (worker_count * PARSE_DEPTH);
+    job_count--;
+}
+
+static void queue_file(const char *path, unsigned long mtime)
+{
+    int slots = worker_count * PARSE_DEPTH;
+    int slot = (job_first + job_count) % slots;
+    int len = strlen(path);
+
+    if (job_count == slots)
+    {
+        finish_job();
+        slot = (job_first + job_count) % slots;
+    }
+
+    /* Slots are handed to the workers round robin */
+    strmemccpy(jobs[slot].path, path, PATH_BUFSZ);
+    jobs[slot].mtime = mtime;
+    if (!write_full(workers[slot % worker_count].req_fd, &len, sizeof(len))
+        || !write_full(workers[slot % worker_count].req_fd, path, len))
+    {
+        fprintf(stderr, "Metadata worker %d failed\n", slot % worker_count);
+        exit(1);
+    }
+    job_count++;
+}
+
+static void flush_files(void)
+{
+    while (job_count > 0)
+        finish_job();
+}
+
+static const struct tagcache_scan_hooks parse_hooks = {
+    .queue_file = queue_file,
+    .flush = flush_files,
+};
+
+static bool start_workers(int count)
+{
+    int i;
+
+    if (count > MAX_JOBS)
+        count = MAX_JOBS;
+
+    for (i = 0; i < count; i++)
+    {
+        int req[2], res[2];
+
+        if (pipe(req) < 0)
+            break;
+        if (pipe(res) < 0)
+        {
+            close(req[0]);
+            close(req[1]);
+            break;
+        }
+
+        fflush(NULL);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            int j;
+            for (j = 0; j < worker_count; j++)
+            {
+                close(workers[j].req_fd);
+                close(workers[j].res_fd);
+            }
+            close(req[1]);
+            close(res[0]);
+            worker_main(req[0], res[1]);
+        }
+
+        close(req[0]);
+        close(res[1]);
+        if (pid < 0)
+        {
+            close(req[1]);
+            close(res[0]);
+            break;
+        }
+
+        workers[i].pid = pid;
+        workers[i].req_fd = req[1];
+        workers[i].res_fd = res[0];
+        worker_count++;
+    }
+
+    return worker_count > 0;
+}
+
+static void stop_workers(void)
+{
+    int i;
+
+    for (i = 0; i < worker_count; i++)
+    {
+        close(workers[i].req_fd);
+        close(workers[i].res_fd);
+    }
+
+    for (i = 0; i < worker_count; i++)
+        waitpid(workers[i].pid, NULL, 0);
+
+    worker_count = 0;
+}
+#endif /* !WIN32 */
+
+void database_build(int jobs)
+{
+    /* / is actually ., will get translated in io.c
+     * (with the help of sim_root_dir below */
+    const char *paths[] = { "/", NULL };
+
+#ifndef WIN32
+    if (jobs > 1 && start_workers(jobs))
+        tagcache_set_scan_hooks(&parse_hooks);
+#else
+    (void)jobs;
+#endif
+
+    do_tagcache_build(paths);
+
+#ifndef WIN32
+    tagcache_set_scan_hooks(NULL);
+    stop_workers();
+#endif
+
+    tagcache_reverse_scan();
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-j jobs] [-b tracks]\n", name);
+    fprintf(stderr, "  -j jobs    number of processes parsing metadata"
+                    " (default: one per CPU)\n");
+    fprintf(stderr, "  -b tracks  benchmark on a generated library of that"
+                    " many tracks,\n"
+                    "             run in an empty directory (always one"
+                    " process)\n");
+}
+
 int main(int argc, char **argv)
 {
-    (void)argc;
-    (void)argv;
+    int jobs_wanted = 1;
+    int bench_tracks = 0;
+    int i;
+
+#if !defined(WIN32) && defined(_SC_NPROCESSORS_ONLN)
+    jobs_wanted = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-j") && i + 1 < argc)
+            jobs_wanted = atoi(argv[++i]);
+        else if (!strncmp(argv[i], "-j", 2) && argv[i][2])
+            jobs_wanted = atoi(&argv[i][2]);
+        else if (!strcmp(argv[i], "-b") && i + 1 < argc)
+            bench_tracks = atoi(argv[++i]);
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
 
     fprintf(stderr, "Rockbox database tool for '%s'\n\n", TARGET_NAME);
 
+    if (bench_tracks > 0)
+        return database_bench(bench_tracks);
+
     DIR* rbdir = opendir(ROCKBOX_DIR);
     if (!rbdir) {
         fprintf(stderr, "Unable to find the '%s' directory!\n", ROCKBOX_DIR);
@@ -29,15 +399,11 @@ int main(int argc, char **argv)
     }
     closedir(rbdir);
 
-    /* / is actually ., will get translated in io.c
-     * (with the help of sim_root_dir below */
-    const char *paths[] = { "/", NULL };
     tagcache_init();
 
     fprintf(stderr, "Scanning files (make take some time)...");
 
-    do_tagcache_build(paths);
-    tagcache_reverse_scan();
+    database_build(jobs_wanted);
 
     fprintf(stderr, "...done!\n");
 
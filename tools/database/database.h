@@ -0,0 +1,15 @@
+/* Shared between the database tool and its benchmark mode. */
+
+#ifndef DATABASE_H
+#define DATABASE_H
+
+/* Build or update the database of the files under the current directory,
+ * parsing metadata with the given number of processes. */
+void database_build(int jobs);
+
+/* Generate a synthetic library of the given number of tracks under the
+ * current directory and time the database operations on it. Metadata is
+ * parsed without worker processes, so all the work is measured. */
+int database_bench(int tracks);
+
+#endif /* DATABASE_H */
@@ -0,0 +1,348 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * Copyright (C) 2026 by the Rockbox developers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+/* Producer/consumer stress test for the pcmbuf chunk ring.
+ *
+ * The real apps/pcmbuf.c is linked against stubs for the mixer and for
+ * playback. One OS thread plays the codec and writes a running frame counter
+ * through pcmbuf_request_buffer()/pcmbuf_write_complete(), which commits the
+ * chunks. Another plays the mixer and pulls them back out through the
+ * registered pcmbuf_pcm_callback(). The threads are pinned to different
+ * cores, so every chunk crosses between caches and a missing acquire or
+ * release shows up as a stale sample, size or position stamp.
+ *
+ * Run it with "make pcmbuftest" in a simulator build directory. */
+
+#define _GNU_SOURCE /* pthread_setaffinity_np */
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "config.h"
+#include "system.h"
+#include "kernel.h"
+#include "pcm.h"
+#include "pcm_mixer.h"
+#include "pcmbuf.h"
+#include "settings.h"
+#include "codec_thread.h"
+#include "voice_thread.h"
+
+#define DEFAULT_FRAMES  (1ul << 27)
+#define TEST_SAMPR      44100
+
+struct user_settings global_settings;
+
+static unsigned long total_frames = DEFAULT_FRAMES;
+
+/* Mixer channel state shared between the two threads */
+static pcm_play_callback_type play_cb;
+static int play_status = CHANNEL_STOPPED;
+static int consumer_done;
+
+/* Consumer side bookkeeping; only touched by the consumer thread */
+static unsigned long played_frames;
+static unsigned long stamp_elapsed;
+static bool stamp_seen;
+static unsigned long restarts;
+static unsigned long chunks;
+
+static pthread_mutex_t pcm_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void fail(const char *what, unsigned long a, unsigned long b)
+{
+    fprintf(stderr, "pcmbuftest: %s (%lu, %lu) after %lu frames\n",
+            what, a, b, played_frames);
+    exit(1);
+}
+
+/* Simple LCG so that both sides vary their timing and request sizes */
+static unsigned int rnd(unsigned int *seed)
+{
+    *seed = *seed * 1103515245u + 12345u;
+    return *seed >> 16;
+}
+
+static void spin(unsigned int n)
+{
+    for (volatile unsigned int i = 0; i < n; i++);
+}
+
+/** Stubs for what pcmbuf.c calls **/
+
+void audio_pcmbuf_position_callback(unsigned long elapsed, off_t offset,
+                                    unsigned int key)
+{
+    (void)offset; (void)key;
+    stamp_elapsed = elapsed;
+    stamp_seen = true;
+}
+
+void audio_pcmbuf_track_change(bool pcmbuf)
+{
+    (void)pcmbuf;
+}
+
+bool audio_pcmbuf_may_play(void)
+{
+    return true;
+}
+
+void audio_pcmbuf_sync_position(void)
+{
+}
+
+int codec_thread_set_priority(int priority)
+{
+    return priority;
+}
+
+void voice_thread_set_priority(int priority)
+{
+    (void)priority;
+}
+
+void mixer_channel_play_data(enum pcm_mixer_channel channel,
+                             pcm_play_callback_type get_more,
+                             const void *start, size_t size)
+{
+    (void)channel; (void)start; (void)size;
+    play_cb = get_more;
+    __atomic_store_n(&play_status, CHANNEL_PLAYING, __ATOMIC_RELEASE);
+}
+
+void mixer_channel_play_pause(enum pcm_mixer_channel channel, bool play)
+{
+    (void)channel; (void)play;
+}
+
+void mixer_channel_stop(enum pcm_mixer_channel channel)
+{
+    (void)channel;
+    __atomic_store_n(&play_status, CHANNEL_STOPPED, __ATOMIC_RELEASE);
+}
+
+void mixer_channel_set_amplitude(enum pcm_mixer_channel channel,
+                                 unsigned int amplitude)
+{
+    (void)channel; (void)amplitude;
+}
+
+enum channel_status mixer_channel_status(enum pcm_mixer_channel channel)
+{
+    (void)channel;
+    return __atomic_load_n(&play_status, __ATOMIC_ACQUIRE);
+}
+
+unsigned int mixer_get_frequency(void)
+{
+    return TEST_SAMPR;
+}
+
+void pcm_play_lock(void)
+{
+    pthread_mutex_lock(&pcm_mtx);
+}
+
+void pcm_play_unlock(void)
+{
+    pthread_mutex_unlock(&pcm_mtx);
+}
+
+int tick_add_task(void (*f)(void))
+{
+    (void)f;
+    return 0;
+}
+
+int tick_remove_task(void (*f)(void))
+{
+    (void)f;
+    return 0;
+}
+
+/** Threads **/
+
+static void pin_thread(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof (set), &set) != 0)
+        fprintf(stderr, "pcmbuftest: can't pin to cpu %d\n", cpu);
+}
+
+/* The codec side: write the frame number into every frame */
+static void * producer_thread(void *arg)
+{
+    unsigned int seed = 1;
+    unsigned long frame = 0;
+
+    pin_thread((intptr_t)arg);
+
+    while (frame < total_frames)
+    {
+        int want = 1 + rnd(&seed) % 4096;
+
+        if ((unsigned long)want > total_frames - frame)
+            want = total_frames - frame;
+
+        /* Offers all the free space, like for the DSP */
+        int count = want;
+        uint32_t *buf = pcmbuf_request_buffer(&count);
+        if (!buf)
+        {
+            sched_yield();
+            continue;
+        }
+
+        count = MIN(count, want);
+
+        for (int i = 0; i < count; i++)
+            buf[i] = frame + i;
+
+        pcmbuf_write_complete(count, frame, 0);
+        frame += count;
+
+        /* Now and then commit a short chunk, like at the end of a track */
+        if (rnd(&seed) % 64 == 0)
+            pcmbuf_start_track_change(TRACK_CHANGE_AUTO_PILEUP);
+
+        if (rnd(&seed) % 8 == 0)
+            spin(rnd(&seed) % 20000);
+    }
+
+    /* Commit the tail and start playback even below the watermark */
+    pcmbuf_start_track_change(TRACK_CHANGE_END_OF_DATA);
+
+    /* The consumer may have run dry just before the tail came in, after
+       the start above found the channel still playing. Keep starting it
+       like the codec would until everything is played. */
+    while (!__atomic_load_n(&consumer_done, __ATOMIC_ACQUIRE))
+    {
+        if (mixer_channel_status(PCM_MIXER_CHAN_PLAYBACK) == CHANNEL_STOPPED)
+        {
+            if (pcmbuf_free() == pcmbuf_get_bufsize())
+                fail("data lost", frame, 0);
+
+            pcmbuf_play_start();
+        }
+
+        sched_yield();
+    }
+
+    return NULL;
+}
+
+/* The mixer side: check every chunk against the expected frame numbers */
+static void * consumer_thread(void *arg)
+{
+    unsigned int seed = 2;
+
+    pin_thread((intptr_t)arg);
+
+    while (played_frames < total_frames)
+    {
+        if (mixer_channel_status(PCM_MIXER_CHAN_PLAYBACK) != CHANNEL_PLAYING)
+        {
+            /* Ran dry and stopped like the real mixer; the codec side
+               restarts the channel once it is above the watermark again */
+            sched_yield();
+            continue;
+        }
+
+        const void *start = NULL;
+        size_t size = 0;
+
+        stamp_seen = false;
+        play_cb(&start, &size);
+
+        if (size == 0)
+        {
+            restarts++;
+            mixer_channel_stop(PCM_MIXER_CHAN_PLAYBACK);
+            continue;
+        }
+
+        if (size % 4 != 0 || size > 8192)
+            fail("bad chunk size", size, 0);
+
+        const uint32_t *p = start;
+        size_t n = size / 4;
+
+        if (stamp_seen &&
+            (stamp_elapsed < played_frames ||
+             stamp_elapsed >= played_frames + n))
+            fail("stamp outside of chunk", stamp_elapsed, played_frames);
+
+        for (size_t i = 0; i < n; i++)
+        {
+            if (p[i] != (uint32_t)(played_frames + i))
+                fail("bad sample", p[i], played_frames + i);
+        }
+
+        played_frames += n;
+        chunks++;
+
+        if (rnd(&seed) % 8 == 0)
+            spin(rnd(&seed) % 20000);
+    }
+
+    __atomic_store_n(&consumer_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t producer, consumer;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (argc > 1)
+        total_frames = strtoul(argv[1], NULL, 0);
+
+    if (cpus < 2)
+        fprintf(stderr, "pcmbuftest: only one cpu, the threads will share it\n");
+
+    pcmbuf_update_frequency();
+
+    size_t size = pcmbuf_size_reqd() + 65536;
+    char *buf = malloc(size);
+    if (!buf || pcmbuf_init(buf + size) > size)
+    {
+        fprintf(stderr, "pcmbuftest: can't set up the buffer\n");
+        return 1;
+    }
+
+    pthread_create(&consumer, NULL, consumer_thread,
+                   (void *)(intptr_t)(cpus > 1 ? 1 : 0));
+    pthread_create(&producer, NULL, producer_thread, (void *)(intptr_t)0);
+
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+
+    printf("pcmbuftest: %lu frames in %lu chunks, %lu restarts, ok\n",
+           played_frames, chunks, restarts);
+
+    free(buf);
+    return 0;
+}